@@ -10,8 +10,17 @@
 # To Public License, Version 2, as published by Sam Hocevar. See
 # http://sam.zoy.org/wtfpl/COPYING for more details.
 
-# This is just an example script to show how to resize the screen before
-# running am7xxx-play, this can be called also from a udev script.
+# This is just an example script to show how to resize the screen when
+# the am7xxx device is plugged in or out, and how to keep am7xxx-play
+# running in resident mode so it shows the screen on the device as soon
+# as it is plugged in.
+#
+# The "start" and "stop" actions can be called from a udev script, they
+# only resize the screen and return at once; the "service" action runs
+# am7xxx-play for as long as the session lasts, for example from the
+# am7xxx-autodisplay.service systemd user unit. Starting am7xxx-play from
+# udev is not a good idea: udev kills long running programs, and the
+# pipeline would be set up again each time the device is plugged in.
 #
 # Resizing the screen may be needed if the am7xxx device has problems
 # displaying a certain resolution.
@@ -25,25 +34,31 @@ USER=ao2
 RESOLUTION_PROJECTOR=800x600
 RESOLUTION_ORIGINAL=1024x600
 
+# the model the images are made for, see the --resident option
+MODEL=C110
+
 AM7XXX_PLAY=am7xxx-play
 
 # needed when running xrandr as root from udev rules,
 # see https://bugs.launchpad.net/ubuntu/+source/xserver-xorg-video-intel/+bug/660901
-export XAUTHORITY=$(find /var/run/gdm3/ -type f -path "*${USER}*" 2> /dev/null)
+export XAUTHORITY=${XAUTHORITY:-$(find /var/run/gdm3/ -type f -path "*${USER}*" 2> /dev/null)}
 
-export DISPLAY=:0.0
+export DISPLAY=${DISPLAY:-:0.0}
 
 case $1 in
   start)
-    xrandr --size $RESOLUTION_PROJECTOR && \
-      $AM7XXX_PLAY -f x11grab -i $DISPLAY
+    xrandr --size $RESOLUTION_PROJECTOR
     ;;
 
   stop)
     xrandr --size $RESOLUTION_ORIGINAL
     ;;
 
+  service)
+    exec $AM7XXX_PLAY -f x11grab -i $DISPLAY --resident=$MODEL
+    ;;
+
   *)
-    { echo "usage: $(basename $0) <start|stop>" 1>&2; exit 1; }
+    { echo "usage: $(basename $0) <start|stop|service>" 1>&2; exit 1; }
     ;;
 esac
@@ -16,10 +16,9 @@ DISPLAY=":0"
 
 WIN_INFO="$(xwininfo)"
 
-X=$(echo "$WIN_INFO" | sed -n -e "/^[[:space:]]*Absolute upper-left X:[[:space:]]*/s///p")
-Y=$(echo "$WIN_INFO" | sed -n -e "/^[[:space:]]*Absolute upper-left Y:[[:space:]]*/s///p")
-WIDTH=$(echo "$WIN_INFO" | sed -n -e "/^[[:space:]]*Width:[[:space:]]*/s///p")
-HEIGHT=$(echo "$WIN_INFO" | sed -n -e "/^[[:space:]]*Height:[[:space:]]*/s///p")
+# The window is followed even when moved or covered, and the X server
+# scales it down to the device native size
+WIN_ID=$(echo "$WIN_INFO" | sed -n -e "s/^xwininfo: Window id: \(0x[[:xdigit:]]*\).*/\1/p")
 
 set -x
-am7xxx-play -f x11grab -i "${DISPLAY}+${X},${Y}" -o video_size="${WIDTH}x${HEIGHT}"
+am7xxx-play -f xwindow -i "${DISPLAY}/${WIN_ID}" "$@"
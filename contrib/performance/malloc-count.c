@@ -0,0 +1,80 @@
+/*
+ * malloc-count - count the heap allocations made by a program
+ *
+ * This program is free software. It comes without any warranty, to
+ * the extent permitted by applicable law. You can redistribute it
+ * and/or modify it under the terms of the Do What The Fuck You Want
+ * To Public License, Version 2, as published by Sam Hocevar. See
+ * http://sam.zoy.org/wtfpl/COPYING for more details.
+ *
+ * Build it and preload it, glibc only:
+ *
+ *   gcc -shared -fPIC -O2 -o malloc-count.so malloc-count.c
+ *   LD_PRELOAD=./malloc-count.so am7xxx-play -i input.mkv
+ *
+ * am7xxx-play then reports the allocations made per frame once the
+ * pipeline is full.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long count;
+
+static void count_allocation(void)
+{
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long malloc_count(void)
+{
+	return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_allocation();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_allocation();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_allocation();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	count_allocation();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count_allocation();
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	count_allocation();
+	ptr = __libc_memalign(alignment, size);
+	if (ptr == NULL)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
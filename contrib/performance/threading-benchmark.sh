@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# threading-benchmark - compare the am7xxx-play threading configurations
+#
+# Copyright (C) 2013-2014  Antonio Ospite <ao2@ao2.it>
+#
+# This program is free software. It comes without any warranty, to
+# the extent permitted by applicable law. You can redistribute it
+# and/or modify it under the terms of the Do What The Fuck You Want
+# To Public License, Version 2, as published by Sam Hocevar. See
+# http://sam.zoy.org/wtfpl/COPYING for more details.
+
+set -e
+
+if [ $# -lt 1 ];
+then
+  echo "usage: $(basename "$0") <input file> [<seconds per run>] [<am7xxx-play options>]" 1>&2
+  exit 1
+fi
+
+INPUT="$1"
+DURATION="${2:-30}"
+[ $# -gt 1 ] && shift 2 || shift 1
+
+# The -t options compared, the first one is the single-threaded baseline
+CONFIGS="
+decoder=1,scaler=1,encoder=1
+decoder=0,decoder_type=slice,scaler=1,encoder=1
+decoder=0,decoder_type=frame,scaler=1,encoder=1
+decoder=0,decoder_type=both,scaler=1,encoder=1
+decoder=0,decoder_type=both,scaler=0,encoder=1
+decoder=0,decoder_type=both,scaler=0,encoder=0
+decoder=0,low_delay=1,scaler=0,encoder=1
+"
+
+for CONFIG in $CONFIGS;
+do
+  LOG="threading_$(echo "$CONFIG" | tr ',=' '_-').log"
+
+  # Frames are sent as fast as possible (-A), am7xxx-play prints the
+  # pipeline statistics when interrupted.
+  timeout -s INT "$DURATION" am7xxx-play -A -t "$CONFIG" -i "$INPUT" "$@" > "$LOG" 2>&1 || true
+
+  SECONDS_RUN=$(sed -n -e "s/^Pipeline statistics over \([0-9.]*\) s:$/\1/p" "$LOG")
+  FRAMES=$(sed -n -e "s/^[[:space:]]*send[[:space:]]*\([0-9]*\) items.*/\1/p" "$LOG")
+
+  if [ -z "$SECONDS_RUN" ] || [ -z "$FRAMES" ];
+  then
+    echo "$CONFIG: no statistics, see $LOG"
+    continue
+  fi
+
+  echo "$CONFIG: $(echo "scale=2; $FRAMES / $SECONDS_RUN" | bc) fps"
+  grep -E "^[[:space:]]+(decode|scale|encode)[[:space:]]" "$LOG" | sed -e 's/^/  /'
+done
@@ -17,115 +17,86 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <libusb.h>
+#include <unistd.h>
 
-#define AM7XXX_STORAGE_VID           0x1de1
-#define AM7XXX_STORAGE_PID           0x1101
-#define AM7XXX_STORAGE_CONFIGURATION 1
-#define AM7XXX_STORAGE_INTERFACE     0
-#define AM7XXX_STORAGE_OUT_EP        0x01
+#include "am7xxx.h"
 
-static unsigned char switch_command[] =
-	"\x55\x53\x42\x43\x08\x70\x52\x89\x00\x00\x00\x00\x00\x00"
-	"\x10\xff\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-w <timeout>\t\twait up to timeout milliseconds for the projector\n");
+	printf("\t\t\t\tto show up, 0 for ever, and tell how long it took\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-h \t\t\tthis help message\n");
+}
 
-int main(void)
+int main(int argc, char *argv[])
 {
 	int ret;
-	libusb_device_handle *usb_device;
-	int current_configuration;
-	unsigned int len;
-	int transferred;
-
-	ret = libusb_init(NULL);
-	if (ret < 0) {
-		fprintf(stderr, "libusb_init failed: %s\n",
-			libusb_error_name(ret));
-		goto out;
-	}
-
-	libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_INFO);
-
-	usb_device = libusb_open_device_with_vid_pid(NULL,
-						     AM7XXX_STORAGE_VID,
-						     AM7XXX_STORAGE_PID);
-	if (usb_device == NULL) {
-		fprintf(stderr, "libusb_open failed: %s\n", strerror(errno));
-		ret = -errno;
-		goto out;
-	}
-
-	current_configuration = -1;
-	ret = libusb_get_configuration(usb_device, &current_configuration);
-	if (ret < 0) {
-		fprintf(stderr, "libusb_get_configuration failed: %s\n",
-			libusb_error_name(ret));
-		goto out_libusb_close;
-	}
-
-	if (current_configuration != AM7XXX_STORAGE_CONFIGURATION) {
-		ret = libusb_set_configuration(usb_device,
-					       AM7XXX_STORAGE_CONFIGURATION);
-		if (ret < 0) {
-			fprintf(stderr, "libusb_set_configuration failed: %s\n",
-				libusb_error_name(ret));
-			fprintf(stderr, "Cannot set configuration %d\n",
-				AM7XXX_STORAGE_CONFIGURATION);
-			goto out_libusb_close;
+	int opt;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	am7xxx_modeswitch_timings timings;
+	int log_level = AM7XXX_LOG_ERROR;
+	int wait = 0;
+	int timeout = 0;
+
+	while ((opt = getopt(argc, argv, "w:l:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			wait = 1;
+			timeout = atoi(optarg);
+			if (timeout < 0) {
+				fprintf(stderr, "Unsupported timeout\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE) {
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
 		}
 	}
 
-	libusb_set_auto_detach_kernel_driver(usb_device, 1);
-
-	ret = libusb_claim_interface(usb_device, AM7XXX_STORAGE_INTERFACE);
-	if (ret < 0) {
-		fprintf(stderr, "libusb_claim_interface failed: %s\n",
-			libusb_error_name(ret));
-		fprintf(stderr, "Cannot claim interface %d\n",
-			AM7XXX_STORAGE_INTERFACE);
-		goto out_libusb_close;
-	}
-
-	/*
-	 * Checking that the configuration has not changed, as suggested in
-	 * http://libusb.sourceforge.net/api-1.0/caveats.html
-	 */
-	current_configuration = -1;
-	ret = libusb_get_configuration(usb_device, &current_configuration);
+	ret = am7xxx_init_lazy(&ctx);
 	if (ret < 0) {
-		fprintf(stderr, "libusb_get_configuration after claim failed: %s\n",
-			libusb_error_name(ret));
-		goto out_libusb_release_interface;
-	}
-
-	if (current_configuration != AM7XXX_STORAGE_CONFIGURATION) {
-		fprintf(stderr, "libusb configuration changed (expected: %d, current: %d)\n",
-			AM7XXX_STORAGE_CONFIGURATION, current_configuration);
-		ret = -EINVAL;
-		goto out_libusb_release_interface;
+		perror("am7xxx_init_lazy");
+		goto out;
 	}
 
-	len = sizeof(switch_command);
+	am7xxx_set_log_level(ctx, log_level);
 
-	transferred = 0;
-	ret = libusb_bulk_transfer(usb_device, AM7XXX_STORAGE_OUT_EP,
-				   switch_command, len, &transferred, 0);
-	if (ret != 0 || (unsigned int)transferred != len) {
-		fprintf(stderr, "ret: %d\ttransferred: %d (expected %u)\n",
-		      ret, transferred, len);
-		goto out_libusb_release_interface;
+	ret = am7xxx_modeswitch(ctx, wait ? &dev : NULL, timeout, &timings);
+	if (ret < 0) {
+		fprintf(stderr, "am7xxx_modeswitch failed: %s\n", strerror(-ret));
+		goto cleanup;
 	}
 
 	fprintf(stderr, "OK, command sent!\n");
+	fprintf(stderr, "Switch: %lu us\n", timings.switch_usecs);
+	if (wait) {
+		fprintf(stderr, "Enumeration: %lu us\n", timings.enumeration_usecs);
+		fprintf(stderr, "Open: %lu us\n", timings.open_usecs);
+	}
 
-out_libusb_release_interface:
-	libusb_release_interface(usb_device, AM7XXX_STORAGE_INTERFACE);
-out_libusb_close:
-	libusb_close(usb_device);
-	usb_device = NULL;
+cleanup:
+	am7xxx_shutdown(ctx);
 out:
-	libusb_exit(NULL);
 	return ret;
 }
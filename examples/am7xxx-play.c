@@ -24,322 +24,5575 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include <libavdevice/avdevice.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 
 #include <am7xxx.h>
 
+#ifdef HAVE_LINUX_FB
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#endif
+
+#ifdef HAVE_XCB_CAPTURE
+#include <poll.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <xcb/damage.h>
+#include <xcb/xfixes.h>
+#include <xcb/composite.h>
+#include <xcb/render.h>
+#endif
+
 #include <libavcodec/avcodec.h>
 
 static unsigned int run = 1;
 
-struct video_input_ctx
+/* swscale can split the scaling of a frame among threads since FFmpeg 5.0 */
+#define HAVE_SWS_THREADS (LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100))
+
+/* encoders can write packets to buffers of the caller since FFmpeg 4.4 */
+#define HAVE_ENCODE_BUFFER (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100))
+
+/*
+ * The threads libavcodec and libswscale can use, a count of 0 means one
+ * thread per CPU.
+ */
+struct threading_options
 {
-	AVFormatContext *format_ctx;
-	AVCodecContext *codec_ctx;
-	int video_stream_index;
+	int decoder_threads;
+	int decoder_thread_type; /* FF_THREAD_FRAME and/or FF_THREAD_SLICE, 0 for auto */
+	int low_delay;			 /* -1 for auto */
+	int scaler_threads;
+	int encoder_threads;
 };
 
-static int video_input_init(struct video_input_ctx *input_ctx,
-							const char *input_format_string,
-							const char *input_path,
-							AVDictionary **input_options)
+/*
+ * Latency statistics are always collected, these options control how often
+ * they are reported and where.
+ */
+struct stats_options
 {
-	AVInputFormat *input_format = NULL;
-	AVFormatContext *input_format_ctx;
-	AVCodecParameters *input_codec_params;
-	AVCodecContext *input_codec_ctx;
-	const AVCodec *input_codec;
-	int video_index;
-	int ret;
+	int interval;		   /* seconds between reports, 0 for none */
+	int summary;		   /* print a line on stdout at each report */
+	const char *json_path; /* a file or FIFO to write JSON lines to */
+};
 
-	avdevice_register_all();
-	// avcodec_register_all();
-	// av_register_all();
+/*
+ * The encoded images are kept to be sent again when the same scaled frame
+ * comes back, see struct frame_cache.
+ */
+struct frame_cache_options
+{
+	unsigned int size;		/* MiB, 0 to disable the cache */
+	char *dir;				/* where to store the images too, or NULL */
+	unsigned int disk_size; /* MiB the images in dir may use */
+};
 
-	if (input_format_string)
+/*
+ * The benchmark mode sends the images to a simulated device, see
+ * am7xxx_open_simulated_device(), as fast as they can be made.
+ */
+struct bench_options
+{
+	int enabled;
+	char *model;		  /* part of the model name, NULL for the first */
+	unsigned long rate;	  /* bytes per second, 0 for no limit */
+	unsigned long frames; /* stop after this many frames, 0 for no limit */
+	unsigned int seconds; /* stop after this many seconds, 0 for no limit */
+	double fps;			  /* the frame rate to check for, 0 for none */
+};
+
+/*
+ * The resident mode keeps the pipeline running with no device plugged in:
+ * the images are made for a simulated device of the model, and the send
+ * stage waits for a real one, see am7xxx_wait_for_device().
+ */
+struct resident_options
+{
+	int enabled;
+	char *model; /* part of the model name, NULL for the first */
+	am7xxx_context *ctx;
+	int power_mode; /* set again on each device claimed */
+	int zoom;
+};
+
+/* How often the send stage looks at run while waiting for a device */
+#define RESIDENT_WAIT_MS 500
+
+/*
+ * When each phase of the startup ended, up to the first frame on the wire.
+ * The phases are marked from the main thread, and then from the send stage
+ * only, so no locking is needed.
+ */
+#define STARTUP_PHASES_MAX 16
+
+struct startup_report
+{
+	int enabled;
+	int printed;
+	int64_t start;
+	unsigned int count;
+	const char *phases[STARTUP_PHASES_MAX];
+	int64_t times[STARTUP_PHASES_MAX];
+};
+
+static struct startup_report startup;
+
+static void startup_mark(const char *phase)
+{
+	if (!startup.enabled || startup.printed || startup.count == STARTUP_PHASES_MAX)
+		return;
+
+	startup.phases[startup.count] = phase;
+	startup.times[startup.count] = av_gettime_relative();
+	startup.count++;
+}
+
+static void print_startup_report(void)
+{
+	int64_t previous = startup.start;
+	unsigned int i;
+
+	if (!startup.enabled || startup.printed)
+		return;
+
+	fprintf(stdout, "startup:\n");
+	for (i = 0; i < startup.count; i++)
 	{
-		/* find the desired input format */
-		// input_format = av_find_input_format(input_format_string); //older version
-		const AVInputFormat *input_format = av_find_input_format(input_format_string);
-		if (input_format == NULL)
+		fprintf(stdout, "  %-24s %8.1f ms (+%.1f ms)\n", startup.phases[i],
+				(startup.times[i] - startup.start) / 1000.0,
+				(startup.times[i] - previous) / 1000.0);
+		previous = startup.times[i];
+	}
+	fflush(stdout);
+	startup.printed = 1;
+}
+
+/* Waiting for the first image once tells when it was on the wire */
+static void startup_first_frame(am7xxx_device *dev)
+{
+	if (!startup.enabled || startup.printed)
+		return;
+
+	startup_mark("first frame queued");
+	am7xxx_flush_async(dev);
+	startup_mark("first frame on the wire");
+	print_startup_report();
+}
+
+/*
+ * The rows of a captured frame which changed since the previous one, the
+ * frames of capture sources point to it with their opaque field.
+ */
+struct frame_damage
+{
+	unsigned long sequence; /* the frame number, starting from 1 */
+	int y;
+	int height;
+};
+
+struct capture_source;
+
+/*
+ * A capture source gives raw frames to the scale stage directly, without
+ * going through libavformat and a decoder, and only when the captured
+ * image changed.
+ */
+struct capture_ops
+{
+	const char *format; /* the name used as input format */
+	int (*open)(struct capture_source *source, const char *path);
+	void (*close)(struct capture_source *source);
+
+	/* Wait at most timeout_ms for changes, return 1 if there are some */
+	int (*wait)(struct capture_source *source, int timeout_ms);
+
+	/*
+	 * Put the current image in the frame; return 0 if nothing changed,
+	 * or -EAGAIN when all the buffers are still in use downstream.
+	 */
+	int (*grab)(struct capture_source *source, AVFrame *frame);
+};
+
+struct capture_source
+{
+	const struct capture_ops *ops;
+	void *priv;
+	int width;
+	int height;
+	int max_width; /* the largest frames wanted, 0 if any size is fine */
+	int max_height;
+	AVRational frame_rate; /* the maximum one */
+	unsigned long sequence;
+};
+
+#if defined(HAVE_XCB_CAPTURE) || defined(HAVE_LINUX_FB)
+/*
+ * The frames of capture sources live in a few buffers recycled through an
+ * AVBufferPool. Since the scale stage may still be using the older ones,
+ * each buffer keeps track of the rows changed since it was last updated,
+ * and only those rows are copied when it is used again.
+ */
+#define CAPTURE_BUFFERS 3
+#define CAPTURE_MAX_RANGES 16
+
+struct row_range
+{
+	int start;
+	int end;
+};
+
+struct capture_buffer
+{
+	uint8_t *data;
+	struct row_range pending[CAPTURE_MAX_RANGES];
+	int n_pending;
+	struct frame_damage damage;
+};
+
+struct capture_buffers
+{
+	struct capture_buffer buffers[CAPTURE_BUFFERS];
+	unsigned int allocated;
+	AVBufferPool *pool;
+
+	/* the rows changed since the last frame, none when start >= end */
+	struct row_range damaged;
+};
+
+/* Add the rows [start, end) to a set of disjoint row ranges */
+static void row_ranges_add(struct row_range *ranges, int *count, int start, int end)
+{
+	int i = 0;
+
+	/* absorb the ranges touching the new one */
+	while (i < *count)
+	{
+		if (ranges[i].end < start || ranges[i].start > end)
 		{
-			fprintf(stderr, "cannot find input format\n");
-			ret = -ENODEV;
-			goto out;
+			i++;
+			continue;
 		}
+		start = FFMIN(start, ranges[i].start);
+		end = FFMAX(end, ranges[i].end);
+		ranges[i] = ranges[--(*count)];
+		i = 0;
 	}
 
-	if (input_path == NULL)
+	/* too many scattered changes, just cover all of them */
+	if (*count == CAPTURE_MAX_RANGES)
 	{
-		fprintf(stderr, "input_path must not be NULL!\n");
-		ret = -EINVAL;
-		goto out;
+		for (i = 0; i < *count; i++)
+		{
+			start = FFMIN(start, ranges[i].start);
+			end = FFMAX(end, ranges[i].end);
+		}
+		*count = 0;
+	}
+
+	ranges[*count].start = start;
+	ranges[*count].end = end;
+	(*count)++;
+}
+
+static void capture_add_damage(struct capture_buffers *buffers, int start, int end)
+{
+	int i;
+
+	if (start >= end)
+		return;
+
+	for (i = 0; i < CAPTURE_BUFFERS; i++)
+		row_ranges_add(buffers->buffers[i].pending,
+					   &buffers->buffers[i].n_pending,
+					   start, end);
+
+	if (buffers->damaged.start >= buffers->damaged.end)
+	{
+		buffers->damaged.start = start;
+		buffers->damaged.end = end;
+	}
+	else
+	{
+		buffers->damaged.start = FFMIN(buffers->damaged.start, start);
+		buffers->damaged.end = FFMAX(buffers->damaged.end, end);
+	}
+}
+
+static void capture_buffer_release(void *opaque, uint8_t *data)
+{
+	/* the buffers live as long as the capture source */
+	(void)opaque;
+	(void)data;
+}
+
+/*
+ * Hand out the buffers to the pool, which recycles them; when all of them
+ * are in use the pool gets NULL.
+ */
+static AVBufferRef *capture_buffer_alloc(void *opaque, size_t size)
+{
+	struct capture_buffers *buffers = opaque;
+	struct capture_buffer *buffer;
+
+	if (buffers->allocated == CAPTURE_BUFFERS)
+		return NULL;
+
+	buffer = &buffers->buffers[buffers->allocated++];
+	return av_buffer_create(buffer->data, size, capture_buffer_release, buffer, 0);
+}
+
+/* The data of the buffers, size bytes each, must be set up already */
+static int capture_buffers_init(struct capture_buffers *buffers, int size)
+{
+	buffers->pool = av_buffer_pool_init2(size, buffers, capture_buffer_alloc, NULL);
+	if (buffers->pool == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/* The frames are all back by now, so the pool is freed at once */
+static void capture_buffers_free(struct capture_buffers *buffers)
+{
+	av_buffer_pool_uninit(&buffers->pool);
+}
+
+/* Get a buffer, NULL when all of them are still in use downstream */
+static struct capture_buffer *capture_buffer_get(struct capture_buffers *buffers,
+												 AVBufferRef **buf)
+{
+	*buf = av_buffer_pool_get(buffers->pool);
+	if (*buf == NULL)
+		return NULL;
+
+	return av_buffer_pool_buffer_get_opaque(*buf);
+}
+
+/* Make a frame out of a buffer just brought up to date */
+static void capture_frame_init(struct capture_source *source,
+							   struct capture_buffers *buffers,
+							   struct capture_buffer *buffer,
+							   AVBufferRef *buf,
+							   AVFrame *frame,
+							   enum AVPixelFormat pix_fmt,
+							   int linesize)
+{
+	buffer->n_pending = 0;
+
+	source->sequence++;
+	buffer->damage.sequence = source->sequence;
+	buffer->damage.y = buffers->damaged.start;
+	buffer->damage.height = buffers->damaged.end - buffers->damaged.start;
+	buffers->damaged.start = buffers->damaged.end = 0;
+
+	frame->buf[0] = buf;
+	frame->data[0] = buffer->data;
+	frame->linesize[0] = linesize;
+	frame->width = source->width;
+	frame->height = source->height;
+	frame->format = pix_fmt;
+	frame->pts = av_gettime_relative();
+	frame->opaque = &buffer->damage;
+}
+#endif
+
+#ifdef HAVE_XCB_CAPTURE
+/*
+ * Capture with the MIT-SHM, Damage and XFixes X extensions: the X server
+ * tells which areas changed and only those are copied into shared memory
+ * segments, the capture buffers, so an idle desktop costs nothing.
+ *
+ * Single windows are followed with XComposite, which keeps their content
+ * available when they are moved or covered, and XRender scales them on the
+ * X server side to the requested size before they are copied.
+ */
+struct xshm_segment
+{
+	int shmid;
+	xcb_shm_seg_t shmseg;
+	int attached;
+};
+
+struct xshm_capture
+{
+	xcb_connection_t *connection;
+	xcb_window_t root;
+	xcb_drawable_t drawable; /* the images are copied from here */
+	xcb_damage_damage_t damage;
+	xcb_xfixes_region_t region;
+	uint8_t damage_event;
+	struct capture_buffers buffers;
+	struct xshm_segment segments[CAPTURE_BUFFERS];
+
+	/* window capture only, window is 0 otherwise */
+	xcb_window_t window;
+	int window_width;
+	int window_height;
+	int resized;
+	int destroyed;
+	xcb_render_picture_t window_picture;
+	xcb_render_pictformat_t scaled_format;
+	xcb_pixmap_t scaled_pixmap;
+	xcb_render_picture_t scaled_picture;
+};
+
+static int xshm_segment_init(struct xshm_capture *capture, unsigned int index, int size)
+{
+	struct xshm_segment *segment = &capture->segments[index];
+	struct capture_buffer *buffer = &capture->buffers.buffers[index];
+	xcb_generic_error_t *error;
+	int ret;
+
+	segment->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (segment->shmid < 0)
+	{
+		ret = -errno;
+		perror("shmget");
+		return ret;
+	}
+
+	buffer->data = shmat(segment->shmid, NULL, 0);
+	if (buffer->data == (void *)-1)
+	{
+		ret = -errno;
+		perror("shmat");
+		shmctl(segment->shmid, IPC_RMID, NULL);
+		buffer->data = NULL;
+		return ret;
+	}
+
+	segment->shmseg = xcb_generate_id(capture->connection);
+	error = xcb_request_check(capture->connection,
+							  xcb_shm_attach_checked(capture->connection,
+													 segment->shmseg,
+													 segment->shmid,
+													 0));
+
+	/* the segment goes away once both the X server and we detach it */
+	shmctl(segment->shmid, IPC_RMID, NULL);
+
+	if (error)
+	{
+		fprintf(stderr, "cannot share memory with the X server, is it a remote one?\n");
+		free(error);
+		return -EIO;
+	}
+	segment->attached = 1;
+
+	return 0;
+}
+
+/*
+ * Bring a buffer up to date; whole rows are copied, so the layout of the
+ * image in the buffer is always the one of a full frame.
+ */
+static int xshm_buffer_update(struct xshm_capture *capture,
+							  struct capture_buffer *buffer,
+							  int width)
+{
+	xcb_shm_get_image_cookie_t cookies[CAPTURE_MAX_RANGES];
+	xcb_shm_get_image_reply_t *reply;
+	struct xshm_segment *segment;
+	int ret = 0;
+	int i;
+
+	segment = &capture->segments[buffer - capture->buffers.buffers];
+
+	for (i = 0; i < buffer->n_pending; i++)
+		cookies[i] = xcb_shm_get_image(capture->connection,
+									   capture->drawable,
+									   0,
+									   buffer->pending[i].start,
+									   width,
+									   buffer->pending[i].end - buffer->pending[i].start,
+									   ~0U,
+									   XCB_IMAGE_FORMAT_Z_PIXMAP,
+									   segment->shmseg,
+									   buffer->pending[i].start * width * 4);
+
+	/* the requests are all sent before waiting for the first reply */
+	for (i = 0; i < buffer->n_pending; i++)
+	{
+		reply = xcb_shm_get_image_reply(capture->connection, cookies[i], NULL);
+		if (reply == NULL)
+			ret = -EIO;
+		free(reply);
+	}
+
+	return ret;
+}
+
+/* Forget the older changes, the whole image is new */
+static void xshm_damage_all(struct capture_buffers *buffers, int height)
+{
+	int i;
+
+	for (i = 0; i < CAPTURE_BUFFERS; i++)
+		buffers->buffers[i].n_pending = 0;
+	buffers->damaged.start = buffers->damaged.end = 0;
+
+	capture_add_damage(buffers, 0, height);
+}
+
+static void xshm_close(struct capture_source *source)
+{
+	struct xshm_capture *capture = source->priv;
+	int i;
+
+	if (capture == NULL)
+		return;
+
+	capture_buffers_free(&capture->buffers);
+
+	for (i = 0; i < CAPTURE_BUFFERS; i++)
+	{
+		if (capture->segments[i].attached)
+			xcb_shm_detach(capture->connection, capture->segments[i].shmseg);
+		if (capture->buffers.buffers[i].data)
+			shmdt(capture->buffers.buffers[i].data);
+	}
+
+	if (capture->damage && !capture->destroyed)
+		xcb_damage_destroy(capture->connection, capture->damage);
+	if (capture->region)
+		xcb_xfixes_destroy_region(capture->connection, capture->region);
+
+	if (capture->scaled_picture)
+		xcb_render_free_picture(capture->connection, capture->scaled_picture);
+	if (capture->scaled_pixmap)
+		xcb_free_pixmap(capture->connection, capture->scaled_pixmap);
+	if (capture->window_picture && !capture->destroyed)
+	{
+		xcb_render_free_picture(capture->connection, capture->window_picture);
+		xcb_composite_unredirect_window(capture->connection, capture->window,
+										XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+	}
+
+	xcb_disconnect(capture->connection);
+	free(capture);
+	source->priv = NULL;
+}
+
+static int xshm_has_extension(struct xshm_capture *capture, xcb_extension_t *id, const char *name)
+{
+	const xcb_query_extension_reply_t *extension;
+
+	extension = xcb_get_extension_data(capture->connection, id);
+	if (extension == NULL || !extension->present)
+	{
+		fprintf(stderr, "The X server does not support %s\n", name);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Connect to the X server and set up the extensions; the frames are BGR0,
+ * so the pixmaps of the given depth must have 32 bits per pixel.
+ */
+static int xshm_connect(struct xshm_capture *capture, const char *display, int depth)
+{
+	const xcb_setup_t *setup;
+	xcb_screen_iterator_t screens;
+	xcb_format_iterator_t formats;
+	xcb_damage_query_version_reply_t *damage_version;
+	xcb_xfixes_query_version_reply_t *xfixes_version;
+	int screen_number;
+	int bits_per_pixel = 0;
+	int i;
+	int ret;
+
+	capture->connection = xcb_connect(display, &screen_number);
+	if (xcb_connection_has_error(capture->connection))
+	{
+		fprintf(stderr, "Cannot open a connection to %s\n", display ? display : "the X server");
+		return -EINVAL;
+	}
+
+	setup = xcb_get_setup(capture->connection);
+	screens = xcb_setup_roots_iterator(setup);
+	for (i = 0; i < screen_number; i++)
+		xcb_screen_next(&screens);
+	capture->root = screens.data->root;
+
+	if (depth == 0)
+		depth = screens.data->root_depth;
+
+	for (formats = xcb_setup_pixmap_formats_iterator(setup); formats.rem; xcb_format_next(&formats))
+		if (formats.data->depth == depth)
+			bits_per_pixel = formats.data->bits_per_pixel;
+
+	if (depth < 24 || bits_per_pixel != 32 ||
+		setup->image_byte_order != XCB_IMAGE_ORDER_LSB_FIRST)
+	{
+		fprintf(stderr, "Unsupported image format: depth %d, %d bits per pixel\n",
+				depth, bits_per_pixel);
+		return -ENOTSUP;
+	}
+
+	if (!xshm_has_extension(capture, &xcb_shm_id, "MIT-SHM") ||
+		!xshm_has_extension(capture, &xcb_xfixes_id, "XFixes") ||
+		!xshm_has_extension(capture, &xcb_damage_id, "Damage"))
+		return -ENOTSUP;
+
+	capture->damage_event = xcb_get_extension_data(capture->connection, &xcb_damage_id)->first_event;
+
+	/* Damage and XFixes cannot be used before telling the version spoken */
+	xfixes_version = xcb_xfixes_query_version_reply(capture->connection,
+													xcb_xfixes_query_version(capture->connection,
+																			 XCB_XFIXES_MAJOR_VERSION,
+																			 XCB_XFIXES_MINOR_VERSION),
+													NULL);
+	damage_version = xcb_damage_query_version_reply(capture->connection,
+													xcb_damage_query_version(capture->connection,
+																			 XCB_DAMAGE_MAJOR_VERSION,
+																			 XCB_DAMAGE_MINOR_VERSION),
+													NULL);
+	ret = (xfixes_version && damage_version) ? 0 : -ENOTSUP;
+	free(xfixes_version);
+	free(damage_version);
+	if (ret < 0)
+		fprintf(stderr, "Cannot set up the Damage and XFixes extensions\n");
+
+	return ret;
+}
+
+/* Set up the segments for frames of up to size bytes and watch for damage */
+static int xshm_start(struct xshm_capture *capture, xcb_drawable_t watched, int size)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < CAPTURE_BUFFERS; i++)
+	{
+		ret = xshm_segment_init(capture, i, size);
+		if (ret < 0)
+			return ret;
 	}
 
-	/* open the input format/device */
-	input_format_ctx = NULL;
-	ret = avformat_open_input(&input_format_ctx,
-							  input_path,
-							  input_format,
-							  input_options);
+	ret = capture_buffers_init(&capture->buffers, size);
+	if (ret < 0)
+		return ret;
+
+	capture->damage = xcb_generate_id(capture->connection);
+	xcb_damage_create(capture->connection, capture->damage, watched,
+					  XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+	capture->region = xcb_generate_id(capture->connection);
+	xcb_xfixes_create_region(capture->connection, capture->region, 0, NULL);
+	xcb_flush(capture->connection);
+
+	return 0;
+}
+
+static int xshm_open(struct capture_source *source, const char *path)
+{
+	struct xshm_capture *capture;
+	xcb_get_geometry_reply_t *geometry;
+	int ret;
+
+	capture = calloc(1, sizeof(*capture));
+	if (capture == NULL)
+		return -ENOMEM;
+	source->priv = capture;
+
+	ret = xshm_connect(capture, path, 0);
+	if (ret < 0)
+		goto err;
+
+	geometry = xcb_get_geometry_reply(capture->connection,
+									  xcb_get_geometry(capture->connection, capture->root),
+									  NULL);
+	if (geometry == NULL)
+	{
+		ret = -EIO;
+		goto err;
+	}
+	source->width = geometry->width;
+	source->height = geometry->height;
+	free(geometry);
+
+	capture->drawable = capture->root;
+	ret = xshm_start(capture, capture->root, source->width * source->height * 4);
+	if (ret < 0)
+		goto err;
+
+	/* the first frame is a full one */
+	xshm_damage_all(&capture->buffers, source->height);
+
+	fprintf(stdout, "capturing the %dx%d screen of %s with MIT-SHM and Damage\n",
+			source->width, source->height, path);
+
+	return 0;
+
+err:
+	xshm_close(source);
+	return ret;
+}
+
+/*
+ * Find the XRender format of a visual, or with visual 0 the usual 24 bit
+ * RGB format.
+ */
+static xcb_render_pictformat_t xwindow_find_format(const xcb_render_query_pict_formats_reply_t *formats,
+												   xcb_visualid_t visual)
+{
+	xcb_render_pictscreen_iterator_t screens;
+	xcb_render_pictdepth_iterator_t depths;
+	xcb_render_pictvisual_t *visuals;
+	xcb_render_pictforminfo_t *info;
+	int i;
+
+	if (visual == 0)
+	{
+		info = xcb_render_query_pict_formats_formats(formats);
+		for (i = 0; i < xcb_render_query_pict_formats_formats_length(formats); i++)
+			if (info[i].type == XCB_RENDER_PICT_TYPE_DIRECT && info[i].depth == 24 &&
+				info[i].direct.red_shift == 16 && info[i].direct.red_mask == 0xff &&
+				info[i].direct.green_shift == 8 && info[i].direct.green_mask == 0xff &&
+				info[i].direct.blue_shift == 0 && info[i].direct.blue_mask == 0xff)
+				return info[i].id;
+		return 0;
+	}
+
+	for (screens = xcb_render_query_pict_formats_screens_iterator(formats); screens.rem; xcb_render_pictscreen_next(&screens))
+		for (depths = xcb_render_pictscreen_depths_iterator(screens.data); depths.rem; xcb_render_pictdepth_next(&depths))
+		{
+			visuals = xcb_render_pictdepth_visuals(depths.data);
+			for (i = 0; i < xcb_render_pictdepth_visuals_length(depths.data); i++)
+				if (visuals[i].visual == visual)
+					return visuals[i].format;
+		}
+
+	return 0;
+}
+
+/*
+ * Make the pixmap the window is scaled into, as big as possible within the
+ * source maximum size keeping the aspect ratio; windows are never enlarged.
+ */
+static int xwindow_setup_scaling(struct capture_source *source)
+{
+	struct xshm_capture *capture = source->priv;
+	xcb_get_geometry_reply_t *geometry;
+	xcb_render_transform_t transform;
+	int width;
+	int height;
+
+	geometry = xcb_get_geometry_reply(capture->connection,
+									  xcb_get_geometry(capture->connection, capture->window),
+									  NULL);
+	if (geometry == NULL)
+	{
+		fprintf(stderr, "The window is gone\n");
+		return -EPIPE;
+	}
+	capture->window_width = geometry->width;
+	capture->window_height = geometry->height;
+	free(geometry);
+
+	width = capture->window_width;
+	height = capture->window_height;
+	if (width > source->max_width)
+	{
+		height = (int)((int64_t)height * source->max_width / width);
+		width = source->max_width;
+	}
+	if (height > source->max_height)
+	{
+		width = (int)((int64_t)width * source->max_height / height);
+		height = source->max_height;
+	}
+
+	/* even sizes suit the 4:2:0 formats of the device */
+	source->width = FFMAX(width & ~1, 2);
+	source->height = FFMAX(height & ~1, 2);
+
+	if (capture->scaled_picture)
+		xcb_render_free_picture(capture->connection, capture->scaled_picture);
+	if (capture->scaled_pixmap)
+		xcb_free_pixmap(capture->connection, capture->scaled_pixmap);
+
+	capture->scaled_pixmap = xcb_generate_id(capture->connection);
+	xcb_create_pixmap(capture->connection, 24, capture->scaled_pixmap, capture->root,
+					  source->width, source->height);
+	capture->scaled_picture = xcb_generate_id(capture->connection);
+	xcb_render_create_picture(capture->connection, capture->scaled_picture,
+							  capture->scaled_pixmap, capture->scaled_format, 0, NULL);
+	capture->drawable = capture->scaled_pixmap;
+
+	/* the transform maps the scaled pixels to the window ones, in 16.16 fixed point */
+	memset(&transform, 0, sizeof(transform));
+	transform.matrix11 = (xcb_render_fixed_t)(((int64_t)capture->window_width << 16) / source->width);
+	transform.matrix22 = (xcb_render_fixed_t)(((int64_t)capture->window_height << 16) / source->height);
+	transform.matrix33 = 1 << 16;
+	xcb_render_set_picture_transform(capture->connection, capture->window_picture, transform);
+	xcb_render_composite(capture->connection, XCB_RENDER_PICT_OP_SRC,
+						 capture->window_picture, XCB_NONE, capture->scaled_picture,
+						 0, 0, 0, 0, 0, 0, source->width, source->height);
+
+	capture->resized = 0;
+	xshm_damage_all(&capture->buffers, source->height);
+
+	fprintf(stdout, "capturing a %dx%d window scaled to %dx%d\n",
+			capture->window_width, capture->window_height,
+			source->width, source->height);
+
+	return 0;
+}
+
+/* The path is the window id, optionally after the display and a slash */
+static int xwindow_open(struct capture_source *source, const char *path)
+{
+	struct xshm_capture *capture;
+	xcb_get_window_attributes_reply_t *attributes;
+	xcb_render_query_pict_formats_reply_t *formats;
+	xcb_render_query_version_reply_t *render_version;
+	xcb_composite_query_version_reply_t *composite_version;
+	xcb_render_pictformat_t window_format;
+	const char *window_id = path;
+	char *display = NULL;
+	char *end;
+	uint32_t values[1];
+	int ret;
+
+	capture = calloc(1, sizeof(*capture));
+	if (capture == NULL)
+		return -ENOMEM;
+	source->priv = capture;
+
+	if (strrchr(path, '/'))
+	{
+		window_id = strrchr(path, '/') + 1;
+		display = strdup(path);
+		if (display == NULL)
+		{
+			ret = -ENOMEM;
+			goto err;
+		}
+		display[window_id - path - 1] = '\0';
+	}
+
+	capture->window = strtoul(window_id, &end, 0);
+	if (*window_id == '\0' || *end != '\0' || capture->window == 0)
+	{
+		fprintf(stderr, "Invalid window id: %s\n", window_id);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	ret = xshm_connect(capture, display, 24);
+	if (ret < 0)
+		goto err;
+
+	if (!xshm_has_extension(capture, &xcb_composite_id, "Composite") ||
+		!xshm_has_extension(capture, &xcb_render_id, "Render"))
+	{
+		ret = -ENOTSUP;
+		goto err;
+	}
+
+	composite_version = xcb_composite_query_version_reply(capture->connection,
+														  xcb_composite_query_version(capture->connection,
+																					  XCB_COMPOSITE_MAJOR_VERSION,
+																					  XCB_COMPOSITE_MINOR_VERSION),
+														  NULL);
+	render_version = xcb_render_query_version_reply(capture->connection,
+													xcb_render_query_version(capture->connection,
+																			 XCB_RENDER_MAJOR_VERSION,
+																			 XCB_RENDER_MINOR_VERSION),
+													NULL);
+	ret = (composite_version && render_version) ? 0 : -ENOTSUP;
+	free(composite_version);
+	free(render_version);
+	if (ret < 0)
+	{
+		fprintf(stderr, "Cannot set up the Composite and Render extensions\n");
+		goto err;
+	}
+
+	attributes = xcb_get_window_attributes_reply(capture->connection,
+												 xcb_get_window_attributes(capture->connection,
+																		   capture->window),
+												 NULL);
+	if (attributes == NULL)
+	{
+		fprintf(stderr, "No such window: %s\n", window_id);
+		capture->window = 0;
+		ret = -EINVAL;
+		goto err;
+	}
+
+	formats = xcb_render_query_pict_formats_reply(capture->connection,
+												  xcb_render_query_pict_formats(capture->connection),
+												  NULL);
+	if (formats == NULL)
+	{
+		free(attributes);
+		ret = -EIO;
+		goto err;
+	}
+	window_format = xwindow_find_format(formats, attributes->visual);
+	capture->scaled_format = xwindow_find_format(formats, 0);
+	free(formats);
+	free(attributes);
+
+	if (window_format == 0 || capture->scaled_format == 0)
+	{
+		fprintf(stderr, "Cannot find the picture formats for the window\n");
+		ret = -ENOTSUP;
+		goto err;
+	}
+
+	/* the window content stays available even when it is covered */
+	xcb_composite_redirect_window(capture->connection, capture->window,
+								  XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+
+	values[0] = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+	capture->window_picture = xcb_generate_id(capture->connection);
+	xcb_render_create_picture(capture->connection, capture->window_picture,
+							  capture->window, window_format,
+							  XCB_RENDER_CP_SUBWINDOW_MODE, values);
+	xcb_render_set_picture_filter(capture->connection, capture->window_picture,
+								  strlen("good"), "good", 0, NULL);
+
+	/* follow size changes, and notice when the window goes away */
+	values[0] = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+	xcb_change_window_attributes(capture->connection, capture->window,
+								 XCB_CW_EVENT_MASK, values);
+
+	if (source->max_width == 0)
+	{
+		source->max_width = xcb_setup_roots_iterator(xcb_get_setup(capture->connection)).data->width_in_pixels;
+		source->max_height = xcb_setup_roots_iterator(xcb_get_setup(capture->connection)).data->height_in_pixels;
+	}
+
+	ret = xwindow_setup_scaling(source);
+	if (ret < 0)
+		goto err;
+
+	ret = xshm_start(capture, capture->window, source->max_width * source->max_height * 4);
+	if (ret < 0)
+		goto err;
+
+	free(display);
+	return 0;
+
+err:
+	free(display);
+	xshm_close(source);
+	return ret;
+}
+
+/*
+ * With the NON_EMPTY report level the X server sends one event when the
+ * image gets damaged, and then none until the damage is taken away.
+ */
+static int xshm_wait(struct capture_source *source, int timeout_ms)
+{
+	struct xshm_capture *capture = source->priv;
+	xcb_generic_event_t *event;
+	xcb_configure_notify_event_t *configure;
+	struct pollfd pollfd;
+	int changed = 0;
+
+	event = xcb_poll_for_event(capture->connection);
+	if (event == NULL)
+	{
+		pollfd.fd = xcb_get_file_descriptor(capture->connection);
+		pollfd.events = POLLIN;
+		if (poll(&pollfd, 1, timeout_ms) < 0 && errno != EINTR)
+			return -errno;
+		event = xcb_poll_for_event(capture->connection);
+	}
+
+	while (event)
+	{
+		if ((event->response_type & ~0x80) == capture->damage_event + XCB_DAMAGE_NOTIFY)
+		{
+			changed = 1;
+		}
+		else if ((event->response_type & ~0x80) == XCB_CONFIGURE_NOTIFY)
+		{
+			configure = (xcb_configure_notify_event_t *)event;
+			if (configure->width != capture->window_width ||
+				configure->height != capture->window_height)
+				capture->resized = changed = 1;
+		}
+		else if ((event->response_type & ~0x80) == XCB_DESTROY_NOTIFY)
+		{
+			capture->destroyed = 1;
+		}
+		free(event);
+		event = xcb_poll_for_event(capture->connection);
+	}
+
+	if (capture->destroyed)
+	{
+		fprintf(stdout, "The window is gone\n");
+		return -EPIPE;
+	}
+
+	if (xcb_connection_has_error(capture->connection))
+	{
+		fprintf(stderr, "Lost the connection to the X server\n");
+		return -EIO;
+	}
+
+	return changed;
+}
+
+/*
+ * Take the damage away from the X server and note it; changes to a window
+ * are scaled again right away, on the rows they cover after scaling plus
+ * one for the bilinear filter.
+ */
+static int xshm_collect_damage(struct capture_source *source)
+{
+	struct xshm_capture *capture = source->priv;
+	xcb_xfixes_fetch_region_reply_t *reply;
+	xcb_rectangle_t *rectangles;
+	struct row_range scaled[CAPTURE_MAX_RANGES];
+	int n_scaled = 0;
+	int n_rectangles;
+	int start;
+	int end;
+	int i;
+
+	xcb_damage_subtract(capture->connection, capture->damage,
+						XCB_XFIXES_REGION_NONE, capture->region);
+	reply = xcb_xfixes_fetch_region_reply(capture->connection,
+										  xcb_xfixes_fetch_region(capture->connection,
+																  capture->region),
+										  NULL);
+	if (reply == NULL)
+		return -EIO;
+
+	rectangles = xcb_xfixes_fetch_region_rectangles(reply);
+	n_rectangles = xcb_xfixes_fetch_region_rectangles_length(reply);
+	for (i = 0; i < n_rectangles; i++)
+	{
+		start = rectangles[i].y;
+		end = rectangles[i].y + rectangles[i].height;
+		if (capture->window)
+		{
+			start = (int)((int64_t)start * source->height / capture->window_height) - 1;
+			end = (int)(((int64_t)end * source->height + capture->window_height - 1) / capture->window_height) + 1;
+		}
+		start = FFMAX(start, 0);
+		end = FFMIN(end, source->height);
+		if (start >= end)
+			continue;
+
+		capture_add_damage(&capture->buffers, start, end);
+		if (capture->window)
+			row_ranges_add(scaled, &n_scaled, start, end);
+	}
+	free(reply);
+
+	for (i = 0; i < n_scaled; i++)
+		xcb_render_composite(capture->connection, XCB_RENDER_PICT_OP_SRC,
+							 capture->window_picture, XCB_NONE, capture->scaled_picture,
+							 0, scaled[i].start, 0, 0, 0, scaled[i].start,
+							 source->width, scaled[i].end - scaled[i].start);
+
+	return 0;
+}
+
+static int xshm_grab(struct capture_source *source, AVFrame *frame)
+{
+	struct xshm_capture *capture = source->priv;
+	struct capture_buffer *buffer;
+	AVBufferRef *buf;
+	int ret;
+
+	if (capture->resized)
+	{
+		ret = xwindow_setup_scaling(source);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = xshm_collect_damage(source);
+	if (ret < 0)
+		return ret;
+
+	if (capture->buffers.damaged.start >= capture->buffers.damaged.end)
+		return 0;
+
+	buffer = capture_buffer_get(&capture->buffers, &buf);
+	if (buffer == NULL)
+		return -EAGAIN;
+
+	ret = xshm_buffer_update(capture, buffer, source->width);
+	if (ret < 0)
+	{
+		av_buffer_unref(&buf);
+		return ret;
+	}
+
+	capture_frame_init(source, &capture->buffers, buffer, buf, frame,
+					   AV_PIX_FMT_BGR0, source->width * 4);
+
+	return 1;
+}
+
+static const struct capture_ops xshm_capture_ops = {
+	.format = "xshm",
+	.open = xshm_open,
+	.close = xshm_close,
+	.wait = xshm_wait,
+	.grab = xshm_grab,
+};
+
+static const struct capture_ops xwindow_capture_ops = {
+	.format = "xwindow",
+	.open = xwindow_open,
+	.close = xshm_close,
+	.wait = xshm_wait,
+	.grab = xshm_grab,
+};
+#endif
+
+#ifdef HAVE_LINUX_FB
+/*
+ * Linux framebuffer capture: the framebuffer is mapped in memory and each
+ * row is compared with a shadow copy of the last frame, the memcmp() of
+ * the C library is vectorized already; only the changed rows are copied,
+ * instead of reading the whole framebuffer for every frame.
+ */
+struct fbdev_capture
+{
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	int line_length; /* of the framebuffer */
+	int row_size;	 /* the bytes of the visible part of a row */
+	int linesize;	 /* of the frames */
+	enum AVPixelFormat pix_fmt;
+	struct fb_var_screeninfo var;
+	uint8_t *shadow;
+	uint8_t *data; /* of all the capture buffers */
+	struct capture_buffers buffers;
+};
+
+/* Map the usual truecolor layouts, in little endian order */
+static enum AVPixelFormat fbdev_get_pixel_format(const struct fb_var_screeninfo *var)
+{
+	if (var->bits_per_pixel == 32 && var->red.offset == 16 &&
+		var->green.offset == 8 && var->blue.offset == 0)
+		return AV_PIX_FMT_BGR0;
+	else if (var->bits_per_pixel == 32 && var->red.offset == 0 &&
+			 var->green.offset == 8 && var->blue.offset == 16)
+		return AV_PIX_FMT_RGB0;
+	else if (var->bits_per_pixel == 24 && var->red.offset == 16 &&
+			 var->green.offset == 8 && var->blue.offset == 0)
+		return AV_PIX_FMT_BGR24;
+	else if (var->bits_per_pixel == 24 && var->red.offset == 0 &&
+			 var->green.offset == 8 && var->blue.offset == 16)
+		return AV_PIX_FMT_RGB24;
+	else if (var->bits_per_pixel == 16 && var->red.offset == 11 &&
+			 var->green.offset == 5 && var->blue.offset == 0)
+		return AV_PIX_FMT_RGB565LE;
+
+	return AV_PIX_FMT_NONE;
+}
+
+static void fbdev_close(struct capture_source *source)
+{
+	struct fbdev_capture *capture = source->priv;
+
+	if (capture == NULL)
+		return;
+
+	capture_buffers_free(&capture->buffers);
+	av_free(capture->data);
+	av_free(capture->shadow);
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	if (capture->fd >= 0)
+		close(capture->fd);
+	free(capture);
+	source->priv = NULL;
+}
+
+/* Update the shadow copy, and note the rows which changed, or all of them */
+static int fbdev_compare(struct capture_source *source, int all)
+{
+	struct fbdev_capture *capture = source->priv;
+	struct fb_var_screeninfo var;
+	const uint8_t *visible;
+	const uint8_t *row;
+	uint8_t *shadow;
+	int changed_start = -1;
+	int y;
+
+	/* panning moves the visible part, as double buffering does */
+	if (ioctl(capture->fd, FBIOGET_VSCREENINFO, &var) < 0)
+		return -errno;
+
+	if (var.xres != capture->var.xres || var.yres != capture->var.yres ||
+		var.bits_per_pixel != capture->var.bits_per_pixel)
+	{
+		fprintf(stderr, "The framebuffer mode changed\n");
+		return -EIO;
+	}
+
+	visible = capture->map + (size_t)var.yoffset * capture->line_length +
+			  (size_t)var.xoffset * var.bits_per_pixel / 8;
+	if (visible + (size_t)(source->height - 1) * capture->line_length + capture->row_size >
+		capture->map + capture->map_size)
+		return -EIO;
+
+	for (y = 0; y < source->height; y++)
+	{
+		row = visible + (size_t)y * capture->line_length;
+		shadow = capture->shadow + (size_t)y * capture->linesize;
+
+		if (all || memcmp(shadow, row, capture->row_size) != 0)
+		{
+			memcpy(shadow, row, capture->row_size);
+			if (changed_start < 0)
+				changed_start = y;
+		}
+		else if (changed_start >= 0)
+		{
+			capture_add_damage(&capture->buffers, changed_start, y);
+			changed_start = -1;
+		}
+	}
+
+	if (changed_start >= 0)
+		capture_add_damage(&capture->buffers, changed_start, source->height);
+
+	return 0;
+}
+
+static int fbdev_open(struct capture_source *source, const char *path)
+{
+	struct fbdev_capture *capture;
+	struct fb_fix_screeninfo fix;
+	int frame_size;
+	unsigned int i;
+	int ret;
+
+	capture = calloc(1, sizeof(*capture));
+	if (capture == NULL)
+		return -ENOMEM;
+	capture->fd = -1;
+	source->priv = capture;
+
+	capture->fd = open(path, O_RDONLY);
+	if (capture->fd < 0)
+	{
+		ret = -errno;
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		goto err;
+	}
+
+	if (ioctl(capture->fd, FBIOGET_FSCREENINFO, &fix) < 0 ||
+		ioctl(capture->fd, FBIOGET_VSCREENINFO, &capture->var) < 0)
+	{
+		ret = -errno;
+		perror("ioctl");
+		goto err;
+	}
+
+	capture->pix_fmt = fbdev_get_pixel_format(&capture->var);
+	if (fix.type != FB_TYPE_PACKED_PIXELS || capture->pix_fmt == AV_PIX_FMT_NONE)
+	{
+		fprintf(stderr, "Unsupported framebuffer format: %u bits per pixel\n",
+				capture->var.bits_per_pixel);
+		ret = -ENOTSUP;
+		goto err;
+	}
+
+	capture->map_size = fix.smem_len;
+	capture->map = mmap(NULL, capture->map_size, PROT_READ, MAP_SHARED, capture->fd, 0);
+	if (capture->map == MAP_FAILED)
+	{
+		ret = -errno;
+		perror("mmap");
+		capture->map = NULL;
+		goto err;
+	}
+
+	source->width = capture->var.xres;
+	source->height = capture->var.yres;
+	capture->line_length = fix.line_length;
+	capture->row_size = source->width * (int)capture->var.bits_per_pixel / 8;
+	capture->linesize = FFALIGN(capture->row_size, 32);
+	frame_size = capture->linesize * source->height;
+
+	capture->shadow = av_malloc(frame_size);
+	capture->data = av_malloc((size_t)frame_size * CAPTURE_BUFFERS);
+	if (capture->shadow == NULL || capture->data == NULL)
+	{
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < CAPTURE_BUFFERS; i++)
+		capture->buffers.buffers[i].data = capture->data + (size_t)frame_size * i;
+
+	ret = capture_buffers_init(&capture->buffers, frame_size);
+	if (ret < 0)
+		goto err;
+
+	/* the first frame is a full one */
+	ret = fbdev_compare(source, 1);
+	if (ret < 0)
+		goto err;
+
+	fprintf(stdout, "capturing the %dx%d %s framebuffer %s\n",
+			source->width, source->height,
+			av_get_pix_fmt_name(capture->pix_fmt), path);
+
+	return 0;
+
+err:
+	fbdev_close(source);
+	return ret;
+}
+
+/* The framebuffer tells nobody about changes, it is looked at every frame */
+static int fbdev_wait(struct capture_source *source, int timeout_ms)
+{
+	int64_t frame_time;
+
+	frame_time = av_rescale(AV_TIME_BASE, source->frame_rate.den, source->frame_rate.num);
+	av_usleep(FFMIN(frame_time, timeout_ms * 1000LL));
+
+	return 1;
+}
+
+static int fbdev_grab(struct capture_source *source, AVFrame *frame)
+{
+	struct fbdev_capture *capture = source->priv;
+	struct capture_buffer *buffer;
+	struct row_range *range;
+	AVBufferRef *buf;
+	int i;
+	int ret;
+
+	ret = fbdev_compare(source, 0);
+	if (ret < 0)
+		return ret;
+
+	if (capture->buffers.damaged.start >= capture->buffers.damaged.end)
+		return 0;
+
+	buffer = capture_buffer_get(&capture->buffers, &buf);
+	if (buffer == NULL)
+		return -EAGAIN;
+
+	for (i = 0; i < buffer->n_pending; i++)
+	{
+		range = &buffer->pending[i];
+		av_image_copy_plane(buffer->data + (size_t)range->start * capture->linesize,
+							capture->linesize,
+							capture->shadow + (size_t)range->start * capture->linesize,
+							capture->linesize,
+							capture->row_size,
+							range->end - range->start);
+	}
+
+	capture_frame_init(source, &capture->buffers, buffer, buf, frame,
+					   capture->pix_fmt, capture->linesize);
+
+	return 1;
+}
+
+static const struct capture_ops fbdev_capture_ops = {
+	.format = "fbdev",
+	.open = fbdev_open,
+	.close = fbdev_close,
+	.wait = fbdev_wait,
+	.grab = fbdev_grab,
+};
+#endif
+
+static const struct capture_ops *const capture_sources[] = {
+#ifdef HAVE_XCB_CAPTURE
+	&xshm_capture_ops,
+	&xwindow_capture_ops,
+#endif
+#ifdef HAVE_LINUX_FB
+	&fbdev_capture_ops,
+#endif
+	NULL
+};
+
+/* Return -ENOENT if format is not the one of a capture source */
+static int capture_source_open(struct capture_source **source,
+							   const char *format,
+							   const char *path,
+							   AVDictionary *options)
+{
+	struct capture_source *new_source;
+	AVDictionaryEntry *entry;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; capture_sources[i]; i++)
+		if (strcmp(format, capture_sources[i]->format) == 0)
+			break;
+
+	if (capture_sources[i] == NULL)
+		return -ENOENT;
+
+	new_source = calloc(1, sizeof(*new_source));
+	if (new_source == NULL)
+		return -ENOMEM;
+
+	new_source->ops = capture_sources[i];
+	new_source->frame_rate.num = 30;
+	new_source->frame_rate.den = 1;
+
+	entry = av_dict_get(options, "framerate", NULL, 0);
+	if (entry && (av_parse_video_rate(&new_source->frame_rate, entry->value) < 0 ||
+				  new_source->frame_rate.num <= 0))
+	{
+		fprintf(stderr, "Invalid frame rate: %s\n", entry->value);
+		free(new_source);
+		return -EINVAL;
+	}
+
+	entry = av_dict_get(options, "video_size", NULL, 0);
+	if (entry && av_parse_video_size(&new_source->max_width,
+									 &new_source->max_height,
+									 entry->value) < 0)
+	{
+		fprintf(stderr, "Invalid video size: %s\n", entry->value);
+		free(new_source);
+		return -EINVAL;
+	}
+
+	ret = new_source->ops->open(new_source, path);
+	if (ret < 0)
+	{
+		free(new_source);
+		return ret;
+	}
+
+	*source = new_source;
+	return 0;
+}
+
+static void capture_source_close(struct capture_source *source)
+{
+	if (source == NULL)
+		return;
+
+	source->ops->close(source);
+	free(source);
+}
+
+struct video_input_ctx
+{
+	AVFormatContext *format_ctx;
+	AVCodecContext *codec_ctx;
+	int video_stream_index;
+	struct capture_source *capture; /* used instead of libavformat */
+};
+
+/*
+ * Tell if the demuxer already knows enough about a video stream to decode
+ * it, as most containers and devices do from their header; the decoder
+ * finds out the rest from the first packets. MJPEG passthrough also needs
+ * the pixel format.
+ */
+static int stream_info_known(AVFormatContext *format_ctx)
+{
+	AVCodecParameters *params;
+	unsigned int i;
+
+	for (i = 0; i < format_ctx->nb_streams; i++)
+	{
+		params = format_ctx->streams[i]->codecpar;
+		if (params->codec_type == AVMEDIA_TYPE_VIDEO &&
+			params->codec_id != AV_CODEC_ID_NONE &&
+			params->width > 0 && params->height > 0 &&
+			(params->codec_id != AV_CODEC_ID_MJPEG || params->format != AV_PIX_FMT_NONE))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int video_input_init(struct video_input_ctx *input_ctx,
+							const char *input_format_string,
+							const char *input_path,
+							AVDictionary **input_options,
+							const struct threading_options *threading,
+							int fast_start)
+{
+	const AVInputFormat *input_format = NULL;
+	AVFormatContext *input_format_ctx;
+	AVCodecParameters *input_codec_params;
+	AVCodecContext *input_codec_ctx;
+	const AVCodec *input_codec;
+	int video_index;
+	int low_delay;
+	int ret;
+
+	// avcodec_register_all();
+	// av_register_all();
+
+	input_ctx->format_ctx = NULL;
+	input_ctx->codec_ctx = NULL;
+	input_ctx->video_stream_index = -1;
+	input_ctx->capture = NULL;
+
+	if (input_format_string)
+	{
+		/*
+		 * Some inputs are captured without libavformat, unless the
+		 * native capture cannot handle them.
+		 */
+		ret = capture_source_open(&input_ctx->capture,
+								  input_format_string,
+								  input_path,
+								  *input_options);
+		if (ret == 0)
+			startup_mark("capture opened");
+		if (ret != -ENOENT && ret != -ENOTSUP)
+			goto out;
+
+		/* only devices need this, files and streams are found without it */
+		avdevice_register_all();
+		startup_mark("devices registered");
+
+		/* find the desired input format */
+		input_format = av_find_input_format(input_format_string);
+		if (input_format == NULL)
+		{
+			fprintf(stderr, "cannot find input format\n");
+			ret = -ENODEV;
+			goto out;
+		}
+	}
+
+	if (input_path == NULL)
+	{
+		fprintf(stderr, "input_path must not be NULL!\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * A few KiB and a tenth of a second are enough to find a video stream
+	 * in most inputs, instead of the default 5 MB and 5 seconds.
+	 */
+	if (fast_start)
+	{
+		if (!av_dict_get(*input_options, "probesize", NULL, 0))
+			av_dict_set(input_options, "probesize", "32768", 0);
+		if (!av_dict_get(*input_options, "analyzeduration", NULL, 0))
+			av_dict_set(input_options, "analyzeduration", "100000", 0);
+	}
+
+	/* open the input format/device */
+	input_format_ctx = NULL;
+	ret = avformat_open_input(&input_format_ctx,
+							  input_path,
+							  input_format,
+							  input_options);
+	if (ret < 0)
+	{
+		fprintf(stderr, "cannot open input format/device\n");
+		goto out;
+	}
+
+	startup_mark("input opened");
+
+	/* get information on the input stream (e.g. format, bitrate, framerate) */
+	if (!fast_start || !stream_info_known(input_format_ctx))
+	{
+		ret = avformat_find_stream_info(input_format_ctx, NULL);
+		if (ret < 0)
+		{
+			fprintf(stderr, "cannot get information on the stream\n");
+			goto cleanup;
+		}
+		startup_mark("stream info found");
+	}
+
+	/* dump what was found */
+	if (!fast_start)
+		av_dump_format(input_format_ctx, 0, input_path, 0);
+
+	/* look for the first video_stream */
+	input_codec = NULL;
+	video_index = av_find_best_stream(input_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_codec, 0);
+
+	// video_index = av_find_best_stream(input_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_codec, 0);
+	if (video_index < 0)
+	{
+		fprintf(stderr, "cannot find any video streams\n");
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	input_codec_ctx = avcodec_alloc_context3(input_codec);
+	if (input_codec_ctx == NULL)
+	{
+		fprintf(stderr, "failed to allocate the input codec context\n");
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	input_codec_params = input_format_ctx->streams[video_index]->codecpar;
+	ret = avcodec_parameters_to_context(input_codec_ctx, input_codec_params);
+	if (ret < 0)
+	{
+		fprintf(stderr, "cannot copy parameters to input codec context\n");
+		goto cleanup_ctx;
+	}
+
+	/*
+	 * Frame threading decodes several frames at once, which is the
+	 * fastest way for codecs like H.264 and HEVC, but each thread delays
+	 * the output by one frame; live sources only use slice threading and
+	 * get each frame out of the decoder as soon as possible.
+	 */
+	low_delay = threading->low_delay;
+	if (low_delay < 0)
+		low_delay = (input_format_ctx->iformat->flags & AVFMT_NOFILE) != 0;
+
+	input_codec_ctx->thread_count = threading->decoder_threads;
+	if (threading->decoder_thread_type)
+		input_codec_ctx->thread_type = threading->decoder_thread_type;
+	else if (low_delay)
+		input_codec_ctx->thread_type = FF_THREAD_SLICE;
+	else
+		input_codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+	if (low_delay)
+		input_codec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+	/* open the decoder */
+	ret = avcodec_open2(input_codec_ctx, input_codec, NULL);
+	if (ret < 0)
+	{
+		fprintf(stderr, "cannot open input codec\n");
+		goto cleanup_ctx;
+	}
+	startup_mark("decoder opened");
+
+	fprintf(stdout, "decoding with %d thread(s)%s%s%s\n",
+			input_codec_ctx->thread_count,
+			(input_codec_ctx->active_thread_type & FF_THREAD_FRAME) ? ", frame threading" : "",
+			(input_codec_ctx->active_thread_type & FF_THREAD_SLICE) ? ", slice threading" : "",
+			low_delay ? ", low delay" : "");
+
+	input_ctx->format_ctx = input_format_ctx;
+	input_ctx->codec_ctx = input_codec_ctx;
+	input_ctx->video_stream_index = video_index;
+
+	ret = 0;
+	goto out;
+
+cleanup_ctx:
+	avcodec_free_context(&input_codec_ctx);
+cleanup:
+	avformat_close_input(&input_format_ctx);
+out:
+	av_dict_free(input_options);
+	*input_options = NULL;
+	return ret;
+}
+
+struct video_output_ctx
+{
+	am7xxx_device *dev;
+	am7xxx_image_format image_format;
+	unsigned int rescale_method;
+	unsigned int upscale;
+	unsigned int quality;
+	int native_scale;
+	AVRational time_base;
+	int64_t bit_rate;
+	const AVCodec *codec;
+	int raw_output;
+	int scaler_threads;
+	int encoder_threads;
+};
+
+static int video_output_init(struct video_output_ctx *output_ctx,
+							 struct video_input_ctx *input_ctx,
+							 unsigned int rescale_method,
+							 unsigned int upscale,
+							 unsigned int quality,
+							 am7xxx_image_format image_format,
+							 int native_scale,
+							 const struct threading_options *threading,
+							 am7xxx_device *dev)
+{
+	if (input_ctx == NULL)
+	{
+		fprintf(stderr, "input_ctx must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	output_ctx->dev = dev;
+	output_ctx->image_format = image_format;
+	output_ctx->rescale_method = rescale_method;
+	output_ctx->upscale = upscale;
+	output_ctx->quality = quality;
+	output_ctx->native_scale = native_scale;
+	if (input_ctx->capture)
+	{
+		/* captured frames are stamped with av_gettime_relative() */
+		output_ctx->bit_rate = 0;
+		output_ctx->time_base.num = 1;
+		output_ctx->time_base.den = AV_TIME_BASE;
+	}
+	else
+	{
+		output_ctx->bit_rate = (input_ctx->codec_ctx)->bit_rate;
+		output_ctx->time_base =
+			(input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->time_base;
+	}
+	output_ctx->codec = NULL;
+	output_ctx->scaler_threads = threading->scaler_threads;
+	output_ctx->encoder_threads = threading->encoder_threads;
+
+#if !HAVE_SWS_THREADS
+	if (output_ctx->scaler_threads != 1)
+	{
+		fprintf(stderr, "swscale is too old to use threads, scaling with one thread\n");
+		output_ctx->scaler_threads = 1;
+	}
+#endif
+
+	/* When the raw format is requested we don't actually need to setup
+	 * and open an encoder
+	 */
+	if (image_format == AM7XXX_IMAGE_FORMAT_NV12)
+	{
+		fprintf(stdout, "using raw output format\n");
+		output_ctx->raw_output = 1;
+		return 0;
+	}
+
+	/* find the encoder, it is opened for each output size */
+	output_ctx->codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (output_ctx->codec == NULL)
+	{
+		fprintf(stderr, "cannot find output codec!\n");
+		return -EINVAL;
+	}
+
+	output_ctx->raw_output = 0;
+
+	return 0;
+}
+
+/*
+ * Buffers for packets whose size varies from image to image, like JPEG
+ * ones: the pool is made of buffers as big as the biggest packet seen so
+ * far, so after the first few images no more buffers get allocated.
+ *
+ * Only the thread filling the packets can get buffers from a pool, the
+ * buffers can be released anywhere.
+ */
+struct packet_pool
+{
+	AVBufferPool *pool;
+	int buffer_size;
+};
+
+static int packet_pool_get(struct packet_pool *packet_pool, AVPacket *packet, int size)
+{
+	int buffer_size = size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+	if (buffer_size > packet_pool->buffer_size)
+	{
+		/* leave some room for the next images, which may be bigger */
+		buffer_size += buffer_size / 4;
+
+		/* the buffers in use keep the old pool alive */
+		av_buffer_pool_uninit(&packet_pool->pool);
+		packet_pool->buffer_size = 0;
+
+		packet_pool->pool = av_buffer_pool_init(buffer_size, NULL);
+		if (packet_pool->pool == NULL)
+			return AVERROR(ENOMEM);
+		packet_pool->buffer_size = buffer_size;
+	}
+
+	packet->buf = av_buffer_pool_get(packet_pool->pool);
+	if (packet->buf == NULL)
+		return AVERROR(ENOMEM);
+
+	packet->data = packet->buf->data;
+	packet->size = size;
+	memset(packet->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	return 0;
+}
+
+static void packet_pool_free(struct packet_pool *packet_pool)
+{
+	av_buffer_pool_uninit(&packet_pool->pool);
+	packet_pool->buffer_size = 0;
+}
+
+#if HAVE_ENCODE_BUFFER
+/* Let the encoder write the packets to pooled buffers */
+static int get_pooled_encode_buffer(AVCodecContext *codec_ctx, AVPacket *packet, int flags)
+{
+	(void)flags;
+	return packet_pool_get(codec_ctx->opaque, packet, packet->size);
+}
+#endif
+
+static int video_output_open_encoder(struct video_output_ctx *output_ctx,
+									 int width,
+									 int height,
+									 struct packet_pool *packet_pool,
+									 AVCodecContext **codec_ctx)
+{
+	AVCodecContext *output_codec_ctx;
+	unsigned int quality = output_ctx->quality;
+	int ret;
+
+	/* create the encoder context */
+	output_codec_ctx = avcodec_alloc_context3(output_ctx->codec);
+	if (output_codec_ctx == NULL)
+	{
+		fprintf(stderr, "cannot allocate output codec context!\n");
+		return -ENOMEM;
+	}
+
+	/* put sample parameters */
+	output_codec_ctx->bit_rate = output_ctx->bit_rate;
+	output_codec_ctx->width = width;
+	output_codec_ctx->height = height;
+	output_codec_ctx->time_base = output_ctx->time_base;
+
+	/* YUVJ420P is deprecated in swscaler, but mjpeg still relies on it. */
+	output_codec_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	output_codec_ctx->codec_id = AV_CODEC_ID_MJPEG;
+	output_codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+
+	/* Set quality and other VBR settings */
+
+	/* @note: 'quality' is expected to be between 1 and 100, but a value
+	 * between 0 to 99 has to be passed when calculating qmin and qmax.
+	 * This way qmin and qmax will cover the range 1-FF_QUALITY_SCALE, and
+	 * in particular they won't be 0, this is needed because they are used
+	 * as divisor somewhere in the encoding process */
+	output_codec_ctx->qmin = output_codec_ctx->qmax = ((100 - (quality - 1)) * FF_QUALITY_SCALE) / 100;
+	output_codec_ctx->mb_lmin = output_codec_ctx->qmin * FF_QP2LAMBDA;
+	output_codec_ctx->mb_lmax = output_codec_ctx->qmax * FF_QP2LAMBDA;
+	output_codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+	output_codec_ctx->global_quality = output_codec_ctx->qmin * FF_QP2LAMBDA;
+
+	/*
+	 * The MJPEG encoder splits the image in slices separated by restart
+	 * markers when using more than one thread.
+	 */
+	output_codec_ctx->thread_count = output_ctx->encoder_threads;
+	output_codec_ctx->thread_type = FF_THREAD_SLICE;
+
+#if HAVE_ENCODE_BUFFER
+	if (output_ctx->codec->capabilities & AV_CODEC_CAP_DR1)
+	{
+		output_codec_ctx->opaque = packet_pool;
+		output_codec_ctx->get_encode_buffer = get_pooled_encode_buffer;
+	}
+#else
+	(void)packet_pool;
+#endif
+
+	/* open the codec */
+	ret = avcodec_open2(output_codec_ctx, output_ctx->codec, NULL);
+	if (ret < 0)
+	{
+		fprintf(stderr, "could not open output codec!\n");
+		avcodec_free_context(&output_codec_ctx);
+		return ret;
+	}
+
+	*codec_ctx = output_codec_ctx;
+	return 0;
+}
+
+/*
+ * Wrap the new avcodec API from FFMpeg 3.1 to minimize the changes in the
+ * user code.
+ *
+ * If the use of the wrappers were to be made conditional, a check like the
+ * following could be used:
+ *
+ *	#if (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 48, 101))
+ *
+ * As derived from the APIchanges document:
+ * https://github.com/FFmpeg/FFmpeg/blob/master/doc/APIchanges
+ *
+ * The wrapper implementation has been taken from:
+ * https://blogs.gentoo.org/lu_zero/2016/03/29/new-avcodec-api/
+ */
+static int encode(AVCodecContext *avctx, AVPacket *pkt, int *got_packet, AVFrame *frame)
+{
+	int ret;
+
+	*got_packet = 0;
+
+	ret = avcodec_send_frame(avctx, frame);
+	if (ret < 0)
+		return ret;
+
+	ret = avcodec_receive_packet(avctx, pkt);
+	if (!ret)
+		*got_packet = 1;
+	if (ret == AVERROR(EAGAIN))
+		return 0;
+
+	return ret;
+}
+
+/*
+ * Check the stream frame rate against the capabilities measured by
+ * am7xxx-probe, so the user knows in advance if the device can keep up.
+ */
+static void check_device_profile(const am7xxx_device_profile *profile,
+								 struct video_input_ctx *input_ctx,
+								 struct video_output_ctx *output_ctx)
+{
+	AVRational frame_rate;
+	double fps;
+	double frame_time_us;
+	double frame_budget;
+
+	if (profile == NULL)
+		return;
+
+	if (input_ctx->capture)
+		frame_rate = input_ctx->capture->frame_rate;
+	else
+		frame_rate = (input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->avg_frame_rate;
+	if (frame_rate.num == 0 || frame_rate.den == 0)
+		return;
+
+	fps = av_q2d(frame_rate);
+
+	if (output_ctx->raw_output)
+	{
+		if (profile->max_fps_nv12 > 0 && fps > profile->max_fps_nv12)
+			fprintf(stderr, "WARNING: the device shows at most %.2f fps in NV12 format, the input is %.2f fps\n",
+					profile->max_fps_nv12, fps);
+		return;
+	}
+
+	if (profile->bulk_throughput == 0)
+		return;
+
+	/* the time left to transfer each frame after the firmware delay */
+	frame_time_us = 1000000.0 / fps - profile->frame_delay_us;
+	if (frame_time_us <= 0)
+	{
+		fprintf(stderr, "WARNING: the device cannot process %.2f fps, the frame delay is %u us\n",
+				fps, profile->frame_delay_us);
+		return;
+	}
+
+	frame_budget = profile->bulk_throughput * frame_time_us / 1000000.0;
+	fprintf(stdout, "JPEG frames must be smaller than %.0f bytes to sustain %.2f fps\n",
+			frame_budget, fps);
+}
+
+/*
+ * The state needed to scale the frames of one input geometry.
+ *
+ * Sources like v4l2 cameras or network streams can change resolution or
+ * pixel format mid-stream; keeping a few of these around makes switching
+ * back and forth cost just a lookup.
+ */
+struct scale_cache_entry
+{
+	int input_width;
+	int input_height;
+	enum AVPixelFormat input_pix_fmt;
+	unsigned int last_used; /* 0 when the entry is unused */
+	int width;
+	int height;
+	enum AVPixelFormat pix_fmt;
+	struct SwsContext *sw_scale_ctx;
+	am7xxx_scaler *scaler;
+	int passthrough; /* the frames are sent as they are */
+	int out_buf_size;
+	AVBufferPool *buffer_pool; /* the buffers of the scaled frames */
+
+	/* the last output for captured frames, see struct frame_damage */
+	uint8_t *last_data[4];
+	int last_linesize[4];
+	unsigned long last_sequence;
+};
+
+#define SCALE_CACHE_SIZE 4
+
+struct scale_cache
+{
+	struct scale_cache_entry entries[SCALE_CACHE_SIZE];
+	unsigned int clock;
+};
+
+/* Map the YUV 4:2:0 layouts libam7xxx can handle without swscale */
+static int get_pixel_format(enum AVPixelFormat pix_fmt, am7xxx_pixel_format *pixel_format)
+{
+	if (pix_fmt == AV_PIX_FMT_YUV420P || pix_fmt == AV_PIX_FMT_YUVJ420P)
+		*pixel_format = AM7XXX_PIXEL_FORMAT_YUV420P;
+	else if (pix_fmt == AV_PIX_FMT_NV12)
+		*pixel_format = AM7XXX_PIXEL_FORMAT_NV12;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Set up the libam7xxx scaler, which sends NV12 images at the device native
+ * size with black bars around the picture, instead of sending images of
+ * arbitrary dimensions which some firmware versions display badly.
+ *
+ * When the scaler cannot be used entry->scaler is left NULL and swscale is
+ * used.
+ */
+static int native_scaler_init(struct scale_cache_entry *entry,
+							  struct video_output_ctx *output_ctx)
+{
+	am7xxx_device_info device_info;
+	enum AVPixelFormat pix_fmt = entry->input_pix_fmt;
+	am7xxx_pixel_format pixel_format;
+	am7xxx_scale_method scale_method;
+	int ret;
+
+	if (!output_ctx->raw_output)
+	{
+		fprintf(stderr, "Native scaling needs the NV12 format, using swscale\n");
+		return 0;
+	}
+
+	if (get_pixel_format(pix_fmt, &pixel_format) < 0)
+	{
+		fprintf(stderr, "Native scaling not supported for %s input, using swscale\n",
+				av_get_pix_fmt_name(pix_fmt));
+		return 0;
+	}
+
+	scale_method = (output_ctx->rescale_method == SWS_AREA) ? AM7XXX_SCALE_AREA : AM7XXX_SCALE_BILINEAR;
+
+	ret = am7xxx_get_device_info(output_ctx->dev, &device_info);
+	if (ret < 0)
+	{
+		perror("am7xxx_get_device_info");
+		return ret;
+	}
+
+	ret = am7xxx_scaler_new(output_ctx->dev, &entry->scaler, pixel_format,
+							entry->input_width,
+							entry->input_height,
+							output_ctx->upscale, scale_method);
+	if (ret < 0)
+	{
+		perror("am7xxx_scaler_new");
+		return ret;
+	}
+
+	/* The scaler always outputs images at the native size */
+	entry->width = device_info.native_width & ~1U;
+	entry->height = device_info.native_height & ~1U;
+
+	return 0;
+}
+
+/*
+ * Set up the swscale context of the entry; an existing context is reused
+ * if the parameters match, unless it is needed to use threads, which can
+ * only be set up with the AVOptions API.
+ */
+static struct SwsContext *scale_context_get(struct scale_cache_entry *entry,
+											struct video_output_ctx *output_ctx)
+{
+	struct SwsContext *sw_scale_ctx;
+
+	if (output_ctx->scaler_threads == 1)
+		return sws_getCachedContext(entry->sw_scale_ctx,
+									entry->input_width,
+									entry->input_height,
+									entry->input_pix_fmt,
+									entry->width,
+									entry->height,
+									entry->pix_fmt,
+									output_ctx->rescale_method,
+									NULL, NULL, NULL);
+
+	sws_freeContext(entry->sw_scale_ctx);
+
+	sw_scale_ctx = sws_alloc_context();
+	if (sw_scale_ctx == NULL)
+		return NULL;
+
+	av_opt_set_int(sw_scale_ctx, "srcw", entry->input_width, 0);
+	av_opt_set_int(sw_scale_ctx, "srch", entry->input_height, 0);
+	av_opt_set_int(sw_scale_ctx, "src_format", entry->input_pix_fmt, 0);
+	av_opt_set_int(sw_scale_ctx, "dstw", entry->width, 0);
+	av_opt_set_int(sw_scale_ctx, "dsth", entry->height, 0);
+	av_opt_set_int(sw_scale_ctx, "dst_format", entry->pix_fmt, 0);
+	av_opt_set_int(sw_scale_ctx, "sws_flags", output_ctx->rescale_method, 0);
+	av_opt_set_int(sw_scale_ctx, "threads", output_ctx->scaler_threads, 0);
+
+	if (sws_init_context(sw_scale_ctx, NULL, NULL) < 0)
+	{
+		sws_freeContext(sw_scale_ctx);
+		return NULL;
+	}
+
+	return sw_scale_ctx;
+}
+
+/* Release everything but the swscale context, which can be recycled */
+static void scale_cache_entry_clear(struct scale_cache_entry *entry)
+{
+	am7xxx_scaler_free(entry->scaler);
+	entry->scaler = NULL;
+	av_buffer_pool_uninit(&entry->buffer_pool);
+	av_freep(&entry->last_data[0]);
+	entry->last_sequence = 0;
+	entry->passthrough = 0;
+	entry->out_buf_size = 0;
+	entry->last_used = 0;
+}
+
+static int scale_cache_entry_init(struct scale_cache_entry *entry,
+								  struct video_output_ctx *output_ctx,
+								  AVFrame *frame)
+{
+	unsigned int new_output_width;
+	unsigned int new_output_height;
+	am7xxx_pixel_format pixel_format;
+	int ret;
+
+	entry->input_width = frame->width;
+	entry->input_height = frame->height;
+	entry->input_pix_fmt = frame->format;
+
+	if (output_ctx->native_scale)
+	{
+		ret = native_scaler_init(entry, output_ctx);
+		if (ret < 0)
+			goto err;
+	}
+
+	if (entry->scaler == NULL)
+	{
+		/* Calculate the new output dimension so the original frame is
+		 * shown in its entirety */
+		ret = am7xxx_calc_scaled_image_dimensions(output_ctx->dev,
+												  output_ctx->upscale,
+												  frame->width,
+												  frame->height,
+												  &new_output_width,
+												  &new_output_height);
+		if (ret < 0)
+		{
+			fprintf(stderr, "cannot calculate output dimension\n");
+			goto err;
+		}
+		entry->width = new_output_width;
+		entry->height = new_output_height;
+	}
+
+	/*
+	 * Raw YUV 4:2:0 frames which already have the output size need no
+	 * scaling, their planes are packed directly into the transfer buffer
+	 * when sending.
+	 */
+	if (output_ctx->raw_output &&
+		entry->width == frame->width && entry->height == frame->height &&
+		(frame->width % 2) == 0 && (frame->height % 2) == 0 &&
+		get_pixel_format(frame->format, &pixel_format) == 0)
+	{
+		am7xxx_scaler_free(entry->scaler);
+		entry->scaler = NULL;
+		entry->passthrough = 1;
+		entry->pix_fmt = frame->format;
+
+		fprintf(stdout, "sending %dx%d %s frames as they are\n",
+				frame->width, frame->height,
+				av_get_pix_fmt_name(frame->format));
+		return 0;
+	}
+
+	/* YUVJ420P is deprecated in swscaler, but mjpeg still relies on it. */
+	entry->pix_fmt = output_ctx->raw_output ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUVJ420P;
+
+	/* calculate the bytes needed for the output image */
+	entry->out_buf_size = av_image_get_buffer_size(entry->pix_fmt,
+												   entry->width,
+												   entry->height,
+												   1);
+
+	entry->buffer_pool = av_buffer_pool_init(entry->out_buf_size, NULL);
+	if (entry->buffer_pool == NULL)
+	{
+		fprintf(stderr, "cannot allocate the output buffers!\n");
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	if (entry->scaler == NULL)
+	{
+		entry->sw_scale_ctx = scale_context_get(entry, output_ctx);
+		if (entry->sw_scale_ctx == NULL)
+		{
+			fprintf(stderr, "cannot set up the rescaling context!\n");
+			ret = -EINVAL;
+			goto err;
+		}
+	}
+
+	fprintf(stdout, "scaling %dx%d %s to %dx%d%s\n",
+			frame->width, frame->height,
+			av_get_pix_fmt_name(frame->format),
+			entry->width, entry->height,
+			entry->scaler ? " (native)" : "");
+
+	return 0;
+
+err:
+	scale_cache_entry_clear(entry);
+	return ret;
+}
+
+/*
+ * Get the scaling state for the geometry and pixel format of the frame,
+ * setting up a new one in place of the least recently used if needed.
+ */
+static struct scale_cache_entry *scale_cache_get(struct scale_cache *cache,
+												 struct video_output_ctx *output_ctx,
+												 AVFrame *frame)
+{
+	struct scale_cache_entry *entry;
+	struct scale_cache_entry *lru = NULL;
+	unsigned int i;
+	int ret;
+
+	cache->clock++;
+
+	for (i = 0; i < SCALE_CACHE_SIZE; i++)
+	{
+		entry = &cache->entries[i];
+		if (entry->last_used &&
+			entry->input_width == frame->width &&
+			entry->input_height == frame->height &&
+			entry->input_pix_fmt == frame->format)
+		{
+			entry->last_used = cache->clock;
+			return entry;
+		}
+
+		if (lru == NULL || entry->last_used < lru->last_used)
+			lru = entry;
+	}
+
+	scale_cache_entry_clear(lru);
+	ret = scale_cache_entry_init(lru, output_ctx, frame);
+	if (ret < 0)
+		return NULL;
+
+	lru->last_used = cache->clock;
+	return lru;
+}
+
+static void scale_cache_free(struct scale_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < SCALE_CACHE_SIZE; i++)
+	{
+		scale_cache_entry_clear(&cache->entries[i]);
+		sws_freeContext(cache->entries[i].sw_scale_ctx);
+		cache->entries[i].sw_scale_ctx = NULL;
+	}
+}
+
+/*
+ * The JPEG encoders, one per output size, used by the encode stage.
+ */
+struct encoder_cache_entry
+{
+	int width;
+	int height;
+	unsigned int last_used; /* 0 when the entry is unused */
+	AVCodecContext *codec_ctx;
+	struct packet_pool packet_pool;
+};
+
+struct encoder_cache
+{
+	struct encoder_cache_entry entries[SCALE_CACHE_SIZE];
+	unsigned int clock;
+};
+
+static AVCodecContext *encoder_cache_get(struct encoder_cache *cache,
+										 struct video_output_ctx *output_ctx,
+										 int width,
+										 int height)
+{
+	struct encoder_cache_entry *entry;
+	struct encoder_cache_entry *lru = NULL;
+	unsigned int i;
+	int ret;
+
+	cache->clock++;
+
+	for (i = 0; i < SCALE_CACHE_SIZE; i++)
+	{
+		entry = &cache->entries[i];
+		if (entry->last_used &&
+			entry->width == width &&
+			entry->height == height)
+		{
+			entry->last_used = cache->clock;
+			return entry->codec_ctx;
+		}
+
+		if (lru == NULL || entry->last_used < lru->last_used)
+			lru = entry;
+	}
+
+	/* Freeing the codec context is needed as well,
+	 * see https://libav.org/documentation/doxygen/master/group__lavc__core.html#gaf4daa92361efb3523ef5afeb0b54077f
+	 */
+	avcodec_free_context(&lru->codec_ctx);
+	lru->last_used = 0;
+
+	ret = video_output_open_encoder(output_ctx, width, height,
+									&lru->packet_pool, &lru->codec_ctx);
+	if (ret < 0)
+		return NULL;
+
+	lru->width = width;
+	lru->height = height;
+	lru->last_used = cache->clock;
+	return lru->codec_ctx;
+}
+
+static void encoder_cache_free(struct encoder_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < SCALE_CACHE_SIZE; i++)
+	{
+		avcodec_free_context(&cache->entries[i].codec_ctx);
+		packet_pool_free(&cache->entries[i].packet_pool);
+	}
+}
+
+/*
+ * A bounded single-producer single-consumer queue connecting two pipeline
+ * stages.
+ *
+ * Only the producer writes the tail and only the consumer writes the head,
+ * so passing items does not need a lock; the mutex and the condition are
+ * used just to sleep when the queue is full or empty, which is what makes
+ * a fast stage wait for a slower one (backpressure).
+ */
+#define QUEUE_SIZE 4 /* must be a power of two */
+
+struct queue
+{
+	void *items[QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	int closed;	 /* the producer will not push any more items */
+	int aborted; /* the consumer will not pop any more items */
+	int sleepers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* Statistics, updated by the producer */
+	unsigned long pushed;
+	unsigned long depth_sum;
+	unsigned int depth_max;
+};
+
+static int queue_init(struct queue *queue)
+{
+	int ret;
+
+	memset(queue, 0, sizeof(*queue));
+
+	ret = pthread_mutex_init(&queue->mutex, NULL);
+	if (ret != 0)
+		return -ret;
+
+	ret = pthread_cond_init(&queue->cond, NULL);
+	if (ret != 0)
+	{
+		pthread_mutex_destroy(&queue->mutex);
+		return -ret;
+	}
+
+	return 0;
+}
+
+/* Free the items left in the queue and the queue resources */
+static void queue_destroy(struct queue *queue, void (*free_item)(void *item))
+{
+	while (queue->head != queue->tail)
+	{
+		free_item(queue->items[queue->head % QUEUE_SIZE]);
+		queue->head++;
+	}
+
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->mutex);
+}
+
+static void queue_wake(struct queue *queue, int force)
+{
+	if (force || __atomic_load_n(&queue->sleepers, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&queue->mutex);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+}
+
+/* Sleep as long as *index is equal to value */
+static void queue_wait(struct queue *queue, unsigned int *index, unsigned int value)
+{
+	pthread_mutex_lock(&queue->mutex);
+	__atomic_add_fetch(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value &&
+		   !__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST) &&
+		   !__atomic_load_n(&queue->aborted, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	__atomic_sub_fetch(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Push an item, waiting while the queue is full.
+ *
+ * Return -EPIPE if the consumer went away, in this case the item is still
+ * owned by the caller.
+ */
+static int queue_push(struct queue *queue, void *item)
+{
+	unsigned int tail = queue->tail;
+	unsigned int head;
+	unsigned int depth;
+
+	for (;;)
+	{
+		if (__atomic_load_n(&queue->aborted, __ATOMIC_SEQ_CST))
+			return -EPIPE;
+
+		head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+		if (tail - head < QUEUE_SIZE)
+			break;
+
+		queue_wait(queue, &queue->head, head);
+	}
+
+	queue->items[tail % QUEUE_SIZE] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+	queue_wake(queue, 0);
+
+	depth = tail + 1 - head;
+	queue->pushed++;
+	queue->depth_sum += depth;
+	if (depth > queue->depth_max)
+		queue->depth_max = depth;
+
+	return 0;
+}
+
+/*
+ * Pop an item, waiting while the queue is empty.
+ *
+ * Return NULL when the producer closed the queue and all the items have
+ * been consumed.
+ */
+static void *queue_pop(struct queue *queue)
+{
+	unsigned int head = queue->head;
+	void *item;
+
+	for (;;)
+	{
+		if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) != head)
+			break;
+
+		/* the tail is stored before closing, check it once more */
+		if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST))
+		{
+			if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) != head)
+				break;
+			return NULL;
+		}
+
+		queue_wait(queue, &queue->tail, head);
+	}
+
+	item = queue->items[head % QUEUE_SIZE];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+	queue_wake(queue, 0);
+
+	return item;
+}
+
+static void queue_close(struct queue *queue)
+{
+	__atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+	queue_wake(queue, 1);
+}
+
+static void queue_abort(struct queue *queue)
+{
+	__atomic_store_n(&queue->aborted, 1, __ATOMIC_SEQ_CST);
+	queue_wake(queue, 1);
+}
+
+/*
+ * Push an item only if there is room for it, for producers which must not
+ * wait for the consumer.
+ *
+ * Return -EAGAIN if the queue is full, in this case the item is still
+ * owned by the caller.
+ */
+static int queue_try_push(struct queue *queue, void *item)
+{
+	unsigned int tail = queue->tail;
+
+	if (tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) >= QUEUE_SIZE)
+		return -EAGAIN;
+
+	queue->items[tail % QUEUE_SIZE] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+	queue_wake(queue, 0);
+
+	return 0;
+}
+
+/* The number of items waiting in the queue, as seen by the consumer */
+static unsigned int queue_count(struct queue *queue)
+{
+	return __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) - queue->head;
+}
+
+/*
+ * The JPEG images already made, found again from the contents of the
+ * scaled frame: slideshows and looping inputs keep scaling to the same
+ * frames, which then need no encoding. The least recently used images are
+ * dropped to stay under the memory cap, and when a directory is given the
+ * images are also stored there to be found again after a restart.
+ *
+ * Only the encode stage uses the cache, so it needs no lock; the images
+ * are stored by a writer thread, which alone keeps the index of the files
+ * in the directory and removes the oldest ones to stay under the disk cap.
+ */
+#define FRAME_CACHE_BUCKETS 1024 /* must be a power of two */
+
+struct frame_cache_entry
+{
+	uint64_t key;
+	int width;
+	int height;
+	AVBufferRef *buf;				 /* the JPEG image, with padding */
+	int size;						 /* the size of the JPEG image */
+	struct frame_cache_entry *next;	 /* in the same bucket */
+	struct frame_cache_entry *newer; /* in the LRU list */
+	struct frame_cache_entry *older;
+};
+
+/* An image for the writer thread */
+struct frame_cache_write
+{
+	uint64_t key;
+	int width;
+	int height;
+	AVBufferRef *buf; /* a reference to the image in memory */
+	int size;
+};
+
+/* An image in the directory, in the order they were stored */
+struct frame_cache_file
+{
+	char name[64];
+	size_t size;
+	time_t mtime;
+	struct frame_cache_file *newer;
+};
+
+struct frame_cache
+{
+	size_t max_size;	  /* 0 when the cache is disabled */
+	const char *dir;	  /* where images are stored too, or NULL */
+	size_t max_disk_size; /* what the images in dir may use */
+	size_t size;
+	unsigned int count;
+	struct frame_cache_entry *buckets[FRAME_CACHE_BUCKETS];
+	struct frame_cache_entry *newest;
+	struct frame_cache_entry *oldest;
+	unsigned long hits;
+	unsigned long disk_hits;
+	unsigned long misses;
+	unsigned long evictions;
+
+	/* The disk tier, the index is only used by the writer thread */
+	struct queue writes;
+	pthread_t writer;
+	int writing;
+	unsigned long write_drops;
+	size_t disk_size;
+	unsigned int disk_count;
+	struct frame_cache_file *disk_newest;
+	struct frame_cache_file *disk_oldest;
+	unsigned long disk_evictions;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, int size)
+{
+	uint64_t word;
+
+	/* multiply and rotate a word at a time, the bytes left one by one */
+	for (; size >= 8; data += 8, size -= 8)
+	{
+		memcpy(&word, data, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash = (hash << 31) | (hash >> 33);
+	}
+	for (; size > 0; data++, size--)
+		hash = (hash ^ *data) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* The key of a scaled frame also depends on what the encoder does with it */
+static uint64_t frame_cache_key(AVFrame *frame, unsigned int quality)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int plane;
+	int width;
+	int height;
+	int y;
+
+	hash = hash_bytes(hash, (const uint8_t *)&frame->format, sizeof(frame->format));
+	hash = hash_bytes(hash, (const uint8_t *)&quality, sizeof(quality));
+
+	for (plane = 0; plane < 3 && frame->data[plane]; plane++)
+	{
+		width = (plane == 0 || frame->format == AV_PIX_FMT_NV12) ? frame->width : frame->width / 2;
+		height = (plane == 0) ? frame->height : frame->height / 2;
+
+		for (y = 0; y < height; y++)
+			hash = hash_bytes(hash, frame->data[plane] + y * frame->linesize[plane], width);
+	}
+
+	return hash;
+}
+
+static size_t frame_cache_entry_size(struct frame_cache_entry *entry)
+{
+	return sizeof(*entry) + entry->size;
+}
+
+static void frame_cache_unlink(struct frame_cache *cache, struct frame_cache_entry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+}
+
+static void frame_cache_link(struct frame_cache *cache, struct frame_cache_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+}
+
+static void frame_cache_remove(struct frame_cache *cache, struct frame_cache_entry *entry)
+{
+	struct frame_cache_entry **link = &cache->buckets[entry->key & (FRAME_CACHE_BUCKETS - 1)];
+
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+
+	frame_cache_unlink(cache, entry);
+	cache->size -= frame_cache_entry_size(entry);
+	cache->count--;
+
+	/* images still being sent keep their own reference */
+	av_buffer_unref(&entry->buf);
+	free(entry);
+}
+
+/*
+ * Add an image to the cache, taking the reference to buf; images which
+ * would not fit even in an empty cache are not added.
+ */
+static int frame_cache_add(struct frame_cache *cache,
+						   uint64_t key,
+						   int width,
+						   int height,
+						   AVBufferRef *buf,
+						   int size)
+{
+	struct frame_cache_entry *entry;
+	struct frame_cache_entry **bucket;
+
+	if (sizeof(*entry) + size > cache->max_size)
+	{
+		av_buffer_unref(&buf);
+		return 0;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+	{
+		av_buffer_unref(&buf);
+		return -ENOMEM;
+	}
+	entry->key = key;
+	entry->width = width;
+	entry->height = height;
+	entry->buf = buf;
+	entry->size = size;
+
+	while (cache->size + frame_cache_entry_size(entry) > cache->max_size)
+	{
+		frame_cache_remove(cache, cache->oldest);
+		cache->evictions++;
+	}
+
+	bucket = &cache->buckets[key & (FRAME_CACHE_BUCKETS - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	frame_cache_link(cache, entry);
+	cache->size += frame_cache_entry_size(entry);
+	cache->count++;
+
+	return 0;
+}
+
+static void frame_cache_path(struct frame_cache *cache,
+							 uint64_t key,
+							 int width,
+							 int height,
+							 char *path,
+							 size_t path_size)
+{
+	snprintf(path, path_size, "%s/%016" PRIx64 "-%dx%d.jpg",
+			 cache->dir, key, width, height);
+}
+
+/* Read an image stored by a previous run, NULL when there is none */
+static AVBufferRef *frame_cache_load(struct frame_cache *cache,
+									 uint64_t key,
+									 int width,
+									 int height,
+									 int *size)
+{
+	char path[PATH_MAX];
+	AVBufferRef *buf = NULL;
+	FILE *file;
+	long file_size;
+
+	frame_cache_path(cache, key, width, height, path, sizeof(path));
+	file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) != 0 || (file_size = ftell(file)) <= 0 ||
+		file_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE ||
+		fseek(file, 0, SEEK_SET) != 0)
+		goto out;
+
+	buf = av_buffer_alloc(file_size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (buf == NULL)
+		goto out;
+
+	if (fread(buf->data, 1, file_size, file) != (size_t)file_size)
+	{
+		av_buffer_unref(&buf);
+		goto out;
+	}
+	memset(buf->data + file_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	*size = file_size;
+
+out:
+	fclose(file);
+	return buf;
+}
+
+/* Add a file to the end of the index of the directory */
+static void frame_cache_index(struct frame_cache *cache, struct frame_cache_file *file)
+{
+	file->newer = NULL;
+	if (cache->disk_newest)
+		cache->disk_newest->newer = file;
+	else
+		cache->disk_oldest = file;
+	cache->disk_newest = file;
+	cache->disk_size += file->size;
+	cache->disk_count++;
+}
+
+/* Remove the oldest files until size more bytes fit under the disk cap */
+static void frame_cache_evict(struct frame_cache *cache, size_t size)
+{
+	struct frame_cache_file *file;
+	char path[PATH_MAX];
+
+	while (cache->disk_oldest && cache->disk_size + size > cache->max_disk_size)
+	{
+		file = cache->disk_oldest;
+		cache->disk_oldest = file->newer;
+		if (cache->disk_oldest == NULL)
+			cache->disk_newest = NULL;
+		cache->disk_size -= file->size;
+		cache->disk_count--;
+
+		/* another run may have removed it already */
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, file->name);
+		remove(path);
+		free(file);
+		cache->disk_evictions++;
+	}
+}
+
+static int frame_cache_file_compare(const void *a, const void *b)
+{
+	const struct frame_cache_file *file_a = *(const struct frame_cache_file *const *)a;
+	const struct frame_cache_file *file_b = *(const struct frame_cache_file *const *)b;
+
+	return (file_a->mtime > file_b->mtime) - (file_a->mtime < file_b->mtime);
+}
+
+/*
+ * Index the images stored by the previous runs, oldest first, and remove
+ * the ones over the disk cap; images stored by other runs from now on are
+ * not counted.
+ */
+static void frame_cache_scan(struct frame_cache *cache)
+{
+	struct frame_cache_file **files = NULL;
+	struct frame_cache_file **new_files;
+	struct frame_cache_file *file;
+	struct dirent *dirent;
+	struct stat st;
+	size_t allocated = 0;
+	size_t count = 0;
+	size_t length;
+	size_t i;
+	DIR *dir;
+
+	dir = opendir(cache->dir);
+	if (dir == NULL)
+		return;
+
+	while ((dirent = readdir(dir)))
+	{
+		/* the temporary files of the other runs end differently */
+		length = strlen(dirent->d_name);
+		if (length < 4 || length >= sizeof(file->name) ||
+			strcmp(dirent->d_name + length - 4, ".jpg") != 0 ||
+			fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 ||
+			!S_ISREG(st.st_mode))
+			continue;
+
+		if (count == allocated)
+		{
+			allocated = allocated ? allocated * 2 : 256;
+			new_files = realloc(files, allocated * sizeof(*files));
+			if (new_files == NULL)
+				break;
+			files = new_files;
+		}
+
+		file = malloc(sizeof(*file));
+		if (file == NULL)
+			break;
+		strcpy(file->name, dirent->d_name);
+		file->size = st.st_size;
+		file->mtime = st.st_mtime;
+		files[count++] = file;
+	}
+	closedir(dir);
+
+	if (count > 0)
+		qsort(files, count, sizeof(*files), frame_cache_file_compare);
+	for (i = 0; i < count; i++)
+		frame_cache_index(cache, files[i]);
+	free(files);
+
+	frame_cache_evict(cache, 0);
+}
+
+/*
+ * Store an image for the next runs; it is written to a temporary file
+ * first, so that another run never reads half an image.
+ */
+static void frame_cache_store(struct frame_cache *cache, struct frame_cache_write *write)
+{
+	struct frame_cache_file *file;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 16];
+	FILE *out;
+	int ret;
+
+	if ((size_t)write->size > cache->max_disk_size)
+		return;
+
+	file = malloc(sizeof(*file));
+	if (file == NULL)
+		return;
+
+	frame_cache_path(cache, write->key, write->width, write->height, path, sizeof(path));
+	snprintf(file->name, sizeof(file->name), "%s", strrchr(path, '/') + 1);
+	file->size = write->size;
+	file->mtime = time(NULL);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+
+	frame_cache_evict(cache, file->size);
+
+	out = fopen(tmp_path, "wb");
+	if (out == NULL)
+	{
+		free(file);
+		return;
+	}
+
+	ret = fwrite(write->buf->data, 1, write->size, out) == (size_t)write->size;
+	if (fclose(out) != 0 || !ret || rename(tmp_path, path) != 0)
+	{
+		remove(tmp_path);
+		free(file);
+		return;
+	}
+
+	/*
+	 * Replacing an image stored by another run since the scan counts it
+	 * twice until it is evicted, which only errs on the small side.
+	 */
+	frame_cache_index(cache, file);
+}
+
+static void free_frame_cache_write(void *item)
+{
+	struct frame_cache_write *write = item;
+
+	av_buffer_unref(&write->buf);
+	free(write);
+}
+
+static void *frame_cache_writer(void *arg)
+{
+	struct frame_cache *cache = arg;
+	struct frame_cache_write *write;
+
+	frame_cache_scan(cache);
+
+	while ((write = queue_pop(&cache->writes)))
+	{
+		frame_cache_store(cache, write);
+		free_frame_cache_write(write);
+	}
+
+	return NULL;
+}
+
+/* Start the writer thread, when the images are stored in a directory */
+static int frame_cache_start(struct frame_cache *cache)
+{
+	int ret;
+
+	if (cache->max_size == 0 || cache->dir == NULL)
+		return 0;
+
+	ret = queue_init(&cache->writes);
+	if (ret < 0)
+		return ret;
+
+	ret = pthread_create(&cache->writer, NULL, frame_cache_writer, cache);
+	if (ret != 0)
+	{
+		queue_destroy(&cache->writes, NULL);
+		return -ret;
+	}
+	cache->writing = 1;
+
+	return 0;
+}
+
+/* Let the writer thread store the images still queued, then stop it */
+static void frame_cache_stop(struct frame_cache *cache)
+{
+	if (!cache->writing)
+		return;
+
+	queue_close(&cache->writes);
+	pthread_join(cache->writer, NULL);
+	queue_destroy(&cache->writes, free_frame_cache_write);
+	cache->writing = 0;
+}
+
+/*
+ * Hand an image over to the writer thread; the encode stage does not wait
+ * for the disk, images which do not fit in the queue are not stored.
+ */
+static void frame_cache_queue_write(struct frame_cache *cache,
+									uint64_t key,
+									int width,
+									int height,
+									AVBufferRef *buf,
+									int size)
+{
+	struct frame_cache_write *write;
+
+	write = malloc(sizeof(*write));
+	if (write == NULL)
+	{
+		cache->write_drops++;
+		return;
+	}
+	write->key = key;
+	write->width = width;
+	write->height = height;
+	write->buf = av_buffer_ref(buf);
+	write->size = size;
+
+	if (write->buf == NULL || queue_try_push(&cache->writes, write) < 0)
+	{
+		free_frame_cache_write(write);
+		cache->write_drops++;
+	}
+}
+
+/*
+ * Look for the image of a scaled frame, in memory first and then in the
+ * directory; on success the packet gets a reference to the image, else
+ * the key is what to pass to frame_cache_put() once the frame is encoded.
+ */
+static int frame_cache_get(struct frame_cache *cache,
+						   AVFrame *frame,
+						   unsigned int quality,
+						   uint64_t *key_out,
+						   AVPacket *packet)
+{
+	struct frame_cache_entry *entry;
+	AVBufferRef *cache_buf;
+	AVBufferRef *buf;
+	uint64_t key = frame_cache_key(frame, quality);
+	int width = frame->width;
+	int height = frame->height;
+	int size;
+
+	*key_out = key;
+
+	for (entry = cache->buckets[key & (FRAME_CACHE_BUCKETS - 1)]; entry; entry = entry->next)
+		if (entry->key == key && entry->width == width && entry->height == height)
+			break;
+
+	if (entry)
+	{
+		frame_cache_unlink(cache, entry);
+		frame_cache_link(cache, entry);
+		buf = entry->buf;
+		size = entry->size;
+		cache->hits++;
+	}
+	else if (cache->dir && (buf = frame_cache_load(cache, key, width, height, &size)))
+	{
+		cache->disk_hits++;
+
+		/* the cache takes its own reference, if it can keep the image */
+		cache_buf = av_buffer_ref(buf);
+		if (cache_buf)
+			frame_cache_add(cache, key, width, height, cache_buf, size);
+
+		packet->buf = buf;
+		packet->data = buf->data;
+		packet->size = size;
+		return 0;
+	}
+	else
+	{
+		cache->misses++;
+		return -ENOENT;
+	}
+
+	packet->buf = av_buffer_ref(buf);
+	if (packet->buf == NULL)
+		return -ENOMEM;
+	packet->data = buf->data;
+	packet->size = size;
+
+	return 0;
+}
+
+/* Keep a copy of a new image, the encoder buffers are reused */
+static int frame_cache_put(struct frame_cache *cache,
+						   uint64_t key,
+						   int width,
+						   int height,
+						   AVPacket *packet)
+{
+	AVBufferRef *buf;
+
+	buf = av_buffer_alloc(packet->size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	memcpy(buf->data, packet->data, packet->size);
+	memset(buf->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	/* the writer shares the copy, which is never modified */
+	if (cache->writing)
+		frame_cache_queue_write(cache, key, width, height, buf, packet->size);
+
+	return frame_cache_add(cache, key, width, height, buf, packet->size);
+}
+
+static void frame_cache_free(struct frame_cache *cache)
+{
+	struct frame_cache_file *file;
+
+	frame_cache_stop(cache);
+
+	while (cache->oldest)
+		frame_cache_remove(cache, cache->oldest);
+
+	while ((file = cache->disk_oldest))
+	{
+		cache->disk_oldest = file->newer;
+		free(file);
+	}
+	cache->disk_newest = NULL;
+}
+
+struct pipeline;
+
+/* An image ready to be sent to the device, either encoded or raw */
+struct output_image
+{
+	AVPacket *packet;
+	AVFrame *frame;
+	int width;
+	int height;
+	int64_t pts; /* microseconds, or AV_NOPTS_VALUE */
+	int64_t submit_time;
+	struct pipeline *pipeline;
+};
+
+static void free_packet(void *item)
+{
+	AVPacket *packet = item;
+	av_packet_free(&packet);
+}
+
+static void free_frame(void *item)
+{
+	AVFrame *frame = item;
+	av_frame_free(&frame);
+}
+
+static void free_image(void *item)
+{
+	struct output_image *image = item;
+	av_packet_free(&image->packet);
+	av_frame_free(&image->frame);
+	free(image);
+}
+
+/*
+ * A free list of packets, frames or images: the stages put back what they
+ * are done with and get from here what they need, so once the pipeline
+ * is full no more of them get allocated.
+ */
+#define RECYCLER_SIZE 16
+
+/* One recycler each for packets, frames and images */
+#define PIPELINE_RECYCLERS 3
+
+struct recycler
+{
+	void *items[RECYCLER_SIZE];
+	unsigned int count;
+	pthread_mutex_t mutex;
+	void (*free_item)(void *item);
+};
+
+static int recycler_init(struct recycler *recycler, void (*free_item)(void *item))
+{
+	memset(recycler, 0, sizeof(*recycler));
+	recycler->free_item = free_item;
+	return -pthread_mutex_init(&recycler->mutex, NULL);
+}
+
+static void recycler_destroy(struct recycler *recycler)
+{
+	while (recycler->count > 0)
+		recycler->free_item(recycler->items[--recycler->count]);
+
+	pthread_mutex_destroy(&recycler->mutex);
+}
+
+/* Return NULL when there is nothing to recycle */
+static void *recycler_get(struct recycler *recycler)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&recycler->mutex);
+	if (recycler->count > 0)
+		item = recycler->items[--recycler->count];
+	pthread_mutex_unlock(&recycler->mutex);
+
+	return item;
+}
+
+static void recycler_put(struct recycler *recycler, void *item)
+{
+	pthread_mutex_lock(&recycler->mutex);
+	if (recycler->count < RECYCLER_SIZE)
+	{
+		recycler->items[recycler->count++] = item;
+		item = NULL;
+	}
+	pthread_mutex_unlock(&recycler->mutex);
+
+	/* more items than ever needed at once, let this one go */
+	if (item)
+		recycler->free_item(item);
+}
+
+/*
+ * The frames go through the pipeline stages, each one running in its own
+ * thread:
+ *
+ *   demux -> decode -> scale -> encode -> send
+ *
+ * so the frame rate is bounded by the slowest stage rather than by the sum
+ * of the time spent in all of them.
+ */
+enum stage_id
+{
+	STAGE_DEMUX = 0,
+	STAGE_DECODE,
+	STAGE_SCALE,
+	STAGE_ENCODE,
+	STAGE_SEND,
+	STAGE_COUNT,
+};
+
+/*
+ * Latency histograms, in microseconds: each power of two is split in
+ * HISTOGRAM_SUB_BUCKETS buckets, so percentiles are within 25% of the
+ * real value up to about half an hour, in a fixed amount of memory.
+ */
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * 30)
+
+struct histogram
+{
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+	unsigned long count;
+	int64_t sum;
+	int64_t max;
+};
+
+/* The latency of a stage, over the whole run and since the last report */
+struct latency
+{
+	struct histogram total;
+	struct histogram interval;
+};
+
+static unsigned int histogram_bucket(int64_t value)
+{
+	unsigned int exponent = 0;
+	unsigned int bucket;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value < 0 ? 0 : value;
+
+	while ((value >> exponent) >= 2 * HISTOGRAM_SUB_BUCKETS)
+		exponent++;
+
+	bucket = (exponent + 1) * HISTOGRAM_SUB_BUCKETS +
+		(value >> exponent) - HISTOGRAM_SUB_BUCKETS;
+
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/* The smallest value which falls in a bucket */
+static int64_t histogram_bucket_value(unsigned int bucket)
+{
+	unsigned int exponent;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	exponent = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	return (int64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << exponent;
+}
+
+static void histogram_add(struct histogram *histogram, int64_t value)
+{
+	histogram->buckets[histogram_bucket(value)]++;
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+static int64_t histogram_mean(const struct histogram *histogram)
+{
+	return histogram->count ? histogram->sum / (int64_t)histogram->count : 0;
+}
+
+/* Estimate a percentile with the middle of the bucket it falls in */
+static int64_t histogram_percentile(const struct histogram *histogram, unsigned int percent)
+{
+	unsigned long rank;
+	unsigned long seen = 0;
+	unsigned int i;
+	int64_t value;
+
+	if (histogram->count == 0)
+		return 0;
+
+	rank = (histogram->count * percent + 99) / 100;
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+	{
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	value = (histogram_bucket_value(i) + histogram_bucket_value(i + 1)) / 2;
+	return FFMIN(value, histogram->max);
+}
+
+struct stage
+{
+	const char *name;
+	struct pipeline *pipeline;
+	struct queue *input;
+	struct queue *output;
+	pthread_t thread;
+	int started;
+	int ret;
+
+	/* Statistics */
+	unsigned long items;
+	int64_t busy_time;
+	int64_t busy_start;
+	struct latency latency;
+};
+
+/*
+ * Packs hold images ready to be sent to a device, made once by the pipeline
+ * and then played straight from a mapping of the file, which costs next to
+ * nothing. All the integers are little endian:
+ *
+ *   header, PACK_HEADER_SIZE bytes:
+ *     "AM7XXXPK", version, image format, frame count, 0,
+ *     index offset (64 bits), duration in microseconds (64 bits)
+ *   the images, each one aligned to PACK_ALIGNMENT bytes
+ *   the index, an entry of PACK_ENTRY_SIZE bytes per image:
+ *     offset (64 bits), size, width (16 bits), height (16 bits),
+ *     presentation time in microseconds (64 bits)
+ */
+#define PACK_MAGIC "AM7XXXPK"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 40
+#define PACK_ENTRY_SIZE 24
+#define PACK_ALIGNMENT 8
+
+/* How long an image lasts when the input does not tell, 25 fps */
+#define PACK_IMAGE_DURATION_US 40000
+
+struct pack_entry
+{
+	uint64_t offset;
+	unsigned int size;
+	unsigned int width;
+	unsigned int height;
+	int64_t pts;
+};
+
+struct pack_writer
+{
+	FILE *file;
+	am7xxx_image_format format;
+	uint64_t offset;
+	struct pack_entry *entries;
+	unsigned int count;
+	unsigned int allocated;
+};
+
+static uint8_t *pack_put_le(uint8_t *buffer, uint64_t value, unsigned int bytes)
+{
+	unsigned int i;
+
+	for (i = 0; i < bytes; i++)
+		*buffer++ = value >> (8 * i);
+
+	return buffer;
+}
+
+static uint64_t pack_get_le(const uint8_t *buffer, unsigned int bytes)
+{
+	uint64_t value = 0;
+
+	while (bytes-- > 0)
+		value = (value << 8) | buffer[bytes];
+
+	return value;
+}
+
+static int pack_write(struct pack_writer *pack, const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, pack->file) != size)
+	{
+		perror("cannot write the pack");
+		return -EIO;
+	}
+	pack->offset += size;
+	return 0;
+}
+
+static int pack_write_header(struct pack_writer *pack, uint64_t index_offset, uint64_t duration)
+{
+	uint8_t header[PACK_HEADER_SIZE];
+	uint8_t *buffer = header;
+
+	memcpy(buffer, PACK_MAGIC, 8);
+	buffer = pack_put_le(buffer + 8, PACK_VERSION, 4);
+	buffer = pack_put_le(buffer, pack->format, 4);
+	buffer = pack_put_le(buffer, pack->count, 4);
+	buffer = pack_put_le(buffer, 0, 4);
+	buffer = pack_put_le(buffer, index_offset, 8);
+	pack_put_le(buffer, duration, 8);
+
+	return pack_write(pack, header, sizeof(header));
+}
+
+static int pack_writer_open(struct pack_writer *pack, const char *path,
+							am7xxx_image_format format)
+{
+	memset(pack, 0, sizeof(*pack));
+	pack->format = format;
+
+	pack->file = fopen(path, "wb");
+	if (pack->file == NULL)
+	{
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	/* the header is written again at the end, when the index is known */
+	return pack_write_header(pack, 0, 0);
+}
+
+static int pack_align(struct pack_writer *pack)
+{
+	static const uint8_t padding[PACK_ALIGNMENT];
+
+	if (pack->offset % PACK_ALIGNMENT == 0)
+		return 0;
+
+	return pack_write(pack, padding, PACK_ALIGNMENT - pack->offset % PACK_ALIGNMENT);
+}
+
+/* Start a new entry, its data is written right after */
+static int pack_add_entry(struct pack_writer *pack, unsigned int size,
+						  unsigned int width, unsigned int height, int64_t pts)
+{
+	struct pack_entry *entries;
+	struct pack_entry *entry;
+	unsigned int allocated;
+	int ret;
+
+	if (pack->count == pack->allocated)
+	{
+		allocated = pack->allocated ? pack->allocated * 2 : 256;
+		entries = realloc(pack->entries, allocated * sizeof(*entries));
+		if (entries == NULL)
+		{
+			fprintf(stderr, "cannot grow the pack index\n");
+			return -ENOMEM;
+		}
+		pack->entries = entries;
+		pack->allocated = allocated;
+	}
+
+	ret = pack_align(pack);
+	if (ret < 0)
+		return ret;
+
+	entry = &pack->entries[pack->count++];
+	entry->offset = pack->offset;
+	entry->size = size;
+	entry->width = width;
+	entry->height = height;
+
+	/* keep the timestamps growing, even when the input has none */
+	if (pts == AV_NOPTS_VALUE)
+		pts = (pack->count > 1) ? entry[-1].pts + PACK_IMAGE_DURATION_US : 0;
+	entry->pts = pts;
+
+	return 0;
+}
+
+/* Store raw images as NV12, the way the device takes them */
+static int pack_write_frame(struct pack_writer *pack, AVFrame *frame)
+{
+	am7xxx_pixel_format pixel_format;
+	uint8_t *row = NULL;
+	int width = frame->width;
+	int x;
+	int y;
+	int ret;
+
+	ret = get_pixel_format(frame->format, &pixel_format);
+	if (ret < 0)
+		return ret;
+
+	for (y = 0; y < frame->height; y++)
+	{
+		ret = pack_write(pack, frame->data[0] + y * frame->linesize[0], width);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (pixel_format == AM7XXX_PIXEL_FORMAT_NV12)
+	{
+		for (y = 0; y < frame->height / 2; y++)
+		{
+			ret = pack_write(pack, frame->data[1] + y * frame->linesize[1], width);
+			if (ret < 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	row = malloc(width);
+	if (row == NULL)
+		return -ENOMEM;
+
+	for (y = 0; y < frame->height / 2; y++)
+	{
+		for (x = 0; x < width / 2; x++)
+		{
+			row[2 * x] = frame->data[1][y * frame->linesize[1] + x];
+			row[2 * x + 1] = frame->data[2][y * frame->linesize[2] + x];
+		}
+		ret = pack_write(pack, row, width);
+		if (ret < 0)
+			break;
+	}
+	free(row);
+
+	return ret;
+}
+
+static int pack_add_image(struct pack_writer *pack, struct output_image *image)
+{
+	int ret;
+
+	if (image->frame)
+	{
+		ret = pack_add_entry(pack, image->width * image->height * 3 / 2,
+							 image->width, image->height, image->pts);
+		if (ret < 0)
+			return ret;
+
+		return pack_write_frame(pack, image->frame);
+	}
+
+	ret = pack_add_entry(pack, image->packet->size,
+						 image->width, image->height, image->pts);
+	if (ret < 0)
+		return ret;
+
+	return pack_write(pack, image->packet->data, image->packet->size);
+}
+
+/* Write the index and the final header, then close the pack */
+static int pack_writer_close(struct pack_writer *pack)
+{
+	uint8_t entry[PACK_ENTRY_SIZE];
+	struct pack_entry *entries = pack->entries;
+	uint64_t index_offset;
+	uint64_t duration = PACK_IMAGE_DURATION_US;
+	uint8_t *buffer;
+	unsigned int i;
+	int ret;
+
+	ret = pack_align(pack);
+	if (ret < 0)
+		goto out;
+
+	index_offset = pack->offset;
+	for (i = 0; i < pack->count; i++)
+	{
+		buffer = pack_put_le(entry, entries[i].offset, 8);
+		buffer = pack_put_le(buffer, entries[i].size, 4);
+		buffer = pack_put_le(buffer, entries[i].width, 2);
+		buffer = pack_put_le(buffer, entries[i].height, 2);
+		pack_put_le(buffer, entries[i].pts - entries[0].pts, 8);
+
+		ret = pack_write(pack, entry, sizeof(entry));
+		if (ret < 0)
+			goto out;
+	}
+
+	/* the last image lasts as long as the average one */
+	if (pack->count > 1)
+		duration = (entries[pack->count - 1].pts - entries[0].pts) *
+			pack->count / (pack->count - 1);
+
+	if (fseek(pack->file, 0, SEEK_SET) != 0)
+	{
+		perror("cannot complete the pack");
+		ret = -errno;
+		goto out;
+	}
+	ret = pack_write_header(pack, index_offset, duration);
+
+out:
+	if (fclose(pack->file) != 0 && ret == 0)
+	{
+		perror("cannot complete the pack");
+		ret = -EIO;
+	}
+	free(pack->entries);
+	return ret;
+}
+
+/* The images are in the mapping of the pack, there is nothing to free */
+static void pack_image_sent(void *user_data, int status)
+{
+	(void)user_data;
+	(void)status;
+}
+
+/*
+ * Play a pack made with -K, at the pace of its timestamps unless no_pacing
+ * is set, loops times or for ever when loops is 0; the images are sent
+ * from the mapping of the file, without even copying them.
+ */
+static int play_pack(am7xxx_device *dev, const char *path, int loops, int no_pacing)
+{
+	struct stat st;
+	uint8_t *data = MAP_FAILED;
+	const uint8_t *entry;
+	am7xxx_image_format format;
+	unsigned int count;
+	uint64_t index_offset;
+	uint64_t offset;
+	uint64_t size;
+	int64_t duration;
+	int64_t start_time;
+	int64_t due;
+	unsigned int i;
+	int loop;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret == 0 && st.st_size >= PACK_HEADER_SIZE)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED ||
+		memcmp(data, PACK_MAGIC, 8) != 0 ||
+		pack_get_le(data + 8, 4) != PACK_VERSION)
+	{
+		fprintf(stderr, "%s is not a pack made by this version of am7xxx-play\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	format = pack_get_le(data + 12, 4);
+	count = pack_get_le(data + 16, 4);
+	index_offset = pack_get_le(data + 24, 8);
+	duration = pack_get_le(data + 32, 8);
+
+	if (count == 0 || index_offset > (uint64_t)st.st_size ||
+		count > (st.st_size - index_offset) / PACK_ENTRY_SIZE)
+	{
+		fprintf(stderr, "%s is empty or incomplete\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		entry = data + index_offset + i * PACK_ENTRY_SIZE;
+		offset = pack_get_le(entry, 8);
+		size = pack_get_le(entry + 8, 4);
+		if (offset > index_offset || size > index_offset - offset)
+		{
+			fprintf(stderr, "%s is corrupted\n", path);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	/* the images are read in order, again and again */
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	fprintf(stdout, "Playing %u images from %s\n", count, path);
+	startup_mark("pack mapped");
+
+	start_time = av_gettime_relative();
+	for (loop = 0; run && (loops == 0 || loop < loops); loop++)
+	{
+		for (i = 0; run && i < count; i++)
+		{
+			entry = data + index_offset + i * PACK_ENTRY_SIZE;
+
+			if (!no_pacing)
+			{
+				due = start_time + loop * duration + (int64_t)pack_get_le(entry + 16, 8);
+				if (due > av_gettime_relative())
+					av_usleep(due - av_gettime_relative());
+			}
+
+			ret = am7xxx_send_image_async_nocopy(dev,
+												 format,
+												 pack_get_le(entry + 12, 2),
+												 pack_get_le(entry + 14, 2),
+												 data + pack_get_le(entry, 8),
+												 pack_get_le(entry + 8, 4),
+												 pack_image_sent,
+												 NULL);
+			if (ret < 0)
+			{
+				perror("am7xxx_send_image_async_nocopy");
+				goto out;
+			}
+			startup_first_frame(dev);
+		}
+	}
+	am7xxx_flush_async(dev);
+
+out:
+	if (data != MAP_FAILED)
+		munmap(data, st.st_size);
+	return ret;
+}
+
+struct pipeline
+{
+	struct video_input_ctx *input_ctx;
+	struct video_output_ctx *output_ctx;
+	struct scale_cache scale_cache;
+	struct encoder_cache encoder_cache;
+	struct frame_cache frame_cache;
+	int dump_frame;
+
+	/* MJPEG input sent to the device as it is */
+	int passthrough;
+	int strip_markers;
+	am7xxx_device_info device_info;
+	unsigned long dropped;
+
+	/*
+	 * Presentation clock: an image with timestamp pts is due at
+	 * clock_offset + pts, in the av_gettime_relative() time base.
+	 */
+	int pacing;
+	pthread_mutex_t clock_mutex;
+	int clock_started;
+	int64_t clock_offset;
+	unsigned int late_frames;
+	int lagging;
+
+	/* Pacing statistics */
+	unsigned long dropped_scale;
+	unsigned long dropped_send;
+	unsigned long presented;
+	int64_t lateness_sum;
+	unsigned long skip_switches;
+
+	/* Items done with, ready to be used again, see PIPELINE_RECYCLERS */
+	struct recycler free_packets;
+	struct recycler free_frames;
+	struct recycler free_images;
+	struct packet_pool passthrough_pool;
+
+	/* Heap allocations, counted when malloc_count() is available */
+	unsigned long warm_allocations;
+	unsigned long allocations;
+	unsigned long allocation_frames;
+
+	/*
+	 * Latency statistics, the ones of the stages and the time the device
+	 * takes to be done with images sent without copying them; they are
+	 * updated and read under stats_mutex, stats_cond wakes the reporter.
+	 */
+	const struct stats_options *stats;
+	pthread_mutex_t stats_mutex;
+	pthread_cond_t stats_cond;
+	int stats_stop;
+	struct latency completion;
+
+	/* The images sent, in bytes, only touched by the send stage */
+	struct histogram image_sizes;
+
+	/* The benchmark stops when its frames or seconds are done */
+	const struct bench_options *bench;
+	int64_t bench_deadline;
+
+	/* the images go to this pack instead of the device, see -K */
+	struct pack_writer *pack;
+
+	/*
+	 * Where the images go, only touched by the send stage; in resident
+	 * mode it is NULL until a device is claimed, and output_ctx->dev is
+	 * the simulated device the images are made for.
+	 */
+	am7xxx_device *dev;
+	const struct resident_options *resident;
+
+	struct queue packets; /* demux -> decode */
+	struct queue frames;  /* decode -> scale */
+	struct queue scaled;  /* scale -> encode */
+	struct queue images;  /* encode -> send */
+	struct stage stages[STAGE_COUNT];
+};
+
+static void stage_busy_begin(struct stage *stage)
+{
+	stage->busy_start = av_gettime_relative();
+}
+
+static void latency_add(struct pipeline *pipeline, struct latency *latency, int64_t value)
+{
+	pthread_mutex_lock(&pipeline->stats_mutex);
+	histogram_add(&latency->total, value);
+	histogram_add(&latency->interval, value);
+	pthread_mutex_unlock(&pipeline->stats_mutex);
+}
+
+static void stage_busy_end(struct stage *stage)
+{
+	int64_t busy = av_gettime_relative() - stage->busy_start;
+
+	stage->busy_time += busy;
+	stage->items++;
+	latency_add(stage->pipeline, &stage->latency, busy);
+}
+
+/*
+ * Tell the neighbours that this stage is done: the upstream stage must stop
+ * producing and the downstream stage must stop waiting.
+ */
+static void stage_finish(struct stage *stage, int ret)
+{
+	stage->ret = ret;
+	if (stage->input)
+		queue_abort(stage->input);
+	if (stage->output)
+		queue_close(stage->output);
+}
+
+/*
+ * Count the heap allocations made once the pipeline is full, they are
+ * expected to be none: the malloc-count library in contrib/performance
+ * provides malloc_count() when preloaded.
+ */
+#define ALLOCATION_WARMUP_FRAMES 100
+
+#ifdef __GNUC__
+extern unsigned long malloc_count(void) __attribute__((weak));
+#else
+static unsigned long (*malloc_count)(void) = NULL;
+#endif
+
+static void count_allocations(struct pipeline *pipeline, unsigned long frames)
+{
+	if (malloc_count == NULL || frames < ALLOCATION_WARMUP_FRAMES)
+		return;
+
+	if (frames == ALLOCATION_WARMUP_FRAMES)
+		pipeline->warm_allocations = malloc_count();
+
+	pipeline->allocations = malloc_count() - pipeline->warm_allocations;
+	pipeline->allocation_frames = frames - ALLOCATION_WARMUP_FRAMES;
+}
+
+static AVPacket *get_packet(struct pipeline *pipeline)
+{
+	AVPacket *packet = recycler_get(&pipeline->free_packets);
+
+	if (packet == NULL)
+		packet = av_packet_alloc();
+
+	return packet;
+}
+
+static void recycle_packet(struct pipeline *pipeline, AVPacket *packet)
+{
+	if (packet == NULL)
+		return;
+
+	av_packet_unref(packet);
+	recycler_put(&pipeline->free_packets, packet);
+}
+
+static AVFrame *get_frame(struct pipeline *pipeline)
+{
+	AVFrame *frame = recycler_get(&pipeline->free_frames);
+
+	if (frame == NULL)
+		frame = av_frame_alloc();
+
+	return frame;
+}
+
+static void recycle_frame(struct pipeline *pipeline, AVFrame *frame)
+{
+	if (frame == NULL)
+		return;
+
+	av_frame_unref(frame);
+	recycler_put(&pipeline->free_frames, frame);
+}
+
+/* The packet of the image is kept, ready for the next encoded image */
+static struct output_image *get_image(struct pipeline *pipeline)
+{
+	struct output_image *image = recycler_get(&pipeline->free_images);
+
+	if (image == NULL)
+	{
+		image = calloc(1, sizeof(*image));
+		if (image == NULL)
+			return NULL;
+
+		image->packet = av_packet_alloc();
+		if (image->packet == NULL)
+		{
+			free(image);
+			return NULL;
+		}
+	}
+
+	image->pipeline = pipeline;
+	return image;
+}
+
+static void recycle_image(struct pipeline *pipeline, struct output_image *image)
+{
+	if (image == NULL)
+		return;
+
+	av_packet_unref(image->packet);
+	recycle_frame(pipeline, image->frame);
+	image->frame = NULL;
+	recycler_put(&pipeline->free_images, image);
+}
+
+/*
+ * Frames later than this are dropped, if a newer frame is already waiting
+ * to take their place; it is about a frame time at 25 fps.
+ */
+#define MAX_LATENESS_US 40000
+
+/* A frame due further than this in the future means the timestamps jumped */
+#define MAX_EARLINESS_US 1000000
+
+/* After this many consecutive late frames the decoder skips some work */
+#define LAGGING_FRAMES 4
+
+/* Convert a timestamp of the input stream to microseconds */
+static int64_t stream_time_us(struct pipeline *pipeline, int64_t pts)
+{
+	AVRational time_base_us = { 1, AV_TIME_BASE };
+
+	if (pts == AV_NOPTS_VALUE)
+		return AV_NOPTS_VALUE;
+
+	return av_rescale_q(pts, pipeline->output_ctx->time_base, time_base_us);
+}
+
+/*
+ * Return how late a frame is, in microseconds, according to the
+ * presentation clock; the value is negative when the frame is early and 0
+ * when there is no way to tell.
+ */
+static int64_t clock_lateness(struct pipeline *pipeline, int64_t pts)
+{
+	int64_t lateness = 0;
+
+	if (!pipeline->pacing || pts == AV_NOPTS_VALUE)
+		return 0;
+
+	pthread_mutex_lock(&pipeline->clock_mutex);
+	if (pipeline->clock_started)
+		lateness = av_gettime_relative() - (pipeline->clock_offset + pts);
+	pthread_mutex_unlock(&pipeline->clock_mutex);
+
+	return lateness;
+}
+
+static void clock_update_lag(struct pipeline *pipeline, int late)
+{
+	pthread_mutex_lock(&pipeline->clock_mutex);
+	if (late)
+		pipeline->late_frames++;
+	else
+		pipeline->late_frames = 0;
+	pipeline->lagging = (pipeline->late_frames >= LAGGING_FRAMES);
+	pthread_mutex_unlock(&pipeline->clock_mutex);
+}
+
+static int clock_lagging(struct pipeline *pipeline)
+{
+	int lagging;
+
+	pthread_mutex_lock(&pipeline->clock_mutex);
+	lagging = pipeline->lagging;
+	pthread_mutex_unlock(&pipeline->clock_mutex);
+
+	return lagging;
+}
+
+/*
+ * Decide whether to drop a frame before spending more time on it: only
+ * late frames are dropped, and only when a newer one is already queued,
+ * so that something is shown even when every frame is late.
+ */
+static int frame_must_be_dropped(struct pipeline *pipeline, int64_t pts, struct queue *queue)
+{
+	if (clock_lateness(pipeline, pts) <= MAX_LATENESS_US || queue_count(queue) == 0)
+		return 0;
+
+	clock_update_lag(pipeline, 1);
+	return 1;
+}
+
+/*
+ * Wait until the image is due, the presentation clock starts with the
+ * first image sent. Return 1 if the image is too late and must be dropped.
+ */
+static int wait_for_presentation(struct pipeline *pipeline, int64_t pts, struct queue *queue)
+{
+	int64_t now;
+	int64_t lateness;
+
+	if (!pipeline->pacing || pts == AV_NOPTS_VALUE)
+		return 0;
+
+	now = av_gettime_relative();
+
+	pthread_mutex_lock(&pipeline->clock_mutex);
+	if (!pipeline->clock_started)
+	{
+		pipeline->clock_offset = now - pts;
+		pipeline->clock_started = 1;
+	}
+	lateness = now - (pipeline->clock_offset + pts);
+	if (lateness < -MAX_EARLINESS_US)
+	{
+		/* restart the clock from here */
+		pipeline->clock_offset = now - pts;
+		lateness = 0;
+	}
+	pthread_mutex_unlock(&pipeline->clock_mutex);
+
+	if (lateness > MAX_LATENESS_US && queue_count(queue) > 0)
+	{
+		pipeline->dropped_send++;
+		clock_update_lag(pipeline, 1);
+		return 1;
+	}
+
+	if (lateness < 0)
+	{
+		av_usleep(-lateness);
+		lateness = 0;
+	}
+
+	pipeline->presented++;
+	pipeline->lateness_sum += lateness;
+	if (lateness <= MAX_LATENESS_US)
+		clock_update_lag(pipeline, 0);
+
+	return 0;
+}
+
+/*
+ * The Huffman tables suggested by the JPEG standard (ITU-T T.81, Annex K.3)
+ * as a single DHT segment.
+ *
+ * Many webcams omit the tables from MJPEG frames and rely on the decoder
+ * to know them, the decoder in the device does not.
+ */
+static const uint8_t jpeg_default_dht[] = {
+	0xff, 0xc4, 0x01, 0xa2,
+
+	/* luminance DC */
+	0x00,
+	0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b,
+
+	/* luminance AC */
+	0x10,
+	0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03,
+	0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+
+	/* chrominance DC */
+	0x01,
+	0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b,
+
+	/* chrominance AC */
+	0x11,
+	0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04,
+	0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+#define JPEG_MARKER_SOF0 0xc0
+#define JPEG_MARKER_SOF1 0xc1
+#define JPEG_MARKER_DHT 0xc4
+#define JPEG_MARKER_SOS 0xda
+#define JPEG_MARKER_APP0 0xe0
+#define JPEG_MARKER_APP15 0xef
+#define JPEG_MARKER_COM 0xfe
+
+/*
+ * Find the next marker segment in the JPEG header, starting at *pos.
+ *
+ * On success *pos is the offset of the segment, marker bytes included, and
+ * *length is the size of the whole segment; for the SOS marker *length is
+ * 0, the entropy coded data which follows has no length field.
+ */
+static int jpeg_next_segment(const uint8_t *data, int size, int *pos,
+							 uint8_t *marker, int *length)
+{
+	int offset = *pos;
+
+	/* markers can be preceded by any number of fill bytes */
+	while (offset + 1 < size && data[offset] == 0xff && data[offset + 1] == 0xff)
+		offset++;
+
+	if (offset + 4 > size || data[offset] != 0xff)
+		return -EINVAL;
+
+	*pos = offset;
+	*marker = data[offset + 1];
+	if (*marker == JPEG_MARKER_SOS)
+	{
+		*length = 0;
+		return 0;
+	}
+
+	*length = 2 + ((data[offset + 2] << 8) | data[offset + 3]);
+	if (*length < 4 || offset + *length > size)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int jpeg_is_strippable(uint8_t marker)
+{
+	return (marker >= JPEG_MARKER_APP0 && marker <= JPEG_MARKER_APP15) ||
+		   marker == JPEG_MARKER_COM;
+}
+
+/*
+ * Prepare an MJPEG packet to be sent to the device as it is.
+ *
+ * The image must be a baseline JPEG with 4:2:0 chroma subsampling no larger
+ * than the device native size. The standard Huffman tables are added when
+ * missing, and the APPn and COM segments are dropped if strip is set; when
+ * no change is needed the packet data is passed on without copying.
+ *
+ * Return -EINVAL if the image cannot be sent as it is.
+ */
+static int jpeg_passthrough(AVPacket *packet,
+							const am7xxx_device_info *device_info,
+							int strip,
+							struct packet_pool *packet_pool,
+							struct output_image *image)
+{
+	const uint8_t *data = packet->data;
+	int size = packet->size;
+	int pos;
+	int length;
+	uint8_t marker;
+	const uint8_t *sof = NULL;
+	int has_dht = 0;
+	int stripped = 0;
+	int sos_pos;
+	uint8_t *out;
+	int ret;
+
+	if (size < 4 || data[0] != 0xff || data[1] != 0xd8)
+		return -EINVAL;
+
+	pos = 2;
+	for (;;)
+	{
+		ret = jpeg_next_segment(data, size, &pos, &marker, &length);
+		if (ret < 0)
+			return ret;
+
+		if (marker == JPEG_MARKER_SOS)
+			break;
+
+		if (marker == JPEG_MARKER_SOF0 || marker == JPEG_MARKER_SOF1)
+			sof = data + pos;
+		else if (marker >= 0xc2 && marker <= 0xcf &&
+				 marker != JPEG_MARKER_DHT && marker != 0xc8 && marker != 0xcc)
+			return -EINVAL; /* progressive, lossless or arithmetic coding */
+		else if (marker == JPEG_MARKER_DHT)
+			has_dht = 1;
+		else if (strip && jpeg_is_strippable(marker))
+			stripped += length;
+
+		pos += length;
+	}
+	sos_pos = pos;
+
+	/*
+	 * SOF: length (2), precision (1), height (2), width (2),
+	 * components (1), then id, sampling factors and quantization table
+	 * for each component.
+	 */
+	if (sof == NULL || ((sof[2] << 8) | sof[3]) < 17)
+		return -EINVAL;
+
+	image->height = (sof[5] << 8) | sof[6];
+	image->width = (sof[7] << 8) | sof[8];
+	if (sof[4] != 8 || sof[9] != 3 ||
+		sof[11] != 0x22 || sof[14] != 0x11 || sof[17] != 0x11)
+		return -EINVAL;
+
+	if (image->width <= 0 || image->height <= 0 ||
+		(unsigned int)image->width > device_info->native_width ||
+		(unsigned int)image->height > device_info->native_height)
+		return -EINVAL;
+
+	if (has_dht && stripped == 0)
+	{
+		av_packet_move_ref(image->packet, packet);
+		return 0;
+	}
+
+	ret = packet_pool_get(packet_pool, image->packet,
+						  size - stripped + (has_dht ? 0 : (int)sizeof(jpeg_default_dht)));
+	if (ret < 0)
+		return ret;
+
+	out = image->packet->data;
+
+	/* SOI */
+	memcpy(out, data, 2);
+	out += 2;
+
+	pos = 2;
+	while (pos < sos_pos)
+	{
+		jpeg_next_segment(data, size, &pos, &marker, &length);
+		if (!(strip && jpeg_is_strippable(marker)))
+		{
+			memcpy(out, data + pos, length);
+			out += length;
+		}
+		pos += length;
+	}
+
+	if (!has_dht)
+	{
+		memcpy(out, jpeg_default_dht, sizeof(jpeg_default_dht));
+		out += sizeof(jpeg_default_dht);
+	}
+
+	/* SOS, the entropy coded data and EOI */
+	memcpy(out, data + sos_pos, size - sos_pos);
+
+	return 0;
+}
+
+/*
+ * In passthrough mode the demux stage feeds the send stage directly, the
+ * packets which cannot be sent as they are get dropped.
+ */
+static int passthrough_packet(struct pipeline *pipeline,
+							  AVPacket *packet,
+							  struct output_image **image)
+{
+	struct output_image *new_image;
+	int ret;
+
+	*image = NULL;
+
+	new_image = get_image(pipeline);
+	if (new_image == NULL)
+	{
+		fprintf(stderr, "cannot allocate the output image!\n");
+		return -ENOMEM;
+	}
+	new_image->pts = stream_time_us(pipeline, packet->pts);
+
+	ret = jpeg_passthrough(packet, &pipeline->device_info,
+						   pipeline->strip_markers,
+						   &pipeline->passthrough_pool,
+						   new_image);
+	if (ret < 0)
+	{
+		recycle_image(pipeline, new_image);
+		if (ret != -EINVAL)
+			return ret;
+
+		if (pipeline->dropped++ == 0)
+			fprintf(stderr, "WARNING: dropping MJPEG frames the device cannot show as they are, use -T to transcode them\n");
+		return 0;
+	}
+
+	*image = new_image;
+	return 0;
+}
+
+static void *demux_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	struct video_input_ctx *input_ctx = pipeline->input_ctx;
+	struct output_image *image;
+	AVPacket *packet = NULL;
+	int ret = 0;
+
+	while (run)
+	{
+		if (packet == NULL)
+		{
+			packet = get_packet(pipeline);
+			if (packet == NULL)
+			{
+				fprintf(stderr, "cannot allocate a packet!\n");
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		/* read packet */
+		stage_busy_begin(stage);
+		ret = av_read_frame(input_ctx->format_ctx, packet);
+		if (ret < 0)
+		{
+			if (ret == (int)AVERROR_EOF || input_ctx->format_ctx->pb->eof_reached)
+				ret = 0;
+			else
+				fprintf(stderr, "av_read_frame failed, EOF?\n");
+			break;
+		}
+
+		if (packet->stream_index != input_ctx->video_stream_index)
+		{
+			av_packet_unref(packet);
+			continue;
+		}
+
+		if (pipeline->passthrough)
+		{
+			ret = passthrough_packet(pipeline, packet, &image);
+			av_packet_unref(packet);
+			if (ret < 0)
+				break;
+			stage_busy_end(stage);
+
+			if (image == NULL)
+				continue;
+
+			ret = queue_push(stage->output, image);
+			if (ret < 0)
+			{
+				recycle_image(pipeline, image);
+				break;
+			}
+			continue;
+		}
+		stage_busy_end(stage);
+
+		ret = queue_push(stage->output, packet);
+		if (ret < 0)
+			break;
+		packet = NULL;
+	}
+
+	recycle_packet(pipeline, packet);
+	stage_finish(stage, ret == -EPIPE ? 0 : ret);
+	return NULL;
+}
+
+static void *decode_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	AVCodecContext *codec_ctx = pipeline->input_ctx->codec_ctx;
+	enum AVDiscard skip_frame;
+	AVPacket *packet;
+	AVFrame *frame = NULL;
+	int flush;
+	int ret = 0;
+
+	do
+	{
+		/* a NULL packet at the end of the input flushes the decoder */
+		packet = queue_pop(stage->input);
+		flush = (packet == NULL);
+
+		/*
+		 * When the output keeps falling behind, dropping frames after
+		 * decoding them is not enough: skip decoding the frames no other
+		 * frame depends on until the output catches up.
+		 */
+		skip_frame = clock_lagging(pipeline) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+		if (codec_ctx->skip_frame != skip_frame)
+		{
+			codec_ctx->skip_frame = skip_frame;
+			if (skip_frame == AVDISCARD_NONREF)
+				pipeline->skip_switches++;
+		}
+
+		stage_busy_begin(stage);
+		ret = avcodec_send_packet(codec_ctx, packet);
+		recycle_packet(pipeline, packet);
+		if (ret < 0 && ret != AVERROR_EOF)
+		{
+			fprintf(stderr, "cannot decode video\n");
+			break;
+		}
+
+		for (;;)
+		{
+			if (frame == NULL)
+			{
+				frame = get_frame(pipeline);
+				if (frame == NULL)
+				{
+					fprintf(stderr, "cannot allocate the raw frame!\n");
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
+
+			ret = avcodec_receive_frame(codec_ctx, frame);
+			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			{
+				ret = 0;
+				break;
+			}
+			if (ret < 0)
+			{
+				fprintf(stderr, "cannot decode video\n");
+				goto out;
+			}
+			frame->pts = frame->best_effort_timestamp;
+			stage_busy_end(stage);
+
+			ret = queue_push(stage->output, frame);
+			if (ret < 0)
+				goto out;
+			frame = NULL;
+
+			stage_busy_begin(stage);
+		}
+	} while (!flush);
+
+out:
+	recycle_frame(pipeline, frame);
+	stage_finish(stage, ret == -EPIPE ? 0 : ret);
+	return NULL;
+}
+
+/* How often the capture stage checks if it must stop, in milliseconds */
+#define CAPTURE_POLL_MS 100
+
+/*
+ * Make frames out of a capture source, as long as the image changes; the
+ * frames are spaced by at least a frame time, so that the changes made
+ * meanwhile end up in the same frame.
+ */
+static void *capture_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	struct capture_source *source = pipeline->input_ctx->capture;
+	int64_t frame_time;
+	int64_t next_frame = 0;
+	int64_t now;
+	int changed = 1; /* the first frame is always grabbed */
+	AVFrame *frame = NULL;
+	int ret = 0;
+
+	frame_time = av_rescale(AV_TIME_BASE, source->frame_rate.den, source->frame_rate.num);
+
+	while (run)
+	{
+		if (!changed)
+		{
+			ret = source->ops->wait(source, CAPTURE_POLL_MS);
+			if (ret < 0)
+				break;
+			changed = ret;
+			continue;
+		}
+
+		now = av_gettime_relative();
+		if (now < next_frame)
+		{
+			av_usleep(next_frame - now);
+			continue;
+		}
+
+		if (frame == NULL)
+		{
+			frame = get_frame(pipeline);
+			if (frame == NULL)
+			{
+				fprintf(stderr, "cannot allocate the captured frame!\n");
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		stage_busy_begin(stage);
+		ret = source->ops->grab(source, frame);
+		if (ret == -EAGAIN)
+		{
+			/* the scale stage is behind, try again a frame time later */
+			next_frame = now + frame_time;
+			continue;
+		}
+		if (ret < 0)
+		{
+			if (ret != -EPIPE)
+				fprintf(stderr, "cannot capture the frame\n");
+			break;
+		}
+		changed = 0;
+		next_frame = now + frame_time;
+		if (ret == 0)
+			continue;
+		stage_busy_end(stage);
+
+		ret = queue_push(stage->output, frame);
+		if (ret < 0)
+			break;
+		frame = NULL;
+	}
+
+	recycle_frame(pipeline, frame);
+	stage_finish(stage, ret == -EPIPE ? 0 : ret);
+	return NULL;
+}
+
+#if HAVE_SWS_THREADS
+/*
+ * Scale only the rows of a captured frame which changed, on top of a copy
+ * of the previous output. The swscale filters spread each input row over
+ * a few output rows, so some rows around the changed ones are scaled again
+ * too; the wide sinc filter would need too many of them.
+ */
+static int scale_damaged_rows(struct scale_cache_entry *entry,
+							  AVFrame *frame,
+							  AVFrame *new_frame,
+							  const struct frame_damage *damage)
+{
+	int margin;
+	int start;
+	int end;
+	int alignment;
+	int ret;
+
+	av_image_copy(new_frame->data, new_frame->linesize,
+				  (const uint8_t **)entry->last_data, entry->last_linesize,
+				  entry->pix_fmt, entry->width, entry->height);
+
+	margin = 16 * (1 + entry->height / frame->height);
+	start = (int)((int64_t)damage->y * entry->height / frame->height) - margin;
+	end = (int)(((int64_t)(damage->y + damage->height) * entry->height + frame->height - 1) / frame->height) + margin;
+
+	ret = sws_frame_start(entry->sw_scale_ctx, new_frame, frame);
+	if (ret < 0)
+		return ret;
+
+	ret = sws_send_slice(entry->sw_scale_ctx, 0, frame->height);
+	if (ret >= 0)
+	{
+		/* slices must be aligned, except for the one at the bottom */
+		alignment = sws_receive_slice_alignment(entry->sw_scale_ctx);
+		start = FFMAX(start, 0) / alignment * alignment;
+		end = FFMIN((end + alignment - 1) / alignment * alignment, entry->height);
+		ret = sws_receive_slice(entry->sw_scale_ctx, start, end - start);
+	}
+
+	sws_frame_end(entry->sw_scale_ctx);
+	return ret;
+}
+
+/* Keep the output of a captured frame, the next one may change only in part */
+static int scale_keep_output(struct scale_cache_entry *entry,
+							 AVFrame *new_frame,
+							 const struct frame_damage *damage)
+{
+	int ret;
+
+	if (entry->last_data[0] == NULL)
+	{
+		ret = av_image_alloc(entry->last_data, entry->last_linesize,
+							 entry->width, entry->height, entry->pix_fmt, 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	av_image_copy(entry->last_data, entry->last_linesize,
+				  (const uint8_t **)new_frame->data, new_frame->linesize,
+				  entry->pix_fmt, entry->width, entry->height);
+	entry->last_sequence = damage->sequence;
+
+	return 0;
+}
+#endif
+
+static int scale_frame(struct pipeline *pipeline,
+					   struct scale_cache_entry *entry,
+					   AVFrame *frame,
+					   AVFrame **frame_scaled)
+{
+#if HAVE_SWS_THREADS
+	/* captured frames tell which rows changed */
+	const struct frame_damage *damage = pipeline->input_ctx->capture ? frame->opaque : NULL;
+#endif
+	AVFrame *new_frame;
+	int ret;
+
+	/* allocate output frame */
+	new_frame = get_frame(pipeline);
+	if (new_frame == NULL)
+	{
+		fprintf(stderr, "cannot allocate the scaled frame!\n");
+		return -ENOMEM;
+	}
+	new_frame->format = entry->pix_fmt;
+	new_frame->width = entry->width;
+	new_frame->height = entry->height;
+	new_frame->pts = frame->pts;
+
+	/* the planes are contiguous, so raw frames can be sent as they are */
+	new_frame->buf[0] = av_buffer_pool_get(entry->buffer_pool);
+	if (new_frame->buf[0] == NULL)
+	{
+		fprintf(stderr, "cannot allocate output data buffer!\n");
+		recycle_frame(pipeline, new_frame);
+		return -ENOMEM;
+	}
+
+	/* assign appropriate parts of buffer to image planes in frame_scaled */
+	av_image_fill_arrays(new_frame->data,
+						 new_frame->linesize,
+						 new_frame->buf[0]->data,
+						 entry->pix_fmt,
+						 entry->width,
+						 entry->height,
+						 1);
+
+	/*
+	 * Rescaling the frame also changes its pixel format
+	 * to the raw format supported by the projector if
+	 * this was set in video_output_init()
+	 */
+	if (entry->scaler)
+	{
+		am7xxx_scaler_scale(entry->scaler,
+							(const uint8_t *const *)frame->data,
+							frame->linesize,
+							new_frame->data[0]);
+	}
+	else
+	{
+#if HAVE_SWS_THREADS
+		if (damage && entry->last_data[0] &&
+			damage->sequence == entry->last_sequence + 1 &&
+			!(pipeline->output_ctx->rescale_method & SWS_SINC))
+			ret = scale_damaged_rows(entry, frame, new_frame, damage);
+		else if (pipeline->output_ctx->scaler_threads != 1)
+			/* unlike sws_scale(), this splits the work among the context threads */
+			ret = sws_scale_frame(entry->sw_scale_ctx, new_frame, frame);
+		else
+#endif
+			/* unlike sws_scale_frame(), this allocates nothing */
+			ret = sws_scale(entry->sw_scale_ctx,
+							(const uint8_t *const *)frame->data,
+							frame->linesize,
+							0,
+							frame->height,
+							new_frame->data,
+							new_frame->linesize);
+#if HAVE_SWS_THREADS
+		if (ret >= 0 && damage)
+			ret = scale_keep_output(entry, new_frame, damage);
+#endif
+		if (ret < 0)
+		{
+			fprintf(stderr, "cannot scale the frame!\n");
+			recycle_frame(pipeline, new_frame);
+			return ret;
+		}
+	}
+
+	*frame_scaled = new_frame;
+	return 0;
+}
+
+static void *scale_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	struct scale_cache_entry *entry;
+	AVFrame *frame;
+	AVFrame *frame_scaled = NULL;
+	int ret = 0;
+
+	while ((frame = queue_pop(stage->input)) != NULL)
+	{
+		/* do not waste time scaling and encoding a late frame */
+		if (frame_must_be_dropped(pipeline,
+								  stream_time_us(pipeline, frame->pts),
+								  stage->input))
+		{
+			pipeline->dropped_scale++;
+			recycle_frame(pipeline, frame);
+			continue;
+		}
+
+		stage_busy_begin(stage);
+
+		/* the frame geometry can differ from the initial one */
+		entry = scale_cache_get(&pipeline->scale_cache, pipeline->output_ctx, frame);
+		if (entry == NULL)
+		{
+			fprintf(stderr, "cannot set up scaling for %dx%d frames\n",
+					frame->width, frame->height);
+			recycle_frame(pipeline, frame);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (entry->passthrough)
+		{
+			frame_scaled = frame;
+		}
+		else
+		{
+			ret = scale_frame(pipeline, entry, frame, &frame_scaled);
+			recycle_frame(pipeline, frame);
+			if (ret < 0)
+				break;
+		}
+		stage_busy_end(stage);
+
+		ret = queue_push(stage->output, frame_scaled);
+		if (ret < 0)
+		{
+			recycle_frame(pipeline, frame_scaled);
+			break;
+		}
+	}
+
+	stage_finish(stage, ret == -EPIPE ? 0 : ret);
+	return NULL;
+}
+
+static void *encode_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	struct video_output_ctx *output_ctx = pipeline->output_ctx;
+	struct frame_cache *frame_cache = &pipeline->frame_cache;
+	AVCodecContext *codec_ctx;
+	struct output_image *image;
+	AVFrame *frame;
+	uint64_t key = 0;
+	int got_packet;
+	int ret = 0;
+
+	while ((frame = queue_pop(stage->input)) != NULL)
+	{
+		stage_busy_begin(stage);
+
+		image = get_image(pipeline);
+		if (image == NULL)
+		{
+			fprintf(stderr, "cannot allocate the output image!\n");
+			recycle_frame(pipeline, frame);
+			ret = -ENOMEM;
+			break;
+		}
+		image->width = frame->width;
+		image->height = frame->height;
+		image->pts = stream_time_us(pipeline, frame->pts);
+
+		if (output_ctx->raw_output)
+		{
+			/* the planes of raw frames are packed when sending */
+			image->frame = frame;
+			frame = NULL;
+		}
+		else if (frame_cache->max_size &&
+				 frame_cache_get(frame_cache, frame, output_ctx->quality,
+								 &key, image->packet) == 0)
+		{
+			/* the same image was made before */
+			recycle_frame(pipeline, frame);
+		}
+		else
+		{
+			codec_ctx = encoder_cache_get(&pipeline->encoder_cache,
+										  output_ctx,
+										  frame->width,
+										  frame->height);
+			if (codec_ctx == NULL)
+			{
+				ret = -EINVAL;
+				goto err;
+			}
+
+			frame->quality = codec_ctx->global_quality;
+			got_packet = 0;
+			ret = encode(codec_ctx, image->packet, &got_packet, frame);
+			if (ret < 0 || !got_packet)
+			{
+				fprintf(stderr, "cannot encode video\n");
+				ret = ret < 0 ? ret : -EINVAL;
+				goto err;
+			}
+			recycle_frame(pipeline, frame);
+
+			/* playing goes on even if the image cannot be kept */
+			if (frame_cache->max_size)
+				frame_cache_put(frame_cache, key, image->width, image->height,
+								image->packet);
+		}
+		stage_busy_end(stage);
+
+		ret = queue_push(stage->output, image);
+		if (ret < 0)
+		{
+			recycle_image(pipeline, image);
+			break;
+		}
+	}
+
+	stage_finish(stage, ret == -EPIPE ? 0 : ret);
+	return NULL;
+
+err:
+	recycle_image(pipeline, image);
+	recycle_frame(pipeline, frame);
+	stage_finish(stage, ret);
+	return NULL;
+}
+
+#ifdef DEBUG
+static void dump_image(struct output_image *image, struct video_output_ctx *output_ctx)
+{
+	char filename[NAME_MAX];
+	FILE *file;
+	AVFrame *frame = image->frame;
+	int plane;
+	int y;
+
+	if (!output_ctx->raw_output)
+		snprintf(filename, NAME_MAX, "out_q%03d.jpg", output_ctx->quality);
+	else
+		snprintf(filename, NAME_MAX, "out.raw");
+	file = fopen(filename, "wb");
+	if (file == NULL)
+		return;
+
+	if (frame == NULL)
+	{
+		fwrite(image->packet->data, 1, image->packet->size, file);
+	}
+	else
+	{
+		/* the planes as they are, NV12 or I420 */
+		for (plane = 0; plane < 3 && frame->data[plane]; plane++)
+		{
+			int width = (plane == 0 || frame->format == AV_PIX_FMT_NV12) ? frame->width : frame->width / 2;
+			int height = (plane == 0) ? frame->height : frame->height / 2;
+
+			for (y = 0; y < height; y++)
+				fwrite(frame->data[plane] + y * frame->linesize[plane], 1, width, file);
+		}
+	}
+	fclose(file);
+}
+#endif
+
+/* The device is done with the image, its buffers can be used again */
+static void image_sent(void *user_data, int status)
+{
+	struct output_image *image = user_data;
+	struct pipeline *pipeline = image->pipeline;
+
+	/* the library already reported any error */
+	if (status == 0)
+		latency_add(pipeline, &pipeline->completion,
+					av_gettime_relative() - image->submit_time);
+
+	recycle_image(pipeline, image);
+}
+
+/*
+ * Tell if the benchmark is over: clearing run stops the input, and the
+ * images already on their way are still sent.
+ */
+static int bench_done(struct pipeline *pipeline)
+{
+	const struct bench_options *bench = pipeline->bench;
+
+	if (bench->frames && pipeline->image_sizes.count >= bench->frames)
+		return 1;
+
+	if (bench->seconds && av_gettime_relative() >= pipeline->bench_deadline)
+		return 1;
+
+	return 0;
+}
+
+/* Set up a device just claimed in resident mode as it was asked for */
+static int resident_setup_device(struct pipeline *pipeline, am7xxx_device *dev)
+{
+	const struct resident_options *resident = pipeline->resident;
+	am7xxx_device_info made_for;
+	am7xxx_device_info device_info;
+	int ret;
+
+	ret = am7xxx_set_zoom_mode(dev, resident->zoom);
 	if (ret < 0)
 	{
-		fprintf(stderr, "cannot open input format/device\n");
-		goto out;
+		perror("am7xxx_set_zoom_mode");
+		return ret;
 	}
 
-	/* get information on the input stream (e.g. format, bitrate, framerate) */
-	ret = avformat_find_stream_info(input_format_ctx, NULL);
+	ret = am7xxx_set_power_mode(dev, resident->power_mode);
 	if (ret < 0)
 	{
-		fprintf(stderr, "cannot get information on the stream\n");
-		goto cleanup;
+		perror("am7xxx_set_power_mode");
+		return ret;
 	}
 
-	/* dump what was found */
-	av_dump_format(input_format_ctx, 0, input_path, 0);
+	/* the images are shown anyway, the device scales them */
+	if (am7xxx_get_device_info(pipeline->output_ctx->dev, &made_for) == 0 &&
+		am7xxx_get_device_info(dev, &device_info) == 0 &&
+		(made_for.native_width != device_info.native_width ||
+		 made_for.native_height != device_info.native_height))
+		fprintf(stderr, "the device is %ux%u but the images are made for %ux%u, see --resident=<model>\n",
+				device_info.native_width, device_info.native_height,
+				made_for.native_width, made_for.native_height);
 
-	/* look for the first video_stream */
-	input_codec = NULL;
-	video_index = av_find_best_stream(input_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_codec, 0);
+	return 0;
+}
 
-	// video_index = av_find_best_stream(input_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_codec, 0);
-	if (video_index < 0)
-	{
-		fprintf(stderr, "cannot find any video streams\n");
-		ret = -EINVAL;
-		goto cleanup;
-	}
+/*
+ * Wait until a device is claimed or run is cleared, returns 0 when
+ * pipeline->dev can be used.
+ */
+static int resident_wait_for_device(struct pipeline *pipeline)
+{
+	am7xxx_device *dev;
+	int ret;
 
-	input_codec_ctx = avcodec_alloc_context3(input_codec);
-	if (input_codec_ctx == NULL)
+	while (run)
 	{
-		fprintf(stderr, "failed to allocate the input codec context\n");
-		ret = -ENOMEM;
-		goto cleanup;
-	}
+		ret = am7xxx_wait_for_device(pipeline->resident->ctx, &dev,
+									 RESIDENT_WAIT_MS);
+		if (ret == -ETIMEDOUT)
+			continue;
 
-	input_codec_params = input_format_ctx->streams[video_index]->codecpar;
-	ret = avcodec_parameters_to_context(input_codec_ctx, input_codec_params);
-	if (ret < 0)
-	{
-		fprintf(stderr, "cannot copy parameters to input codec context\n");
-		goto cleanup_ctx;
+		/* there is no way to know when a device shows up */
+		if (ret == -ENOTSUP)
+			return ret;
+
+		if (ret == 0)
+		{
+			ret = resident_setup_device(pipeline, dev);
+			if (ret == 0)
+			{
+				fprintf(stdout, "device claimed\n");
+				pipeline->dev = dev;
+				return 0;
+			}
+			am7xxx_close_device(dev);
+		}
+
+		/* the device may be busy or just going away, not to spin */
+		av_usleep(RESIDENT_WAIT_MS * 1000);
 	}
 
-	/* open the decoder */
-	ret = avcodec_open2(input_codec_ctx, input_codec, NULL);
-	if (ret < 0)
+	return 1;
+}
+
+static void *send_stage(void *arg)
+{
+	struct stage *stage = arg;
+	struct pipeline *pipeline = stage->pipeline;
+	struct video_output_ctx *output_ctx = pipeline->output_ctx;
+	struct output_image *image;
+	am7xxx_pixel_format pixel_format;
+	int size;
+	int ret = 0;
+
+	while ((image = queue_pop(stage->input)) != NULL)
 	{
-		fprintf(stderr, "cannot open input codec\n");
-		goto cleanup_ctx;
-	}
+		if (pipeline->resident && pipeline->dev == NULL)
+		{
+			/* the stages before stall on the full queues meanwhile */
+			ret = resident_wait_for_device(pipeline);
+			if (ret != 0)
+			{
+				recycle_image(pipeline, image);
+				if (ret > 0)
+					ret = 0;
+				break;
+			}
 
-	input_ctx->format_ctx = input_format_ctx;
-	input_ctx->codec_ctx = input_codec_ctx;
-	input_ctx->video_stream_index = video_index;
+			/* the newest image is shown, not the ones piled up */
+			while (queue_count(stage->input) > 0)
+			{
+				recycle_image(pipeline, image);
+				image = queue_pop(stage->input);
+				if (image == NULL)
+					goto out;
+			}
+		}
 
-	ret = 0;
-	goto out;
+		if (wait_for_presentation(pipeline, image->pts, stage->input))
+		{
+			recycle_image(pipeline, image);
+			continue;
+		}
+
+		stage_busy_begin(stage);
+
+#ifdef DEBUG
+		if (pipeline->dump_frame)
+			dump_image(image, output_ctx);
+#endif
+
+		if (pipeline->pack)
+		{
+			size = image->frame ? image->width * image->height * 3 / 2 : image->packet->size;
+			ret = pack_add_image(pipeline->pack, image);
+			recycle_image(pipeline, image);
+		}
+		else if (image->frame)
+		{
+			/* NV12 and I420 both take 12 bits per pixel */
+			size = image->width * image->height * 3 / 2;
+			ret = get_pixel_format(image->frame->format, &pixel_format);
+			if (ret == 0)
+				ret = am7xxx_send_image_planes_async(pipeline->dev,
+													 pixel_format,
+													 image->width,
+													 image->height,
+													 (const uint8_t *const *)image->frame->data,
+													 image->frame->linesize);
+			recycle_image(pipeline, image);
+		}
+		else
+		{
+			/* the image is recycled when the device is done with it */
+			size = image->packet->size;
+			image->submit_time = av_gettime_relative();
+			ret = am7xxx_send_image_async_nocopy(pipeline->dev,
+												 output_ctx->image_format,
+												 image->width,
+												 image->height,
+												 image->packet->data,
+												 image->packet->size,
+												 image_sent,
+												 image);
+			if (ret < 0)
+				recycle_image(pipeline, image);
+		}
+		if (ret < 0 && pipeline->resident)
+		{
+			/* the images in flight are recycled by the closing */
+			fprintf(stderr, "the device went away (%d), waiting for it to come back\n", ret);
+			am7xxx_close_device(pipeline->dev);
+			pipeline->dev = NULL;
+			stage_busy_end(stage);
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+		{
+			perror("am7xxx_send_image_async");
+			break;
+		}
+
+		if (!pipeline->pack)
+			startup_first_frame(pipeline->dev);
+
+		stage_busy_end(stage);
+		count_allocations(pipeline, stage->items);
+
+		histogram_add(&pipeline->image_sizes, size);
+		if (pipeline->bench && bench_done(pipeline))
+			run = 0;
+	}
 
-cleanup_ctx:
-	avcodec_free_context(&input_codec_ctx);
-cleanup:
-	avformat_close_input(&input_format_ctx);
 out:
-	av_dict_free(input_options);
-	*input_options = NULL;
-	return ret;
+	/* get back the image still being sent */
+	if (pipeline->dev)
+		am7xxx_flush_async(pipeline->dev);
+
+	stage_finish(stage, ret);
+	return NULL;
 }
 
-struct video_output_ctx
+/* The latencies reported: the ones of the stages, then the completion one */
+#define LATENCY_COUNT (STAGE_COUNT + 1)
+
+/* Short enough for a single write() to a FIFO to be atomic, see PIPE_BUF */
+#define STATS_LINE_SIZE 4096
+
+static const char *latency_name(struct pipeline *pipeline, unsigned int i)
 {
-	AVCodecContext *codec_ctx;
-	int raw_output;
-};
+	return i < STAGE_COUNT ? pipeline->stages[i].name : "complete";
+}
 
-static int video_output_init(struct video_output_ctx *output_ctx,
-							 struct video_input_ctx *input_ctx,
-							 unsigned int upscale,
-							 unsigned int quality,
-							 am7xxx_image_format image_format,
-							 am7xxx_device *dev)
+static int latency_reported(struct pipeline *pipeline, unsigned int i)
 {
-	AVCodecContext *output_codec_ctx;
-	AVCodec *output_codec;
-	unsigned int new_output_width;
-	unsigned int new_output_height;
-	int ret;
+	if (i < STAGE_COUNT)
+		return pipeline->stages[i].started;
 
-	if (input_ctx == NULL)
-	{
-		fprintf(stderr, "input_ctx must not be NULL!\n");
-		ret = -EINVAL;
-		goto out;
-	}
+	/* only the images sent without copying them tell when they are done */
+	return !pipeline->output_ctx->raw_output;
+}
 
-	/* create the encoder context */
-	output_codec_ctx = avcodec_alloc_context3(NULL);
-	if (output_codec_ctx == NULL)
-	{
-		fprintf(stderr, "cannot allocate output codec context!\n");
-		ret = -ENOMEM;
-		goto out;
-	}
+static void print_latencies(struct pipeline *pipeline, const struct histogram *histograms)
+{
+	unsigned int i;
 
-	/* Calculate the new output dimension so the original frame is shown
-	 * in its entirety */
-	ret = am7xxx_calc_scaled_image_dimensions(dev,
-											  upscale,
-											  (input_ctx->codec_ctx)->width,
-											  (input_ctx->codec_ctx)->height,
-											  &new_output_width,
-											  &new_output_height);
-	if (ret < 0)
+	for (i = 0; i < LATENCY_COUNT; i++)
 	{
-		fprintf(stderr, "cannot calculate output dimension\n");
-		goto cleanup;
+		if (!latency_reported(pipeline, i))
+			continue;
+
+		fprintf(stdout, " %s %.2f/%.2f/%.2f",
+				latency_name(pipeline, i),
+				histogram_percentile(&histograms[i], 50) / 1000.0,
+				histogram_percentile(&histograms[i], 99) / 1000.0,
+				histograms[i].max / 1000.0);
 	}
+}
 
-	/* put sample parameters */
-	output_codec_ctx->bit_rate = (input_ctx->codec_ctx)->bit_rate;
-	output_codec_ctx->width = new_output_width;
-	output_codec_ctx->height = new_output_height;
-	output_codec_ctx->time_base.num =
-		(input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->time_base.num;
-	output_codec_ctx->time_base.den =
-		(input_ctx->format_ctx)->streams[input_ctx->video_stream_index]->time_base.den;
+static void print_pipeline_stats(struct pipeline *pipeline, int64_t elapsed)
+{
+	struct histogram histograms[LATENCY_COUNT];
+	struct stage *stage;
+	unsigned int i;
 
-	/* When the raw format is requested we don't actually need to setup
-	 * and open a decoder
-	 */
-	if (image_format == AM7XXX_IMAGE_FORMAT_NV12)
+	if (elapsed <= 0)
+		return;
+
+	fprintf(stdout, "Pipeline statistics over %.2f s:\n", elapsed / 1000000.0);
+	for (i = 0; i < STAGE_COUNT; i++)
 	{
-		fprintf(stdout, "using raw output format\n");
-		output_codec_ctx->pix_fmt = AV_PIX_FMT_NV12;
-		output_ctx->codec_ctx = output_codec_ctx;
-		output_ctx->raw_output = 1;
-		ret = 0;
-		goto out;
+		stage = &pipeline->stages[i];
+		histograms[i] = stage->latency.total;
+		if (!stage->started)
+			continue;
+
+		fprintf(stdout, "\t%-7s %6lu items, busy %5.1f%%, %7.2f ms per item",
+				stage->name,
+				stage->items,
+				stage->busy_time * 100.0 / elapsed,
+				stage->items ? stage->busy_time / 1000.0 / stage->items : 0.0);
+		if (stage->input && stage->input->pushed)
+			fprintf(stdout, ", input queue depth avg %.2f max %u",
+					(double)stage->input->depth_sum / stage->input->pushed,
+					stage->input->depth_max);
+		fprintf(stdout, "\n");
 	}
+	histograms[STAGE_COUNT] = pipeline->completion.total;
 
-	/* YUVJ420P is deprecated in swscaler, but mjpeg still relies on it. */
-	output_codec_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
-	output_codec_ctx->codec_id = AV_CODEC_ID_MJPEG;
-	output_codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+	fprintf(stdout, "\tlatency p50/p99/max ms:");
+	print_latencies(pipeline, histograms);
+	fprintf(stdout, "\n");
 
-	/* Set quality and other VBR settings */
+	if (pipeline->image_sizes.count)
+		fprintf(stdout, "\timage size KiB: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+				histogram_mean(&pipeline->image_sizes) / 1024.0,
+				histogram_percentile(&pipeline->image_sizes, 50) / 1024.0,
+				histogram_percentile(&pipeline->image_sizes, 90) / 1024.0,
+				histogram_percentile(&pipeline->image_sizes, 99) / 1024.0,
+				pipeline->image_sizes.max / 1024.0);
 
-	/* @note: 'quality' is expected to be between 1 and 100, but a value
-	 * between 0 to 99 has to be passed when calculating qmin and qmax.
-	 * This way qmin and qmax will cover the range 1-FF_QUALITY_SCALE, and
-	 * in particular they won't be 0, this is needed because they are used
-	 * as divisor somewhere in the encoding process */
-	output_codec_ctx->qmin = output_codec_ctx->qmax = ((100 - (quality - 1)) * FF_QUALITY_SCALE) / 100;
-	output_codec_ctx->mb_lmin = output_codec_ctx->qmin * FF_QP2LAMBDA;
-	output_codec_ctx->mb_lmax = output_codec_ctx->qmax * FF_QP2LAMBDA;
-	output_codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
-	output_codec_ctx->global_quality = output_codec_ctx->qmin * FF_QP2LAMBDA;
+	if (pipeline->dropped)
+		fprintf(stdout, "\t%lu MJPEG frames dropped\n", pipeline->dropped);
+
+	if (pipeline->frame_cache.max_size)
+		fprintf(stdout, "\tframe cache: %lu hits, %lu from disk, %lu misses, %lu evicted, %u images in %.1f MiB\n",
+				pipeline->frame_cache.hits,
+				pipeline->frame_cache.disk_hits,
+				pipeline->frame_cache.misses,
+				pipeline->frame_cache.evictions,
+				pipeline->frame_cache.count,
+				pipeline->frame_cache.size / (1024.0 * 1024.0));
 
-	/* find the encoder */
-	//	output_codec = avcodec_find_encoder(output_codec_ctx->codec_id);
-	//const AVCodec *output_codec = avcodec_find_encoder(output_codec_ctx->codec_id);
-	output_codec = avcodec_find_encoder(output_codec_ctx->codec_id);
+	if (pipeline->frame_cache.max_size && pipeline->frame_cache.dir)
+		fprintf(stdout, "\tframe cache disk: %u images in %.1f MiB, %lu evicted, %lu not stored\n",
+				pipeline->frame_cache.disk_count,
+				pipeline->frame_cache.disk_size / (1024.0 * 1024.0),
+				pipeline->frame_cache.disk_evictions,
+				pipeline->frame_cache.write_drops);
 
-	if (output_codec == NULL)
+	if (pipeline->pacing)
+		fprintf(stdout, "\tpacing: %lu frames sent, average lateness %.2f ms, %lu dropped before scaling, %lu before sending, %lu decoder slowdowns\n",
+				pipeline->presented,
+				pipeline->presented ? pipeline->lateness_sum / 1000.0 / pipeline->presented : 0.0,
+				pipeline->dropped_scale,
+				pipeline->dropped_send,
+				pipeline->skip_switches);
+
+	if (pipeline->allocation_frames)
+		fprintf(stdout, "\theap allocations after %d frames: %lu in %lu frames, %.2f per frame\n",
+				ALLOCATION_WARMUP_FRAMES,
+				pipeline->allocations,
+				pipeline->allocation_frames,
+				(double)pipeline->allocations / pipeline->allocation_frames);
+}
+
+static void stats_append(char *line, size_t *len, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void stats_append(char *line, size_t *len, const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	if (*len >= STATS_LINE_SIZE)
+		return;
+
+	va_start(args, format);
+	ret = vsnprintf(line + *len, STATS_LINE_SIZE - *len, format, args);
+	va_end(args);
+
+	*len = (ret < 0) ? STATS_LINE_SIZE : *len + ret;
+}
+
+/*
+ * Write a JSON line for the monitoring tools; the file is opened without
+ * blocking, so a FIFO nobody reads yet is tried again at the next report,
+ * and a line which does not fit in a full FIFO is lost rather than
+ * stalling the pipeline.
+ */
+static void write_json_stats(struct pipeline *pipeline,
+							 const struct histogram *histograms,
+							 int64_t elapsed,
+							 int64_t interval,
+							 int *fd)
+{
+	const char *path = pipeline->stats->json_path;
+	const struct histogram *histogram;
+	struct stage *stage;
+	const char *separator = "";
+	char line[STATS_LINE_SIZE];
+	size_t len = 0;
+	unsigned int i;
+	ssize_t written;
+
+	if (*fd < 0)
 	{
-		fprintf(stderr, "cannot find output codec!\n");
-		ret = -EINVAL;
-		goto cleanup;
+		*fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+		if (*fd < 0)
+		{
+			if (errno != ENXIO)
+				fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+			return;
+		}
 	}
 
-	/* open the codec */
-	ret = avcodec_open2(output_codec_ctx, output_codec, NULL);
-	if (ret < 0)
+	stats_append(line, &len, "{\"time\":%.3f,\"interval\":%.3f,\"fps\":%.2f,\"latency\":{",
+				 elapsed / 1000000.0,
+				 interval / 1000000.0,
+				 histograms[STAGE_SEND].count * 1000000.0 / interval);
+	for (i = 0; i < LATENCY_COUNT; i++)
 	{
-		fprintf(stderr, "could not open output codec!\n");
-		goto cleanup;
-	}
+		if (!latency_reported(pipeline, i))
+			continue;
 
-	output_ctx->codec_ctx = output_codec_ctx;
-	output_ctx->raw_output = 0;
+		histogram = &histograms[i];
+		stats_append(line, &len, "%s\"%s\":{\"count\":%lu,\"mean_us\":%lld,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,\"max_us\":%lld",
+					 separator,
+					 latency_name(pipeline, i),
+					 histogram->count,
+					 (long long)histogram_mean(histogram),
+					 (long long)histogram_percentile(histogram, 50),
+					 (long long)histogram_percentile(histogram, 90),
+					 (long long)histogram_percentile(histogram, 99),
+					 (long long)histogram->max);
 
-	ret = 0;
-	goto out;
+		stage = (i < STAGE_COUNT) ? &pipeline->stages[i] : NULL;
+		if (stage && stage->input)
+			stats_append(line, &len, ",\"queue\":%u", queue_count(stage->input));
+		stats_append(line, &len, "}");
+		separator = ",";
+	}
+	stats_append(line, &len, "}}\n");
 
-cleanup:
-	avcodec_free_context(&output_codec_ctx);
-out:
-	return ret;
+	if (len >= STATS_LINE_SIZE)
+		return;
+
+	written = write(*fd, line, len);
+	if (written < 0 && errno != EAGAIN)
+	{
+		/* the reader went away, wait for the next one */
+		close(*fd);
+		*fd = -1;
+	}
 }
 
 /*
- * Wrap the new avcodec API from FFMpeg 3.1 to minimize the changes in the
- * user code.
- *
- * If the use of the wrappers were to be made conditional, a check like the
- * following could be used:
- *
- *	#if (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 48, 101))
- *
- * As derived from the APIchanges document:
- * https://github.com/FFmpeg/FFmpeg/blob/master/doc/APIchanges
- *
- * The wrapper implementation has been taken from:
- * https://blogs.gentoo.org/lu_zero/2016/03/29/new-avcodec-api/
+ * Report the latencies of the last interval periodically, until the
+ * pipeline stops; the histograms are copied under the lock, so the stages
+ * are only held up for as long as that takes.
  */
-static int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt)
+static void *report_thread(void *arg)
 {
-	int ret;
+	struct pipeline *pipeline = arg;
+	const struct stats_options *stats = pipeline->stats;
+	struct histogram histograms[LATENCY_COUNT];
+	struct latency *latency;
+	struct timespec deadline;
+	int64_t start_time;
+	int64_t last_time;
+	int64_t now;
+	unsigned int i;
+	int fd = -1;
+	int stop = 0;
 
-	*got_frame = 0;
+	start_time = last_time = av_gettime_relative();
+	clock_gettime(CLOCK_REALTIME, &deadline);
 
-	if (pkt)
+	while (!stop)
 	{
-		ret = avcodec_send_packet(avctx, pkt);
-		/*
-		 * In particular, we don't expect AVERROR(EAGAIN), because we
-		 * read all decoded frames with avcodec_receive_frame() until
-		 * done.
-		 */
-		if (ret < 0)
-			return ret == AVERROR_EOF ? 0 : ret;
+		deadline.tv_sec += stats->interval;
+
+		pthread_mutex_lock(&pipeline->stats_mutex);
+		while (!pipeline->stats_stop &&
+			   pthread_cond_timedwait(&pipeline->stats_cond,
+									  &pipeline->stats_mutex,
+									  &deadline) != ETIMEDOUT)
+			;
+		stop = pipeline->stats_stop;
+
+		for (i = 0; i < LATENCY_COUNT; i++)
+		{
+			latency = (i < STAGE_COUNT) ? &pipeline->stages[i].latency : &pipeline->completion;
+			histograms[i] = latency->interval;
+			memset(&latency->interval, 0, sizeof(latency->interval));
+		}
+		pthread_mutex_unlock(&pipeline->stats_mutex);
+
+		/* the whole run is summed up when the pipeline stops */
+		if (stop)
+			break;
+
+		now = av_gettime_relative();
+
+		if (stats->summary)
+		{
+			fprintf(stdout, "%.1f s: %.2f fps, latency p50/p99/max ms:",
+					(now - start_time) / 1000000.0,
+					histograms[STAGE_SEND].count * 1000000.0 / (now - last_time));
+			print_latencies(pipeline, histograms);
+			fprintf(stdout, "\n");
+			fflush(stdout);
+		}
+
+		if (stats->json_path)
+			write_json_stats(pipeline, histograms, now - start_time,
+							 now - last_time, &fd);
+
+		last_time = now;
 	}
 
-	ret = avcodec_receive_frame(avctx, frame);
-	if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
-		return ret;
-	if (ret >= 0)
-		*got_frame = 1;
+	if (fd >= 0)
+		close(fd);
 
-	return 0;
+	return NULL;
 }
 
-static int encode(AVCodecContext *avctx, AVPacket *pkt, int *got_packet, AVFrame *frame)
+static void print_bench_results(struct pipeline *pipeline, int64_t elapsed)
+{
+	const struct bench_options *bench = pipeline->bench;
+	double fps;
+
+	if (elapsed <= 0)
+		return;
+
+	fps = pipeline->image_sizes.count * 1000000.0 / elapsed;
+
+	fprintf(stdout, "Benchmark: %lu frames in %.2f s, %.2f fps, %.2f MB/s to the device\n",
+			pipeline->image_sizes.count,
+			elapsed / 1000000.0,
+			fps,
+			pipeline->image_sizes.sum / (elapsed / 1000000.0) / 1000000.0);
+
+	if (bench->fps > 0)
+		fprintf(stdout, "\t%.2f fps %s\n", bench->fps,
+				fps >= bench->fps ? "sustained" : "NOT sustained");
+}
+
+/*
+ * MJPEG input, as produced by many webcams, can be sent to the device
+ * without decoding and encoding it again, if the device can show the
+ * images as they are.
+ */
+static int mjpeg_passthrough_possible(struct video_input_ctx *input_ctx,
+									  struct video_output_ctx *output_ctx,
+									  am7xxx_device_info *device_info)
 {
+	AVCodecContext *codec_ctx = input_ctx->codec_ctx;
 	int ret;
 
-	*got_packet = 0;
+	if (output_ctx->raw_output || input_ctx->capture ||
+		codec_ctx->codec_id != AV_CODEC_ID_MJPEG)
+		return 0;
+
+	if (codec_ctx->pix_fmt != AV_PIX_FMT_YUVJ420P &&
+		codec_ctx->pix_fmt != AV_PIX_FMT_YUV420P)
+		return 0;
 
-	ret = avcodec_send_frame(avctx, frame);
+	ret = am7xxx_get_device_info(output_ctx->dev, device_info);
 	if (ret < 0)
-		return ret;
+		return 0;
 
-	ret = avcodec_receive_packet(avctx, pkt);
-	if (!ret)
-		*got_packet = 1;
-	if (ret == AVERROR(EAGAIN))
+	if ((unsigned int)codec_ctx->width > device_info->native_width ||
+		(unsigned int)codec_ctx->height > device_info->native_height)
 		return 0;
 
-	return ret;
+	/* the user asked for the image to fill the display */
+	if (output_ctx->upscale &&
+		(unsigned int)codec_ctx->width < device_info->native_width &&
+		(unsigned int)codec_ctx->height < device_info->native_height)
+		return 0;
+
+	return 1;
 }
 
 static int am7xxx_play(const char *input_format_string,
@@ -350,227 +5603,284 @@ static int am7xxx_play(const char *input_format_string,
 					   unsigned int quality,
 					   am7xxx_image_format image_format,
 					   am7xxx_device *dev,
+					   const am7xxx_device_profile *profile,
+					   int native_scale,
+					   int transcode,
+					   int strip_markers,
+					   int no_pacing,
+					   int fast_start,
+					   const struct threading_options *threading,
+					   const struct stats_options *stats,
+					   const struct frame_cache_options *frame_cache,
+					   const struct bench_options *bench,
+					   const struct resident_options *resident,
+					   const char *pack_path,
 					   int dump_frame)
 {
+	static const char *stage_names[STAGE_COUNT] = {
+		"demux", "decode", "scale", "encode", "send"
+	};
+	static void *(*const stage_functions[STAGE_COUNT])(void *) = {
+		demux_stage, decode_stage, scale_stage, encode_stage, send_stage
+	};
+	void *(*stage_function)(void *);
+	static void (*const recycler_free_functions[PIPELINE_RECYCLERS])(void *) = {
+		free_packet, free_frame, free_image
+	};
 	struct video_input_ctx input_ctx;
 	struct video_output_ctx output_ctx;
-	AVFrame *frame_raw;
-	AVFrame *frame_scaled;
-	int out_buf_size;
-	uint8_t *out_buf;
-	int out_frame_size;
-	uint8_t *out_frame;
-	struct SwsContext *sw_scale_ctx;
-	AVPacket in_packet;
-	AVPacket out_packet;
-	int got_frame;
-	int got_packet;
+	struct pipeline pipeline;
+	struct pack_writer pack;
+	struct queue *queues[STAGE_COUNT - 1];
+	struct recycler *recyclers[PIPELINE_RECYCLERS];
+	struct stage *stage;
+	pthread_t report;
+	int reporting = 0;
+	int64_t start_time;
+	int64_t elapsed;
+	unsigned int i;
 	int ret;
 
-	ret = video_input_init(&input_ctx, input_format_string, input_path, input_options);
+	ret = video_input_init(&input_ctx, input_format_string, input_path,
+						   input_options, threading, fast_start);
 	if (ret < 0)
 	{
 		fprintf(stderr, "cannot initialize input\n");
 		goto out;
 	}
 
-	ret = video_output_init(&output_ctx, &input_ctx, upscale, quality, image_format, dev);
+	ret = video_output_init(&output_ctx, &input_ctx, rescale_method, upscale,
+							quality, image_format, native_scale, threading,
+							dev);
 	if (ret < 0)
 	{
-		fprintf(stderr, "cannot initialize input\n");
+		fprintf(stderr, "cannot initialize output\n");
 		goto cleanup_input;
 	}
+	startup_mark("output ready");
+
+	check_device_profile(profile, &input_ctx, &output_ctx);
 
-	/* allocate an input frame */
-	frame_raw = av_frame_alloc();
-	if (frame_raw == NULL)
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.input_ctx = &input_ctx;
+	pipeline.output_ctx = &output_ctx;
+	pipeline.dump_frame = dump_frame;
+	pipeline.strip_markers = strip_markers;
+	pipeline.stats = stats;
+	pipeline.bench = bench->enabled ? bench : NULL;
+	pipeline.resident = resident->enabled ? resident : NULL;
+	pipeline.dev = resident->enabled ? NULL : dev;
+	pipeline.frame_cache.max_size = (size_t)frame_cache->size * 1024 * 1024;
+	pipeline.frame_cache.dir = frame_cache->dir;
+	pipeline.frame_cache.max_disk_size = (size_t)frame_cache->disk_size * 1024 * 1024;
+
+	if (!transcode)
+		pipeline.passthrough = mjpeg_passthrough_possible(&input_ctx,
+														  &output_ctx,
+														  &pipeline.device_info);
+	if (pipeline.passthrough)
+		fprintf(stdout, "using MJPEG passthrough\n");
+
+	if (pack_path)
 	{
-		fprintf(stderr, "cannot allocate the raw frame!\n");
-		ret = -ENOMEM;
-		goto cleanup_output;
+		ret = pack_writer_open(&pack, pack_path, output_ctx.image_format);
+		if (ret < 0)
+			goto cleanup_input;
+		pipeline.pack = &pack;
 	}
 
-	/* allocate output frame */
-	frame_scaled = av_frame_alloc();
-	if (frame_scaled == NULL)
+	/*
+	 * Files are played at their own pace, live sources like screen
+	 * grabbers and webcams already produce frames in real time.
+	 */
+	pipeline.pacing = !no_pacing && input_ctx.capture == NULL &&
+		!(input_ctx.format_ctx->iformat->flags & AVFMT_NOFILE);
+
+	ret = pthread_mutex_init(&pipeline.clock_mutex, NULL);
+	if (ret != 0)
 	{
-		fprintf(stderr, "cannot allocate the scaled frame!\n");
-		ret = -ENOMEM;
-		goto cleanup_frame_raw;
+		fprintf(stderr, "cannot initialize the presentation clock\n");
+		ret = -ret;
+		goto cleanup_pack;
 	}
-	frame_scaled->format = (output_ctx.codec_ctx)->pix_fmt;
-	frame_scaled->width = (output_ctx.codec_ctx)->width;
-	frame_scaled->height = (output_ctx.codec_ctx)->height;
 
-	/* calculate the bytes needed for the output image and create buffer for the output image */
-	out_buf_size = av_image_get_buffer_size((output_ctx.codec_ctx)->pix_fmt,
-											(output_ctx.codec_ctx)->width,
-											(output_ctx.codec_ctx)->height,
-											1);
-	out_buf = av_malloc(out_buf_size * sizeof(uint8_t));
-	if (out_buf == NULL)
+	ret = pthread_mutex_init(&pipeline.stats_mutex, NULL);
+	if (ret == 0)
 	{
-		fprintf(stderr, "cannot allocate output data buffer!\n");
-		ret = -ENOMEM;
-		goto cleanup_frame_scaled;
+		ret = pthread_cond_init(&pipeline.stats_cond, NULL);
+		if (ret != 0)
+			pthread_mutex_destroy(&pipeline.stats_mutex);
 	}
-
-	/* assign appropriate parts of buffer to image planes in frame_scaled */
-	av_image_fill_arrays(frame_scaled->data,
-						 frame_scaled->linesize,
-						 out_buf,
-						 (output_ctx.codec_ctx)->pix_fmt,
-						 (output_ctx.codec_ctx)->width,
-						 (output_ctx.codec_ctx)->height,
-						 1);
-
-	sw_scale_ctx = sws_getCachedContext(NULL,
-										(input_ctx.codec_ctx)->width,
-										(input_ctx.codec_ctx)->height,
-										(input_ctx.codec_ctx)->pix_fmt,
-										(output_ctx.codec_ctx)->width,
-										(output_ctx.codec_ctx)->height,
-										(output_ctx.codec_ctx)->pix_fmt,
-										rescale_method,
-										NULL, NULL, NULL);
-	if (sw_scale_ctx == NULL)
+	if (ret != 0)
 	{
-		fprintf(stderr, "cannot set up the rescaling context!\n");
-		ret = -EINVAL;
-		goto cleanup_out_buf;
+		fprintf(stderr, "cannot initialize the statistics\n");
+		pthread_mutex_destroy(&pipeline.clock_mutex);
+		ret = -ret;
+		goto cleanup_pack;
 	}
 
-	got_packet = 0;
-	while (run)
+	recyclers[0] = &pipeline.free_packets;
+	recyclers[1] = &pipeline.free_frames;
+	recyclers[2] = &pipeline.free_images;
+
+	for (i = 0; i < PIPELINE_RECYCLERS; i++)
 	{
-		/* read packet */
-		ret = av_read_frame(input_ctx.format_ctx, &in_packet);
+		ret = recycler_init(recyclers[i], recycler_free_functions[i]);
 		if (ret < 0)
 		{
-			if (ret == (int)AVERROR_EOF || input_ctx.format_ctx->pb->eof_reached)
-				ret = 0;
-			else
-				fprintf(stderr, "av_read_frame failed, EOF?\n");
-			run = 0;
-			goto end_while;
+			fprintf(stderr, "cannot initialize the pipeline recyclers\n");
+			goto cleanup_recyclers;
 		}
+	}
 
-		if (in_packet.stream_index != input_ctx.video_stream_index)
-		{
-			/* that is more or less a "continue", but there is
-			 * still the packet to free */
-			goto end_while;
-		}
+	queues[0] = &pipeline.packets;
+	queues[1] = &pipeline.frames;
+	queues[2] = &pipeline.scaled;
+	queues[3] = &pipeline.images;
 
-		/* decode */
-		got_frame = 0;
-		ret = decode(input_ctx.codec_ctx, frame_raw, &got_frame, &in_packet);
+	for (i = 0; i < STAGE_COUNT - 1; i++)
+	{
+		ret = queue_init(queues[i]);
 		if (ret < 0)
 		{
-			fprintf(stderr, "cannot decode video\n");
-			run = 0;
-			goto end_while;
+			fprintf(stderr, "cannot initialize the pipeline queues\n");
+			while (i-- > 0)
+				queue_destroy(queues[i], NULL);
+			i = PIPELINE_RECYCLERS;
+			goto cleanup_recyclers;
 		}
+	}
 
-		/* if we got the complete frame */
-		if (got_frame)
+	/* playing goes on even if the images cannot be stored */
+	ret = frame_cache_start(&pipeline.frame_cache);
+	if (ret < 0)
+	{
+		fprintf(stderr, "cannot start storing the images in %s: %s\n",
+				pipeline.frame_cache.dir, strerror(-ret));
+		ret = 0;
+	}
+
+	/* from now on only the send stage marks the startup phases */
+	startup_mark("pipeline ready");
+
+	start_time = av_gettime_relative();
+	pipeline.bench_deadline = start_time + bench->seconds * (int64_t)1000000;
+
+	for (i = 0; i < STAGE_COUNT; i++)
+	{
+		stage = &pipeline.stages[i];
+		stage->name = stage_names[i];
+		stage->pipeline = &pipeline;
+		stage->input = (i > 0) ? queues[i - 1] : NULL;
+		stage->output = (i < STAGE_COUNT - 1) ? queues[i] : NULL;
+
+		stage_function = stage_functions[i];
+
+		/* there is nothing to decode, scale or encode */
+		if (pipeline.passthrough)
 		{
-			/*
-			 * Rescaling the frame also changes its pixel format
-			 * to the raw format supported by the projector if
-			 * this was set in video_output_init()
-			 */
-			sws_scale(sw_scale_ctx,
-					  (const uint8_t *const *)frame_raw->data,
-					  frame_raw->linesize,
-					  0,
-					  (input_ctx.codec_ctx)->height,
-					  frame_scaled->data,
-					  frame_scaled->linesize);
-
-			if (output_ctx.raw_output)
-			{
-				out_frame = out_buf;
-				out_frame_size = out_buf_size;
-			}
+			if (i == STAGE_DEMUX)
+				stage->output = &pipeline.images;
+			else if (i == STAGE_SEND)
+				stage->input = &pipeline.images;
 			else
-			{
-				frame_scaled->quality = (output_ctx.codec_ctx)->global_quality;
-				//av_init_packet(&out_packet);
-				av_packet_unref(&out_packet);
-				out_packet.data = NULL;
-				out_packet.size = 0;
-				got_packet = 0;
-				ret = encode(output_ctx.codec_ctx,
-							 &out_packet,
-							 &got_packet,
-							 frame_scaled);
-				if (ret < 0 || !got_packet)
-				{
-					fprintf(stderr, "cannot encode video\n");
-					run = 0;
-					goto end_while;
-				}
-
-				out_frame = out_packet.data;
-				out_frame_size = out_packet.size;
-			}
+				continue;
+		}
 
-#ifdef DEBUG
-			if (dump_frame)
+		/* captured frames go straight to the scale stage */
+		if (input_ctx.capture)
+		{
+			if (i == STAGE_DEMUX)
 			{
-				char filename[NAME_MAX];
-				FILE *file;
-				if (!output_ctx.raw_output)
-					snprintf(filename, NAME_MAX, "out_q%03d.jpg", quality);
-				else
-					snprintf(filename, NAME_MAX, "out.raw");
-				file = fopen(filename, "wb");
-				fwrite(out_frame, 1, out_frame_size, file);
-				fclose(file);
+				stage->name = "capture";
+				stage->output = &pipeline.frames;
+				stage_function = capture_stage;
 			}
-#else
-			(void)dump_frame;
-#endif
-
-			ret = am7xxx_send_image_async(dev,
-										  image_format,
-										  (output_ctx.codec_ctx)->width,
-										  (output_ctx.codec_ctx)->height,
-										  out_frame,
-										  out_frame_size);
-			if (ret < 0)
+			else if (i == STAGE_DECODE)
 			{
-				perror("am7xxx_send_image_async");
-				run = 0;
-				goto end_while;
+				continue;
 			}
 		}
-	end_while:
-		if (!output_ctx.raw_output && got_packet)
-			av_packet_unref(&out_packet);
-		av_packet_unref(&in_packet);
+
+		ret = pthread_create(&stage->thread, NULL, stage_function, stage);
+		if (ret != 0)
+		{
+			fprintf(stderr, "cannot start the %s stage: %s\n",
+					stage->name, strerror(ret));
+			ret = -ret;
+			/* stop the stages already running */
+			if (stage->input)
+				queue_abort(stage->input);
+			break;
+		}
+		stage->started = 1;
+	}
+
+	if (ret == 0 && stats->interval > 0)
+	{
+		/* playing goes on without the reports if they cannot be made */
+		if (pthread_create(&report, NULL, report_thread, &pipeline) == 0)
+			reporting = 1;
+		else
+			fprintf(stderr, "cannot start the statistics reports\n");
 	}
 
-	sws_freeContext(sw_scale_ctx);
-cleanup_out_buf:
-	av_free(out_buf);
-cleanup_frame_scaled:
-	av_frame_free(&frame_scaled);
-cleanup_frame_raw:
-	av_frame_free(&frame_raw);
+	for (i = 0; i < STAGE_COUNT; i++)
+	{
+		stage = &pipeline.stages[i];
+		if (!stage->started)
+			continue;
 
-cleanup_output:
-	/* Freeing the codec context is needed as well,
-	 * see https://libav.org/documentation/doxygen/master/group__lavc__core.html#gaf4daa92361efb3523ef5afeb0b54077f
-	 */
-	avcodec_close(output_ctx.codec_ctx);
-	avcodec_free_context(&(output_ctx.codec_ctx));
+		pthread_join(stage->thread, NULL);
+		if (ret == 0 && stage->ret < 0)
+			ret = stage->ret;
+	}
+
+	/* the disk statistics are final once the writer is done */
+	frame_cache_stop(&pipeline.frame_cache);
+
+	if (reporting)
+	{
+		pthread_mutex_lock(&pipeline.stats_mutex);
+		pipeline.stats_stop = 1;
+		pthread_cond_signal(&pipeline.stats_cond);
+		pthread_mutex_unlock(&pipeline.stats_mutex);
+		pthread_join(report, NULL);
+	}
+
+	elapsed = av_gettime_relative() - start_time;
+	print_pipeline_stats(&pipeline, elapsed);
+	if (pipeline.bench)
+		print_bench_results(&pipeline, elapsed);
+
+	queue_destroy(&pipeline.packets, free_packet);
+	queue_destroy(&pipeline.frames, free_frame);
+	queue_destroy(&pipeline.scaled, free_frame);
+	queue_destroy(&pipeline.images, free_image);
+	encoder_cache_free(&pipeline.encoder_cache);
+	frame_cache_free(&pipeline.frame_cache);
+	scale_cache_free(&pipeline.scale_cache);
+	packet_pool_free(&pipeline.passthrough_pool);
+	i = PIPELINE_RECYCLERS;
+
+cleanup_recyclers:
+	/* i is the number of recyclers set up */
+	while (i-- > 0)
+		recycler_destroy(recyclers[i]);
+	pthread_cond_destroy(&pipeline.stats_cond);
+	pthread_mutex_destroy(&pipeline.stats_mutex);
+	pthread_mutex_destroy(&pipeline.clock_mutex);
+
+cleanup_pack:
+	/* what was packed until now can be played, even after an error */
+	if (pipeline.pack && pack_writer_close(pipeline.pack) < 0 && ret == 0)
+		ret = -EIO;
 
 cleanup_input:
 	avcodec_close(input_ctx.codec_ctx);
 	avcodec_free_context(&(input_ctx.codec_ctx));
 	avformat_close_input(&(input_ctx.format_ctx));
+	capture_source_close(input_ctx.capture);
 
 out:
 	return ret;
@@ -704,6 +6014,115 @@ static int set_signal_handler(void (*signal_handler)(int))
 }
 #endif
 
+static int set_threading_option(struct threading_options *threading,
+								const char *name,
+								const char *value)
+{
+	char *end;
+	long count;
+
+	if (strcmp(name, "decoder_type") == 0)
+	{
+		if (strcmp(value, "frame") == 0)
+			threading->decoder_thread_type = FF_THREAD_FRAME;
+		else if (strcmp(value, "slice") == 0)
+			threading->decoder_thread_type = FF_THREAD_SLICE;
+		else if (strcmp(value, "both") == 0)
+			threading->decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+		else if (strcmp(value, "auto") == 0)
+			threading->decoder_thread_type = 0;
+		else
+			return -EINVAL;
+		return 0;
+	}
+
+	if (strcmp(name, "low_delay") == 0 && strcmp(value, "auto") == 0)
+	{
+		threading->low_delay = -1;
+		return 0;
+	}
+
+	count = strtol(value, &end, 10);
+	if (*end != '\0' || count < 0 || count > 64)
+		return -EINVAL;
+
+	if (strcmp(name, "decoder") == 0)
+		threading->decoder_threads = count;
+	else if (strcmp(name, "scaler") == 0)
+		threading->scaler_threads = count;
+	else if (strcmp(name, "encoder") == 0)
+		threading->encoder_threads = count;
+	else if (strcmp(name, "low_delay") == 0)
+		threading->low_delay = (count != 0);
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_cache_option(struct frame_cache_options *frame_cache,
+							const char *name,
+							const char *value)
+{
+	char *end;
+	long number;
+
+	if (strcmp(name, "dir") == 0)
+	{
+		free(frame_cache->dir);
+		frame_cache->dir = strdup(value);
+		return frame_cache->dir ? 0 : -ENOMEM;
+	}
+
+	/* the sizes are MiB, kept as a size_t of bytes */
+	errno = 0;
+	number = strtol(value, &end, 10);
+	if (*end != '\0' || errno != 0 || number <= 0 ||
+		(unsigned long)number > SIZE_MAX / (1024 * 1024) || number > UINT_MAX)
+		return -EINVAL;
+
+	if (strcmp(name, "size") == 0)
+		frame_cache->size = number;
+	else if (strcmp(name, "disk") == 0)
+		frame_cache->disk_size = number;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_bench_option(struct bench_options *bench,
+							const char *name,
+							const char *value)
+{
+	char *end;
+	double number;
+
+	if (strcmp(name, "model") == 0)
+	{
+		free(bench->model);
+		bench->model = strdup(value);
+		return bench->model ? 0 : -ENOMEM;
+	}
+
+	number = strtod(value, &end);
+	if (*end != '\0' || number < 0)
+		return -EINVAL;
+
+	if (strcmp(name, "bandwidth") == 0)
+		bench->rate = number * 1000000;
+	else if (strcmp(name, "frames") == 0)
+		bench->frames = number;
+	else if (strcmp(name, "seconds") == 0)
+		bench->seconds = number;
+	else if (strcmp(name, "fps") == 0)
+		bench->fps = number;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
 static void usage(char *name)
 {
 	printf("usage: %s [OPTIONS]\n\n", name);
@@ -713,12 +6132,39 @@ static void usage(char *name)
 	printf("\t-D \t\t\tdump the last frame to a file (only active in DEBUG mode)\n");
 #endif
 	printf("\t-f <input format>\tthe input device format\n");
+#ifdef HAVE_XCB_CAPTURE
+	printf("\t\t\t\t(xshm captures the X screen natively, updating only\n");
+	printf("\t\t\t\twhat changed, framerate=N sets the maximum rate;\n");
+	printf("\t\t\t\txwindow does the same for the window whose id is\n");
+	printf("\t\t\t\tthe input path, scaled to video_size by the X server)\n");
+#endif
+#ifdef HAVE_LINUX_FB
+	printf("\t\t\t\t(fbdev maps the framebuffer and only copies the rows\n");
+	printf("\t\t\t\twhich changed, framerate=N sets how often it looks)\n");
+#endif
 	printf("\t-i <input path>\t\tthe input path\n");
 	printf("\t-o <options>\t\ta comma separated list of input format options\n");
 	printf("\t\t\t\tEXAMPLE:\n");
 	printf("\t\t\t\t\t-o draw_mouse=1,framerate=100,video_size=800x480\n");
 	printf("\t-s <scaling method>\tthe rescaling method (see swscale.h)\n");
+	printf("\t-t <options>\t\ta comma separated list of threading options,\n");
+	printf("\t\t\t\ta count of 0 means one thread per CPU:\n");
+	printf("\t\t\t\t\tdecoder=<count> (default 0)\n");
+	printf("\t\t\t\t\tdecoder_type=frame|slice|both|auto (default auto)\n");
+	printf("\t\t\t\t\tlow_delay=0|1|auto (default auto, on for live inputs)\n");
+	printf("\t\t\t\t\tscaler=<count> (default 0)\n");
+	printf("\t\t\t\t\tencoder=<count> (default 1)\n");
 	printf("\t-u \t\t\tupscale the image if smaller than the display dimensions\n");
+	printf("\t-T \t\t\talways transcode, even MJPEG input the device can show as it is\n");
+	printf("\t-S \t\t\tstrip APPn and COM markers from MJPEG input sent as it is\n");
+	printf("\t-A \t\t\tsend the frames as fast as possible, ignoring their timestamps\n");
+	printf("\t-Q, --fast-start\tshow the first frame as soon as possible: trust the\n");
+	printf("\t\t\t\tcached device info, probe less of the input and\n");
+	printf("\t\t\t\tonly when its header is not enough, do not dump it\n");
+	printf("\t-P, --startup-report\tprint how long each startup phase took, up to\n");
+	printf("\t\t\t\tthe first frame on the wire\n");
+	printf("\t-N \t\t\tscale NV12 images to the native size with libam7xxx,\n");
+	printf("\t\t\t\tadding black bars to preserve the aspect ratio\n");
 	printf("\t-F <format>\t\tthe image format to use (default is JPEG)\n");
 	printf("\t\t\t\tSUPPORTED FORMATS:\n");
 	printf("\t\t\t\t\t1 - JPEG\n");
@@ -731,10 +6177,43 @@ static void usage(char *name)
 	printf("\t\t\t\t         the slave connector to be plugged in.\n");
 	printf("\t-z <zoom mode>\t\tthe display zoom mode, between %d (original) and %d (tele)\n",
 		   AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TELE);
+	printf("\t-I <seconds>\t\tprint the frame rate and the latencies of each stage\n");
+	printf("\t\t\t\tperiodically\n");
+	printf("\t-J <file>\t\talso write them as JSON lines to a file or FIFO,\n");
+	printf("\t\t\t\tevery second unless -I says otherwise\n");
+	printf("\t-C <options>\t\tkeep the JPEG images made, to send them again when\n");
+	printf("\t\t\t\tthe same frame comes back, with a comma separated\n");
+	printf("\t\t\t\tlist of options:\n");
+	printf("\t\t\t\t\tsize=<MiB> (default 0, no cache)\n");
+	printf("\t\t\t\t\tdir=<path> (store the images there too)\n");
+	printf("\t\t\t\t\tdisk=<MiB> (default 256, for the images in dir)\n");
+	printf("\t-R <file>\t\trecord the images sent to a capture file, which\n");
+	printf("\t\t\t\tam7xxx-replay can send again\n");
+	printf("\t-K <file>\t\tmake the images once and store them in a pack for\n");
+	printf("\t\t\t\tthe simulated device of -B, play it with -f pack\n");
+	printf("\t\t\t\tand -o loop=<count> (default 1, 0 loops for ever)\n");
+	printf("\t-B, --bench[=<options>]\tsend the images as fast as possible to a simulated\n");
+	printf("\t\t\t\tdevice, with a comma separated list of options:\n");
+	printf("\t\t\t\t\tmodel=<name> (default the first supported one)\n");
+	printf("\t\t\t\t\tbandwidth=<MB/s> (default 0, no limit)\n");
+	printf("\t\t\t\t\tframes=<count> (default 0, the whole input)\n");
+	printf("\t\t\t\t\tseconds=<count> (default 0, the whole input)\n");
+	printf("\t\t\t\t\tfps=<rate> (tell if this frame rate is sustained)\n");
+	printf("\t-W, --resident[=<model>] keep running with no device: make the images\n");
+	printf("\t\t\t\tfor the model (default the first supported one),\n");
+	printf("\t\t\t\tshow them on any device plugged in, and wait for\n");
+	printf("\t\t\t\tit again when it is unplugged\n");
 	printf("\t-h \t\t\tthis help message\n");
 	printf("\n\nEXAMPLES OF USE:\n");
 	printf("\t%s -f x11grab -i :0.0 -o video_size=800x480\n", name);
+#ifdef HAVE_XCB_CAPTURE
+	printf("\t%s -f xshm -i :0 -o framerate=30\n", name);
+	printf("\t%s -f xwindow -i :0/0x3a00007\n", name);
+#endif
 	printf("\t%s -f fbdev -i /dev/fb0\n", name);
+	printf("\t%s -i input.mkv --bench=model=C110,bandwidth=20,seconds=30,fps=30\n", name);
+	printf("\t%s -i input.mkv -K input.pack -B model=C110 && %s -f pack -i input.pack -o loop=0\n", name, name);
+	printf("\t%s -f x11grab -i :0 --resident=C110\n", name);
 	printf("\t%s -f video4linux2 -i /dev/video0 -o video_size=320x240,frame_rate=100 -u -q 90\n", name);
 	printf("\t%s -i http://download.blender.org/peach/bigbuckbunny_movies/BigBuckBunny_640x360.m4v\n", name);
 }
@@ -759,9 +6238,60 @@ int main(int argc, char *argv[])
 	int format = AM7XXX_IMAGE_FORMAT_JPEG;
 	am7xxx_context *ctx;
 	am7xxx_device *dev;
+	am7xxx_device_profile profile;
+	am7xxx_device_profile *device_profile = NULL;
+	am7xxx_device_info device_info;
+	int native_scale = 0;
+	int transcode = 0;
+	int no_pacing = 0;
+	int fast_start = 0;
+	int strip_markers = 0;
 	int dump_frame = 0;
+	char *record_path = NULL;
+	char *pack_path = NULL;
+	AVDictionaryEntry *loop;
+	int loops = 1;
+	struct stats_options stats = {
+		.interval = 0,
+		.summary = 0,
+		.json_path = NULL,
+	};
+	struct frame_cache_options frame_cache = {
+		.size = 0,
+		.dir = NULL,
+		.disk_size = 256,
+	};
+	struct bench_options bench = {
+		.enabled = 0,
+		.model = NULL,
+		.rate = 0,
+		.frames = 0,
+		.seconds = 0,
+		.fps = 0,
+	};
+	struct resident_options resident = {
+		.enabled = 0,
+		.model = NULL,
+	};
+	static const struct option long_options[] = {
+		{ "bench", optional_argument, NULL, 'B' },
+		{ "resident", optional_argument, NULL, 'W' },
+		{ "fast-start", no_argument, NULL, 'Q' },
+		{ "startup-report", no_argument, NULL, 'P' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct threading_options threading = {
+		.decoder_threads = 0,
+		.decoder_thread_type = 0,
+		.low_delay = -1,
+		.scaler_threads = 0,
+		.encoder_threads = 1,
+	};
 
-	while ((opt = getopt(argc, argv, "d:Df:i:o:s:uF:q:l:p:z:h")) != -1)
+	startup.start = av_gettime_relative();
+
+	while ((opt = getopt_long(argc, argv, "d:Df:i:o:s:t:uTSANQPF:q:l:p:z:I:J:C:B:R:K:W::h",
+							  long_options, NULL)) != -1)
 	{
 		switch (opt)
 		{
@@ -832,9 +6362,53 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 't':
+#ifdef HAVE_STRTOK_R
+			/*
+			 * parse suboptions, the expected format is something
+			 * like:
+			 *   decoder=4,decoder_type=slice,scaler=2
+			 */
+			subopts = subopts_saved = strdup(optarg);
+			while ((subopt = strtok_r(subopts, ",", &subopts)))
+			{
+				char *subopt_name = strtok_r(subopt, "=", &subopt);
+				char *subopt_value = strtok_r(NULL, "", &subopt);
+				if (subopt_value == NULL ||
+					set_threading_option(&threading, subopt_name, subopt_value) < 0)
+				{
+					fprintf(stderr, "invalid threading option: %s\n", subopt_name);
+					free(subopts_saved);
+					ret = -EINVAL;
+					goto out;
+				}
+			}
+			free(subopts_saved);
+#else
+			fprintf(stderr, "Option '-t' not implemented\n");
+#endif
+			break;
 		case 'u':
 			upscale = 1;
 			break;
+		case 'T':
+			transcode = 1;
+			break;
+		case 'S':
+			strip_markers = 1;
+			break;
+		case 'A':
+			no_pacing = 1;
+			break;
+		case 'Q':
+			fast_start = 1;
+			break;
+		case 'P':
+			startup.enabled = 1;
+			break;
+		case 'N':
+			native_scale = 1;
+			break;
 		case 'F':
 			format = atoi(optarg);
 			switch (format)
@@ -904,6 +6478,90 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'I':
+			stats.interval = atoi(optarg);
+			if (stats.interval < 1)
+			{
+				fprintf(stderr, "Invalid statistics interval, must be at least 1 second\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			stats.summary = 1;
+			break;
+		case 'J':
+			stats.json_path = optarg;
+			break;
+		case 'C':
+#ifdef HAVE_STRTOK_R
+			/*
+			 * parse suboptions, the expected format is something
+			 * like:
+			 *   size=64,dir=/var/cache/am7xxx-play
+			 */
+			subopts = subopts_saved = strdup(optarg);
+			while ((subopt = strtok_r(subopts, ",", &subopts)))
+			{
+				char *subopt_name = strtok_r(subopt, "=", &subopt);
+				char *subopt_value = strtok_r(NULL, "", &subopt);
+				if (subopt_value == NULL ||
+					set_cache_option(&frame_cache, subopt_name, subopt_value) < 0)
+				{
+					fprintf(stderr, "invalid cache option: %s\n", subopt_name);
+					free(subopts_saved);
+					ret = -EINVAL;
+					goto out;
+				}
+			}
+			free(subopts_saved);
+#else
+			fprintf(stderr, "Option '-C' not implemented\n");
+#endif
+			break;
+		case 'B':
+			bench.enabled = 1;
+			if (optarg == NULL)
+				break;
+#ifdef HAVE_STRTOK_R
+			/*
+			 * parse suboptions, the expected format is something
+			 * like:
+			 *   model=PicoPix 2055,bandwidth=20,frames=1000
+			 */
+			subopts = subopts_saved = strdup(optarg);
+			while ((subopt = strtok_r(subopts, ",", &subopts)))
+			{
+				char *subopt_name = strtok_r(subopt, "=", &subopt);
+				char *subopt_value = strtok_r(NULL, "", &subopt);
+				if (subopt_value == NULL ||
+					set_bench_option(&bench, subopt_name, subopt_value) < 0)
+				{
+					fprintf(stderr, "invalid benchmark option: %s\n", subopt_name);
+					free(subopts_saved);
+					ret = -EINVAL;
+					goto out;
+				}
+			}
+			free(subopts_saved);
+#else
+			fprintf(stderr, "Option '-B' only runs the benchmark with the default options\n");
+#endif
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'K':
+			/* packing needs no device, nor waiting for the images */
+			pack_path = optarg;
+			bench.enabled = 1;
+			break;
+		case 'W':
+			resident.enabled = 1;
+			if (optarg)
+			{
+				free(resident.model);
+				resident.model = strdup(optarg);
+			}
+			break;
 		case 'h':
 			usage(argv[0]);
 			ret = 0;
@@ -923,6 +6581,25 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* the device is the one thing which comes and goes in resident mode */
+	if (resident.enabled &&
+		(bench.enabled || record_path ||
+		 (input_format_string && strcmp(input_format_string, "pack") == 0)))
+	{
+		fprintf(stderr, "The --resident option cannot be used with -B, -K, -R or -f pack\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (stats.json_path)
+	{
+		if (stats.interval == 0)
+			stats.interval = 1;
+
+		/* a FIFO reader going away must not stop the playback */
+		signal(SIGPIPE, SIG_IGN);
+	}
+
 	/*
 	 * When the input format is 'x11grab' set some useful fallback options
 	 * if not supplied by the user, in particular grab full screen
@@ -952,20 +6629,81 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	ret = am7xxx_init(&ctx);
+	/* the bus is scanned only if a real device is opened */
+	ret = am7xxx_init_lazy(&ctx);
 	if (ret < 0)
 	{
-		perror("am7xxx_init");
+		perror("am7xxx_init_lazy");
 		goto out;
 	}
 
 	am7xxx_set_log_level(ctx, log_level);
+	startup_mark("library initialized");
 
-	ret = am7xxx_open_device(ctx, &dev, device_index);
-	if (ret < 0)
+	if (bench.enabled)
 	{
-		perror("am7xxx_open_device");
-		goto cleanup;
+		/* the images are sent as soon as they are ready */
+		no_pacing = 1;
+
+		ret = am7xxx_open_simulated_device(ctx, &dev, bench.model, bench.rate);
+		if (ret < 0)
+		{
+			perror("am7xxx_open_simulated_device");
+			goto cleanup;
+		}
+	}
+	else if (resident.enabled)
+	{
+		/* the pipeline is set up for the model before any device is there */
+		ret = am7xxx_open_simulated_device(ctx, &dev, resident.model, 0);
+		if (ret < 0)
+		{
+			perror("am7xxx_open_simulated_device");
+			goto cleanup;
+		}
+		resident.ctx = ctx;
+		resident.power_mode = power_mode;
+		resident.zoom = zoom;
+		fprintf(stdout, "Resident mode, waiting for a device\n");
+	}
+	else
+	{
+		if (fast_start)
+			ret = am7xxx_open_device_cached(ctx, &dev, device_index, NULL);
+		else
+			ret = am7xxx_open_device(ctx, &dev, device_index);
+		if (ret < 0)
+		{
+			perror("am7xxx_open_device");
+			goto cleanup;
+		}
+		startup_mark("device opened");
+
+		ret = am7xxx_get_device_profile(dev, NULL, &profile);
+		if (ret == 0)
+		{
+			fprintf(stdout, "Device profile: %.2f MB/s, frame delay %u us, max fps NV12 %.2f, max fps JPEG %.2f\n",
+					profile.bulk_throughput / 1000000.0,
+					profile.frame_delay_us,
+					profile.max_fps_nv12,
+					profile.max_fps_jpeg);
+			device_profile = &profile;
+		}
+		else
+		{
+			fprintf(stdout, "No profile for device %04x:%04x:%04x, it can be measured with am7xxx-probe\n",
+					profile.vendor_id, profile.product_id, profile.firmware_version);
+		}
+	}
+
+	if (record_path)
+	{
+		ret = am7xxx_start_recording(dev, record_path);
+		if (ret < 0)
+		{
+			fprintf(stderr, "cannot record to %s\n", record_path);
+			goto cleanup;
+		}
 	}
 
 	ret = am7xxx_set_zoom_mode(dev, zoom);
@@ -981,11 +6719,39 @@ int main(int argc, char *argv[])
 		perror("am7xxx_set_power_mode");
 		goto cleanup;
 	}
+	startup_mark("device set up");
 
 	/* When setting AM7XXX_ZOOM_TEST don't display the actual image */
 	if (zoom == AM7XXX_ZOOM_TEST)
 		goto cleanup;
 
+	/*
+	 * When the input format is 'xwindow' let the X server scale the
+	 * window down to the device native size, if not told otherwise
+	 */
+	if (input_format_string && strcmp(input_format_string, "xwindow") == 0 &&
+		!av_dict_get(options, "video_size", NULL, 0) &&
+		am7xxx_get_device_info(dev, &device_info) == 0)
+	{
+		char video_size[32];
+
+		snprintf(video_size, sizeof(video_size), "%ux%u",
+				 device_info.native_width, device_info.native_height);
+		av_dict_set(&options, "video_size", video_size, 0);
+	}
+
+	if (input_format_string && strcmp(input_format_string, "pack") == 0)
+	{
+		loop = av_dict_get(options, "loop", NULL, 0);
+		if (loop)
+			loops = atoi(loop->value);
+
+		ret = play_pack(dev, input_path, loops, no_pacing);
+		if (ret < 0)
+			fprintf(stderr, "cannot play the pack\n");
+		goto cleanup;
+	}
+
 	ret = am7xxx_play(input_format_string,
 					  &options,
 					  input_path,
@@ -994,6 +6760,18 @@ int main(int argc, char *argv[])
 					  quality,
 					  format,
 					  dev,
+					  device_profile,
+					  native_scale,
+					  transcode,
+					  strip_markers,
+					  no_pacing,
+					  fast_start,
+					  &threading,
+					  &stats,
+					  &frame_cache,
+					  &bench,
+					  &resident,
+					  pack_path,
 					  dump_frame);
 	if (ret < 0)
 	{
@@ -1002,9 +6780,14 @@ int main(int argc, char *argv[])
 	}
 
 cleanup:
+	/* when no image was sent, how far the startup went */
+	print_startup_report();
 	am7xxx_shutdown(ctx);
 out:
 	av_dict_free(&options);
+	free(bench.model);
+	free(resident.model);
+	free(frame_cache.dir);
 	free(input_path);
 	free(input_format_string);
 	return ret;
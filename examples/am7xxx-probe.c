@@ -0,0 +1,572 @@
+/* am7xxx-probe - measure the capabilities of an am7xxx device
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-probe.c
+ * am7xxx-probe measures the sustainable bulk throughput, the max frame rate
+ * per image format and the per-frame processing delay of a device, and
+ * saves the results as a device profile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <am7xxx.h>
+
+/* The number of frames sent for each size when measuring the frame delay */
+#define DELAY_SAMPLES 8
+
+/* The number of different frame sizes used when measuring the frame delay */
+#define DELAY_STEPS 4
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Fill an NV12 buffer with vertical bars, so the probe is visible */
+static void fill_nv12_pattern(uint8_t *image, unsigned int width, unsigned int height)
+{
+	static const uint8_t bars[][3] = {
+		/* Y, U, V */
+		{235, 128, 128},
+		{210, 16, 146},
+		{170, 166, 16},
+		{145, 54, 34},
+		{106, 202, 222},
+		{81, 90, 240},
+		{41, 240, 110},
+		{16, 128, 128},
+	};
+	unsigned int num_bars = sizeof(bars) / sizeof(bars[0]);
+	uint8_t *uv = image + width * height;
+	unsigned int x;
+	unsigned int y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			image[y * width + x] = bars[x * num_bars / width][0];
+
+	for (y = 0; y < height / 2; y++)
+		for (x = 0; x < width; x += 2)
+		{
+			uv[y * width + x] = bars[x * num_bars / width][1];
+			uv[y * width + x + 1] = bars[x * num_bars / width][2];
+		}
+}
+
+/*
+ * Get the dimensions of a JPEG image from its Start Of Frame marker.
+ *
+ * Only the markers are walked, the image data is not decoded.
+ */
+static int jpeg_get_dimensions(const uint8_t *jpeg, unsigned int size,
+							   unsigned int *width, unsigned int *height)
+{
+	unsigned int i = 2;
+
+	if (size < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+		return -EINVAL;
+
+	while (i + 9 < size)
+	{
+		uint8_t marker;
+		unsigned int length;
+
+		if (jpeg[i] != 0xff)
+			return -EINVAL;
+
+		marker = jpeg[i + 1];
+		length = (jpeg[i + 2] << 8) | jpeg[i + 3];
+
+		/* SOF0 to SOF15, excluding DHT, JPG and DAC */
+		if (marker >= 0xc0 && marker <= 0xcf &&
+			marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+		{
+			*height = (jpeg[i + 5] << 8) | jpeg[i + 6];
+			*width = (jpeg[i + 7] << 8) | jpeg[i + 8];
+			return 0;
+		}
+
+		/* Start Of Scan, no SOF found before the image data */
+		if (marker == 0xda)
+			break;
+
+		i += 2 + length;
+	}
+
+	return -EINVAL;
+}
+
+static int load_file(const char *filename, uint8_t **data, unsigned int *size)
+{
+	FILE *fp;
+	long file_size;
+	int ret;
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+	{
+		perror("fopen");
+		return -EINVAL;
+	}
+
+	ret = fseek(fp, 0, SEEK_END);
+	if (ret < 0)
+	{
+		perror("fseek");
+		goto out_close;
+	}
+
+	file_size = ftell(fp);
+	if (file_size <= 0)
+	{
+		fprintf(stderr, "Invalid file size\n");
+		ret = -EINVAL;
+		goto out_close;
+	}
+	rewind(fp);
+
+	*data = malloc(file_size);
+	if (*data == NULL)
+	{
+		perror("malloc");
+		ret = -ENOMEM;
+		goto out_close;
+	}
+
+	if (fread(*data, file_size, 1, fp) != 1)
+	{
+		fprintf(stderr, "Cannot read %s\n", filename);
+		free(*data);
+		*data = NULL;
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	*size = (unsigned int)file_size;
+	ret = 0;
+
+out_close:
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Estimate the per-frame processing delay of the firmware and the bulk
+ * throughput.
+ *
+ * Frames of increasing size are sent synchronously and the transfer time is
+ * modeled as: time = delay + size / throughput
+ *
+ * The best time for each size is used, and the delay is the intercept of the
+ * least squares line fitted on the (size, time) points; the throughput is
+ * the inverse of its slope, so it is the one of the bulk transfers alone.
+ */
+static int measure_frame_delay(am7xxx_device *dev,
+							   unsigned int width,
+							   unsigned int height,
+							   uint8_t *image,
+							   unsigned int *frame_delay_us,
+							   unsigned int *bulk_throughput)
+{
+	double sizes[DELAY_STEPS];
+	double times[DELAY_STEPS];
+	double mean_size = 0;
+	double mean_time = 0;
+	double covariance = 0;
+	double variance = 0;
+	double intercept;
+	double slope;
+	unsigned int i;
+	unsigned int j;
+	int ret;
+
+	for (i = 0; i < DELAY_STEPS; i++)
+	{
+		/* NV12 needs even dimensions */
+		unsigned int step_height = (height * (i + 1) / DELAY_STEPS) & ~1U;
+		unsigned int step_size = width * step_height * 3 / 2;
+		uint64_t best = UINT64_MAX;
+
+		for (j = 0; j < DELAY_SAMPLES; j++)
+		{
+			uint64_t start = get_time_us();
+			uint64_t elapsed;
+
+			ret = am7xxx_send_image(dev, AM7XXX_IMAGE_FORMAT_NV12,
+									width, step_height,
+									image, step_size);
+			if (ret < 0)
+			{
+				perror("am7xxx_send_image");
+				return ret;
+			}
+
+			elapsed = get_time_us() - start;
+			if (elapsed < best)
+				best = elapsed;
+		}
+
+		sizes[i] = step_size;
+		times[i] = (double)best;
+		mean_size += sizes[i] / DELAY_STEPS;
+		mean_time += times[i] / DELAY_STEPS;
+	}
+
+	for (i = 0; i < DELAY_STEPS; i++)
+	{
+		covariance += (sizes[i] - mean_size) * (times[i] - mean_time);
+		variance += (sizes[i] - mean_size) * (sizes[i] - mean_size);
+	}
+
+	slope = covariance / variance;
+	intercept = mean_time - slope * mean_size;
+	*frame_delay_us = intercept > 0 ? (unsigned int)intercept : 0;
+
+	/* microseconds per byte, too noisy to tell when not positive */
+	if (slope > 0)
+	{
+		*bulk_throughput = (unsigned int)(1000000.0 / slope);
+	}
+	else
+	{
+		fprintf(stderr, "WARNING: the transfer times do not grow with the size, bulk throughput not measured\n");
+		*bulk_throughput = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Measure the sustained frame rate of back to back asynchronous transfers.
+ *
+ * am7xxx_send_image_async() waits for the previous transfer before
+ * submitting a new one, so after N submissions N - 1 frames have been
+ * transferred in the interval between the first and the last submission.
+ */
+static int measure_frame_rate(am7xxx_device *dev,
+							  am7xxx_image_format format,
+							  unsigned int width,
+							  unsigned int height,
+							  uint8_t *image,
+							  unsigned int image_size,
+							  unsigned int seconds,
+							  float *fps)
+{
+	uint64_t start;
+	uint64_t now;
+	unsigned int frames;
+	int ret;
+
+	ret = am7xxx_send_image_async(dev, format, width, height, image, image_size);
+	if (ret < 0)
+	{
+		perror("am7xxx_send_image_async");
+		return ret;
+	}
+
+	start = get_time_us();
+	frames = 0;
+	do
+	{
+		ret = am7xxx_send_image_async(dev, format, width, height, image, image_size);
+		if (ret < 0)
+		{
+			perror("am7xxx_send_image_async");
+			return ret;
+		}
+		frames++;
+		now = get_time_us();
+	} while (now - start < seconds * 1000000ULL);
+
+	*fps = (float)(frames * 1000000.0 / (now - start));
+
+	return 0;
+}
+
+static void print_profile(const am7xxx_device_profile *profile)
+{
+	printf("Device profile for %04x:%04x:%04x\n",
+		   profile->vendor_id, profile->product_id, profile->firmware_version);
+	printf("\tbulk throughput: %.2f MB/s\n", profile->bulk_throughput / 1000000.0);
+	printf("\tframe delay:     %u us\n", profile->frame_delay_us);
+	printf("\tmax fps NV12:    %.2f\n", profile->max_fps_nv12);
+	if (profile->jpeg_frame_size > 0)
+		printf("\tmax fps JPEG:    %.2f (%u bytes frames)\n",
+			   profile->max_fps_jpeg, profile->jpeg_frame_size);
+	else
+		printf("\tmax fps JPEG:    not measured\n");
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-j <filename>\t\ta JPEG image at native size, to measure the JPEG frame rate\n");
+	printf("\t-t <seconds>\t\tthe duration of each frame rate measurement (default is 3)\n");
+	printf("\t-P <path>\t\tthe profiles file (default is $HOME/.config/libam7xxx/profiles)\n");
+	printf("\t-n \t\t\tdo not save the profile, only print it\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+		   AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLE OF USE:\n");
+	printf("\t%s -j image_800x480.jpg -t 5\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *jpeg_filename = NULL;
+	char *profiles_path = NULL;
+	unsigned int seconds = 3;
+	int dry_run = 0;
+	int log_level = AM7XXX_LOG_ERROR;
+	int device_index = 0;
+	int power_mode = AM7XXX_POWER_LOW;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	am7xxx_device_info device_info;
+	am7xxx_device_profile profile;
+	uint8_t *nv12_image = NULL;
+	unsigned int nv12_size;
+	uint8_t *jpeg_image = NULL;
+	unsigned int jpeg_size = 0;
+	unsigned int jpeg_width = 0;
+	unsigned int jpeg_height = 0;
+	float fps;
+
+	while ((opt = getopt(argc, argv, "d:j:t:P:nl:p:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			device_index = atoi(optarg);
+			if (device_index < 0)
+			{
+				fprintf(stderr, "Unsupported device index\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'j':
+			free(jpeg_filename);
+			jpeg_filename = strdup(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			if (seconds < 1)
+			{
+				fprintf(stderr, "Invalid duration, must be at least 1 second\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'P':
+			free(profiles_path);
+			profiles_path = strdup(optarg);
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE)
+			{
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			switch (power_mode)
+			{
+			case AM7XXX_POWER_OFF:
+			case AM7XXX_POWER_LOW:
+			case AM7XXX_POWER_MIDDLE:
+			case AM7XXX_POWER_HIGH:
+			case AM7XXX_POWER_TURBO:
+				fprintf(stdout, "Power mode: %d\n", power_mode);
+				break;
+			default:
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+						AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (jpeg_filename)
+	{
+		ret = load_file(jpeg_filename, &jpeg_image, &jpeg_size);
+		if (ret < 0)
+			goto out;
+
+		ret = jpeg_get_dimensions(jpeg_image, jpeg_size, &jpeg_width, &jpeg_height);
+		if (ret < 0)
+		{
+			fprintf(stderr, "%s does not look like a JPEG image\n", jpeg_filename);
+			goto out;
+		}
+	}
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0)
+	{
+		perror("am7xxx_init");
+		goto out;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	ret = am7xxx_open_device(ctx, &dev, device_index);
+	if (ret < 0)
+	{
+		perror("am7xxx_open_device");
+		goto cleanup;
+	}
+
+	ret = am7xxx_get_device_info(dev, &device_info);
+	if (ret < 0)
+	{
+		perror("am7xxx_get_device_info");
+		goto cleanup;
+	}
+	printf("Native resolution: %dx%d\n",
+		   device_info.native_width, device_info.native_height);
+
+	ret = am7xxx_set_zoom_mode(dev, AM7XXX_ZOOM_ORIGINAL);
+	if (ret < 0)
+	{
+		perror("am7xxx_set_zoom_mode");
+		goto cleanup;
+	}
+
+	ret = am7xxx_set_power_mode(dev, power_mode);
+	if (ret < 0)
+	{
+		perror("am7xxx_set_power_mode");
+		goto cleanup;
+	}
+
+	/* Only the key fields are needed from here, the profile may not exist */
+	am7xxx_get_device_profile(dev, profiles_path, &profile);
+
+	/* what is not measured below must not be saved again as new */
+	profile.bulk_throughput = 0;
+	profile.frame_delay_us = 0;
+	profile.max_fps_jpeg = 0;
+	profile.max_fps_nv12 = 0;
+	profile.jpeg_frame_size = 0;
+
+	nv12_size = device_info.native_width * device_info.native_height * 3 / 2;
+	nv12_image = malloc(nv12_size);
+	if (nv12_image == NULL)
+	{
+		perror("malloc");
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+	fill_nv12_pattern(nv12_image, device_info.native_width, device_info.native_height);
+
+	printf("Measuring the frame delay and the bulk throughput...\n");
+	ret = measure_frame_delay(dev,
+							  device_info.native_width,
+							  device_info.native_height,
+							  nv12_image,
+							  &profile.frame_delay_us,
+							  &profile.bulk_throughput);
+	if (ret < 0)
+		goto cleanup;
+
+	printf("Measuring the NV12 frame rate for %u seconds...\n", seconds);
+	ret = measure_frame_rate(dev, AM7XXX_IMAGE_FORMAT_NV12,
+							 device_info.native_width,
+							 device_info.native_height,
+							 nv12_image, nv12_size,
+							 seconds, &fps);
+	if (ret < 0)
+		goto cleanup;
+	profile.max_fps_nv12 = fps;
+
+	if (jpeg_image)
+	{
+		if (jpeg_width != device_info.native_width ||
+			jpeg_height != device_info.native_height)
+			fprintf(stderr,
+					"WARNING: JPEG image is %ux%u, the frame rate at native size may differ\n",
+					jpeg_width, jpeg_height);
+
+		printf("Measuring the JPEG frame rate for %u seconds...\n", seconds);
+		ret = measure_frame_rate(dev, AM7XXX_IMAGE_FORMAT_JPEG,
+								 jpeg_width, jpeg_height,
+								 jpeg_image, jpeg_size,
+								 seconds, &fps);
+		if (ret < 0)
+			goto cleanup;
+		profile.max_fps_jpeg = fps;
+		profile.jpeg_frame_size = jpeg_size;
+	}
+
+	print_profile(&profile);
+
+	if (!dry_run)
+	{
+		ret = am7xxx_save_device_profile(dev, profiles_path, &profile);
+		if (ret < 0)
+		{
+			fprintf(stderr, "Cannot save the device profile\n");
+			goto cleanup;
+		}
+		printf("Profile saved\n");
+	}
+
+	ret = 0;
+
+cleanup:
+	am7xxx_shutdown(ctx);
+out:
+	free(nv12_image);
+	free(jpeg_image);
+	free(profiles_path);
+	free(jpeg_filename);
+	return ret;
+}
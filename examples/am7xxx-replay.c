@@ -0,0 +1,489 @@
+/* am7xxx-replay - send the images of a capture file to an am7xxx device
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxx-replay.c
+ * am7xxx-replay sends the images recorded with am7xxx_start_recording() to
+ * a device, or to a simulated one, with the recorded timing or as fast as
+ * possible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <am7xxx.h>
+
+/* The capture file format, see am7xxx_start_recording() */
+#define CAPTURE_MAGIC "AM7XXXRC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_HEADER_SIZE 16
+#define CAPTURE_MIN_RECORD_HEADER_SIZE 40
+
+/* Where the image header sent on the wire is in a record */
+#define RECORD_WIRE_HEADER_OFFSET 16
+
+/* The packet type of images in the wire header */
+#define PACKET_TYPE_IMAGE 0x02
+
+static volatile sig_atomic_t run = 1;
+
+struct capture
+{
+	uint8_t *data;
+	size_t size;
+	unsigned int record_header_size;
+};
+
+struct record
+{
+	uint64_t timestamp; /* microseconds since the recording started */
+	am7xxx_image_format format;
+	unsigned int width;
+	unsigned int height;
+	uint8_t *image;
+	unsigned int image_size;
+};
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t usecs)
+{
+	struct timespec delay;
+
+	delay.tv_sec = usecs / 1000000;
+	delay.tv_nsec = (usecs % 1000000) * 1000;
+	while (nanosleep(&delay, &delay) == -1 && errno == EINTR && run)
+		;
+}
+
+static uint32_t get_le32(const uint8_t *buffer)
+{
+	return (uint32_t)buffer[0] |
+		(uint32_t)buffer[1] << 8 |
+		(uint32_t)buffer[2] << 16 |
+		(uint32_t)buffer[3] << 24;
+}
+
+static int capture_open(struct capture *capture, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		ret = -errno;
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		ret = -errno;
+		perror("fstat");
+		goto out;
+	}
+
+	if (st.st_size < CAPTURE_FILE_HEADER_SIZE)
+	{
+		fprintf(stderr, "%s is not a capture file\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* the images are sent straight from the mapping */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		ret = -errno;
+		perror("mmap");
+		goto out;
+	}
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	capture->data = data;
+	capture->size = st.st_size;
+	capture->record_header_size = get_le32(capture->data + 12);
+
+	if (memcmp(capture->data, CAPTURE_MAGIC, 8) != 0 ||
+		get_le32(capture->data + 8) != CAPTURE_VERSION ||
+		capture->record_header_size < CAPTURE_MIN_RECORD_HEADER_SIZE)
+	{
+		fprintf(stderr, "%s is not a capture file, or an unsupported version\n", path);
+		munmap(capture->data, capture->size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+static void capture_close(struct capture *capture)
+{
+	munmap(capture->data, capture->size);
+}
+
+/*
+ * Read the record at *offset and move past it.
+ *
+ * Return 1 when a record was read, 0 at the end of the capture, which may
+ * have been cut short by a recording which did not end cleanly, and a
+ * negative value when the record makes no sense.
+ */
+static int capture_next(struct capture *capture, size_t *offset, struct record *record)
+{
+	const uint8_t *wire_header;
+	uint8_t *data;
+	size_t left;
+	uint32_t record_size;
+
+	left = capture->size - *offset;
+	if (left < capture->record_header_size)
+	{
+		if (left > 0)
+			fprintf(stderr, "the capture ends with an incomplete record\n");
+		return 0;
+	}
+
+	data = capture->data + *offset;
+	record_size = get_le32(data);
+	if (record_size > left)
+	{
+		fprintf(stderr, "the capture ends with an incomplete record\n");
+		return 0;
+	}
+
+	wire_header = data + RECORD_WIRE_HEADER_OFFSET;
+	record->timestamp = get_le32(data + 4) | (uint64_t)get_le32(data + 8) << 32;
+	record->image_size = get_le32(data + 12);
+	record->format = get_le32(wire_header + 8);
+	record->width = get_le32(wire_header + 12);
+	record->height = get_le32(wire_header + 16);
+	record->image = data + capture->record_header_size;
+
+	if (record_size < capture->record_header_size ||
+		record->image_size > record_size - capture->record_header_size ||
+		get_le32(wire_header) != PACKET_TYPE_IMAGE)
+	{
+		fprintf(stderr, "invalid record at offset %zu\n", *offset);
+		return -EINVAL;
+	}
+
+	*offset += record_size;
+	return 1;
+}
+
+/* The images are in the mapping of the capture, there is nothing to free */
+static void image_sent(void *user_data, int status)
+{
+	(void)user_data;
+	(void)status;
+}
+
+/*
+ * Send all the images of a capture, at the recorded pace unless
+ * max_rate is set; the images and bytes sent are added to the counters.
+ */
+static int replay(am7xxx_device *dev, struct capture *capture, int max_rate,
+				  unsigned long *frames, uint64_t *bytes)
+{
+	struct record record;
+	size_t offset = CAPTURE_FILE_HEADER_SIZE;
+	uint64_t start_time = 0;
+	uint64_t first_timestamp = 0;
+	uint64_t now;
+	int ret = 0;
+
+	while (run && (ret = capture_next(capture, &offset, &record)) > 0)
+	{
+		if (start_time == 0)
+		{
+			start_time = get_time_us();
+			first_timestamp = record.timestamp;
+		}
+
+		if (!max_rate)
+		{
+			now = get_time_us();
+			if (start_time + (record.timestamp - first_timestamp) > now)
+				sleep_us(start_time + (record.timestamp - first_timestamp) - now);
+		}
+
+		ret = am7xxx_send_image_async_nocopy(dev,
+											 record.format,
+											 record.width,
+											 record.height,
+											 record.image,
+											 record.image_size,
+											 image_sent,
+											 NULL);
+		if (ret < 0)
+		{
+			perror("am7xxx_send_image_async_nocopy");
+			return ret;
+		}
+
+		(*frames)++;
+		*bytes += record.image_size;
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+static void stop_replay(int signo)
+{
+	(void)signo;
+	run = 0;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-i <filename>\t\tthe capture file, as recorded by am7xxx-play -R\n");
+	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-m <model>\t\tsend to a simulated device of this model instead,\n");
+	printf("\t\t\t\tlike C110 or \"PicoPix 2055\"\n");
+	printf("\t-b <MB/s>\t\tthe bandwidth of the simulated device (default no limit)\n");
+	printf("\t-r \t\t\tsend the images as fast as possible, not at the recorded pace\n");
+	printf("\t-n <count>\t\thow many times to send the capture, 0 for ever (default is 1)\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of device, between %d (off) and %d (turbo)\n",
+		   AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLES OF USE:\n");
+	printf("\t%s -i session.am7xxx\n", name);
+	printf("\t%s -i session.am7xxx -m C110 -b 20 -r -n 10\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *capture_filename = NULL;
+	char *model = NULL;
+	double bandwidth = 0;
+	int max_rate = 0;
+	int loops = 1;
+	int loop;
+	int log_level = AM7XXX_LOG_ERROR;
+	int device_index = 0;
+	int power_mode = AM7XXX_POWER_LOW;
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	struct capture capture = { 0 };
+	struct sigaction action;
+	unsigned long frames = 0;
+	unsigned long previous_frames;
+	uint64_t bytes = 0;
+	uint64_t start_time;
+	double seconds;
+
+	while ((opt = getopt(argc, argv, "i:d:m:b:rn:l:p:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			free(capture_filename);
+			capture_filename = strdup(optarg);
+			break;
+		case 'd':
+			device_index = atoi(optarg);
+			if (device_index < 0)
+			{
+				fprintf(stderr, "Unsupported device index\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'm':
+			free(model);
+			model = strdup(optarg);
+			break;
+		case 'b':
+			bandwidth = atof(optarg);
+			if (bandwidth < 0)
+			{
+				fprintf(stderr, "Invalid bandwidth, must not be negative\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'r':
+			max_rate = 1;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			if (loops < 0)
+			{
+				fprintf(stderr, "Invalid count, must not be negative\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE)
+			{
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			switch (power_mode)
+			{
+			case AM7XXX_POWER_OFF:
+			case AM7XXX_POWER_LOW:
+			case AM7XXX_POWER_MIDDLE:
+			case AM7XXX_POWER_HIGH:
+			case AM7XXX_POWER_TURBO:
+				fprintf(stdout, "Power mode: %d\n", power_mode);
+				break;
+			default:
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+						AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (capture_filename == NULL)
+	{
+		fprintf(stderr, "The -i option must always be passed\n\n");
+		usage(argv[0]);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = capture_open(&capture, capture_filename);
+	if (ret < 0)
+		goto out;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_replay;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0)
+	{
+		perror("am7xxx_init");
+		goto cleanup_capture;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	if (model)
+	{
+		ret = am7xxx_open_simulated_device(ctx, &dev, model,
+										   (unsigned long)(bandwidth * 1000000));
+		if (ret < 0)
+		{
+			perror("am7xxx_open_simulated_device");
+			goto cleanup;
+		}
+	}
+	else
+	{
+		ret = am7xxx_open_device(ctx, &dev, device_index);
+		if (ret < 0)
+		{
+			perror("am7xxx_open_device");
+			goto cleanup;
+		}
+	}
+
+	ret = am7xxx_set_zoom_mode(dev, AM7XXX_ZOOM_ORIGINAL);
+	if (ret < 0)
+	{
+		perror("am7xxx_set_zoom_mode");
+		goto cleanup;
+	}
+
+	ret = am7xxx_set_power_mode(dev, power_mode);
+	if (ret < 0)
+	{
+		perror("am7xxx_set_power_mode");
+		goto cleanup;
+	}
+
+	start_time = get_time_us();
+	for (loop = 0; run && (loops == 0 || loop < loops); loop++)
+	{
+		previous_frames = frames;
+		ret = replay(dev, &capture, max_rate, &frames, &bytes);
+		if (ret < 0)
+			break;
+
+		if (frames == previous_frames)
+		{
+			fprintf(stderr, "there are no images in %s\n", capture_filename);
+			break;
+		}
+	}
+	am7xxx_flush_async(dev);
+
+	seconds = (get_time_us() - start_time) / 1000000.0;
+	if (seconds > 0)
+		printf("%lu images in %.2f s: %.2f fps, %.2f MB/s\n",
+			   frames, seconds, frames / seconds, bytes / seconds / 1000000.0);
+
+cleanup:
+	am7xxx_shutdown(ctx);
+cleanup_capture:
+	capture_close(&capture);
+out:
+	free(model);
+	free(capture_filename);
+	return ret;
+}
@@ -0,0 +1,832 @@
+/* am7xxxd - keep am7xxx devices open and send images from shared memory
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @example examples/am7xxxd.c
+ * am7xxxd opens the am7xxx devices once and keeps them configured, clients
+ * write their images to a ring in shared memory and the daemon sends them
+ * from there without copying them; see am7xxxd.h for the protocol.
+ */
+
+#define _GNU_SOURCE /* for memfd_create() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <am7xxx.h>
+
+#include "am7xxxd.h"
+
+#define MAX_DEVICES 8
+
+/* A client has this long to send its request once connected */
+#define REQUEST_TIMEOUT_S 1
+
+static volatile sig_atomic_t run = 1;
+
+/* The share of the USB bus of a device, see am7xxx_set_bus_share() */
+struct bus_share
+{
+	unsigned int weight;
+	double fps;
+};
+
+struct device
+{
+	unsigned int index;
+	am7xxx_device *dev;
+	struct am7xxxd_ring *ring;
+	size_t ring_size;
+	unsigned int slot_count; /* the geometry of the ring, the client */
+	unsigned int slot_size;	 /* can overwrite the one in shared memory */
+	size_t data_offset;
+	int memfd;
+	int publish_fd;	   /* written by the client, see am7xxxd.h */
+	int done_fd;	   /* written by the daemon */
+	int client_fd;	   /* -1 when no client has the device */
+	uint32_t submitted; /* images passed to the library */
+	uint32_t done;		/* tail and errors, as the daemon counts them */
+	uint32_t errors;
+	int stop;
+	pthread_t thread;
+	int started;
+};
+
+static void unset_run(int signo)
+{
+	(void)signo;
+	run = 0;
+}
+
+/* The device is done with an image, its slot can be written again */
+static void image_done(void *user_data, int status)
+{
+	struct device *device = user_data;
+	uint64_t one = 1;
+
+	if (status < 0)
+	{
+		__atomic_add_fetch(&device->errors, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&device->ring->errors, 1, __ATOMIC_SEQ_CST);
+	}
+	__atomic_add_fetch(&device->done, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&device->ring->tail, 1, __ATOMIC_SEQ_CST);
+
+	/* the counter cannot overflow, the client reads it when waiting */
+	if (write(device->done_fd, &one, sizeof(one)) < 0)
+		perror("write");
+}
+
+/* Count images which were not sent, once the ones before are done */
+static void skip_images(struct device *device, uint32_t count)
+{
+	uint64_t value = count;
+
+	am7xxx_flush_async(device->dev);
+
+	device->submitted += count;
+	__atomic_add_fetch(&device->errors, count, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&device->done, count, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&device->ring->errors, count, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&device->ring->tail, count, __ATOMIC_SEQ_CST);
+	if (write(device->done_fd, &value, sizeof(value)) < 0)
+		perror("write");
+}
+
+/*
+ * Send the images published in the ring, in order. The client can write
+ * anything to the shared memory, so only head is read from there and
+ * every slot is checked before sending it; at worst a client garbles its
+ * own images.
+ */
+static void *device_thread(void *arg)
+{
+	struct device *device = arg;
+	struct am7xxxd_ring *ring = device->ring;
+	struct am7xxxd_slot slot;
+	uint32_t index;
+	uint32_t head;
+	uint64_t value;
+	uint8_t *data;
+	int ret;
+
+	while (!__atomic_load_n(&device->stop, __ATOMIC_SEQ_CST))
+	{
+		head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		if (head == device->submitted)
+		{
+			/* give the slots back before waiting for new images */
+			if (__atomic_load_n(&device->done, __ATOMIC_SEQ_CST) != device->submitted)
+			{
+				am7xxx_flush_async(device->dev);
+				continue;
+			}
+
+			if (read(device->publish_fd, &value, sizeof(value)) < 0 && errno != EINTR)
+			{
+				perror("read");
+				break;
+			}
+			continue;
+		}
+
+		if (head - device->submitted > device->slot_count)
+		{
+			fprintf(stderr, "device %u: the client published more images than slots\n",
+					device->index);
+			skip_images(device, head - device->submitted);
+			continue;
+		}
+
+		index = device->submitted % device->slot_count;
+		memcpy(&slot, &ring->slots[index], sizeof(slot));
+		if ((slot.format != AM7XXX_IMAGE_FORMAT_JPEG &&
+			 slot.format != AM7XXX_IMAGE_FORMAT_NV12) ||
+			slot.size == 0 || slot.size > device->slot_size)
+		{
+			skip_images(device, 1);
+			continue;
+		}
+
+		data = (uint8_t *)ring + device->data_offset + (size_t)index * device->slot_size;
+		ret = am7xxx_send_image_async_nocopy(device->dev,
+											 slot.format,
+											 slot.width,
+											 slot.height,
+											 data,
+											 slot.size,
+											 image_done,
+											 device);
+		if (ret < 0)
+		{
+			fprintf(stderr, "device %u: cannot send the image: %s\n",
+					device->index, strerror(-ret));
+			skip_images(device, 1);
+			continue;
+		}
+		device->submitted++;
+	}
+
+	am7xxx_flush_async(device->dev);
+	return NULL;
+}
+
+static int device_ring_init(struct device *device,
+							unsigned int slot_count,
+							unsigned int slot_size)
+{
+	am7xxx_device_info device_info;
+	size_t header_size;
+	int ret;
+
+	ret = am7xxx_get_device_info(device->dev, &device_info);
+	if (ret < 0)
+	{
+		fprintf(stderr, "device %u: cannot get the device info\n", device->index);
+		return ret;
+	}
+
+	/* the image data starts on its own cache line */
+	header_size = sizeof(struct am7xxxd_ring) + slot_count * sizeof(struct am7xxxd_slot);
+	header_size = (header_size + 63) & ~(size_t)63;
+	if ((uint64_t)slot_count * slot_size > SIZE_MAX - header_size)
+	{
+		fprintf(stderr, "device %u: %u slots of %u KiB do not fit in memory\n",
+				device->index, slot_count, slot_size / 1024);
+		return -EOVERFLOW;
+	}
+	device->ring_size = header_size + (size_t)slot_count * slot_size;
+	device->slot_count = slot_count;
+	device->slot_size = slot_size;
+	device->data_offset = header_size;
+
+	device->memfd = memfd_create("am7xxxd-ring", MFD_CLOEXEC);
+	if (device->memfd < 0)
+	{
+		ret = -errno;
+		perror("memfd_create");
+		return ret;
+	}
+
+	if (ftruncate(device->memfd, device->ring_size) < 0)
+	{
+		ret = -errno;
+		perror("ftruncate");
+		return ret;
+	}
+
+	device->ring = mmap(NULL, device->ring_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED, device->memfd, 0);
+	if (device->ring == MAP_FAILED)
+	{
+		ret = -errno;
+		device->ring = NULL;
+		perror("mmap");
+		return ret;
+	}
+
+	device->ring->magic = AM7XXXD_MAGIC;
+	device->ring->version = AM7XXXD_VERSION;
+	device->ring->native_width = device_info.native_width;
+	device->ring->native_height = device_info.native_height;
+	device->ring->slot_count = slot_count;
+	device->ring->slot_size = slot_size;
+	device->ring->data_offset = header_size;
+
+	device->publish_fd = eventfd(0, EFD_CLOEXEC);
+	device->done_fd = eventfd(0, EFD_CLOEXEC);
+	if (device->publish_fd < 0 || device->done_fd < 0)
+	{
+		ret = -errno;
+		perror("eventfd");
+		return ret;
+	}
+
+	ret = pthread_create(&device->thread, NULL, device_thread, device);
+	if (ret != 0)
+	{
+		fprintf(stderr, "device %u: cannot start the thread: %s\n",
+				device->index, strerror(ret));
+		return -ret;
+	}
+	device->started = 1;
+
+	fprintf(stdout, "device %u: %ux%u, %u slots of %u KiB\n",
+			device->index, device_info.native_width, device_info.native_height,
+			slot_count, slot_size / 1024);
+	return 0;
+}
+
+static void device_cleanup(struct device *device)
+{
+	uint64_t one = 1;
+
+	if (device->started)
+	{
+		__atomic_store_n(&device->stop, 1, __ATOMIC_SEQ_CST);
+		if (write(device->publish_fd, &one, sizeof(one)) < 0)
+			perror("write");
+		pthread_join(device->thread, NULL);
+	}
+
+	if (device->client_fd >= 0)
+		close(device->client_fd);
+	if (device->publish_fd >= 0)
+		close(device->publish_fd);
+	if (device->done_fd >= 0)
+		close(device->done_fd);
+	if (device->ring)
+		munmap(device->ring, device->ring_size);
+	if (device->memfd >= 0)
+		close(device->memfd);
+}
+
+static int send_reply(int fd, struct am7xxxd_reply *reply, const int *fds, unsigned int fd_count)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { reply, sizeof(*reply) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd_count)
+	{
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+	}
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*reply))
+		return -errno;
+
+	return 0;
+}
+
+/* Give a device to a new client, if it is free */
+static void accept_client(int listen_fd, struct device *devices, unsigned int device_count)
+{
+	struct am7xxxd_request request;
+	struct am7xxxd_reply reply;
+	struct timeval timeout = { REQUEST_TIMEOUT_S, 0 };
+	struct device *device = NULL;
+	int fds[3];
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+	{
+		if (errno != EINTR && errno != EAGAIN)
+			perror("accept");
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&reply, 0, sizeof(reply));
+	if (recv(fd, &request, sizeof(request), MSG_WAITALL) != (ssize_t)sizeof(request) ||
+		request.magic != AM7XXXD_MAGIC || request.version != AM7XXXD_VERSION)
+	{
+		reply.status = -EPROTO;
+	}
+	else if (request.device_index >= device_count)
+	{
+		reply.status = -ENODEV;
+	}
+	else
+	{
+		device = &devices[request.device_index];
+		if (device->client_fd >= 0)
+			reply.status = -EBUSY;
+	}
+
+	if (reply.status < 0)
+	{
+		send_reply(fd, &reply, NULL, 0);
+		close(fd);
+		return;
+	}
+
+	reply.ring_size = device->ring_size;
+	fds[0] = device->memfd;
+	fds[1] = device->publish_fd;
+	fds[2] = device->done_fd;
+	if (send_reply(fd, &reply, fds, 3) < 0)
+	{
+		close(fd);
+		return;
+	}
+
+	device->client_fd = fd;
+	fprintf(stdout, "device %u: client connected\n", device->index);
+}
+
+static int listen_on(const char *path)
+{
+	union {
+		struct sockaddr sa;
+		struct sockaddr_un un;
+	} addr;
+	int fd;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.un.sun_path))
+	{
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		ret = -errno;
+		perror("socket");
+		return ret;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.un.sun_family = AF_UNIX;
+	strcpy(addr.un.sun_path, path);
+
+	/* a socket left behind by a previous run */
+	unlink(path);
+
+	if (bind(fd, &addr.sa, sizeof(addr.un)) < 0 || listen(fd, MAX_DEVICES) < 0)
+	{
+		ret = -errno;
+		fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static int64_t monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* How the devices sharing a bus are doing, the ones scheduled at least */
+static void print_bus_stats(struct device *devices, unsigned int device_count)
+{
+	am7xxx_bus_stats stats;
+	unsigned int i;
+
+	for (i = 0; i < device_count; i++)
+	{
+		if (am7xxx_get_bus_stats(devices[i].dev, &stats) < 0)
+			continue;
+
+		fprintf(stdout, "device %u: bus %u (%u devices), %.2f fps, %.2f MB/s, %lu images, %.2f ms waiting per image\n",
+				devices[i].index, stats.bus_number, stats.bus_devices,
+				stats.fps, stats.bytes_per_second / 1000000.0, stats.images,
+				stats.images ? stats.wait_usecs / 1000.0 / stats.images : 0.0);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Wait for clients, forgetting the ones which go away; the bus statistics
+ * are printed every report_interval seconds, if it is not 0.
+ */
+static void serve(int listen_fd, struct device *devices, unsigned int device_count,
+				  int report_interval)
+{
+	struct pollfd fds[MAX_DEVICES + 1];
+	struct device *clients[MAX_DEVICES + 1];
+	char buffer[64];
+	unsigned int count;
+	unsigned int i;
+	int64_t next_report = 0;
+	int timeout = -1;
+
+	if (report_interval > 0)
+		next_report = monotonic_ms() + report_interval * 1000;
+
+	while (run)
+	{
+		if (report_interval > 0)
+		{
+			timeout = next_report - monotonic_ms();
+			if (timeout <= 0)
+			{
+				print_bus_stats(devices, device_count);
+				next_report += report_interval * 1000;
+				continue;
+			}
+		}
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		count = 1;
+		for (i = 0; i < device_count; i++)
+		{
+			if (devices[i].client_fd < 0)
+				continue;
+			fds[count].fd = devices[i].client_fd;
+			fds[count].events = POLLIN;
+			clients[count] = &devices[i];
+			count++;
+		}
+
+		if (poll(fds, count, timeout) < 0)
+		{
+			if (errno != EINTR)
+			{
+				perror("poll");
+				break;
+			}
+			continue;
+		}
+
+		/* clients send nothing after the request, so this is the end */
+		for (i = 1; i < count; i++)
+		{
+			if (fds[i].revents == 0 ||
+				recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+				continue;
+
+			close(clients[i]->client_fd);
+			clients[i]->client_fd = -1;
+			fprintf(stdout, "device %u: client gone, %u images done, %u not sent\n",
+					clients[i]->index,
+					__atomic_load_n(&clients[i]->done, __ATOMIC_SEQ_CST),
+					__atomic_load_n(&clients[i]->errors, __ATOMIC_SEQ_CST));
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_client(listen_fd, devices, device_count);
+	}
+}
+
+/* Parse a list like "2,30fps,1", one share per device */
+static int parse_bus_shares(const char *list, struct bus_share *shares)
+{
+	const char *value = list;
+	unsigned int i = 0;
+	char *end;
+	double number;
+
+	while (*value != '\0')
+	{
+		if (i == MAX_DEVICES)
+			return -EINVAL;
+
+		number = strtod(value, &end);
+		if (end == value || number <= 0)
+			return -EINVAL;
+
+		if (strncmp(end, "fps", 3) == 0)
+		{
+			shares[i].weight = 0;
+			shares[i].fps = number;
+			end += 3;
+		}
+		else
+		{
+			shares[i].weight = number;
+			shares[i].fps = 0;
+			if (shares[i].weight == 0)
+				return -EINVAL;
+		}
+		i++;
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -EINVAL;
+		value = end;
+	}
+
+	return 0;
+}
+
+static void usage(char *name)
+{
+	printf("usage: %s [OPTIONS]\n\n", name);
+	printf("OPTIONS:\n");
+	printf("\t-s <socket>\t\tthe path of the socket (default is %s)\n", AM7XXXD_SOCKET_PATH);
+	printf("\t-n <count>\t\tthe number of image slots of each device (default is 4)\n");
+	printf("\t-b <KiB>\t\tthe maximum size of an image (default is 1024)\n");
+	printf("\t-m <model>\t\tuse a simulated device of this model instead,\n");
+	printf("\t\t\t\tlike C110 or \"PicoPix 2055\"\n");
+	printf("\t-B <MB/s>\t\tthe bandwidth of the simulated device (default no limit)\n");
+	printf("\t-l <log level>\t\tthe verbosity level of libam7xxx output (0-5)\n");
+	printf("\t-p <power mode>\t\tthe power mode of the devices, between %d (off) and %d (turbo)\n",
+		   AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+	printf("\t\t\t\tWARNING: Level 2 and greater require the master AND\n");
+	printf("\t\t\t\t         the slave connector to be plugged in.\n");
+	printf("\t-z <zoom mode>\t\tthe display zoom mode, between %d (original) and %d (tele)\n",
+		   AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TELE);
+	printf("\t-w <shares>\t\tshare the bandwidth of each USB bus among the devices\n");
+	printf("\t\t\t\ton it, a comma separated list with the share of\n");
+	printf("\t\t\t\teach device: a weight, or a frame rate like 30fps\n");
+	printf("\t\t\t\t(default 1 for the devices not listed)\n");
+	printf("\t-I <seconds>\t\tprint the frame rate each scheduled device gets\n");
+	printf("\t\t\t\tperiodically\n");
+	printf("\t-h \t\t\tthis help message\n");
+	printf("\n\nEXAMPLES OF USE:\n");
+	printf("\t%s -p 2\n", name);
+	printf("\t%s -w 2,1,1 -I 5\n", name);
+	printf("\t%s -w 30fps,15fps\n", name);
+	printf("\tpicoproj -x %s -f image.jpg\n", AM7XXXD_SOCKET_PATH);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	int opt;
+	char *socket_path = NULL;
+	char *model = NULL;
+	double bandwidth = 0;
+	int slot_count = 4;
+	int slot_size_kib = 1024;
+	int log_level = AM7XXX_LOG_ERROR;
+	int power_mode = AM7XXX_POWER_LOW;
+	int zoom = AM7XXX_ZOOM_ORIGINAL;
+	struct bus_share shares[MAX_DEVICES];
+	int scheduled = 0;
+	int report_interval = 0;
+	am7xxx_context *ctx;
+	struct device devices[MAX_DEVICES];
+	unsigned int device_count = 0;
+	struct sigaction action;
+	int listen_fd = -1;
+	unsigned int i;
+
+	for (i = 0; i < MAX_DEVICES; i++)
+	{
+		shares[i].weight = 1;
+		shares[i].fps = 0;
+	}
+
+	while ((opt = getopt(argc, argv, "s:n:b:m:B:l:p:z:w:I:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			free(socket_path);
+			socket_path = strdup(optarg);
+			break;
+		case 'n':
+			slot_count = atoi(optarg);
+			if (slot_count < 2 || slot_count > 64)
+			{
+				fprintf(stderr, "The slot count must be between 2 and 64\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'b':
+			slot_size_kib = atoi(optarg);
+			if (slot_size_kib <= 0 || slot_size_kib > 64 * 1024)
+			{
+				fprintf(stderr, "Unsupported image size\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'm':
+			free(model);
+			model = strdup(optarg);
+			break;
+		case 'B':
+			bandwidth = atof(optarg);
+			if (bandwidth < 0)
+			{
+				fprintf(stderr, "Unsupported bandwidth\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'l':
+			log_level = atoi(optarg);
+			if (log_level < AM7XXX_LOG_FATAL || log_level > AM7XXX_LOG_TRACE)
+			{
+				fprintf(stderr, "Unsupported log level, falling back to AM7XXX_LOG_ERROR\n");
+				log_level = AM7XXX_LOG_ERROR;
+			}
+			break;
+		case 'p':
+			power_mode = atoi(optarg);
+			if (power_mode < AM7XXX_POWER_OFF || power_mode > AM7XXX_POWER_TURBO)
+			{
+				fprintf(stderr, "Invalid power mode value, must be between %d and %d\n",
+						AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'z':
+			zoom = atoi(optarg);
+			if (zoom < AM7XXX_ZOOM_ORIGINAL || zoom > AM7XXX_ZOOM_TELE)
+			{
+				fprintf(stderr, "Invalid zoom mode value, must be between %d and %d\n",
+						AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TELE);
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'w':
+			if (parse_bus_shares(optarg, shares) < 0)
+			{
+				fprintf(stderr, "Invalid bus shares: %s\n", optarg);
+				ret = -EINVAL;
+				goto out;
+			}
+			scheduled = 1;
+			break;
+		case 'I':
+			report_interval = atoi(optarg);
+			if (report_interval < 1)
+			{
+				fprintf(stderr, "Invalid statistics interval, must be at least 1 second\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			ret = 0;
+			goto out;
+		default: /* '?' */
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = unset_run;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	ret = am7xxx_init(&ctx);
+	if (ret < 0)
+	{
+		perror("am7xxx_init");
+		goto out;
+	}
+
+	am7xxx_set_log_level(ctx, log_level);
+
+	/* take all the devices there are, or just the simulated one */
+	for (i = 0; i < MAX_DEVICES; i++)
+	{
+		struct device *device = &devices[i];
+
+		memset(device, 0, sizeof(*device));
+		device->index = i;
+		device->memfd = -1;
+		device->publish_fd = -1;
+		device->done_fd = -1;
+		device->client_fd = -1;
+
+		if (model)
+			ret = (i == 0) ? am7xxx_open_simulated_device(ctx, &device->dev, model,
+														  bandwidth * 1000000) : -ENODEV;
+		else
+			ret = am7xxx_open_device(ctx, &device->dev, i);
+		if (ret < 0)
+			break;
+		device_count++;
+
+		ret = am7xxx_set_zoom_mode(device->dev, zoom);
+		if (ret == 0)
+			ret = am7xxx_set_power_mode(device->dev, power_mode);
+		if (ret < 0)
+		{
+			fprintf(stderr, "device %u: cannot set it up\n", i);
+			goto cleanup;
+		}
+
+		/* before the thread of the device starts sending */
+		if (scheduled)
+		{
+			ret = am7xxx_set_bus_share(device->dev, shares[i].weight, shares[i].fps);
+			if (ret == -ENOTSUP)
+			{
+				fprintf(stderr, "device %u: not on a bus, not scheduled\n", i);
+			}
+			else if (ret < 0)
+			{
+				fprintf(stderr, "device %u: cannot schedule it\n", i);
+				goto cleanup;
+			}
+		}
+
+		ret = device_ring_init(device, slot_count, slot_size_kib * 1024);
+		if (ret < 0)
+			goto cleanup;
+	}
+
+	if (device_count == 0)
+	{
+		fprintf(stderr, "No device found\n");
+		ret = -ENODEV;
+		goto cleanup;
+	}
+
+	listen_fd = listen_on(socket_path ? socket_path : AM7XXXD_SOCKET_PATH);
+	if (listen_fd < 0)
+	{
+		ret = listen_fd;
+		goto cleanup;
+	}
+
+	serve(listen_fd, devices, device_count, report_interval);
+
+	close(listen_fd);
+	unlink(socket_path ? socket_path : AM7XXXD_SOCKET_PATH);
+	ret = 0;
+
+cleanup:
+	for (i = 0; i < device_count; i++)
+		device_cleanup(&devices[i]);
+	am7xxx_shutdown(ctx);
+out:
+	free(model);
+	free(socket_path);
+	return ret;
+}
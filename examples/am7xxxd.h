@@ -0,0 +1,89 @@
+/* am7xxxd - the protocol between the am7xxx daemon and its clients
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AM7XXXD_H
+#define __AM7XXXD_H
+
+#include <stdint.h>
+
+/*
+ * am7xxxd keeps the devices open and gives each one a ring of image slots
+ * in shared memory. A client connects to the Unix socket of the daemon and
+ * sends a struct am7xxxd_request; the daemon answers with a struct
+ * am7xxxd_reply and, on success, passes three file descriptors with
+ * SCM_RIGHTS:
+ *
+ *   - the memfd holding the ring, to be mapped read-write;
+ *   - an eventfd the client writes to after publishing images;
+ *   - an eventfd the daemon writes to after the device is done with
+ *     images, which the client reads to wait for a free slot.
+ *
+ * The ring starts with a struct am7xxxd_ring, the image data of slot i is
+ * at data_offset + i * slot_size. The client writes an image in slot
+ * head % slot_count, fills in its struct am7xxxd_slot and then increments
+ * head; the daemon sends the image straight from the slot and increments
+ * tail once the device is done with it. A slot can be written again only
+ * when head - tail < slot_count.
+ *
+ * Only one client at a time gets a device; when it goes away the device
+ * stays open and configured for the next one, which goes on from the
+ * current head. Both counters are only accessed atomically.
+ */
+#define AM7XXXD_SOCKET_PATH "/run/am7xxxd.socket"
+
+#define AM7XXXD_MAGIC 0x44583741 /* "A7XD" */
+#define AM7XXXD_VERSION 2
+
+struct am7xxxd_request
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t device_index;
+};
+
+struct am7xxxd_reply
+{
+	int32_t status;		/* 0, or a negative errno value */
+	uint32_t reserved;	/* 0, so that ring_size is aligned on every ABI */
+	uint64_t ring_size; /* how much of the memfd to map */
+};
+
+struct am7xxxd_slot
+{
+	uint32_t format; /* an am7xxx_image_format */
+	uint32_t width;
+	uint32_t height;
+	uint32_t size; /* bytes of image data */
+};
+
+struct am7xxxd_ring
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t native_width;
+	uint32_t native_height;
+	uint32_t slot_count;
+	uint32_t slot_size;	  /* the maximum size of an image */
+	uint32_t data_offset; /* where the data of the first slot is */
+	uint32_t head;		  /* images published, written by the client */
+	uint32_t tail;		  /* images done with, written by the daemon */
+	uint32_t errors;	  /* images the device did not take */
+	struct am7xxxd_slot slots[];
+};
+
+#endif /* __AM7XXXD_H */
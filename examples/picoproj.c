@@ -30,13 +30,628 @@
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef HAVE_AM7XXXD
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef HAVE_SLIDESHOW
+#include <stdint.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#endif
+
 #include "am7xxx.h"
 
+#ifdef HAVE_SLIDESHOW
+struct slide {
+	char *name;
+	unsigned char *data;
+	size_t size;
+	int width;
+	int height;
+};
+
+struct slideshow {
+	struct slide *slides;
+	int count;
+	int current;
+	int failed; /* images the device did not take */
+};
+
+static volatile sig_atomic_t run = 1;
+
+static void stop_slideshow(int signo)
+{
+	(void)signo;
+	run = 0;
+}
+
+static int select_image(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+static void free_slides(struct slideshow *show)
+{
+	int i;
+
+	for (i = 0; i < show->count; i++) {
+		munmap(show->slides[i].data, show->slides[i].size);
+		free(show->slides[i].name);
+	}
+	free(show->slides);
+	show->slides = NULL;
+	show->count = 0;
+}
+
+/*
+ * Get the dimensions of a JPEG image from its Start Of Frame marker, only
+ * the markers are walked.
+ */
+static int jpeg_get_dimensions(const unsigned char *jpeg, size_t size,
+			       int *width, int *height)
+{
+	size_t i = 2;
+
+	if (size < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+		return -EINVAL;
+
+	while (i + 9 < size) {
+		unsigned char marker;
+
+		if (jpeg[i] != 0xff)
+			return -EINVAL;
+
+		/* SOF0 to SOF15, excluding DHT, JPG and DAC */
+		marker = jpeg[i + 1];
+		if (marker >= 0xc0 && marker <= 0xcf &&
+		    marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			*height = (jpeg[i + 5] << 8) | jpeg[i + 6];
+			*width = (jpeg[i + 7] << 8) | jpeg[i + 8];
+			return 0;
+		}
+
+		/* Start Of Scan, no SOF before the image data */
+		if (marker == 0xda)
+			break;
+
+		i += 2 + ((jpeg[i + 2] << 8) | jpeg[i + 3]);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Map all the images in a directory, sorted by name, so that showing one
+ * of them is only a matter of sending it.
+ *
+ * JPEG images are sent with the size they have, NV12 ones have no header
+ * so they must all be width x height.
+ */
+static int load_slides(const char *dir, struct slideshow *show,
+		       int format, int width, int height)
+{
+	struct dirent **entries;
+	char path[FILENAME_MAX];
+	struct stat st;
+	struct slide *slide;
+	int n;
+	int fd;
+	int ret;
+	int i;
+
+	n = scandir(dir, &entries, select_image, alphasort);
+	if (n < 0) {
+		ret = -errno;
+		fprintf(stderr, "cannot read %s: %s\n", dir, strerror(errno));
+		return ret;
+	}
+
+	show->slides = calloc(n > 0 ? n : 1, sizeof(*show->slides));
+	if (show->slides == NULL) {
+		perror("calloc");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+			continue;
+		}
+
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			close(fd);
+			continue;
+		}
+
+		slide = &show->slides[show->count];
+		slide->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (slide->data == MAP_FAILED) {
+			fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+			continue;
+		}
+
+		slide->width = width;
+		slide->height = height;
+		if (format == AM7XXX_IMAGE_FORMAT_JPEG ?
+		    jpeg_get_dimensions(slide->data, st.st_size,
+					&slide->width, &slide->height) < 0 :
+		    st.st_size != (off_t)width * height * 3 / 2) {
+			fprintf(stderr, "skipping %s, not a %s image\n", path,
+				format == AM7XXX_IMAGE_FORMAT_JPEG ? "JPEG" : "NV12 WxH");
+			munmap(slide->data, st.st_size);
+			continue;
+		}
+
+		/* read the image now rather than when it is shown */
+		posix_madvise(slide->data, st.st_size, POSIX_MADV_WILLNEED);
+
+		slide->size = st.st_size;
+		slide->name = strdup(entries[i]->d_name);
+		if (slide->name == NULL) {
+			munmap(slide->data, slide->size);
+			perror("strdup");
+			ret = -ENOMEM;
+			goto out;
+		}
+		show->count++;
+	}
+
+	if (show->count == 0) {
+		fprintf(stderr, "no images in %s\n", dir);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	for (i = 0; i < n; i++)
+		free(entries[i]);
+	free(entries);
+	return ret;
+}
+
+/* The images stay mapped until the end, only the errors are counted here */
+static void slide_sent(void *user_data, int status)
+{
+	struct slideshow *show = user_data;
+
+	if (status < 0)
+		show->failed++;
+}
+
+static int show_slide(am7xxx_device *dev, struct slideshow *show, int index,
+		      int format)
+{
+	struct slide *slide;
+	int ret;
+
+	index = ((index % show->count) + show->count) % show->count;
+	slide = &show->slides[index];
+
+	ret = am7xxx_send_image_async_nocopy(dev, format,
+					     slide->width, slide->height,
+					     slide->data, (unsigned int)slide->size,
+					     slide_sent, show);
+	if (ret < 0) {
+		perror("am7xxx_send_image_async_nocopy");
+		return ret;
+	}
+
+	show->current = index;
+	printf("%d/%d %s\n", index + 1, show->count, slide->name);
+	fflush(stdout);
+
+	return 0;
+}
+
+/*
+ * Turn a command into the index of the image to show.
+ *
+ * Return 1 when there is an image to show, 0 to quit and a negative value
+ * for an unknown command.
+ */
+static int parse_command(struct slideshow *show, const char *command, int *index)
+{
+	char *endptr;
+	long number;
+	int i;
+
+	if (command[0] == '\0' || strcmp(command, "n") == 0 ||
+	    strcmp(command, "next") == 0) {
+		*index = show->current + 1;
+		return 1;
+	}
+	if (strcmp(command, "p") == 0 || strcmp(command, "prev") == 0) {
+		*index = show->current - 1;
+		return 1;
+	}
+	if (strcmp(command, "first") == 0) {
+		*index = 0;
+		return 1;
+	}
+	if (strcmp(command, "last") == 0) {
+		*index = show->count - 1;
+		return 1;
+	}
+	if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0)
+		return 0;
+
+	number = strtol(command, &endptr, 10);
+	if (*endptr == '\0' && number >= 1 && number <= show->count) {
+		*index = (int)number - 1;
+		return 1;
+	}
+
+	for (i = 0; i < show->count; i++) {
+		if (strcmp(command, show->slides[i].name) == 0) {
+			*index = i;
+			return 1;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static uint64_t get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Show the images one after the other, every interval seconds and on the
+ * commands read from stdin or from a FIFO, one per line. The device stays
+ * open, so switching image costs a single transfer.
+ */
+static int run_slideshow(am7xxx_device *dev, struct slideshow *show,
+			 const char *fifo_path, int interval, int format)
+{
+	struct sigaction action;
+	struct pollfd pfd;
+	char line[FILENAME_MAX];
+	size_t len = 0;
+	uint64_t deadline = 0;
+	uint64_t now;
+	ssize_t count;
+	char *newline;
+	char *command;
+	int index;
+	int timeout;
+	int ret;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_slideshow;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	if (fifo_path) {
+		/* holding the write end too, the FIFO never gets to EOF when a
+		 * writer goes away */
+		pfd.fd = open(fifo_path, O_RDWR);
+		if (pfd.fd < 0) {
+			ret = -errno;
+			fprintf(stderr, "cannot open %s: %s\n", fifo_path, strerror(errno));
+			return ret;
+		}
+	}
+
+	ret = show_slide(dev, show, 0, format);
+	if (ret < 0)
+		goto out;
+
+	if (interval > 0)
+		deadline = get_time_ms() + (uint64_t)interval * 1000;
+
+	while (run) {
+		timeout = -1;
+		if (interval > 0) {
+			now = get_time_ms();
+			timeout = deadline > now ? (int)(deadline - now) : 0;
+		} else if (pfd.fd < 0) {
+			/* no more commands and no interval, the image stays */
+			break;
+		}
+
+		ret = poll(&pfd, pfd.fd < 0 ? 0 : 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			ret = -errno;
+			goto out;
+		}
+
+		if (ret == 0) {
+			ret = show_slide(dev, show, show->current + 1, format);
+			if (ret < 0)
+				goto out;
+			deadline += (uint64_t)interval * 1000;
+			continue;
+		}
+
+		count = read(pfd.fd, line + len, sizeof(line) - 1 - len);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			ret = -errno;
+			goto out;
+		}
+		if (count == 0) {
+			pfd.fd = -1;
+			continue;
+		}
+		len += count;
+		line[len] = '\0';
+
+		command = line;
+		while ((newline = strchr(command, '\n')) != NULL) {
+			*newline = '\0';
+			if (newline > command && newline[-1] == '\r')
+				newline[-1] = '\0';
+
+			ret = parse_command(show, command, &index);
+			if (ret == 0) {
+				run = 0;
+				break;
+			} else if (ret < 0) {
+				fprintf(stderr, "unknown command: %s\n", command);
+			} else {
+				ret = show_slide(dev, show, index, format);
+				if (ret < 0)
+					goto out;
+				if (interval > 0)
+					deadline = get_time_ms() + (uint64_t)interval * 1000;
+			}
+			command = newline + 1;
+		}
+
+		/* keep a partial command for the next read, drop a too long one */
+		len -= command - line;
+		if (len == sizeof(line) - 1)
+			len = 0;
+		memmove(line, command, len);
+	}
+
+	ret = 0;
+
+out:
+	/* the images must not go away before the device is done with them */
+	if (am7xxx_flush_async(dev) < 0 && ret == 0)
+		ret = -EIO;
+	if (show->failed > 0)
+		fprintf(stderr, "%d images could not be sent\n", show->failed);
+	if (fifo_path && pfd.fd >= 0)
+		close(pfd.fd);
+	return ret;
+}
+#endif
+
+#ifdef HAVE_AM7XXXD
+#include "am7xxxd.h"
+
+static int connect_to_daemon(const char *socket_path, int device_index,
+			     uint64_t *ring_size, int fds[3])
+{
+	union {
+		struct sockaddr sa;
+		struct sockaddr_un un;
+	} addr;
+	struct am7xxxd_request request;
+	struct am7xxxd_reply reply;
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { &reply, sizeof(reply) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd;
+	int ret;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.un.sun_family = AF_UNIX;
+	strncpy(addr.un.sun_path, socket_path, sizeof(addr.un.sun_path) - 1);
+	if (connect(fd, &addr.sa, sizeof(addr.un)) < 0) {
+		ret = -errno;
+		fprintf(stderr, "cannot connect to %s: %s\n", socket_path, strerror(errno));
+		goto out;
+	}
+
+	request.magic = AM7XXXD_MAGIC;
+	request.version = AM7XXXD_VERSION;
+	request.device_index = device_index;
+	if (send(fd, &request, sizeof(request), 0) != (ssize_t)sizeof(request)) {
+		ret = -errno;
+		perror("send");
+		goto out;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(fd, &msg, MSG_WAITALL) != (ssize_t)sizeof(reply)) {
+		fprintf(stderr, "no answer from am7xxxd\n");
+		ret = -EPROTO;
+		goto out;
+	}
+
+	if (reply.status < 0) {
+		ret = reply.status;
+		fprintf(stderr, "am7xxxd refused the device: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		fprintf(stderr, "no ring from am7xxxd\n");
+		ret = -EPROTO;
+		goto out;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	*ring_size = reply.ring_size;
+
+	/* the device stays ours as long as the connection is open */
+	return fd;
+
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Read the image straight into a slot of the ring of am7xxxd, and wait for
+ * the device to be done with it.
+ */
+static int send_to_daemon(const char *socket_path, int device_index,
+			  int format, int width, int height,
+			  FILE *image_fp, unsigned int size)
+{
+	struct am7xxxd_ring *ring = MAP_FAILED;
+	struct am7xxxd_slot *slot;
+	uint64_t ring_size = 0;
+	uint32_t head;
+	uint32_t errors;
+	uint64_t value = 1;
+	int fds[3] = { -1, -1, -1 };
+	int fd;
+	int ret;
+	int i;
+
+	fd = connect_to_daemon(socket_path, device_index, &ring_size, fds);
+	if (fd < 0)
+		return fd;
+
+	if (ring_size > SIZE_MAX) {
+		fprintf(stderr, "the ring of am7xxxd is too big to be mapped\n");
+		ret = -EFBIG;
+		goto out;
+	}
+
+	ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		ret = -errno;
+		goto out;
+	}
+
+	if (ring->magic != AM7XXXD_MAGIC || ring->version != AM7XXXD_VERSION) {
+		fprintf(stderr, "unsupported am7xxxd ring\n");
+		ret = -EPROTO;
+		goto out;
+	}
+	printf("Native resolution: %dx%d\n", ring->native_width, ring->native_height);
+
+	if (size > ring->slot_size) {
+		fprintf(stderr, "the image is bigger than the %u bytes am7xxxd takes\n",
+			ring->slot_size);
+		ret = -EFBIG;
+		goto out;
+	}
+
+	if ((unsigned int)width > ring->native_width ||
+	    (unsigned int)height > ring->native_height)
+		fprintf(stderr,
+			"WARNING: image is %dx%d, not fitting the native resolution, it may be displayed wrongly!\n",
+			width, height);
+
+	/* wait for a free slot */
+	head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) >= ring->slot_count) {
+		if (read(fds[2], &value, sizeof(value)) < 0 && errno != EINTR) {
+			perror("read");
+			ret = -errno;
+			goto out;
+		}
+	}
+	errors = __atomic_load_n(&ring->errors, __ATOMIC_SEQ_CST);
+
+	slot = &ring->slots[head % ring->slot_count];
+	if (fread((uint8_t *)ring + ring->data_offset + (size_t)(head % ring->slot_count) * ring->slot_size,
+		  size, 1, image_fp) != 1) {
+		perror("fread");
+		ret = -EIO;
+		goto out;
+	}
+	slot->format = format;
+	slot->width = width;
+	slot->height = height;
+	slot->size = size;
+
+	/* publish the image and ring the doorbell */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	value = 1;
+	if (write(fds[1], &value, sizeof(value)) < 0) {
+		perror("write");
+		ret = -errno;
+		goto out;
+	}
+
+	while ((int32_t)(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - (head + 1)) < 0) {
+		if (read(fds[2], &value, sizeof(value)) < 0 && errno != EINTR) {
+			perror("read");
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	if (__atomic_load_n(&ring->errors, __ATOMIC_SEQ_CST) != errors) {
+		fprintf(stderr, "am7xxxd could not send the image\n");
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (ring != MAP_FAILED)
+		munmap(ring, ring_size);
+	for (i = 0; i < 3; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	close(fd);
+	return ret;
+}
+#endif
+
+static int open_device(am7xxx_context *ctx, am7xxx_device **dev,
+		       int device_index, int use_cache)
+{
+	if (use_cache)
+		return am7xxx_open_device_cached(ctx, dev, device_index, NULL);
+
+	return am7xxx_open_device(ctx, dev, device_index);
+}
+
 static void usage(char *name)
 {
 	printf("usage: %s [OPTIONS]\n\n", name);
 	printf("OPTIONS:\n");
 	printf("\t-d <index>\t\tthe device index (default is 0)\n");
+	printf("\t-C \t\t\ttrust the cached device info, see\n");
+	printf("\t\t\t\tam7xxx_open_device_cached()\n");
 	printf("\t-f <filename>\t\tthe image file to upload\n");
 	printf("\t-F <format>\t\tthe image format to use (default is JPEG)\n");
 	printf("\t\t\t\tSUPPORTED FORMATS:\n");
@@ -51,9 +666,30 @@ static void usage(char *name)
 	       AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TELE);
 	printf("\t-W <image width>\tthe width of the image to upload\n");
 	printf("\t-H <image height>\tthe height of the image to upload\n");
+#ifdef HAVE_SLIDESHOW
+	printf("\t-S <directory>\t\tshow the images in a directory, keeping the device\n");
+	printf("\t\t\t\topen; all of them must have the format given\n");
+	printf("\t\t\t\twith -F, NV12 ones also the size given with -W\n");
+	printf("\t\t\t\tand -H\n");
+	printf("\t-i <seconds>\t\tthe slideshow interval (default is 0, only the\n");
+	printf("\t\t\t\tcommands switch image)\n");
+	printf("\t-c <fifo>\t\tread the slideshow commands from a FIFO instead\n");
+	printf("\t\t\t\tof stdin: next, prev, first, last, quit, the\n");
+	printf("\t\t\t\tnumber or the file name of an image\n");
+#endif
+#ifdef HAVE_AM7XXXD
+	printf("\t-x <socket>\t\tsend the image through am7xxxd, which keeps the\n");
+	printf("\t\t\t\tdevice open (default socket %s)\n", AM7XXXD_SOCKET_PATH);
+#endif
 	printf("\t-h \t\t\tthis help message\n");
 	printf("\n\nEXAMPLE OF USE:\n");
 	printf("\t%s -f file.jpg -F 1 -l 5 -W 800 -H 480\n", name);
+#ifdef HAVE_AM7XXXD
+	printf("\t%s -f file.jpg -x %s\n", name, AM7XXXD_SOCKET_PATH);
+#endif
+#ifdef HAVE_SLIDESHOW
+	printf("\t%s -S slides/ -i 10 -W 800 -H 480\n", name);
+#endif
 }
 
 int main(int argc, char *argv[])
@@ -62,22 +698,32 @@ int main(int argc, char *argv[])
 	int opt;
 
 	char filename[FILENAME_MAX] = {0};
-	FILE *image_fp;
+#ifdef HAVE_AM7XXXD
+	char *socket_path = NULL;
+#endif
+#ifdef HAVE_SLIDESHOW
+	char *slideshow_dir = NULL;
+	char *fifo_path = NULL;
+	int interval = 0;
+	struct slideshow show = { NULL, 0, 0, 0 };
+#endif
+	FILE *image_fp = NULL;
 	struct stat st;
 	am7xxx_context *ctx;
 	am7xxx_device *dev;
 	int log_level = AM7XXX_LOG_INFO;
 	int device_index = 0;
+	int use_cache = 0;
 	int power_mode = AM7XXX_POWER_LOW;
 	int zoom = AM7XXX_ZOOM_ORIGINAL;
 	int format = AM7XXX_IMAGE_FORMAT_JPEG;
 	int width = 800;
 	int height = 480;
-	unsigned char *image;
+	unsigned char *image = NULL;
 	off_t size;
 	am7xxx_device_info device_info;
 
-	while ((opt = getopt(argc, argv, "d:f:F:l:p:z:W:H:h")) != -1) {
+	while ((opt = getopt(argc, argv, "d:Cf:F:l:p:z:W:H:x:S:i:c:h")) != -1) {
 		switch (opt) {
 		case 'd':
 			device_index = atoi(optarg);
@@ -87,6 +733,9 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'C':
+			use_cache = 1;
+			break;
 		case 'f':
 			if (filename[0] != '\0')
 				fprintf(stderr, "Warning: image file already specified\n");
@@ -164,6 +813,39 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'x':
+#ifdef HAVE_AM7XXXD
+			socket_path = optarg;
+#else
+			fprintf(stderr, "Option '-x' not implemented\n");
+#endif
+			break;
+		case 'S':
+#ifdef HAVE_SLIDESHOW
+			slideshow_dir = optarg;
+#else
+			fprintf(stderr, "Option '-S' not implemented\n");
+#endif
+			break;
+		case 'i':
+#ifdef HAVE_SLIDESHOW
+			interval = atoi(optarg);
+			if (interval < 0) {
+				fprintf(stderr, "Unsupported interval\n");
+				ret = -EINVAL;
+				goto out;
+			}
+#else
+			fprintf(stderr, "Option '-i' not implemented\n");
+#endif
+			break;
+		case 'c':
+#ifdef HAVE_SLIDESHOW
+			fifo_path = optarg;
+#else
+			fprintf(stderr, "Option '-c' not implemented\n");
+#endif
+			break;
 		case 'h':
 			usage(argv[0]);
 			ret = 0;
@@ -175,6 +857,27 @@ int main(int argc, char *argv[])
 		}
 	}
 
+#ifdef HAVE_SLIDESHOW
+	if (slideshow_dir) {
+#ifdef HAVE_AM7XXXD
+		if (socket_path) {
+			fprintf(stderr, "A slideshow cannot be sent through am7xxxd.\n\n");
+			usage(argv[0]);
+			ret = -EINVAL;
+			goto out;
+		}
+#endif
+		ret = load_slides(slideshow_dir, &show, format, width, height);
+		if (ret < 0)
+			goto out_free_image;
+		printf("%d images in %s\n", show.count, slideshow_dir);
+
+		/* the sizes are the ones of the slides */
+		size = 0;
+		goto open_device;
+	}
+#endif
+
 	if (filename[0] == '\0') {
 		fprintf(stderr, "An image file MUST be specified with the -f option.\n\n");
 		usage(argv[0]);
@@ -195,6 +898,14 @@ int main(int argc, char *argv[])
 	}
 	size = st.st_size;
 
+#ifdef HAVE_AM7XXXD
+	if (socket_path) {
+		ret = send_to_daemon(socket_path, device_index, format,
+				     width, height, image_fp, (unsigned int)size);
+		goto out_close_image_fp;
+	}
+#endif
+
 	image = malloc(size * sizeof(unsigned char));
 	if (image == NULL) {
 		perror("malloc");
@@ -216,6 +927,9 @@ int main(int argc, char *argv[])
 		goto out_free_image;
 	}
 
+#ifdef HAVE_SLIDESHOW
+open_device:
+#endif
 	ret = am7xxx_init(&ctx);
 	if (ret < 0) {
 		perror("am7xxx_init");
@@ -224,7 +938,7 @@ int main(int argc, char *argv[])
 
 	am7xxx_set_log_level(ctx, log_level);
 
-	ret = am7xxx_open_device(ctx, &dev, 0);
+	ret = open_device(ctx, &dev, 0, use_cache);
 	if (ret < 0) {
 		perror("am7xxx_open_device");
 		goto cleanup;
@@ -236,7 +950,7 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
-	ret = am7xxx_open_device(ctx, &dev, device_index);
+	ret = open_device(ctx, &dev, device_index, use_cache);
 	if (ret < 0) {
 		perror("am7xxx_open_device");
 		goto cleanup;
@@ -274,6 +988,13 @@ int main(int argc, char *argv[])
 			"WARNING: image is %dx%d, not fitting the native resolution, it may be displayed wrongly!\n",
 			width, height);
 
+#ifdef HAVE_SLIDESHOW
+	if (slideshow_dir) {
+		ret = run_slideshow(dev, &show, fifo_path, interval, format);
+		goto cleanup;
+	}
+#endif
+
 	ret = am7xxx_send_image(dev, format, width, height, image, (unsigned int)size);
 	if (ret < 0) {
 		perror("am7xxx_send_image");
@@ -287,9 +1008,12 @@ cleanup:
 
 out_free_image:
 	free(image);
+#ifdef HAVE_SLIDESHOW
+	free_slides(&show);
+#endif
 
 out_close_image_fp:
-	if (fclose(image_fp) == EOF)
+	if (image_fp && fclose(image_fp) == EOF)
 		perror("fclose");
 
 out:
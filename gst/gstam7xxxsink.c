@@ -0,0 +1,614 @@
+/* am7xxxsink - GStreamer sink element for am7xxx based projectors
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * am7xxxsink shows JPEG and NV12 images on an am7xxx device:
+ *
+ *   gst-launch-1.0 filesrc location=movie.mkv ! decodebin ! videoconvert ! \
+ *       videoscale ! jpegenc ! am7xxxsink
+ *   gst-launch-1.0 v4l2src ! videoconvert ! videoscale ! \
+ *       video/x-raw,format=NV12 ! am7xxxsink
+ *
+ * The caps offered are limited to the native size of the device. The
+ * buffers are sent without copying them, the sink keeps a reference to
+ * each one until the device is done with it; upstream elements are
+ * offered a buffer pool, so that once the pipeline is running no more
+ * buffers get allocated.
+ *
+ * GstBaseSink takes care of the synchronization with the clock and of
+ * QoS: buffers later than max-lateness are dropped before reaching the
+ * device, and upstream is told to skip work.
+ */
+
+#include <errno.h>
+
+#include "gstam7xxxsink.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_am7xxx_sink_debug);
+#define GST_CAT_DEFAULT gst_am7xxx_sink_debug
+
+/* One image on the wire, one rendered, one filled upstream */
+#define MIN_POOL_BUFFERS 3
+
+/* Frames later than this are dropped, like in video sinks */
+#define DEFAULT_MAX_LATENESS (20 * GST_MSECOND)
+
+enum
+{
+	PROP_0,
+	PROP_DEVICE_INDEX,
+	PROP_POWER_MODE,
+	PROP_ZOOM_MODE,
+	PROP_FRAMES_SENT,
+	PROP_BYTES_SENT,
+	PROP_FRAMES_COPIED,
+	PROP_SEND_ERRORS,
+	PROP_AVERAGE_TRANSFER_TIME,
+};
+
+#define SINK_CAPS \
+	"image/jpeg, width = (int) [ 1, MAX ], height = (int) [ 1, MAX ]; " \
+	GST_VIDEO_CAPS_MAKE("NV12")
+
+static GstStaticPadTemplate sink_template =
+	GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS(SINK_CAPS));
+
+/* A buffer the device is not done with yet */
+struct in_flight
+{
+	GstAm7xxxSink *sink;
+	GstBuffer *buffer;
+	GstMapInfo map;
+	GstVideoFrame frame;
+	gboolean is_video;
+	gsize size;
+	gint64 submit_time;
+};
+
+G_DEFINE_TYPE(GstAm7xxxSink, gst_am7xxx_sink, GST_TYPE_BASE_SINK)
+
+static void in_flight_free(struct in_flight *image)
+{
+	if (image->is_video)
+		gst_video_frame_unmap(&image->frame);
+	else
+		gst_buffer_unmap(image->buffer, &image->map);
+	gst_buffer_unref(image->buffer);
+	g_free(image);
+}
+
+/* Called by libam7xxx from the streaming thread, or from stop() */
+static void image_sent(void *user_data, int status)
+{
+	struct in_flight *image = user_data;
+	GstAm7xxxSink *sink = image->sink;
+
+	g_mutex_lock(&sink->stats_lock);
+	if (status == 0)
+	{
+		sink->frames_sent++;
+		sink->bytes_sent += image->size;
+		sink->transfer_time += g_get_monotonic_time() - image->submit_time;
+	}
+	else
+	{
+		sink->send_errors++;
+	}
+	g_mutex_unlock(&sink->stats_lock);
+
+	in_flight_free(image);
+}
+
+static GstCaps *gst_am7xxx_sink_get_caps(GstBaseSink *basesink, GstCaps *filter)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+	GstCaps *caps;
+	GstCaps *intersection;
+	guint native_width;
+	guint native_height;
+	guint i;
+
+	caps = gst_pad_get_pad_template_caps(GST_BASE_SINK_PAD(basesink));
+
+	GST_OBJECT_LOCK(sink);
+	native_width = sink->native_width;
+	native_height = sink->native_height;
+	GST_OBJECT_UNLOCK(sink);
+
+	/* bigger images would be displayed wrongly */
+	if (native_width && native_height)
+	{
+		caps = gst_caps_make_writable(caps);
+		for (i = 0; i < gst_caps_get_size(caps); i++)
+			gst_structure_set(gst_caps_get_structure(caps, i),
+							  "width", GST_TYPE_INT_RANGE, 1, (gint)native_width,
+							  "height", GST_TYPE_INT_RANGE, 1, (gint)native_height,
+							  NULL);
+	}
+
+	if (filter)
+	{
+		intersection = gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
+		gst_caps_unref(caps);
+		caps = intersection;
+	}
+
+	return caps;
+}
+
+static gboolean gst_am7xxx_sink_set_caps(GstBaseSink *basesink, GstCaps *caps)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+	GstStructure *structure = gst_caps_get_structure(caps, 0);
+
+	if (gst_structure_has_name(structure, "image/jpeg"))
+	{
+		if (!gst_structure_get_int(structure, "width", &sink->width) ||
+			!gst_structure_get_int(structure, "height", &sink->height))
+			return FALSE;
+		sink->format = AM7XXX_IMAGE_FORMAT_JPEG;
+	}
+	else
+	{
+		if (!gst_video_info_from_caps(&sink->info, caps))
+			return FALSE;
+		sink->width = GST_VIDEO_INFO_WIDTH(&sink->info);
+		sink->height = GST_VIDEO_INFO_HEIGHT(&sink->info);
+		sink->format = AM7XXX_IMAGE_FORMAT_NV12;
+	}
+
+	GST_DEBUG_OBJECT(sink, "sending %dx%d %s images", sink->width, sink->height,
+					 sink->format == AM7XXX_IMAGE_FORMAT_JPEG ? "JPEG" : "NV12");
+	return TRUE;
+}
+
+/*
+ * Offer upstream a pool of buffers to write the images to; JPEG images
+ * are compressed, buffers with the size of an NV12 image are big enough
+ * for almost all of them.
+ */
+static gboolean gst_am7xxx_sink_propose_allocation(GstBaseSink *basesink, GstQuery *query)
+{
+	GstCaps *caps;
+	gboolean need_pool;
+	GstBufferPool *pool = NULL;
+	GstStructure *config;
+	GstStructure *structure;
+	GstVideoInfo info;
+	gint width;
+	gint height;
+	guint size;
+
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	if (caps == NULL)
+		return FALSE;
+
+	structure = gst_caps_get_structure(caps, 0);
+	if (gst_structure_has_name(structure, "image/jpeg"))
+	{
+		if (!gst_structure_get_int(structure, "width", &width) ||
+			!gst_structure_get_int(structure, "height", &height))
+			return FALSE;
+		size = width * height * 3 / 2;
+	}
+	else
+	{
+		if (!gst_video_info_from_caps(&info, caps))
+			return FALSE;
+		size = GST_VIDEO_INFO_SIZE(&info);
+	}
+
+	if (need_pool)
+	{
+		if (gst_structure_has_name(structure, "image/jpeg"))
+			pool = gst_buffer_pool_new();
+		else
+			pool = gst_video_buffer_pool_new();
+		config = gst_buffer_pool_get_config(pool);
+		gst_buffer_pool_config_set_params(config, caps, size, MIN_POOL_BUFFERS, 0);
+		if (!gst_buffer_pool_set_config(pool, config))
+		{
+			GST_WARNING_OBJECT(basesink, "cannot configure the buffer pool");
+			gst_object_unref(pool);
+			return FALSE;
+		}
+	}
+
+	gst_query_add_allocation_pool(query, pool, size, MIN_POOL_BUFFERS, 0);
+	if (pool)
+		gst_object_unref(pool);
+
+	/* NV12 buffers with padding can be sent too, at the cost of a copy */
+	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+	return TRUE;
+}
+
+static gboolean gst_am7xxx_sink_start(GstBaseSink *basesink)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+	am7xxx_device_info device_info;
+	int ret;
+
+	ret = am7xxx_init(&sink->ctx);
+	if (ret < 0)
+	{
+		GST_ELEMENT_ERROR(sink, RESOURCE, FAILED,
+						  ("Cannot initialize libam7xxx"), ("am7xxx_init: %s", g_strerror(-ret)));
+		return FALSE;
+	}
+
+	ret = am7xxx_open_device(sink->ctx, &sink->dev, sink->device_index);
+	if (ret < 0)
+	{
+		GST_ELEMENT_ERROR(sink, RESOURCE, NOT_FOUND,
+						  ("Cannot open the projector %u", sink->device_index),
+						  ("am7xxx_open_device: %s", g_strerror(-ret)));
+		goto err;
+	}
+
+	ret = am7xxx_get_device_info(sink->dev, &device_info);
+	if (ret == 0)
+		ret = am7xxx_set_zoom_mode(sink->dev, sink->zoom_mode);
+	if (ret == 0)
+		ret = am7xxx_set_power_mode(sink->dev, sink->power_mode);
+	if (ret < 0)
+	{
+		GST_ELEMENT_ERROR(sink, RESOURCE, SETTINGS,
+						  ("Cannot set up the projector"), ("%s", g_strerror(-ret)));
+		goto err;
+	}
+
+	GST_OBJECT_LOCK(sink);
+	sink->native_width = device_info.native_width;
+	sink->native_height = device_info.native_height;
+	GST_OBJECT_UNLOCK(sink);
+
+	GST_INFO_OBJECT(sink, "native size %ux%u", device_info.native_width,
+					device_info.native_height);
+
+	g_mutex_lock(&sink->stats_lock);
+	sink->frames_sent = 0;
+	sink->bytes_sent = 0;
+	sink->frames_copied = 0;
+	sink->send_errors = 0;
+	sink->transfer_time = 0;
+	g_mutex_unlock(&sink->stats_lock);
+
+	return TRUE;
+
+err:
+	am7xxx_shutdown(sink->ctx);
+	sink->ctx = NULL;
+	sink->dev = NULL;
+	return FALSE;
+}
+
+static gboolean gst_am7xxx_sink_stop(GstBaseSink *basesink)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+
+	/* get back the buffer still on the wire */
+	if (sink->dev)
+		am7xxx_flush_async(sink->dev);
+
+	if (sink->ctx)
+		am7xxx_shutdown(sink->ctx);
+	sink->ctx = NULL;
+	sink->dev = NULL;
+
+	GST_OBJECT_LOCK(sink);
+	sink->native_width = 0;
+	sink->native_height = 0;
+	GST_OBJECT_UNLOCK(sink);
+
+	return TRUE;
+}
+
+static gboolean gst_am7xxx_sink_event(GstBaseSink *basesink, GstEvent *event)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+
+	/* the last image is on the wire when EOS is posted */
+	if (GST_EVENT_TYPE(event) == GST_EVENT_EOS && sink->dev)
+		am7xxx_flush_async(sink->dev);
+
+	return GST_BASE_SINK_CLASS(gst_am7xxx_sink_parent_class)->event(basesink, event);
+}
+
+/* NV12 frames with padding are packed by the library, which copies them */
+static GstFlowReturn render_padded_frame(GstAm7xxxSink *sink, GstVideoFrame *frame)
+{
+	const unsigned char *planes[2];
+	int linesizes[2];
+	int ret;
+
+	planes[0] = GST_VIDEO_FRAME_PLANE_DATA(frame, 0);
+	planes[1] = GST_VIDEO_FRAME_PLANE_DATA(frame, 1);
+	linesizes[0] = GST_VIDEO_FRAME_PLANE_STRIDE(frame, 0);
+	linesizes[1] = GST_VIDEO_FRAME_PLANE_STRIDE(frame, 1);
+
+	ret = am7xxx_send_image_planes_async(sink->dev,
+										 AM7XXX_PIXEL_FORMAT_NV12,
+										 sink->width,
+										 sink->height,
+										 planes,
+										 linesizes);
+	gst_video_frame_unmap(frame);
+
+	g_mutex_lock(&sink->stats_lock);
+	if (ret == 0)
+		sink->frames_copied++;
+	else
+		sink->send_errors++;
+	g_mutex_unlock(&sink->stats_lock);
+
+	if (ret < 0)
+	{
+		GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+						  ("Cannot send the image to the projector"),
+						  ("am7xxx_send_image_planes_async: %s", g_strerror(-ret)));
+		return GST_FLOW_ERROR;
+	}
+
+	return GST_FLOW_OK;
+}
+
+static GstFlowReturn gst_am7xxx_sink_render(GstBaseSink *basesink, GstBuffer *buffer)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(basesink);
+	struct in_flight *image;
+	GstFlowReturn flow;
+	guint8 *data;
+	int ret;
+
+	image = g_new0(struct in_flight, 1);
+	image->sink = sink;
+
+	if (sink->format == AM7XXX_IMAGE_FORMAT_NV12)
+	{
+		if (!gst_video_frame_map(&image->frame, &sink->info, buffer, GST_MAP_READ))
+			goto map_failed;
+
+		data = GST_VIDEO_FRAME_PLANE_DATA(&image->frame, 0);
+		if (GST_VIDEO_FRAME_PLANE_STRIDE(&image->frame, 0) != sink->width ||
+			GST_VIDEO_FRAME_PLANE_STRIDE(&image->frame, 1) != sink->width ||
+			(guint8 *)GST_VIDEO_FRAME_PLANE_DATA(&image->frame, 1) != data + sink->width * sink->height)
+		{
+			flow = render_padded_frame(sink, &image->frame);
+			g_free(image);
+			return flow;
+		}
+
+		image->is_video = TRUE;
+		image->size = (gsize)sink->width * sink->height * 3 / 2;
+	}
+	else
+	{
+		if (!gst_buffer_map(buffer, &image->map, GST_MAP_READ))
+			goto map_failed;
+
+		data = image->map.data;
+		image->size = image->map.size;
+	}
+
+	/* the buffer stays mapped until the device is done with it */
+	image->buffer = gst_buffer_ref(buffer);
+	image->submit_time = g_get_monotonic_time();
+	ret = am7xxx_send_image_async_nocopy(sink->dev,
+										 sink->format,
+										 sink->width,
+										 sink->height,
+										 data,
+										 image->size,
+										 image_sent,
+										 image);
+	if (ret < 0)
+	{
+		in_flight_free(image);
+		g_mutex_lock(&sink->stats_lock);
+		sink->send_errors++;
+		g_mutex_unlock(&sink->stats_lock);
+
+		GST_ELEMENT_ERROR(sink, RESOURCE, WRITE,
+						  ("Cannot send the image to the projector"),
+						  ("am7xxx_send_image_async_nocopy: %s", g_strerror(-ret)));
+		return GST_FLOW_ERROR;
+	}
+
+	return GST_FLOW_OK;
+
+map_failed:
+	g_free(image);
+	GST_ELEMENT_ERROR(sink, RESOURCE, READ, ("Cannot map the buffer"), (NULL));
+	return GST_FLOW_ERROR;
+}
+
+static void gst_am7xxx_sink_set_property(GObject *object,
+										 guint prop_id,
+										 const GValue *value,
+										 GParamSpec *pspec)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(object);
+
+	/* the device settings are used when it is opened */
+	GST_OBJECT_LOCK(sink);
+	switch (prop_id)
+	{
+	case PROP_DEVICE_INDEX:
+		sink->device_index = g_value_get_uint(value);
+		break;
+	case PROP_POWER_MODE:
+		sink->power_mode = g_value_get_int(value);
+		break;
+	case PROP_ZOOM_MODE:
+		sink->zoom_mode = g_value_get_int(value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+	GST_OBJECT_UNLOCK(sink);
+}
+
+static void gst_am7xxx_sink_get_property(GObject *object,
+										 guint prop_id,
+										 GValue *value,
+										 GParamSpec *pspec)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(object);
+
+	GST_OBJECT_LOCK(sink);
+	g_mutex_lock(&sink->stats_lock);
+	switch (prop_id)
+	{
+	case PROP_DEVICE_INDEX:
+		g_value_set_uint(value, sink->device_index);
+		break;
+	case PROP_POWER_MODE:
+		g_value_set_int(value, sink->power_mode);
+		break;
+	case PROP_ZOOM_MODE:
+		g_value_set_int(value, sink->zoom_mode);
+		break;
+	case PROP_FRAMES_SENT:
+		g_value_set_uint64(value, sink->frames_sent);
+		break;
+	case PROP_BYTES_SENT:
+		g_value_set_uint64(value, sink->bytes_sent);
+		break;
+	case PROP_FRAMES_COPIED:
+		g_value_set_uint64(value, sink->frames_copied);
+		break;
+	case PROP_SEND_ERRORS:
+		g_value_set_uint64(value, sink->send_errors);
+		break;
+	case PROP_AVERAGE_TRANSFER_TIME:
+		g_value_set_uint64(value, sink->frames_sent ? sink->transfer_time / sink->frames_sent : 0);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+	g_mutex_unlock(&sink->stats_lock);
+	GST_OBJECT_UNLOCK(sink);
+}
+
+static void gst_am7xxx_sink_finalize(GObject *object)
+{
+	GstAm7xxxSink *sink = GST_AM7XXX_SINK(object);
+
+	g_mutex_clear(&sink->stats_lock);
+
+	G_OBJECT_CLASS(gst_am7xxx_sink_parent_class)->finalize(object);
+}
+
+static void gst_am7xxx_sink_init(GstAm7xxxSink *sink)
+{
+	GstBaseSink *basesink = GST_BASE_SINK(sink);
+
+	sink->device_index = 0;
+	sink->power_mode = AM7XXX_POWER_LOW;
+	sink->zoom_mode = AM7XXX_ZOOM_ORIGINAL;
+	g_mutex_init(&sink->stats_lock);
+
+	gst_base_sink_set_sync(basesink, TRUE);
+	gst_base_sink_set_qos_enabled(basesink, TRUE);
+	gst_base_sink_set_max_lateness(basesink, DEFAULT_MAX_LATENESS);
+}
+
+static void gst_am7xxx_sink_class_init(GstAm7xxxSinkClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+	GstBaseSinkClass *basesink_class = GST_BASE_SINK_CLASS(klass);
+	const GParamFlags stats_flags = G_PARAM_READABLE | G_PARAM_STATIC_STRINGS;
+	const GParamFlags settings_flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+		GST_PARAM_MUTABLE_READY;
+
+	gobject_class->set_property = gst_am7xxx_sink_set_property;
+	gobject_class->get_property = gst_am7xxx_sink_get_property;
+	gobject_class->finalize = gst_am7xxx_sink_finalize;
+
+	g_object_class_install_property(gobject_class, PROP_DEVICE_INDEX,
+									g_param_spec_uint("device-index", "Device index",
+													  "The index of the projector to use",
+													  0, G_MAXUINT, 0, settings_flags));
+	g_object_class_install_property(gobject_class, PROP_POWER_MODE,
+									g_param_spec_int("power-mode", "Power mode",
+													 "The power mode, between 0 (off) and 4 (turbo)",
+													 AM7XXX_POWER_OFF, AM7XXX_POWER_TURBO,
+													 AM7XXX_POWER_LOW, settings_flags));
+	g_object_class_install_property(gobject_class, PROP_ZOOM_MODE,
+									g_param_spec_int("zoom-mode", "Zoom mode",
+													 "The zoom mode, between 0 (original) and 4 (tele)",
+													 AM7XXX_ZOOM_ORIGINAL, AM7XXX_ZOOM_TELE,
+													 AM7XXX_ZOOM_ORIGINAL, settings_flags));
+	g_object_class_install_property(gobject_class, PROP_FRAMES_SENT,
+									g_param_spec_uint64("frames-sent", "Frames sent",
+														"The frames the projector received",
+														0, G_MAXUINT64, 0, stats_flags));
+	g_object_class_install_property(gobject_class, PROP_BYTES_SENT,
+									g_param_spec_uint64("bytes-sent", "Bytes sent",
+														"The image data the projector received",
+														0, G_MAXUINT64, 0, stats_flags));
+	g_object_class_install_property(gobject_class, PROP_FRAMES_COPIED,
+									g_param_spec_uint64("frames-copied", "Frames copied",
+														"The NV12 frames with padding, which had to be copied",
+														0, G_MAXUINT64, 0, stats_flags));
+	g_object_class_install_property(gobject_class, PROP_SEND_ERRORS,
+									g_param_spec_uint64("send-errors", "Send errors",
+														"The frames which could not be sent",
+														0, G_MAXUINT64, 0, stats_flags));
+	g_object_class_install_property(gobject_class, PROP_AVERAGE_TRANSFER_TIME,
+									g_param_spec_uint64("average-transfer-time", "Average transfer time",
+														"Microseconds from handing a frame to libam7xxx to the end of its transfer",
+														0, G_MAXUINT64, 0, stats_flags));
+
+	gst_element_class_set_static_metadata(element_class,
+										  "am7xxx projector sink",
+										  "Sink/Video",
+										  "Shows JPEG and NV12 images on am7xxx based projectors",
+										  "Antonio Ospite <ao2@ao2.it>");
+	gst_element_class_add_static_pad_template(element_class, &sink_template);
+
+	basesink_class->get_caps = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_get_caps);
+	basesink_class->set_caps = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_set_caps);
+	basesink_class->propose_allocation = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_propose_allocation);
+	basesink_class->start = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_start);
+	basesink_class->stop = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_stop);
+	basesink_class->event = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_event);
+	basesink_class->render = GST_DEBUG_FUNCPTR(gst_am7xxx_sink_render);
+}
+
+static gboolean plugin_init(GstPlugin *plugin)
+{
+	GST_DEBUG_CATEGORY_INIT(gst_am7xxx_sink_debug, "am7xxxsink", 0, "am7xxx projector sink");
+
+	return gst_element_register(plugin, "am7xxxsink", GST_RANK_NONE, GST_TYPE_AM7XXX_SINK);
+}
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR,
+				  GST_VERSION_MINOR,
+				  am7xxx,
+				  "Elements for am7xxx based projectors",
+				  plugin_init,
+				  VERSION,
+				  "GPL",
+				  "libam7xxx",
+				  "http://git.ao2.it/libam7xxx.git")
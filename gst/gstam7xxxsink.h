@@ -0,0 +1,78 @@
+/* am7xxxsink - GStreamer sink element for am7xxx based projectors
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GST_AM7XXX_SINK_H
+#define __GST_AM7XXX_SINK_H
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+#include <gst/video/video.h>
+
+#include <am7xxx.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_AM7XXX_SINK (gst_am7xxx_sink_get_type())
+#define GST_AM7XXX_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_AM7XXX_SINK, GstAm7xxxSink))
+#define GST_AM7XXX_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_AM7XXX_SINK, GstAm7xxxSinkClass))
+#define GST_IS_AM7XXX_SINK(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_AM7XXX_SINK))
+#define GST_IS_AM7XXX_SINK_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_AM7XXX_SINK))
+
+typedef struct _GstAm7xxxSink GstAm7xxxSink;
+typedef struct _GstAm7xxxSinkClass GstAm7xxxSinkClass;
+
+struct _GstAm7xxxSink
+{
+	GstBaseSink parent;
+
+	/* properties */
+	guint device_index;
+	gint power_mode;
+	gint zoom_mode;
+
+	/* set up in start(), the native size is read with the object lock */
+	am7xxx_context *ctx;
+	am7xxx_device *dev;
+	guint native_width;
+	guint native_height;
+
+	/* the negotiated stream */
+	am7xxx_image_format format;
+	GstVideoInfo info; /* only for NV12 */
+	gint width;
+	gint height;
+
+	/* statistics, updated from the streaming thread */
+	GMutex stats_lock;
+	guint64 frames_sent;
+	guint64 bytes_sent;
+	guint64 frames_copied; /* NV12 frames with padding, which are packed */
+	guint64 send_errors;
+	guint64 transfer_time; /* microseconds, summed over the frames sent */
+};
+
+struct _GstAm7xxxSinkClass
+{
+	GstBaseSinkClass parent_class;
+};
+
+GType gst_am7xxx_sink_get_type(void);
+
+G_END_DECLS
+
+#endif /* __GST_AM7XXX_SINK_H */
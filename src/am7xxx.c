@@ -25,6 +25,10 @@
 #include <math.h>
 
 #include "am7xxx.h"
+#include "bus.h"
+#include "devinfo.h"
+#include "profile.h"
+#include "scale.h"
 #include "serialize.h"
 #include "tools.h"
 
@@ -89,6 +93,8 @@ struct am7xxx_usb_device_descriptor
 	uint16_t product_id;
 	uint8_t configuration;	  /* The bConfigurationValue of the device */
 	uint8_t interface_number; /* The bInterfaceNumber of the device */
+	uint16_t native_width;	  /* The display size, for simulated devices */
+	uint16_t native_height;
 	struct am7xxx_ops ops;
 };
 
@@ -110,6 +116,8 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0xc101,
 		.configuration = 2,
 		.interface_number = 0,
+		.native_width = 800,
+		.native_height = 480,
 		.ops = DEFAULT_OPS,
 	},
 	{
@@ -118,6 +126,8 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0x5501,
 		.configuration = 2,
 		.interface_number = 0,
+		.native_width = 800,
+		.native_height = 480,
 		.ops = DEFAULT_OPS,
 	},
 	{
@@ -126,6 +136,8 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0x2144,
 		.configuration = 2,
 		.interface_number = 0,
+		.native_width = 800,
+		.native_height = 480,
 		.ops = DEFAULT_OPS,
 	},
 	{
@@ -134,6 +146,8 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0x000e,
 		.configuration = 2,
 		.interface_number = 0,
+		.native_width = 800,
+		.native_height = 480,
 		.ops = DEFAULT_OPS,
 	},
 	{
@@ -142,6 +156,8 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0x0016,
 		.configuration = 2,
 		.interface_number = 0,
+		.native_width = 854,
+		.native_height = 480,
 		.ops = {
 			.set_power_mode = picopix_set_power_mode,
 			.set_zoom_mode = picopix_set_zoom_mode,
@@ -153,32 +169,91 @@ static const struct am7xxx_usb_device_descriptor supported_devices[] = {
 		.product_id = 0x0019,
 		.configuration = 1,
 		.interface_number = 0,
+		.native_width = 854,
+		.native_height = 480,
 	},
 };
 
+/*
+ * Some devices show up as mass storage first, and become projectors only
+ * after a vendor command is sent to them, see am7xxx_modeswitch().
+ */
+#define AM7XXX_STORAGE_VID 0x1de1
+#define AM7XXX_STORAGE_PID 0x1101
+#define AM7XXX_STORAGE_CONFIGURATION 1
+#define AM7XXX_STORAGE_INTERFACE 0
+#define AM7XXX_STORAGE_OUT_EP 0x01
+
+/* A mass storage CBW, the terminating NUL is sent too as it always was */
+static unsigned char modeswitch_command[] =
+	"\x55\x53\x42\x43\x08\x70\x52\x89\x00\x00\x00\x00\x00\x00"
+	"\x10\xff\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
+
 /* The header size on the wire is known to be always 24 bytes, regardless of
  * the memory configuration enforced by different architectures or compilers
  * for struct am7xxx_header
  */
 #define AM7XXX_HEADER_WIRE_SIZE 24
 
+/*
+ * The asynchronous transfers are used in turns: the buffer of one can be
+ * filled while the other one is being sent. Transfers and buffers are
+ * allocated once and reused, the buffers only grow when the images do.
+ */
+#define AM7XXX_TRANSFER_SLOTS 2
+
+struct am7xxx_transfer_slot
+{
+	am7xxx_device *dev;
+	struct libusb_transfer *transfer;
+	uint8_t *buffer;
+	unsigned int buffer_size;
+
+	/* set when sending a buffer of the caller, see am7xxx_send_image_async_nocopy() */
+	am7xxx_send_done_cb done;
+	void *user_data;
+};
+
 struct _am7xxx_device
 {
 	libusb_device_handle *usb_device;
-	struct libusb_transfer *transfer;
+	struct libusb_transfer *transfer; /* the transfer in flight */
 	int transfer_completed;
+	struct am7xxx_transfer_slot transfer_slots[AM7XXX_TRANSFER_SLOTS];
+	unsigned int next_transfer_slot;
 	uint8_t buffer[AM7XXX_HEADER_WIRE_SIZE];
 	am7xxx_device_info *device_info;
+	uint32_t devinfo_unknown0; /* not understood yet, only kept for the cache */
+	uint32_t devinfo_unknown1;
 	am7xxx_context *ctx;
 	const struct am7xxx_usb_device_descriptor *desc;
+	uint16_t firmware_version; /* The bcdDevice of the device */
+
+	/* Simulated devices, see am7xxx_open_simulated_device() */
+	int simulated;
+	unsigned long simulated_rate;				 /* bytes per second, 0 for no limit */
+	uint64_t simulated_busy_until;				 /* when the transfer in flight ends */
+	struct am7xxx_transfer_slot *simulated_slot; /* the slot of that transfer */
+
+	/* The capture file the images are recorded to, see am7xxx_start_recording() */
+	FILE *recording;
+	uint64_t recording_start;
+
+	/* The bus shared with other devices, see am7xxx_set_bus_share() */
+	struct bus_scheduler *bus;
+	struct bus_member bus_member;
+
+	char bus_path[DEVINFO_BUS_PATH_MAX]; /* where it was last seen plugged */
+
 	am7xxx_device *next;
 };
 
 struct _am7xxx_context
 {
-	libusb_context *usb_context;
+	libusb_context *usb_context; /* NULL until the bus is scanned */
 	int log_level;
 	am7xxx_device *devices_list;
+	struct bus_scheduler *buses; /* the ones with scheduled devices */
 };
 
 typedef enum
@@ -402,11 +477,42 @@ static void trace_dump_buffer(am7xxx_context *ctx, const char *message,
 }
 #endif /* DEBUG */
 
+/*
+ * Simulated devices pretend to send the data at dev->simulated_rate bytes
+ * per second, one transfer after the other: the bus is busy until the end
+ * of the last transfer.
+ */
+static void simulate_transfer(am7xxx_device *dev, unsigned int len)
+{
+	uint64_t now = monotonic_usecs();
+
+	if (dev->simulated_busy_until < now)
+		dev->simulated_busy_until = now;
+
+	if (dev->simulated_rate)
+		dev->simulated_busy_until += (uint64_t)len * 1000000 / dev->simulated_rate;
+}
+
+static void wait_for_simulated_bus(am7xxx_device *dev)
+{
+	uint64_t now = monotonic_usecs();
+
+	if (dev->simulated_busy_until > now)
+		usleep_for(dev->simulated_busy_until - now);
+}
+
 static int read_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
 {
 	int ret;
 	int transferred;
 
+	/* the answers of simulated devices are known in advance */
+	if (dev->simulated)
+	{
+		error(dev->ctx, "simulated devices do not send data\n");
+		return -EIO;
+	}
+
 	transferred = 0;
 	ret = libusb_bulk_transfer(dev->usb_device, 0x81, buffer, len, &transferred, 0);
 	if (ret != 0 || (unsigned int)transferred != len)
@@ -421,30 +527,61 @@ static int read_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
 	return 0;
 }
 
-static int send_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+/*
+ * Put on the wire the images the scheduler of the bus picks, for as long
+ * as there is room. A failure is returned when it is the one of caller,
+ * which handles it as when the device is not scheduled; the failures of
+ * the other devices are left to their own threads, which hand the images
+ * back with the error, see complete_failed_transfer().
+ */
+static int run_bus(struct bus_scheduler *bus, am7xxx_device *caller)
 {
+	struct bus_member *member;
+	am7xxx_device *dev;
+	int caller_ret = 0;
 	int ret;
-	int transferred;
 
-	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
-
-	transferred = 0;
-	ret = libusb_bulk_transfer(dev->usb_device, 0x1, buffer, len, &transferred, 0);
-	if (ret != 0 || (unsigned int)transferred != len)
+	for (;;)
 	{
-		error(dev->ctx, "%s. Transferred: %d (expected %u)\n",
-			  libusb_error_name(ret), transferred, len);
-		return ret;
+		bus_lock(bus);
+		member = bus_next(bus, monotonic_usecs());
+		bus_unlock(bus);
+		if (member == NULL)
+			break;
+
+		dev = member->owner;
+		ret = libusb_submit_transfer(dev->transfer);
+		if (ret == 0)
+			continue;
+
+		bus_lock(bus);
+		bus_done(bus, member, 0, ret, monotonic_usecs());
+		if (dev != caller)
+			member->failed = ret;
+		bus_unlock(bus);
+
+		if (dev == caller)
+		{
+			caller_ret = ret;
+			continue;
+		}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		/* the thread of the device may be the one handling the events */
+		libusb_interrupt_event_handler(dev->ctx->usb_context);
+#endif
 	}
 
-	return 0;
+	return caller_ret;
 }
 
 static void LIBUSB_CALL send_data_async_complete_cb(struct libusb_transfer *transfer)
 {
-	am7xxx_device *dev = (am7xxx_device *)(transfer->user_data);
+	struct am7xxx_transfer_slot *slot = transfer->user_data;
+	am7xxx_device *dev = slot->dev;
 	int *completed = &(dev->transfer_completed);
 	int transferred = transfer->actual_length;
+	am7xxx_send_done_cb done;
 	int ret;
 
 	if (transferred != transfer->length)
@@ -483,18 +620,105 @@ static void LIBUSB_CALL send_data_async_complete_cb(struct libusb_transfer *tran
 		error(dev->ctx, "libusb transfer failed: %s",
 			  libusb_error_name(ret));
 
-	libusb_free_transfer(transfer);
-	transfer = NULL;
+	/* the next image on the bus goes on the wire right away */
+	if (dev->bus)
+	{
+		bus_lock(dev->bus);
+		bus_done(dev->bus, &dev->bus_member, transferred, ret, monotonic_usecs());
+		bus_unlock(dev->bus);
+		run_bus(dev->bus, NULL);
+	}
 
+	/* the transfer is kept for the next image */
+	dev->transfer = NULL;
 	*completed = 1;
+
+	/* hand the buffer back to the caller */
+	done = slot->done;
+	slot->done = NULL;
+	if (done)
+		done(slot->user_data, ret);
+}
+
+static void complete_simulated_transfer(am7xxx_device *dev)
+{
+	struct am7xxx_transfer_slot *slot = dev->simulated_slot;
+	am7xxx_send_done_cb done;
+
+	wait_for_simulated_bus(dev);
+
+	dev->simulated_slot = NULL;
+	dev->transfer_completed = 1;
+
+	done = slot->done;
+	slot->done = NULL;
+	if (done)
+		done(slot->user_data, 0);
+}
+
+/*
+ * Hand back the image of the device run_bus() could not put on the wire
+ * in another thread, return 1 if there was one.
+ */
+static int complete_failed_transfer(am7xxx_device *dev)
+{
+	struct am7xxx_transfer_slot *slot;
+	am7xxx_send_done_cb done;
+	int ret;
+
+	bus_lock(dev->bus);
+	ret = dev->bus_member.failed;
+	dev->bus_member.failed = 0;
+	bus_unlock(dev->bus);
+	if (ret == 0)
+		return 0;
+
+	error(dev->ctx, "libusb_submit_transfer failed: %s\n",
+		  libusb_error_name(ret));
+
+	slot = dev->transfer->user_data;
+	dev->transfer = NULL;
+	dev->transfer_completed = 1;
+
+	done = slot->done;
+	slot->done = NULL;
+	if (done)
+		done(slot->user_data, ret);
+
+	return 1;
 }
 
-static inline void wait_for_trasfer_completed(am7xxx_device *dev)
+static void wait_for_trasfer_completed(am7xxx_device *dev)
 {
+	struct timeval tv;
+
+	if (dev->simulated)
+	{
+		if (!dev->transfer_completed)
+			complete_simulated_transfer(dev);
+		return;
+	}
+
 	while (!dev->transfer_completed)
 	{
-		int ret = libusb_handle_events_completed(dev->ctx->usb_context,
+		int ret;
+
+		if (dev->bus && complete_failed_transfer(dev))
+			break;
+
+		if (dev->bus)
+		{
+			/* a failure from another thread may not wake a waiter up */
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			ret = libusb_handle_events_timeout_completed(dev->ctx->usb_context,
+														 &tv, &(dev->transfer_completed));
+		}
+		else
+		{
+			ret = libusb_handle_events_completed(dev->ctx->usb_context,
 												 &(dev->transfer_completed));
+		}
 		if (ret < 0)
 		{
 			if (ret == LIBUSB_ERROR_INTERRUPTED)
@@ -507,54 +731,168 @@ static inline void wait_for_trasfer_completed(am7xxx_device *dev)
 	}
 }
 
-static int send_data_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+static int send_data(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
 {
 	int ret;
-	uint8_t *transfer_buffer;
+	int transferred;
+
+	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
 
-	dev->transfer = libusb_alloc_transfer(0);
-	if (dev->transfer == NULL)
+	if (dev->simulated)
 	{
-		error(dev->ctx, "cannot allocate transfer (%s)\n",
-			  strerror(errno));
-		return -ENOMEM;
+		simulate_transfer(dev, len);
+		wait_for_simulated_bus(dev);
+		return 0;
 	}
 
-	/* Make a copy of the buffer so the caller can safely reuse it just
-	 * after libusb_submit_transfer() has returned. This technique
-	 * requires more dynamic allocations compared to a proper
-	 * double-buffering approach but it takes a lot less code. */
-	transfer_buffer = malloc(len);
-	if (transfer_buffer == NULL)
+	/*
+	 * An image waiting for its turn on the bus has to go before anything
+	 * sent after it, the header of the next image above all; on the
+	 * endpoint the data would wait for that image anyway.
+	 */
+	if (dev->bus)
+		wait_for_trasfer_completed(dev);
+
+	transferred = 0;
+	ret = libusb_bulk_transfer(dev->usb_device, 0x1, buffer, len, &transferred, 0);
+	if (ret != 0 || (unsigned int)transferred != len)
 	{
-		error(dev->ctx, "cannot allocate transfer buffer (%s)\n",
-			  strerror(errno));
-		ret = -ENOMEM;
-		goto err;
+		error(dev->ctx, "%s. Transferred: %d (expected %u)\n",
+			  libusb_error_name(ret), transferred, len);
+		return ret;
 	}
-	memcpy(transfer_buffer, buffer, len);
 
-	dev->transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
-	libusb_fill_bulk_transfer(dev->transfer, dev->usb_device, 0x1,
-							  transfer_buffer, len,
-							  send_data_async_complete_cb, dev, 0);
+	return 0;
+}
+
+/*
+ * Get a buffer of at least len bytes to be sent with
+ * submit_transfer_async(), it is not in use by the transfer in flight so
+ * it can be filled right away.
+ */
+static uint8_t *get_transfer_buffer(am7xxx_device *dev, unsigned int len)
+{
+	struct am7xxx_transfer_slot *slot = &(dev->transfer_slots[dev->next_transfer_slot]);
+	uint8_t *buffer;
+
+	if (slot->buffer_size < len)
+	{
+		buffer = realloc(slot->buffer, len);
+		if (buffer == NULL)
+		{
+			error(dev->ctx, "cannot allocate transfer buffer (%s)\n",
+				  strerror(errno));
+			return NULL;
+		}
+		slot->buffer = buffer;
+		slot->buffer_size = len;
+	}
+
+	return slot->buffer;
+}
+
+/*
+ * Send a buffer asynchronously after the transfer in flight completes; the
+ * buffer is either the one from get_transfer_buffer() or one owned by the
+ * caller, which is handed back by calling done.
+ */
+static int submit_transfer_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len,
+								 am7xxx_send_done_cb done, void *user_data)
+{
+	struct am7xxx_transfer_slot *slot = &(dev->transfer_slots[dev->next_transfer_slot]);
+	int ret;
+
+	if (dev->simulated)
+	{
+		wait_for_trasfer_completed(dev);
+
+		slot->done = done;
+		slot->user_data = user_data;
+
+		trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
+
+		simulate_transfer(dev, len);
+		dev->simulated_slot = slot;
+		dev->transfer_completed = 0;
+		dev->next_transfer_slot = (dev->next_transfer_slot + 1) % AM7XXX_TRANSFER_SLOTS;
+		return 0;
+	}
+
+	if (slot->transfer == NULL)
+	{
+		slot->transfer = libusb_alloc_transfer(0);
+		if (slot->transfer == NULL)
+		{
+			error(dev->ctx, "cannot allocate transfer (%s)\n",
+				  strerror(errno));
+			return -ENOMEM;
+		}
+		slot->dev = dev;
+	}
 
 	/* wait for the previous transfer to complete */
 	wait_for_trasfer_completed(dev);
 
+	libusb_fill_bulk_transfer(slot->transfer, dev->usb_device, 0x1,
+							  buffer, len,
+							  send_data_async_complete_cb, slot, 0);
+	slot->done = done;
+	slot->user_data = user_data;
+
 	trace_dump_buffer(dev->ctx, "sending -->", buffer, len);
 
+	dev->transfer = slot->transfer;
 	dev->transfer_completed = 0;
-	ret = libusb_submit_transfer(dev->transfer);
+	if (dev->bus)
+	{
+		/* the image waits for its turn on the bus */
+		bus_lock(dev->bus);
+		bus_queue(dev->bus, &dev->bus_member, len, monotonic_usecs());
+		bus_unlock(dev->bus);
+		ret = run_bus(dev->bus, dev);
+	}
+	else
+	{
+		ret = libusb_submit_transfer(slot->transfer);
+	}
 	if (ret < 0)
-		goto err;
+	{
+		dev->transfer = NULL;
+		dev->transfer_completed = 1;
+		slot->done = NULL;
+		return ret;
+	}
 
+	dev->next_transfer_slot = (dev->next_transfer_slot + 1) % AM7XXX_TRANSFER_SLOTS;
 	return 0;
+}
 
-err:
-	libusb_free_transfer(dev->transfer);
-	dev->transfer = NULL;
-	return ret;
+static void free_transfer_slots(am7xxx_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < AM7XXX_TRANSFER_SLOTS; i++)
+	{
+		libusb_free_transfer(dev->transfer_slots[i].transfer);
+		free(dev->transfer_slots[i].buffer);
+	}
+	memset(dev->transfer_slots, 0, sizeof(dev->transfer_slots));
+	dev->next_transfer_slot = 0;
+}
+
+static int send_data_async(am7xxx_device *dev, uint8_t *buffer, unsigned int len)
+{
+	uint8_t *transfer_buffer;
+
+	/* Copy the data to a transfer buffer so the caller can safely reuse
+	 * its buffer just after libusb_submit_transfer() has returned. */
+	transfer_buffer = get_transfer_buffer(dev, len);
+	if (transfer_buffer == NULL)
+		return -ENOMEM;
+
+	memcpy(transfer_buffer, buffer, len);
+
+	return submit_transfer_async(dev, transfer_buffer, len, NULL, NULL);
 }
 
 static void serialize_header(struct am7xxx_header *h, uint8_t *buffer)
@@ -635,6 +973,50 @@ static int send_header(am7xxx_device *dev, struct am7xxx_header *h)
 	return ret;
 }
 
+/*
+ * Capture files, see am7xxx_start_recording(); the records are 8 bytes
+ * aligned so that they can be read in place from a mapped file.
+ */
+#define AM7XXX_CAPTURE_MAGIC "AM7XXXRC"
+#define AM7XXX_CAPTURE_VERSION 1
+#define AM7XXX_CAPTURE_FILE_HEADER_SIZE 16
+#define AM7XXX_CAPTURE_RECORD_HEADER_SIZE (16 + AM7XXX_HEADER_WIRE_SIZE)
+#define AM7XXX_CAPTURE_ALIGNMENT 8
+
+static void record_image(am7xxx_device *dev, struct am7xxx_header *h,
+						 const uint8_t *image, unsigned int image_size)
+{
+	static const uint8_t padding[AM7XXX_CAPTURE_ALIGNMENT];
+	uint8_t record_header[AM7XXX_CAPTURE_RECORD_HEADER_SIZE];
+	uint8_t *buffer = record_header;
+	unsigned int record_size;
+	unsigned int padding_size;
+	uint64_t timestamp;
+
+	if (dev->recording == NULL)
+		return;
+
+	timestamp = monotonic_usecs() - dev->recording_start;
+	record_size = AM7XXX_CAPTURE_RECORD_HEADER_SIZE + image_size;
+	padding_size = (AM7XXX_CAPTURE_ALIGNMENT - record_size % AM7XXX_CAPTURE_ALIGNMENT) % AM7XXX_CAPTURE_ALIGNMENT;
+	record_size += padding_size;
+
+	put_le32(record_size, &buffer);
+	put_le32(timestamp & 0xffffffff, &buffer);
+	put_le32(timestamp >> 32, &buffer);
+	put_le32(image_size, &buffer);
+	serialize_header(h, buffer);
+
+	if (fwrite(record_header, 1, sizeof(record_header), dev->recording) != sizeof(record_header) ||
+		fwrite(image, 1, image_size, dev->recording) != image_size ||
+		fwrite(padding, 1, padding_size, dev->recording) != padding_size)
+	{
+		error(dev->ctx, "cannot record the image (%s), recording stopped\n",
+			  strerror(errno));
+		am7xxx_stop_recording(dev);
+	}
+}
+
 static int send_command(am7xxx_device *dev, am7xxx_packet_type type)
 {
 	struct am7xxx_header h = {
@@ -688,7 +1070,8 @@ static void log_message(am7xxx_context *ctx,
 }
 
 static am7xxx_device *add_new_device(am7xxx_context *ctx,
-									 const struct am7xxx_usb_device_descriptor *desc)
+									 const struct am7xxx_usb_device_descriptor *desc,
+									 uint16_t firmware_version)
 {
 	am7xxx_device **devices_list;
 	am7xxx_device *new_device;
@@ -709,6 +1092,7 @@ static am7xxx_device *add_new_device(am7xxx_context *ctx,
 
 	new_device->ctx = ctx;
 	new_device->desc = desc;
+	new_device->firmware_version = firmware_version;
 	new_device->transfer_completed = 1;
 
 	devices_list = &(ctx->devices_list);
@@ -727,6 +1111,26 @@ static am7xxx_device *add_new_device(am7xxx_context *ctx,
 	return new_device;
 }
 
+/* Tell where a device is plugged, like "3-1.4" */
+static void get_bus_path(libusb_device *usb_dev, char *path, size_t size)
+{
+	uint8_t ports[7];
+	size_t len;
+	int num_ports;
+	int i;
+
+	num_ports = libusb_get_port_numbers(usb_dev, ports, ARRAY_SIZE(ports));
+	if (num_ports < 0)
+		num_ports = 0;
+
+	snprintf(path, size, "%u", libusb_get_bus_number(usb_dev));
+	for (i = 0; i < num_ports; i++)
+	{
+		len = strlen(path);
+		snprintf(path + len, size - len, "%c%u", i == 0 ? '-' : '.', ports[i]);
+	}
+}
+
 static am7xxx_device *find_device(am7xxx_context *ctx,
 								  unsigned int device_index)
 {
@@ -739,8 +1143,10 @@ static am7xxx_device *find_device(am7xxx_context *ctx,
 		return NULL;
 	}
 
+	/* simulated devices have no index, and may come before the real ones
+	 * when the bus is scanned lazily */
 	current = ctx->devices_list;
-	while (current && i++ < device_index)
+	while (current && (current->simulated || i++ < device_index))
 		current = current->next;
 
 	return current;
@@ -774,6 +1180,7 @@ static int open_device(am7xxx_context *ctx,
 		debug(ctx, "libusb_open failed: %s\n", libusb_error_name(ret));
 		goto out;
 	}
+	get_bus_path(usb_dev, (*dev)->bus_path, sizeof((*dev)->bus_path));
 
 	/* XXX, the device is now open, if any of the calls below fail we need
 	 * to close it again before bailing out.
@@ -906,7 +1313,7 @@ static int scan_devices(am7xxx_context *ctx, scan_op op,
 		fatal("context must not be NULL!\n");
 		return -EINVAL;
 	}
-	if (op == SCAN_OP_BUILD_DEVLIST && ctx->devices_list != NULL)
+	if (op == SCAN_OP_BUILD_DEVLIST && find_device(ctx, 0) != NULL)
 	{
 		error(ctx, "device scan done already? Abort!\n");
 		return -EINVAL;
@@ -941,7 +1348,9 @@ static int scan_devices(am7xxx_context *ctx, scan_op op,
 					info(ctx, "am7xxx device found, index: %d, name: %s\n",
 						 current_index,
 						 supported_devices[j].name);
-					new_device = add_new_device(ctx, &supported_devices[j]);
+					new_device = add_new_device(ctx,
+												&supported_devices[j],
+												desc.bcdDevice);
 					if (new_device == NULL)
 					{
 						/* XXX, the caller may want
@@ -953,6 +1362,8 @@ static int scan_devices(am7xxx_context *ctx, scan_op op,
 						ret = -ENODEV;
 						goto out;
 					}
+					get_bus_path(list[i], new_device->bus_path,
+								 sizeof(new_device->bus_path));
 				}
 				else if (op == SCAN_OP_OPEN_DEVICE &&
 						 current_index == open_device_index)
@@ -1153,10 +1564,33 @@ static int picopix_set_zoom_mode(am7xxx_device *dev, am7xxx_zoom_mode zoom)
 
 /* Public API */
 
-AM7XXX_PUBLIC int am7xxx_init(am7xxx_context **ctx)
+/* Initialize libusb and build the list of the devices on the bus */
+static int scan_bus(am7xxx_context *ctx)
 {
 	int ret;
 
+	ret = libusb_init(&(ctx->usb_context));
+	if (ret < 0)
+	{
+		error(ctx, "libusb_init failed: %s\n", libusb_error_name(ret));
+		ctx->usb_context = NULL;
+		return ret;
+	}
+
+	libusb_set_debug(ctx->usb_context, LIBUSB_LOG_LEVEL_INFO);
+
+	ret = scan_devices(ctx, SCAN_OP_BUILD_DEVLIST, 0, NULL);
+	if (ret < 0)
+	{
+		error(ctx, "scan_devices() failed\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+static int new_context(am7xxx_context **ctx)
+{
 	*ctx = malloc(sizeof(**ctx));
 	if (*ctx == NULL)
 	{
@@ -1165,35 +1599,37 @@ AM7XXX_PUBLIC int am7xxx_init(am7xxx_context **ctx)
 	}
 	memset(*ctx, 0, sizeof(**ctx));
 
-	/* Set the highest log level during initialization */
-	(*ctx)->log_level = AM7XXX_LOG_TRACE;
+	/* Set a quieter log level as default for normal operation */
+	(*ctx)->log_level = AM7XXX_LOG_ERROR;
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_init(am7xxx_context **ctx)
+{
+	int ret;
 
-	ret = libusb_init(&((*ctx)->usb_context));
+	ret = new_context(ctx);
 	if (ret < 0)
-	{
-		error(*ctx, "libusb_init failed: %s\n", libusb_error_name(ret));
-		goto out_free_context;
-	}
+		return ret;
 
-	libusb_set_debug((*ctx)->usb_context, LIBUSB_LOG_LEVEL_INFO);
+	/* Set the highest log level during initialization */
+	(*ctx)->log_level = AM7XXX_LOG_TRACE;
 
-	ret = scan_devices(*ctx, SCAN_OP_BUILD_DEVLIST, 0, NULL);
+	ret = scan_bus(*ctx);
 	if (ret < 0)
 	{
-		error(*ctx, "scan_devices() failed\n");
 		am7xxx_shutdown(*ctx);
-		goto out;
+		*ctx = NULL;
+		return ret;
 	}
 
-	/* Set a quieter log level as default for normal operation */
 	(*ctx)->log_level = AM7XXX_LOG_ERROR;
 	return 0;
+}
 
-out_free_context:
-	free(*ctx);
-	*ctx = NULL;
-out:
-	return ret;
+AM7XXX_PUBLIC int am7xxx_init_lazy(am7xxx_context **ctx)
+{
+	return new_context(ctx);
 }
 
 AM7XXX_PUBLIC void am7xxx_shutdown(am7xxx_context *ctx)
@@ -1216,7 +1652,16 @@ AM7XXX_PUBLIC void am7xxx_shutdown(am7xxx_context *ctx)
 		current = next;
 	}
 
-	libusb_exit(ctx->usb_context);
+	while (ctx->buses)
+	{
+		struct bus_scheduler *next = ctx->buses->next;
+		bus_scheduler_destroy(ctx->buses);
+		free(ctx->buses);
+		ctx->buses = next;
+	}
+
+	if (ctx->usb_context)
+		libusb_exit(ctx->usb_context);
 	free(ctx);
 	ctx = NULL;
 }
@@ -1226,8 +1671,9 @@ AM7XXX_PUBLIC void am7xxx_set_log_level(am7xxx_context *ctx, am7xxx_log_level lo
 	ctx->log_level = log_level;
 }
 
-AM7XXX_PUBLIC int am7xxx_open_device(am7xxx_context *ctx, am7xxx_device **dev,
-									 unsigned int device_index)
+/* Open the USB device, without talking to it yet */
+static int claim_device(am7xxx_context *ctx, am7xxx_device **dev,
+						unsigned int device_index)
 {
 	int ret;
 
@@ -1237,47 +1683,800 @@ AM7XXX_PUBLIC int am7xxx_open_device(am7xxx_context *ctx, am7xxx_device **dev,
 		return -EINVAL;
 	}
 
+	/* the context has been initialized with am7xxx_init_lazy() */
+	if (ctx->usb_context == NULL)
+	{
+		ret = scan_bus(ctx);
+		if (ret < 0)
+			return ret;
+	}
+
 	ret = scan_devices(ctx, SCAN_OP_OPEN_DEVICE, device_index, dev);
 	if (ret < 0)
 	{
 		errno = ENODEV;
-		goto out;
+		return ret;
 	}
 	else if (ret > 0)
 	{
 		warning(ctx, "device %d already open\n", device_index);
 		errno = EBUSY;
-		ret = -EBUSY;
-		goto out;
+		return -EBUSY;
 	}
 
-	/* Philips/Sagemcom PicoPix projectors require that the DEVINFO packet
-	 * is the first one to be sent to the device in order for it to
-	 * successfully return the correct device information.
-	 *
-	 * NOTE: am7xxx_get_device_info() will fetch the actual device info
-	 * from the device only the very first time it's called for a given
-	 * device, otherwise, it'll return a cached version of the device info
-	 * (from a previous call to am7xxx_open_device(), for instance).
-	 */
-	ret = am7xxx_get_device_info(*dev, NULL);
-	if (ret < 0)
-		error(ctx, "cannot get device info\n");
-
-out:
-	return ret;
+	return 0;
 }
 
-AM7XXX_PUBLIC int am7xxx_close_device(am7xxx_device *dev)
-{
+/*
+ * Fill in what identifies a device in the device info cache: the model and
+ * firmware revision, the serial number if there is one, and where the
+ * device is plugged.
+ *
+ * Reading the serial number is a standard request on the control endpoint,
+ * not an am7xxx command, so it does not count as the first packet for the
+ * PicoPix projectors.
+ */
+static void get_devinfo_cache_key(am7xxx_device *dev,
+								  struct devinfo_cache_entry *entry)
+{
+	libusb_device *usb_dev;
+	struct libusb_device_descriptor desc;
+	int ret;
+	int i;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->vendor_id = dev->desc->vendor_id;
+	entry->product_id = dev->desc->product_id;
+	entry->firmware_version = dev->firmware_version;
+
+	usb_dev = libusb_get_device(dev->usb_device);
+
+	strcpy(entry->serial, "-");
+	ret = libusb_get_device_descriptor(usb_dev, &desc);
+	if (ret == 0 && desc.iSerialNumber != 0)
+	{
+		ret = libusb_get_string_descriptor_ascii(dev->usb_device,
+												 desc.iSerialNumber,
+												 (unsigned char *)entry->serial,
+												 sizeof(entry->serial));
+		if (ret <= 0)
+		{
+			debug(dev->ctx, "cannot read the serial number: %s\n",
+				  libusb_error_name(ret));
+			strcpy(entry->serial, "-");
+		}
+
+		/* the serial is one word in the cache file */
+		for (i = 0; entry->serial[i] != '\0'; i++)
+			if (entry->serial[i] <= ' ' || entry->serial[i] > '~')
+				entry->serial[i] = '_';
+	}
+
+	get_bus_path(usb_dev, entry->bus_path, sizeof(entry->bus_path));
+}
+
+static int get_devinfo_cache_path(am7xxx_device *dev, const char *cache_path,
+								  char *path, size_t len)
+{
+	int ret;
+
+	if (cache_path)
+	{
+		ret = snprintf(path, len, "%s", cache_path);
+		if (ret < 0 || (size_t)ret >= len)
+			return -ENAMETOOLONG;
+		return 0;
+	}
+
+	ret = devinfo_cache_default_path(path, len);
+	if (ret < 0)
+		debug(dev->ctx, "cannot find a default location for the device info cache\n");
+
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_open_device(am7xxx_context *ctx, am7xxx_device **dev,
+									 unsigned int device_index)
+{
+	int ret;
+
+	ret = claim_device(ctx, dev, device_index);
+	if (ret < 0)
+		goto out;
+
+	/* Philips/Sagemcom PicoPix projectors require that the DEVINFO packet
+	 * is the first one to be sent to the device in order for it to
+	 * successfully return the correct device information.
+	 *
+	 * NOTE: am7xxx_get_device_info() will fetch the actual device info
+	 * from the device only the very first time it's called for a given
+	 * device, otherwise, it'll return a cached version of the device info
+	 * (from a previous call to am7xxx_open_device(), for instance).
+	 */
+	ret = am7xxx_get_device_info(*dev, NULL);
+	if (ret < 0)
+		error(ctx, "cannot get device info\n");
+
+out:
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_open_device_cached(am7xxx_context *ctx,
+											am7xxx_device **dev,
+											unsigned int device_index,
+											const char *cache_path)
+{
+	char path[FILENAME_MAX];
+	struct devinfo_cache_entry entry;
+	am7xxx_device_info *device_info;
+	int ret;
+
+	ret = claim_device(ctx, dev, device_index);
+	if (ret < 0)
+		return ret;
+
+	/* asked already since am7xxx_init() */
+	if ((*dev)->device_info)
+		return 0;
+
+	ret = get_devinfo_cache_path(*dev, cache_path, path, sizeof(path));
+	if (ret < 0)
+	{
+		path[0] = '\0';
+		goto devinfo;
+	}
+
+	get_devinfo_cache_key(*dev, &entry);
+
+	ret = devinfo_cache_load(path, &entry);
+	if (ret < 0)
+	{
+		debug(ctx, "no device info for %04x:%04x:%04x %s %s in %s (%s)\n",
+			  entry.vendor_id, entry.product_id, entry.firmware_version,
+			  entry.serial, entry.bus_path, path, strerror(-ret));
+		goto devinfo;
+	}
+
+	device_info = malloc(sizeof(*device_info));
+	if (device_info == NULL)
+	{
+		error(ctx, "cannot allocate a device info (%s)\n",
+			  strerror(errno));
+		am7xxx_close_device(*dev);
+		*dev = NULL;
+		return -ENOMEM;
+	}
+	memset(device_info, 0, sizeof(*device_info));
+	device_info->native_width = entry.native_width;
+	device_info->native_height = entry.native_height;
+
+	(*dev)->device_info = device_info;
+	(*dev)->devinfo_unknown0 = entry.unknown0;
+	(*dev)->devinfo_unknown1 = entry.unknown1;
+
+	debug(ctx, "device info for %s loaded from %s\n", entry.bus_path, path);
+	return 0;
+
+devinfo:
+	/* The device has not been asked anything yet, so the DEVINFO packet
+	 * is still the first one as the PicoPix projectors require, see
+	 * am7xxx_open_device().
+	 */
+	ret = am7xxx_get_device_info(*dev, NULL);
+	if (ret < 0)
+	{
+		error(ctx, "cannot get device info\n");
+		return ret;
+	}
+
+	if (path[0] == '\0')
+		return 0;
+
+	entry.native_width = (*dev)->device_info->native_width;
+	entry.native_height = (*dev)->device_info->native_height;
+	entry.unknown0 = (*dev)->devinfo_unknown0;
+	entry.unknown1 = (*dev)->devinfo_unknown1;
+
+	ret = devinfo_cache_store(path, &entry);
+	if (ret < 0)
+		warning(ctx, "cannot save the device info to %s (%s)\n",
+				path, strerror(-ret));
+
+	return 0;
+}
+
+/* Where a projector switched from mass storage mode is expected to show up */
+struct modeswitch_wait
+{
+	uint8_t bus_number;
+	uint8_t ports[7];
+	int num_ports;
+
+	/* set when the projector shows up */
+	int completed;
+	libusb_device *usb_dev;
+	const struct am7xxx_usb_device_descriptor *desc;
+	uint16_t firmware_version;
+};
+
+static const struct am7xxx_usb_device_descriptor *find_descriptor(uint16_t vendor_id,
+																  uint16_t product_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(supported_devices); i++)
+		if (supported_devices[i].vendor_id == vendor_id &&
+			supported_devices[i].product_id == product_id)
+			return &supported_devices[i];
+
+	return NULL;
+}
+
+static int LIBUSB_CALL modeswitch_device_arrived(libusb_context *usb_context,
+												 libusb_device *usb_dev,
+												 libusb_hotplug_event event,
+												 void *user_data)
+{
+	struct modeswitch_wait *wait = user_data;
+	struct libusb_device_descriptor desc;
+	const struct am7xxx_usb_device_descriptor *am7xxx_desc;
+	uint8_t ports[7];
+	int num_ports;
+
+	(void)usb_context;
+	(void)event;
+
+	if (wait->completed || libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return 0;
+
+	am7xxx_desc = find_descriptor(desc.idVendor, desc.idProduct);
+	if (am7xxx_desc == NULL)
+		return 0;
+
+	/* the projector comes back on the port the storage device was on */
+	num_ports = libusb_get_port_numbers(usb_dev, ports, ARRAY_SIZE(ports));
+	if (libusb_get_bus_number(usb_dev) != wait->bus_number ||
+		num_ports < 0 || num_ports != wait->num_ports ||
+		memcmp(ports, wait->ports, num_ports) != 0)
+		return 0;
+
+	/* the device is opened outside of the callback, as libusb suggests */
+	wait->usb_dev = libusb_ref_device(usb_dev);
+	wait->desc = am7xxx_desc;
+	wait->firmware_version = desc.bcdDevice;
+	wait->completed = 1;
+	return 0;
+}
+
+static int send_modeswitch_command(am7xxx_context *ctx, libusb_device *usb_dev)
+{
+	libusb_device_handle *usb_device;
+	int current_configuration;
+	int transferred;
+	int ret;
+
+	ret = libusb_open(usb_dev, &usb_device);
+	if (ret < 0)
+	{
+		error(ctx, "libusb_open failed: %s\n", libusb_error_name(ret));
+		return ret;
+	}
+
+	current_configuration = -1;
+	ret = libusb_get_configuration(usb_device, &current_configuration);
+	if (ret < 0)
+	{
+		debug(ctx, "libusb_get_configuration failed: %s\n",
+			  libusb_error_name(ret));
+		goto out_libusb_close;
+	}
+
+	if (current_configuration != AM7XXX_STORAGE_CONFIGURATION)
+	{
+		ret = libusb_set_configuration(usb_device,
+									   AM7XXX_STORAGE_CONFIGURATION);
+		if (ret < 0)
+		{
+			debug(ctx, "libusb_set_configuration failed: %s\n",
+				  libusb_error_name(ret));
+			goto out_libusb_close;
+		}
+	}
+
+	libusb_set_auto_detach_kernel_driver(usb_device, 1);
+
+	ret = libusb_claim_interface(usb_device, AM7XXX_STORAGE_INTERFACE);
+	if (ret < 0)
+	{
+		debug(ctx, "libusb_claim_interface failed: %s\n",
+			  libusb_error_name(ret));
+		goto out_libusb_close;
+	}
+
+	transferred = 0;
+	ret = libusb_bulk_transfer(usb_device, AM7XXX_STORAGE_OUT_EP,
+							   modeswitch_command, sizeof(modeswitch_command),
+							   &transferred, 0);
+	if (ret != 0 || (unsigned int)transferred != sizeof(modeswitch_command))
+	{
+		error(ctx, "cannot send the switch command, ret: %d transferred: %d (expected %u)\n",
+			  ret, transferred, (unsigned int)sizeof(modeswitch_command));
+		if (ret == 0)
+			ret = -EIO;
+	}
+
+	libusb_release_interface(usb_device, AM7XXX_STORAGE_INTERFACE);
+out_libusb_close:
+	libusb_close(usb_device);
+	return ret;
+}
+
+/*
+ * Open a device which showed up after the bus was scanned: a closed device
+ * of the same model takes it, as when a device is plugged in again,
+ * otherwise it becomes one more device of the context.
+ */
+static int open_arrived_device(am7xxx_context *ctx,
+							   libusb_device *usb_dev,
+							   const struct am7xxx_usb_device_descriptor *desc,
+							   uint16_t firmware_version,
+							   am7xxx_device **dev)
+{
+	am7xxx_device *current;
+	unsigned int device_index = 0;
+	char bus_path[DEVINFO_BUS_PATH_MAX];
+	int ret;
+
+	/*
+	 * An entry which is not open can be another unit still plugged in, so
+	 * only the one of a device which was plugged in the same port is
+	 * reused; the indices go on pointing to the same hardware.
+	 */
+	get_bus_path(usb_dev, bus_path, sizeof(bus_path));
+	while ((current = find_device(ctx, device_index)) != NULL)
+	{
+		if (current->usb_device == NULL && current->desc == desc &&
+			strcmp(current->bus_path, bus_path) == 0)
+			break;
+		device_index++;
+	}
+
+	if (current == NULL)
+	{
+		current = add_new_device(ctx, desc, firmware_version);
+		if (current == NULL)
+			return -ENOMEM;
+		strcpy(current->bus_path, bus_path);
+	}
+	current->firmware_version = firmware_version;
+
+	/* it may be another unit, ask again */
+	free(current->device_info);
+	current->device_info = NULL;
+
+	info(ctx, "am7xxx device found, index: %d, name: %s\n",
+		 device_index, desc->name);
+
+	ret = open_device(ctx, device_index, usb_dev, dev);
+	if (ret < 0)
+	{
+		error(ctx, "cannot open the device\n");
+		return ret;
+	}
+
+	/* nothing has been sent to the device yet, see am7xxx_open_device() */
+	ret = am7xxx_get_device_info(*dev, NULL);
+	if (ret < 0)
+	{
+		error(ctx, "cannot get device info\n");
+		am7xxx_close_device(*dev);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Handle the events of libusb until *completed is set, or until the
+ * deadline if it is not 0.
+ */
+static int wait_for_events(am7xxx_context *ctx, uint64_t deadline, int *completed)
+{
+	struct timeval tv;
+	uint64_t now;
+	int ret;
+
+	while (!*completed)
+	{
+		if (deadline > 0)
+		{
+			now = monotonic_usecs();
+			if (now >= deadline)
+				return -ETIMEDOUT;
+			tv.tv_sec = (deadline - now) / 1000000;
+			tv.tv_usec = (deadline - now) % 1000000;
+			ret = libusb_handle_events_timeout_completed(ctx->usb_context,
+														 &tv, completed);
+		}
+		else
+		{
+			ret = libusb_handle_events_completed(ctx->usb_context, completed);
+		}
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+		{
+			error(ctx, "libusb_handle_events failed: %s\n",
+				  libusb_error_name(ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_modeswitch(am7xxx_context *ctx,
+									am7xxx_device **dev,
+									unsigned int timeout_ms,
+									am7xxx_modeswitch_timings *timings)
+{
+	struct modeswitch_wait wait;
+	am7xxx_modeswitch_timings phases;
+	libusb_hotplug_callback_handle callback;
+	libusb_device **list;
+	libusb_device *storage = NULL;
+	struct libusb_device_descriptor desc;
+	ssize_t num_devices;
+	uint64_t start;
+	uint64_t deadline = 0;
+	uint64_t now;
+	int i;
+	int ret;
+
+	if (ctx == NULL)
+	{
+		fatal("context must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	/* the context has been initialized with am7xxx_init_lazy() */
+	if (ctx->usb_context == NULL)
+	{
+		ret = scan_bus(ctx);
+		if (ret < 0)
+			return ret;
+	}
+
+	memset(&phases, 0, sizeof(phases));
+	start = monotonic_usecs();
+
+	num_devices = libusb_get_device_list(ctx->usb_context, &list);
+	if (num_devices < 0)
+		return -ENODEV;
+
+	for (i = 0; i < num_devices; i++)
+	{
+		if (libusb_get_device_descriptor(list[i], &desc) == 0 &&
+			desc.idVendor == AM7XXX_STORAGE_VID &&
+			desc.idProduct == AM7XXX_STORAGE_PID)
+		{
+			storage = libusb_ref_device(list[i]);
+			break;
+		}
+	}
+	libusb_free_device_list(list, 1);
+
+	if (storage == NULL)
+	{
+		error(ctx, "Cannot find any device in mass storage mode\n");
+		errno = ENODEV;
+		return -ENODEV;
+	}
+
+	memset(&wait, 0, sizeof(wait));
+	wait.bus_number = libusb_get_bus_number(storage);
+	wait.num_ports = libusb_get_port_numbers(storage, wait.ports,
+											 ARRAY_SIZE(wait.ports));
+
+	if (dev)
+	{
+		if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		{
+			error(ctx, "libusb cannot tell when the projector shows up\n");
+			ret = -ENOTSUP;
+			goto out_unref_storage;
+		}
+
+		/* listen before switching, not to miss the projector */
+		ret = libusb_hotplug_register_callback(ctx->usb_context,
+											   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+											   0,
+											   LIBUSB_HOTPLUG_MATCH_ANY,
+											   LIBUSB_HOTPLUG_MATCH_ANY,
+											   LIBUSB_HOTPLUG_MATCH_ANY,
+											   modeswitch_device_arrived,
+											   &wait,
+											   &callback);
+		if (ret != LIBUSB_SUCCESS)
+		{
+			error(ctx, "libusb_hotplug_register_callback failed: %s\n",
+				  libusb_error_name(ret));
+			goto out_unref_storage;
+		}
+	}
+
+	ret = send_modeswitch_command(ctx, storage);
+	now = monotonic_usecs();
+	phases.switch_usecs = now - start;
+	if (ret < 0 || dev == NULL)
+		goto out_deregister;
+
+	/* the events of libusb are waited for, there is no polling */
+	if (timeout_ms > 0)
+		deadline = now + (uint64_t)timeout_ms * 1000;
+	ret = wait_for_events(ctx, deadline, &wait.completed);
+	if (ret == -ETIMEDOUT)
+		error(ctx, "the projector did not show up in %u ms\n", timeout_ms);
+	if (ret < 0)
+		goto out_deregister;
+
+	now = monotonic_usecs();
+	phases.enumeration_usecs = now - start - phases.switch_usecs;
+
+	ret = open_arrived_device(ctx, wait.usb_dev, wait.desc,
+							  wait.firmware_version, dev);
+	if (ret < 0)
+		goto out_deregister;
+	phases.open_usecs = monotonic_usecs() - now;
+
+	info(ctx, "switched in %lu us, the projector showed up in %lu us and was opened in %lu us\n",
+		 phases.switch_usecs, phases.enumeration_usecs, phases.open_usecs);
+
+out_deregister:
+	if (dev)
+		libusb_hotplug_deregister_callback(ctx->usb_context, callback);
+	if (wait.usb_dev)
+		libusb_unref_device(wait.usb_dev);
+out_unref_storage:
+	libusb_unref_device(storage);
+	if (timings)
+		memcpy(timings, &phases, sizeof(*timings));
+	return ret;
+}
+
+/* A device showing up, either a projector or one in mass storage mode */
+struct arrival_wait
+{
+	am7xxx_context *ctx;
+
+	int completed;
+	libusb_device *usb_dev;
+	const struct am7xxx_usb_device_descriptor *desc; /* NULL for storage */
+	uint16_t firmware_version;
+};
+
+static int LIBUSB_CALL device_arrived(libusb_context *usb_context,
+									  libusb_device *usb_dev,
+									  libusb_hotplug_event event,
+									  void *user_data)
+{
+	struct arrival_wait *wait = user_data;
+	struct libusb_device_descriptor desc;
+	const struct am7xxx_usb_device_descriptor *am7xxx_desc;
+	am7xxx_device *current;
+
+	(void)usb_context;
+	(void)event;
+
+	/* a projector is preferred to a device which still has to be switched,
+	 * when both are reported at once */
+	if ((wait->completed && wait->desc) ||
+		libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return 0;
+
+	if (desc.idVendor == AM7XXX_STORAGE_VID &&
+		desc.idProduct == AM7XXX_STORAGE_PID)
+	{
+		if (wait->completed)
+			return 0;
+		am7xxx_desc = NULL;
+	}
+	else
+	{
+		am7xxx_desc = find_descriptor(desc.idVendor, desc.idProduct);
+		if (am7xxx_desc == NULL)
+			return 0;
+	}
+
+	/* skip the devices already open in the context */
+	for (current = wait->ctx->devices_list; current; current = current->next)
+		if (current->usb_device &&
+			libusb_get_device(current->usb_device) == usb_dev)
+			return 0;
+
+	if (wait->usb_dev)
+		libusb_unref_device(wait->usb_dev);
+
+	/* the device is opened outside of the callback, as libusb suggests */
+	wait->usb_dev = libusb_ref_device(usb_dev);
+	wait->desc = am7xxx_desc;
+	wait->firmware_version = desc.bcdDevice;
+	wait->completed = 1;
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_wait_for_device(am7xxx_context *ctx,
+										 am7xxx_device **dev,
+										 unsigned int timeout_ms)
+{
+	struct arrival_wait wait;
+	libusb_hotplug_callback_handle callback;
+	uint64_t deadline = 0;
+	int ret;
+
+	if (ctx == NULL)
+	{
+		fatal("context must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	/* the context has been initialized with am7xxx_init_lazy() */
+	if (ctx->usb_context == NULL)
+	{
+		ret = scan_bus(ctx);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		error(ctx, "libusb cannot tell when a device shows up\n");
+		return -ENOTSUP;
+	}
+
+	memset(&wait, 0, sizeof(wait));
+	wait.ctx = ctx;
+
+	/* the devices already plugged in are reported during the call */
+	ret = libusb_hotplug_register_callback(ctx->usb_context,
+										   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+										   LIBUSB_HOTPLUG_ENUMERATE,
+										   LIBUSB_HOTPLUG_MATCH_ANY,
+										   LIBUSB_HOTPLUG_MATCH_ANY,
+										   LIBUSB_HOTPLUG_MATCH_ANY,
+										   device_arrived,
+										   &wait,
+										   &callback);
+	if (ret != LIBUSB_SUCCESS)
+	{
+		error(ctx, "libusb_hotplug_register_callback failed: %s\n",
+			  libusb_error_name(ret));
+		return ret;
+	}
+
+	if (timeout_ms > 0)
+		deadline = monotonic_usecs() + (uint64_t)timeout_ms * 1000;
+
+	for (;;)
+	{
+		ret = wait_for_events(ctx, deadline, &wait.completed);
+		if (ret < 0)
+			goto out;
+
+		if (wait.desc)
+			break;
+
+		/* the projector shows up later as a new device */
+		info(ctx, "switching a device from mass storage mode\n");
+		ret = send_modeswitch_command(ctx, wait.usb_dev);
+		if (ret < 0)
+			goto out;
+		libusb_unref_device(wait.usb_dev);
+		wait.usb_dev = NULL;
+		wait.completed = 0;
+	}
+
+	ret = open_arrived_device(ctx, wait.usb_dev, wait.desc,
+							  wait.firmware_version, dev);
+
+out:
+	libusb_hotplug_deregister_callback(ctx->usb_context, callback);
+	if (wait.usb_dev)
+		libusb_unref_device(wait.usb_dev);
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_open_simulated_device(am7xxx_context *ctx,
+											   am7xxx_device **dev,
+											   const char *model,
+											   unsigned long bytes_per_second)
+{
+	const struct am7xxx_usb_device_descriptor *desc = NULL;
+	am7xxx_device_info *device_info;
+	am7xxx_device *new_device;
+	unsigned int i;
+
+	if (ctx == NULL)
+	{
+		fatal("context must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(supported_devices); i++)
+	{
+		if (model == NULL || strstr(supported_devices[i].name, model))
+		{
+			desc = &supported_devices[i];
+			break;
+		}
+	}
+	if (desc == NULL)
+	{
+		error(ctx, "unknown model '%s', the supported ones are:\n", model);
+		for (i = 0; i < ARRAY_SIZE(supported_devices); i++)
+			error(ctx, "\t%s\n", supported_devices[i].name);
+		errno = ENODEV;
+		return -ENODEV;
+	}
+
+	/* there is nothing to ask, the device info is always the cached one */
+	device_info = malloc(sizeof(*device_info));
+	if (device_info == NULL)
+	{
+		error(ctx, "cannot allocate a device info (%s)\n",
+			  strerror(errno));
+		return -ENOMEM;
+	}
+	memset(device_info, 0, sizeof(*device_info));
+	device_info->native_width = desc->native_width;
+	device_info->native_height = desc->native_height;
+
+	new_device = add_new_device(ctx, desc, 0);
+	if (new_device == NULL)
+	{
+		free(device_info);
+		return -ENOMEM;
+	}
+
+	new_device->simulated = 1;
+	new_device->simulated_rate = bytes_per_second;
+	new_device->device_info = device_info;
+
+	info(ctx, "simulating a %s, %ux%u\n", desc->name,
+		 desc->native_width, desc->native_height);
+
+	*dev = new_device;
+	return 0;
+}
+
+/* Stop scheduling the device, nothing of it must be waiting or on the wire */
+static void leave_bus(am7xxx_device *dev)
+{
+	if (dev->bus == NULL)
+		return;
+
+	bus_lock(dev->bus);
+	bus_leave(dev->bus, &dev->bus_member);
+	bus_unlock(dev->bus);
+	dev->bus = NULL;
+}
+
+AM7XXX_PUBLIC int am7xxx_close_device(am7xxx_device *dev)
+{
 	if (dev == NULL)
 	{
 		fatal("dev must not be NULL!\n");
 		return -EINVAL;
 	}
+	am7xxx_stop_recording(dev);
+	if (dev->simulated)
+	{
+		wait_for_trasfer_completed(dev);
+		free_transfer_slots(dev);
+	}
 	if (dev->usb_device)
 	{
 		wait_for_trasfer_completed(dev);
+		leave_bus(dev);
+		free_transfer_slots(dev);
 		libusb_release_interface(dev->usb_device, dev->desc->interface_number);
 		libusb_close(dev->usb_device);
 		dev->usb_device = NULL;
@@ -1321,17 +2520,123 @@ AM7XXX_PUBLIC int am7xxx_get_device_info(am7xxx_device *dev,
 	}
 	memset(dev->device_info, 0, sizeof(*dev->device_info));
 
-	dev->device_info->native_width = h.header_data.devinfo.native_width;
-	dev->device_info->native_height = h.header_data.devinfo.native_height;
-#if 0
-	/* No reason to expose these in the public API until we know what they mean */
-	dev->device_info->unknown0 = h.header_data.devinfo.unknown0;
-	dev->device_info->unknown1 = h.header_data.devinfo.unknown1;
-#endif
+	dev->device_info->native_width = h.header_data.devinfo.native_width;
+	dev->device_info->native_height = h.header_data.devinfo.native_height;
+#if 0
+	/* No reason to expose these in the public API until we know what they mean */
+	dev->device_info->unknown0 = h.header_data.devinfo.unknown0;
+	dev->device_info->unknown1 = h.header_data.devinfo.unknown1;
+#endif
+	dev->devinfo_unknown0 = h.header_data.devinfo.unknown0;
+	dev->devinfo_unknown1 = h.header_data.devinfo.unknown1;
+
+return_value:
+	if (device_info)
+		memcpy(device_info, dev->device_info, sizeof(*device_info));
+	return 0;
+}
+
+static int get_profiles_path(am7xxx_device *dev, const char *profiles_path,
+							 char *path, size_t len)
+{
+	int ret;
+
+	if (profiles_path)
+	{
+		ret = snprintf(path, len, "%s", profiles_path);
+		if (ret < 0 || (size_t)ret >= len)
+			return -ENAMETOOLONG;
+		return 0;
+	}
+
+	ret = profile_default_path(path, len);
+	if (ret < 0)
+		debug(dev->ctx, "cannot find a default location for the profiles file\n");
+
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_get_device_profile(am7xxx_device *dev,
+											const char *profiles_path,
+											am7xxx_device_profile *profile)
+{
+	char path[FILENAME_MAX];
+	int ret;
+
+	if (dev == NULL)
+	{
+		fatal("dev must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (profile == NULL)
+	{
+		error(dev->ctx, "profile must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	memset(profile, 0, sizeof(*profile));
+	profile->vendor_id = dev->desc->vendor_id;
+	profile->product_id = dev->desc->product_id;
+	profile->firmware_version = dev->firmware_version;
+
+	ret = get_profiles_path(dev, profiles_path, path, sizeof(path));
+	if (ret < 0)
+		return ret;
+
+	ret = profile_load(path, profile);
+	if (ret < 0)
+	{
+		debug(dev->ctx, "no profile for %04x:%04x:%04x in %s (%s)\n",
+			  profile->vendor_id, profile->product_id,
+			  profile->firmware_version, path, strerror(-ret));
+		return -ENOENT;
+	}
+
+	info(dev->ctx, "profile for %04x:%04x:%04x loaded from %s\n",
+		 profile->vendor_id, profile->product_id,
+		 profile->firmware_version, path);
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_save_device_profile(am7xxx_device *dev,
+											 const char *profiles_path,
+											 const am7xxx_device_profile *profile)
+{
+	char path[FILENAME_MAX];
+	am7xxx_device_profile device_profile;
+	int ret;
+
+	if (dev == NULL)
+	{
+		fatal("dev must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (profile == NULL)
+	{
+		error(dev->ctx, "profile must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	memcpy(&device_profile, profile, sizeof(device_profile));
+	device_profile.vendor_id = dev->desc->vendor_id;
+	device_profile.product_id = dev->desc->product_id;
+	device_profile.firmware_version = dev->firmware_version;
+
+	ret = get_profiles_path(dev, profiles_path, path, sizeof(path));
+	if (ret < 0)
+		return ret;
+
+	ret = profile_store(path, &device_profile);
+	if (ret < 0)
+	{
+		error(dev->ctx, "cannot save the profile to %s (%s)\n",
+			  path, strerror(-ret));
+		return ret;
+	}
 
-return_value:
-	if (device_info)
-		memcpy(device_info, dev->device_info, sizeof(*device_info));
 	return 0;
 }
 
@@ -1403,6 +2708,105 @@ AM7XXX_PUBLIC int am7xxx_calc_scaled_image_dimensions(am7xxx_device *dev,
 	return 0;
 }
 
+AM7XXX_PUBLIC int am7xxx_scaler_new(am7xxx_device *dev,
+									am7xxx_scaler **scaler,
+									am7xxx_pixel_format input_format,
+									unsigned int input_width,
+									unsigned int input_height,
+									unsigned int upscale,
+									am7xxx_scale_method method)
+{
+	am7xxx_device_info device_info;
+	unsigned int scaled_width;
+	unsigned int scaled_height;
+	int ret;
+
+	if (scaler == NULL)
+	{
+		error(dev->ctx, "scaler must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	switch (input_format)
+	{
+	case AM7XXX_PIXEL_FORMAT_YUV420P:
+	case AM7XXX_PIXEL_FORMAT_NV12:
+		break;
+	default:
+		error(dev->ctx, "Unsupported pixel format.\n");
+		return -EINVAL;
+	}
+
+	switch (method)
+	{
+	case AM7XXX_SCALE_BILINEAR:
+	case AM7XXX_SCALE_AREA:
+		break;
+	default:
+		error(dev->ctx, "Unsupported scale method.\n");
+		return -EINVAL;
+	}
+
+	ret = am7xxx_get_device_info(dev, &device_info);
+	if (ret < 0)
+	{
+		error(dev->ctx, "cannot get device info\n");
+		return ret;
+	}
+
+	ret = am7xxx_calc_scaled_image_dimensions(dev,
+											  upscale,
+											  input_width,
+											  input_height,
+											  &scaled_width,
+											  &scaled_height);
+	if (ret < 0)
+		return ret;
+
+	/* NV12 chroma is subsampled, keep all the dimensions even */
+	scaled_width &= ~1U;
+	scaled_height &= ~1U;
+
+	ret = scaler_new(scaler, input_format,
+					 input_width, input_height,
+					 scaled_width, scaled_height,
+					 device_info.native_width & ~1U,
+					 device_info.native_height & ~1U,
+					 method);
+	if (ret < 0)
+	{
+		error(dev->ctx, "cannot create a scaler for %ux%u (%s)\n",
+			  input_width, input_height, strerror(-ret));
+		return ret;
+	}
+
+	debug(dev->ctx, "scaler: %ux%u -> %ux%u in %ux%u\n",
+		  input_width, input_height, scaled_width, scaled_height,
+		  device_info.native_width, device_info.native_height);
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_scaler_scale(am7xxx_scaler *scaler,
+									  const uint8_t *const planes[],
+									  const int linesizes[],
+									  uint8_t *output)
+{
+	if (scaler == NULL || planes == NULL || linesizes == NULL || output == NULL)
+	{
+		fatal("scaler, planes, linesizes and output must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	scaler_scale(scaler, planes, linesizes, output);
+	return 0;
+}
+
+AM7XXX_PUBLIC void am7xxx_scaler_free(am7xxx_scaler *scaler)
+{
+	scaler_free(scaler);
+}
+
 AM7XXX_PUBLIC int am7xxx_send_image(am7xxx_device *dev,
 									am7xxx_image_format format,
 									unsigned int width,
@@ -1437,6 +2841,8 @@ AM7XXX_PUBLIC int am7xxx_send_image(am7xxx_device *dev,
 		return 0;
 	}
 
+	record_image(dev, &h, image, image_size);
+
 	return send_data(dev, image, image_size);
 }
 
@@ -1474,9 +2880,339 @@ AM7XXX_PUBLIC int am7xxx_send_image_async(am7xxx_device *dev,
 		return 0;
 	}
 
+	record_image(dev, &h, image, image_size);
+
 	return send_data_async(dev, image, image_size);
 }
 
+AM7XXX_PUBLIC int am7xxx_send_image_planes_async(am7xxx_device *dev,
+												 am7xxx_pixel_format format,
+												 unsigned int width,
+												 unsigned int height,
+												 const uint8_t *const planes[],
+												 const int linesizes[])
+{
+	int ret;
+	uint8_t *transfer_buffer;
+	unsigned int image_size;
+	struct am7xxx_header h = {
+		.packet_type = AM7XXX_PACKET_TYPE_IMAGE,
+		.direction = AM7XXX_DIRECTION_OUT,
+		.header_data_len = sizeof(struct am7xxx_image_header),
+		.unknown2 = 0x3e,
+		.unknown3 = 0x10,
+		.header_data = {
+			.image = {
+				.format = AM7XXX_IMAGE_FORMAT_NV12,
+				.width = width,
+				.height = height,
+			},
+		},
+	};
+
+	if (planes == NULL || linesizes == NULL)
+	{
+		error(dev->ctx, "planes and linesizes must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (width == 0 || height == 0 || (width & 1) || (height & 1))
+	{
+		error(dev->ctx, "invalid image dimensions %ux%u, they must be even\n",
+			  width, height);
+		return -EINVAL;
+	}
+
+	switch (format)
+	{
+	case AM7XXX_PIXEL_FORMAT_YUV420P:
+	case AM7XXX_PIXEL_FORMAT_NV12:
+		break;
+	default:
+		error(dev->ctx, "Unsupported pixel format.\n");
+		return -EINVAL;
+	}
+
+	image_size = width * height * 3 / 2;
+	h.header_data.image.image_size = image_size;
+
+	/* The planes are packed directly into the transfer buffer, so this
+	 * costs the same copy made by am7xxx_send_image_async() */
+	transfer_buffer = get_transfer_buffer(dev, image_size);
+	if (transfer_buffer == NULL)
+		return -ENOMEM;
+
+	pack_nv12(format, width, height, planes, linesizes,
+			  transfer_buffer, transfer_buffer + width * height, width);
+
+	ret = send_header(dev, &h);
+	if (ret < 0)
+		return ret;
+
+	record_image(dev, &h, transfer_buffer, image_size);
+
+	return submit_transfer_async(dev, transfer_buffer, image_size, NULL, NULL);
+}
+
+AM7XXX_PUBLIC int am7xxx_send_image_async_nocopy(am7xxx_device *dev,
+												 am7xxx_image_format format,
+												 unsigned int width,
+												 unsigned int height,
+												 uint8_t *image,
+												 unsigned int image_size,
+												 am7xxx_send_done_cb done,
+												 void *user_data)
+{
+	int ret;
+	struct am7xxx_header h = {
+		.packet_type = AM7XXX_PACKET_TYPE_IMAGE,
+		.direction = AM7XXX_DIRECTION_OUT,
+		.header_data_len = sizeof(struct am7xxx_image_header),
+		.unknown2 = 0x3e,
+		.unknown3 = 0x10,
+		.header_data = {
+			.image = {
+				.format = format,
+				.width = width,
+				.height = height,
+				.image_size = image_size,
+			},
+		},
+	};
+
+	if (done == NULL)
+	{
+		error(dev->ctx, "done must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	ret = send_header(dev, &h);
+	if (ret < 0)
+		return ret;
+
+	if (image == NULL || image_size == 0)
+	{
+		warning(dev->ctx, "Not sending any data, check the 'image' or 'image_size' parameters\n");
+		done(user_data, 0);
+		return 0;
+	}
+
+	record_image(dev, &h, image, image_size);
+
+	return submit_transfer_async(dev, image, image_size, done, user_data);
+}
+
+AM7XXX_PUBLIC int am7xxx_start_recording(am7xxx_device *dev, const char *path)
+{
+	uint8_t file_header[AM7XXX_CAPTURE_FILE_HEADER_SIZE];
+	uint8_t *buffer = file_header;
+	FILE *file;
+	int ret;
+
+	if (dev == NULL || path == NULL)
+	{
+		fatal("dev and path must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (dev->recording)
+	{
+		error(dev->ctx, "the device is already being recorded\n");
+		return -EBUSY;
+	}
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		ret = -errno;
+		error(dev->ctx, "cannot open %s (%s)\n", path, strerror(errno));
+		return ret;
+	}
+
+	memcpy(buffer, AM7XXX_CAPTURE_MAGIC, 8);
+	buffer += 8;
+	put_le32(AM7XXX_CAPTURE_VERSION, &buffer);
+	put_le32(AM7XXX_CAPTURE_RECORD_HEADER_SIZE, &buffer);
+
+	if (fwrite(file_header, 1, sizeof(file_header), file) != sizeof(file_header))
+	{
+		error(dev->ctx, "cannot write to %s (%s)\n", path, strerror(errno));
+		fclose(file);
+		return -EIO;
+	}
+
+	dev->recording = file;
+	dev->recording_start = monotonic_usecs();
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_stop_recording(am7xxx_device *dev)
+{
+	int ret = 0;
+
+	if (dev == NULL)
+	{
+		fatal("dev must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (dev->recording == NULL)
+		return 0;
+
+	if (fclose(dev->recording) != 0)
+	{
+		error(dev->ctx, "cannot finish the recording (%s)\n", strerror(errno));
+		ret = -EIO;
+	}
+	dev->recording = NULL;
+
+	return ret;
+}
+
+AM7XXX_PUBLIC int am7xxx_flush_async(am7xxx_device *dev)
+{
+	if (dev == NULL)
+	{
+		fatal("dev must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	wait_for_trasfer_completed(dev);
+	return 0;
+}
+
+static struct bus_scheduler *get_bus(am7xxx_context *ctx, uint8_t bus_number)
+{
+	struct bus_scheduler *bus;
+	int ret;
+
+	for (bus = ctx->buses; bus; bus = bus->next)
+		if (bus->bus_number == bus_number)
+			return bus;
+
+	bus = malloc(sizeof(*bus));
+	if (bus == NULL)
+	{
+		error(ctx, "cannot allocate the bus scheduler (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	ret = bus_scheduler_init(bus, bus_number);
+	if (ret < 0)
+	{
+		error(ctx, "cannot initialize the bus scheduler (%s)\n", strerror(-ret));
+		free(bus);
+		return NULL;
+	}
+
+	bus->next = ctx->buses;
+	ctx->buses = bus;
+	return bus;
+}
+
+AM7XXX_PUBLIC int am7xxx_set_bus_share(am7xxx_device *dev,
+									   unsigned int weight,
+									   double target_fps)
+{
+	struct bus_scheduler *bus;
+	unsigned int bus_devices;
+
+	if (dev == NULL)
+	{
+		fatal("dev must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (target_fps < 0)
+	{
+		error(dev->ctx, "the target frame rate must not be negative\n");
+		return -EINVAL;
+	}
+
+	if (dev->simulated)
+	{
+		error(dev->ctx, "simulated devices are not on any bus\n");
+		return -ENOTSUP;
+	}
+
+	if (dev->usb_device == NULL)
+	{
+		error(dev->ctx, "the device is not open\n");
+		return -ENODEV;
+	}
+
+	/* the share changes between two images */
+	wait_for_trasfer_completed(dev);
+
+	if (weight == 0 && target_fps == 0)
+	{
+		leave_bus(dev);
+		return 0;
+	}
+
+	bus = dev->bus;
+	if (bus == NULL)
+	{
+		bus = get_bus(dev->ctx, libusb_get_bus_number(libusb_get_device(dev->usb_device)));
+		if (bus == NULL)
+			return -ENOMEM;
+
+		dev->bus_member.owner = dev;
+		dev->bus_member.average_size = 0;
+		bus_lock(bus);
+		bus_join(bus, &dev->bus_member, monotonic_usecs());
+		bus_unlock(bus);
+		dev->bus = bus;
+	}
+
+	bus_lock(bus);
+	dev->bus_member.weight = weight;
+	dev->bus_member.target_fps = target_fps;
+	bus_devices = bus->member_count;
+	bus_unlock(bus);
+
+	if (target_fps > 0)
+		info(dev->ctx, "scheduled on bus %u at %.2f fps, %u devices share it\n",
+			 bus->bus_number, target_fps, bus_devices);
+	else
+		info(dev->ctx, "scheduled on bus %u with weight %u, %u devices share it\n",
+			 bus->bus_number, weight, bus_devices);
+
+	return 0;
+}
+
+AM7XXX_PUBLIC int am7xxx_get_bus_stats(am7xxx_device *dev,
+									   am7xxx_bus_stats *stats)
+{
+	struct bus_member *member;
+
+	if (dev == NULL || stats == NULL)
+	{
+		fatal("dev and stats must not be NULL!\n");
+		return -EINVAL;
+	}
+
+	if (dev->bus == NULL)
+	{
+		debug(dev->ctx, "the device is not scheduled, see am7xxx_set_bus_share()\n");
+		return -ENOENT;
+	}
+
+	member = &dev->bus_member;
+
+	bus_lock(dev->bus);
+	bus_update_rates(member, monotonic_usecs());
+	stats->bus_number = dev->bus->bus_number;
+	stats->bus_devices = dev->bus->member_count;
+	stats->images = member->images;
+	stats->fps = member->fps;
+	stats->bytes_per_second = member->bytes_per_second;
+	stats->wait_usecs = member->wait_usecs;
+	bus_unlock(dev->bus);
+
+	return 0;
+}
+
 AM7XXX_PUBLIC int am7xxx_set_power_mode(am7xxx_device *dev, am7xxx_power_mode power)
 {
 	if (dev->desc->ops.set_power_mode == NULL)
@@ -45,6 +45,14 @@ extern "C"
 	struct _am7xxx_device;
 	typedef struct _am7xxx_device am7xxx_device;
 
+	/**
+	 * @typedef am7xxx_scaler
+	 *
+	 * An opaque data type representing an image scaler.
+	 */
+	struct _am7xxx_scaler;
+	typedef struct _am7xxx_scaler am7xxx_scaler;
+
 	/**
 	 * A struct describing device specific properties.
 	 *
@@ -59,6 +67,52 @@ extern "C"
 		unsigned int native_height; /**< The device native height. */
 	} am7xxx_device_info;
 
+	/**
+	 * A struct describing the measured capabilities of a device.
+	 *
+	 * Different device models, and different firmware revisions of the same
+	 * model, accept data at very different rates; a user program may want to
+	 * inspect the profile of a device before sending the first frame in
+	 * order to size its queues or to choose the image quality.
+	 *
+	 * Profiles are measured by the am7xxx-probe program and stored in
+	 * a profiles file, one per device model and firmware revision.
+	 */
+	typedef struct
+	{
+		unsigned int vendor_id;		   /**< The USB Vendor ID of the device. */
+		unsigned int product_id;	   /**< The USB Product ID of the device. */
+		unsigned int firmware_version; /**< The firmware revision of the device (the bcdDevice field of the USB device descriptor). */
+		unsigned int bulk_throughput;  /**< The bulk throughput in bytes per second, apart from frame_delay_us, 0 if not measured. */
+		unsigned int frame_delay_us;   /**< The per-frame processing delay of the firmware, in microseconds. */
+		float max_fps_jpeg;			   /**< The max frame rate for JPEG images of jpeg_frame_size bytes at native size, 0 if not measured. */
+		float max_fps_nv12;			   /**< The max frame rate for NV12 images at native size, 0 if not measured. */
+		unsigned int jpeg_frame_size;  /**< The size in bytes of the JPEG image used to measure max_fps_jpeg. */
+	} am7xxx_device_profile;
+
+	/**
+	 * How long each phase of am7xxx_modeswitch() took, in microseconds.
+	 */
+	typedef struct
+	{
+		unsigned long switch_usecs;		 /**< Finding the device in mass storage mode and sending it the switch command. */
+		unsigned long enumeration_usecs; /**< Waiting for the projector to show up on the bus. */
+		unsigned long open_usecs;		 /**< Opening the projector and getting its device info. */
+	} am7xxx_modeswitch_timings;
+
+	/**
+	 * How a device scheduled with am7xxx_set_bus_share() is doing.
+	 */
+	typedef struct
+	{
+		unsigned int bus_number;  /**< The USB bus the device is on. */
+		unsigned int bus_devices; /**< How many scheduled devices share the bus, this one included. */
+		unsigned long images;	  /**< The images sent since the device was scheduled. */
+		double fps;				  /**< The frame rate achieved, over the last second or so. */
+		double bytes_per_second;  /**< The data rate achieved, over the same period. */
+		unsigned long wait_usecs; /**< How long the images waited for their turn on the bus, in total. */
+	} am7xxx_bus_stats;
+
 	/**
 	 * The verbosity level of logging messages.
 	 *
@@ -85,6 +139,24 @@ extern "C"
 		AM7XXX_IMAGE_FORMAT_NV12 = 2, /**< Raw YUV in the NV12 variant. */
 	} am7xxx_image_format;
 
+	/**
+	 * The layouts of the YUV 4:2:0 images accepted by the scaler.
+	 */
+	typedef enum
+	{
+		AM7XXX_PIXEL_FORMAT_YUV420P = 0, /**< Planar YUV 4:2:0, with separate Y, U and V planes (I420). */
+		AM7XXX_PIXEL_FORMAT_NV12 = 1,	 /**< Semi-planar YUV 4:2:0, with a Y plane and an interleaved UV plane. */
+	} am7xxx_pixel_format;
+
+	/**
+	 * The filters used by the scaler.
+	 */
+	typedef enum
+	{
+		AM7XXX_SCALE_BILINEAR = 0, /**< Bilinear interpolation, fast, fine for upscaling and mild downscaling. */
+		AM7XXX_SCALE_AREA = 1,	   /**< Area averaging, avoids aliasing when downscaling by large factors. */
+	} am7xxx_scale_method;
+
 	/**
 	 * The device power modes.
 	 *
@@ -132,6 +204,15 @@ extern "C"
 		AM7XXX_ZOOM_TELE = 4,	  /**< Zoom Tele: available on some PicoPix models. */
 	} am7xxx_zoom_mode;
 
+	/**
+	 * The function called when the library does not need an image buffer
+	 * passed to am7xxx_send_image_async_nocopy() anymore.
+	 *
+	 * @param[in] user_data The pointer passed along with the image
+	 * @param[in] status 0 if the image was sent, a negative value on error
+	 */
+	typedef void (*am7xxx_send_done_cb)(void *user_data, int status);
+
 	/**
 	 * Initialize the library context and data structures, and scan for devices.
 	 *
@@ -141,6 +222,23 @@ extern "C"
 	 */
 	int am7xxx_init(am7xxx_context **ctx);
 
+	/**
+	 * Initialize the library context and data structures, leaving the scan
+	 * for devices to the first call to am7xxx_open_device().
+	 *
+	 * The USB bus is not touched at all until a device is opened, so that
+	 * a program can do its own setup first, and simulated devices can be
+	 * used without any USB access.
+	 *
+	 * @note The devices found when scanning the bus are logged with the
+	 * log level of the context at that time.
+	 *
+	 * @param[out] ctx A pointer to the context the library will be used in.
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_init_lazy(am7xxx_context **ctx);
+
 	/**
 	 * Cleanup the library data structures and free the context.
 	 *
@@ -165,7 +263,8 @@ extern "C"
 	 * Open an am7xxx_device according to a index.
 	 *
 	 * The semantics of the 'device_index' argument follows the order
-	 * of the devices as found when scanning the bus at am7xxx_init() time.
+	 * of the devices as found when scanning the bus at am7xxx_init() time,
+	 * or at the first call when using am7xxx_init_lazy().
 	 *
 	 * @note When the user tries to open a device already opened the function
 	 * returns -EBUSY and the device is left open.
@@ -180,6 +279,117 @@ extern "C"
 						   am7xxx_device **dev,
 						   unsigned int device_index);
 
+	/**
+	 * Open an am7xxx_device according to a index, trusting a persistent
+	 * cache of the device info.
+	 *
+	 * This is like am7xxx_open_device() but the device info is looked up
+	 * in a cache file first, keyed by the USB Vendor ID, Product ID,
+	 * firmware revision, serial number and bus path of the device; only
+	 * when the device is not in the cache it is asked for its info, which is
+	 * then saved in the cache. This spares a round trip to the device
+	 * before the first image can be sent.
+	 *
+	 * When cache_path is NULL the cache file is looked up in the location
+	 * given by the AM7XXX_DEVINFO_CACHE environment variable, or in
+	 * $XDG_CACHE_HOME/libam7xxx/devinfo, or in
+	 * $HOME/.cache/libam7xxx/devinfo, in this order.
+	 *
+	 * @note The cached info is trusted as it is: if a device reports
+	 * different info after a firmware update which does not change its
+	 * revision, the entry has to be removed from the cache file.
+	 *
+	 * @param[in] ctx The context to open the device in
+	 * @param[out] dev A pointer to the structure representing the device to open
+	 * @param[in] device_index The index of the device on the bus
+	 * @param[in] cache_path The path of the cache file, or NULL for the default location
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_open_device_cached(am7xxx_context *ctx,
+								  am7xxx_device **dev,
+								  unsigned int device_index,
+								  const char *cache_path);
+
+	/**
+	 * Switch a device from mass storage mode to projector mode, and open it.
+	 *
+	 * Some devices show up as mass storage (USB ID 1de1:1101) when plugged
+	 * in, and become projectors only after a vendor command is sent to
+	 * them. This function sends the command to the first such device and,
+	 * when dev is not NULL, waits for the projector to show up on the same
+	 * port and opens it, so a program does not need to be started again by
+	 * a udev rule.
+	 *
+	 * The wait is driven by the hotplug events of libusb, without polling;
+	 * the projector takes the place of a closed device of the same model,
+	 * or becomes the last device of the context.
+	 *
+	 * @note Waiting needs a libusb with hotplug support, -ENOTSUP is
+	 * returned otherwise and no command is sent.
+	 *
+	 * @param[in] ctx The context to open the device in
+	 * @param[out] dev A pointer to the structure representing the projector, or NULL to only send the switch command
+	 * @param[in] timeout_ms How long to wait for the projector, 0 to wait for ever
+	 * @param[out] timings Where to store how long each phase took, or NULL (see @link am7xxx_modeswitch_timings @endlink)
+	 *
+	 * @return 0 on success, -ENODEV if no device is in mass storage mode, -ETIMEDOUT if the projector did not show up in time, another negative value on error
+	 */
+	int am7xxx_modeswitch(am7xxx_context *ctx,
+						  am7xxx_device **dev,
+						  unsigned int timeout_ms,
+						  am7xxx_modeswitch_timings *timings);
+
+	/**
+	 * Wait for a device to be plugged in, and open it.
+	 *
+	 * Any of the supported models is accepted, and devices which are
+	 * already plugged in but not open in the context are reported at once.
+	 * Devices in mass storage mode are switched to projector mode on the
+	 * way, as am7xxx_modeswitch() does.
+	 *
+	 * This is meant for programs which stay around while devices come and
+	 * go: after an error telling that the device went away
+	 * (LIBUSB_ERROR_NO_DEVICE), the device can be closed with
+	 * am7xxx_close_device() and this function called again; a device of
+	 * the same model plugged in again takes the same am7xxx_device slot,
+	 * the device info is read again in case it is another unit.
+	 *
+	 * @note Waiting needs a libusb with hotplug support, -ENOTSUP is
+	 * returned otherwise.
+	 *
+	 * @param[in] ctx The context to open the device in
+	 * @param[out] dev A pointer to the structure representing the device
+	 * @param[in] timeout_ms How long to wait for a device, 0 to wait for ever
+	 *
+	 * @return 0 on success, -ETIMEDOUT if no device showed up in time, another negative value on error
+	 */
+	int am7xxx_wait_for_device(am7xxx_context *ctx,
+							   am7xxx_device **dev,
+							   unsigned int timeout_ms);
+
+	/**
+	 * Open a simulated am7xxx_device, not backed by any hardware.
+	 *
+	 * The simulated device has the native dimensions of one of the supported
+	 * models and pretends to send the images at the given rate, so that the
+	 * time it takes to prepare and send them can be measured without a
+	 * projector; it does nothing else and always succeeds.
+	 *
+	 * @note The device is closed and freed like any other one.
+	 *
+	 * @param[in] ctx The context to open the device in
+	 * @param[out] dev A pointer to the structure representing the device to open
+	 * @param[in] model A part of the model name, like "C110" or "PicoPix 2055", NULL for the first model
+	 * @param[in] bytes_per_second The rate of the simulated bus, 0 for no limit
+	 *
+	 * @return 0 on success, -ENODEV if the model is not known, another negative value on error
+	 */
+	int am7xxx_open_simulated_device(am7xxx_context *ctx,
+									 am7xxx_device **dev,
+									 const char *model,
+									 unsigned long bytes_per_second);
+
 	/**
 	 * Close an am7xxx_device.
 	 *
@@ -206,6 +416,50 @@ extern "C"
 	int am7xxx_get_device_info(am7xxx_device *dev,
 							   am7xxx_device_info *device_info);
 
+	/**
+	 * Get the capability profile of an am7xxx device.
+	 *
+	 * Look up the profile measured for the model and firmware revision of
+	 * the device in a profiles file.
+	 *
+	 * When profiles_path is NULL the profiles file is looked up in the
+	 * location given by the AM7XXX_PROFILES environment variable, or in
+	 * $XDG_CONFIG_HOME/libam7xxx/profiles, or in
+	 * $HOME/.config/libam7xxx/profiles, in this order.
+	 *
+	 * @note The vendor_id, product_id and firmware_version fields of the
+	 * profile are filled in even when no profile is found, so the caller can
+	 * tell the user which device needs to be probed.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device to get the profile of
+	 * @param[in] profiles_path The path of the profiles file, or NULL for the default location
+	 * @param[out] profile A pointer to the structure where to store the profile (see @link am7xxx_device_profile @endlink)
+	 *
+	 * @return 0 on success, -ENOENT if there is no profile for the device, another negative value on error
+	 */
+	int am7xxx_get_device_profile(am7xxx_device *dev,
+								  const char *profiles_path,
+								  am7xxx_device_profile *profile);
+
+	/**
+	 * Save the capability profile of an am7xxx device.
+	 *
+	 * Store the profile in a profiles file, replacing any previous profile
+	 * for the same model and firmware revision.
+	 *
+	 * @note The vendor_id, product_id and firmware_version fields of the
+	 * profile are ignored, the ones of the device are used instead.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device the profile has been measured on
+	 * @param[in] profiles_path The path of the profiles file, or NULL for the default location (see am7xxx_get_device_profile())
+	 * @param[in] profile A pointer to the profile to save (see @link am7xxx_device_profile @endlink)
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_save_device_profile(am7xxx_device *dev,
+								   const char *profiles_path,
+								   const am7xxx_device_profile *profile);
+
 	/**
 	 * Calculate the dimensions of an image to be shown on an am7xxx device.
 	 *
@@ -228,6 +482,62 @@ extern "C"
 											unsigned int original_height,
 											unsigned int *scaled_width,
 											unsigned int *scaled_height);
+	/**
+	 * Create a scaler to convert images to the device native size.
+	 *
+	 * The scaler outputs NV12 images of exactly the device native
+	 * dimensions: the input image is scaled preserving its aspect ratio, as
+	 * calculated by am7xxx_calc_scaled_image_dimensions(), centered, and the
+	 * remaining area is filled with black letterbox or pillarbox bars.
+	 *
+	 * The filter coefficients are computed once here, and reused for all
+	 * the images scaled with am7xxx_scaler_scale(); a new scaler is needed
+	 * when the input dimensions change.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device to scale images for
+	 * @param[out] scaler A pointer to the new scaler
+	 * @param[in] input_format The layout of the input images (see @link am7xxx_pixel_format @endlink enum)
+	 * @param[in] input_width The width of the input images
+	 * @param[in] input_height The height of the input images
+	 * @param[in] upscale Whether to upscale images smaller than the native dimensions
+	 * @param[in] method The filter to use (see @link am7xxx_scale_method @endlink enum)
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_scaler_new(am7xxx_device *dev,
+						  am7xxx_scaler **scaler,
+						  am7xxx_pixel_format input_format,
+						  unsigned int input_width,
+						  unsigned int input_height,
+						  unsigned int upscale,
+						  am7xxx_scale_method method);
+
+	/**
+	 * Scale an image to the device native size.
+	 *
+	 * The output buffer must hold native_width * native_height * 3 / 2 bytes,
+	 * and can be passed to am7xxx_send_image() with the
+	 * AM7XXX_IMAGE_FORMAT_NV12 format and the native dimensions.
+	 *
+	 * @param[in] scaler The scaler to use
+	 * @param[in] planes The planes of the input image: Y, U and V for AM7XXX_PIXEL_FORMAT_YUV420P, Y and UV for AM7XXX_PIXEL_FORMAT_NV12
+	 * @param[in] linesizes The size in bytes of a line of each plane
+	 * @param[out] output The buffer where to store the scaled NV12 image
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_scaler_scale(am7xxx_scaler *scaler,
+							const unsigned char *const planes[],
+							const int linesizes[],
+							unsigned char *output);
+
+	/**
+	 * Free a scaler.
+	 *
+	 * @param[in] scaler The scaler to free
+	 */
+	void am7xxx_scaler_free(am7xxx_scaler *scaler);
+
 	/**
 	 * Send an image for display on an am7xxx device.
 	 *
@@ -277,6 +587,151 @@ extern "C"
 								unsigned char *image,
 								unsigned int image_size);
 
+	/**
+	 * Queue transfer of a YUV 4:2:0 image made of separate planes for display on an am7xxx device.
+	 *
+	 * This is like am7xxx_send_image_async() with the
+	 * AM7XXX_IMAGE_FORMAT_NV12 format, but the image does not need to be
+	 * a single contiguous NV12 buffer: the planes are packed, and the
+	 * chroma interleaved if needed, directly into the transfer buffer.
+	 * This way decoded frames can be sent without converting them first.
+	 *
+	 * The image is not scaled, so its dimensions should fit the device
+	 * native ones, see am7xxx_get_device_info().
+	 *
+	 * @param[in] dev A pointer to the structure representing the device to get info of
+	 * @param[in] format The layout of the image planes (see @link am7xxx_pixel_format @endlink enum)
+	 * @param[in] width The width of the image, must be even
+	 * @param[in] height The height of the image, must be even
+	 * @param[in] planes The planes of the image: Y, U and V for AM7XXX_PIXEL_FORMAT_YUV420P, Y and UV for AM7XXX_PIXEL_FORMAT_NV12
+	 * @param[in] linesizes The size in bytes of a line of each plane
+	 *
+	 * @note The planes can be reused as soon as the function returns.
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_send_image_planes_async(am7xxx_device *dev,
+									   am7xxx_pixel_format format,
+									   unsigned int width,
+									   unsigned int height,
+									   const unsigned char *const planes[],
+									   const int linesizes[]);
+
+	/**
+	 * Queue transfer of an image for display on an am7xxx device without copying it.
+	 *
+	 * This is like am7xxx_send_image_async() but the image is sent straight
+	 * from the buffer of the caller, which must stay valid and unchanged
+	 * until the done callback is called. The callback is called from
+	 * inside the library, while waiting for the transfer to complete:
+	 * at the latest when sending the next image, or when calling
+	 * am7xxx_flush_async() or am7xxx_close_device().
+	 *
+	 * @param[in] dev A pointer to the structure representing the device to get info of
+	 * @param[in] format The format the image is in (see @link am7xxx_image_format @endlink enum)
+	 * @param[in] width The width of the image
+	 * @param[in] height The height of the image
+	 * @param[in] image A buffer holding data in the format specified by the format parameter
+	 * @param[in] image_size The size in bytes of the image buffer
+	 * @param[in] done The function to call when the buffer is not needed anymore
+	 * @param[in] user_data A pointer passed to the done callback
+	 *
+	 * @note When the function fails the callback is not called, and the
+	 * buffer can be reused right away.
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_send_image_async_nocopy(am7xxx_device *dev,
+									   am7xxx_image_format format,
+									   unsigned int width,
+									   unsigned int height,
+									   unsigned char *image,
+									   unsigned int image_size,
+									   am7xxx_send_done_cb done,
+									   void *user_data);
+
+	/**
+	 * Wait for the images queued with the _async() functions to be sent.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device
+	 *
+	 * @return 0 on success, a negative value on error
+	 */
+	int am7xxx_flush_async(am7xxx_device *dev);
+
+	/**
+	 * Share the bandwidth of a USB bus with the other devices on it.
+	 *
+	 * Devices on the same bus compete for its bandwidth, and without
+	 * scheduling the one sending the larger images, or sending them more
+	 * often, gets ahead of the others. The images sent with the _async()
+	 * functions by the devices of a context which share a bus are instead
+	 * put on the wire in turn, with deficit round-robin: each device gets
+	 * a share of the bytes in proportion to its weight, or enough for its
+	 * target frame rate, whatever the size of its images.
+	 *
+	 * A weight of 1 is worth 16 KiB per turn, a target frame rate of 30
+	 * is worth one image per turn, so the two can be mixed on one bus.
+	 * Only the devices of the context which are scheduled take turns, the
+	 * others, and the ones of other programs, are not held back.
+	 *
+	 * @note This is meant to be called while setting up the devices,
+	 * before sending images from several threads.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device
+	 * @param[in] weight The share of the device, 0 and a target_fps of 0 to stop scheduling it
+	 * @param[in] target_fps The frame rate the device should get, 0 to use the weight
+	 *
+	 * @return 0 on success, -ENOTSUP for simulated devices, another negative value on error
+	 */
+	int am7xxx_set_bus_share(am7xxx_device *dev,
+							 unsigned int weight,
+							 double target_fps);
+
+	/**
+	 * Get how a device scheduled with am7xxx_set_bus_share() is doing.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device
+	 * @param[out] stats Where to store the statistics (see @link am7xxx_bus_stats @endlink)
+	 *
+	 * @return 0 on success, -ENOENT if the device is not scheduled, another negative value on error
+	 */
+	int am7xxx_get_bus_stats(am7xxx_device *dev, am7xxx_bus_stats *stats);
+
+	/**
+	 * Record the images sent to an am7xxx device to a capture file.
+	 *
+	 * From now on every image sent with one of the am7xxx_send_image*()
+	 * functions is also appended to the file, so that it can be sent again
+	 * later, with the same timing, by am7xxx-replay.
+	 *
+	 * The file starts with a 16 bytes header: the 8 characters "AM7XXXRC",
+	 * the format version (1) and the size of the record headers (40), both
+	 * as 32 bits little endian integers. Each image is then a record made
+	 * of, as 32 bits little endian integers: the size of the whole record,
+	 * the low and the high half of the time it was sent in microseconds
+	 * since the recording started, the size of the image; then the 24
+	 * bytes image header as sent on the wire, the image, and the padding
+	 * which keeps the records aligned to 8 bytes.
+	 *
+	 * @note Recording stops when the device is closed.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device
+	 * @param[in] path The capture file, it is overwritten if it exists
+	 *
+	 * @return 0 on success, -EBUSY if the device is already being recorded, another negative value on error
+	 */
+	int am7xxx_start_recording(am7xxx_device *dev, const char *path);
+
+	/**
+	 * Stop recording the images sent to an am7xxx device.
+	 *
+	 * @param[in] dev A pointer to the structure representing the device
+	 *
+	 * @return 0 on success, a negative value if the capture file could not be completed
+	 */
+	int am7xxx_stop_recording(am7xxx_device *dev);
+
 	/**
 	 * Set the power mode of an am7xxx device.
 	 *
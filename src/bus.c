@@ -0,0 +1,276 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "bus.h"
+
+/*
+ * The devices on a bus take turns with deficit round-robin: at each turn
+ * a device waiting to send an image earns its quantum of bytes, and sends
+ * the image once it has earned enough; so the bandwidth is shared in
+ * proportion to the quanta, whatever the size of the images.
+ *
+ * Two images can be on the wire at a time, so that the next one is
+ * already submitted when the previous completes and the bus never idles
+ * between the two. A device sends one image at a time, so it cannot take
+ * two turns in a row when others are waiting.
+ */
+#define BUS_MAX_IN_FLIGHT 2
+
+/* The quantum of a device of weight 1 */
+#define BUS_QUANTUM 16384
+
+/* A device asking for this frame rate earns one image per turn */
+#define BUS_QUANTUM_FPS 30.0
+
+/* The achieved rates are measured over this period */
+#define BUS_RATES_WINDOW_USECS 1000000
+
+int bus_scheduler_init(struct bus_scheduler *bus, uint8_t bus_number)
+{
+	memset(bus, 0, sizeof(*bus));
+	bus->bus_number = bus_number;
+
+#ifdef _WIN32
+	InitializeCriticalSection(&bus->lock);
+	return 0;
+#else
+	return -pthread_mutex_init(&bus->lock, NULL);
+#endif
+}
+
+void bus_scheduler_destroy(struct bus_scheduler *bus)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(&bus->lock);
+#else
+	pthread_mutex_destroy(&bus->lock);
+#endif
+}
+
+void bus_lock(struct bus_scheduler *bus)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&bus->lock);
+#else
+	pthread_mutex_lock(&bus->lock);
+#endif
+}
+
+void bus_unlock(struct bus_scheduler *bus)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&bus->lock);
+#else
+	pthread_mutex_unlock(&bus->lock);
+#endif
+}
+
+static uint64_t bus_quantum(const struct bus_member *member)
+{
+	double quantum;
+
+	if (member->target_fps > 0)
+		quantum = member->target_fps * member->average_size / BUS_QUANTUM_FPS;
+	else
+		quantum = (double)member->weight * BUS_QUANTUM;
+
+	return quantum < 1 ? 1 : (uint64_t)quantum;
+}
+
+/*
+ * The images on the wire side by side get the same bandwidth, whatever
+ * the shares of their devices; so a device only joins the ones already
+ * on the wire when it is behind them, in quanta put on the wire, or it
+ * would get ahead of its share. With nothing on the wire any device
+ * waiting can go.
+ */
+static int bus_member_waiting(const struct bus_scheduler *bus,
+							  const struct bus_member *member)
+{
+	const struct bus_member *other;
+
+	if (!member->queued || member->in_flight)
+		return 0;
+
+	for (other = bus->members; other; other = other->next)
+		if (other->in_flight && member->service >= other->service)
+			return 0;
+
+	return 1;
+}
+
+void bus_join(struct bus_scheduler *bus, struct bus_member *member, uint64_t now)
+{
+	struct bus_member *last;
+
+	member->next = NULL;
+	member->deficit = 0;
+	member->queued = 0;
+	member->in_flight = 0;
+	member->service = bus->service;
+	member->failed = 0;
+	member->images = 0;
+	member->wait_usecs = 0;
+	member->window_start = now;
+	member->window_images = 0;
+	member->window_bytes = 0;
+	member->fps = 0;
+	member->bytes_per_second = 0;
+
+	if (bus->members == NULL)
+	{
+		bus->members = member;
+	}
+	else
+	{
+		last = bus->members;
+		while (last->next)
+			last = last->next;
+		last->next = member;
+	}
+	bus->member_count++;
+}
+
+/* The member has nothing waiting nor on the wire */
+void bus_leave(struct bus_scheduler *bus, struct bus_member *member)
+{
+	struct bus_member **link = &bus->members;
+
+	while (*link && *link != member)
+		link = &(*link)->next;
+	if (*link == NULL)
+		return;
+
+	*link = member->next;
+	if (bus->current == member)
+		bus->current = member->next;
+	bus->member_count--;
+}
+
+void bus_queue(struct bus_scheduler *bus, struct bus_member *member,
+			   unsigned int size, uint64_t now)
+{
+	/* a device which stayed idle does not make up for it */
+	if (member->service < bus->service)
+		member->service = bus->service;
+
+	if (member->average_size == 0)
+		member->average_size = size;
+	else
+		member->average_size += (size - member->average_size) / 8;
+
+	member->queued = size;
+	member->queued_time = now;
+}
+
+/*
+ * Pick the member whose image goes on the wire next, NULL when the bus is
+ * full or nobody is waiting.
+ */
+struct bus_member *bus_next(struct bus_scheduler *bus, uint64_t now)
+{
+	struct bus_member *member;
+	uint64_t quantum;
+	uint64_t rounds;
+	uint64_t min_rounds = UINT64_MAX;
+	unsigned int i;
+
+	if (bus->in_flight >= BUS_MAX_IN_FLIGHT)
+		return NULL;
+
+	/* the turns in which nobody could send are all taken at once */
+	for (member = bus->members; member; member = member->next)
+	{
+		if (!bus_member_waiting(bus, member))
+			continue;
+
+		quantum = bus_quantum(member);
+		rounds = 0;
+		if (member->queued > member->deficit)
+			rounds = (member->queued - member->deficit + quantum - 1) / quantum;
+		if (rounds < min_rounds)
+			min_rounds = rounds;
+	}
+	if (min_rounds == UINT64_MAX)
+		return NULL;
+
+	if (min_rounds > 1)
+		for (member = bus->members; member; member = member->next)
+			if (bus_member_waiting(bus, member))
+				member->deficit += (min_rounds - 1) * bus_quantum(member);
+
+	/* someone is done within this turn */
+	member = bus->current ? bus->current : bus->members;
+	for (i = 0; i < bus->member_count; i++)
+	{
+		bus->current = member->next ? member->next : bus->members;
+
+		if (bus_member_waiting(bus, member))
+		{
+			quantum = bus_quantum(member);
+			member->deficit += quantum;
+			if (member->deficit >= member->queued)
+			{
+				member->deficit -= member->queued;
+				bus->service = member->service;
+				member->service += (double)member->queued / quantum;
+				member->in_flight = 1;
+				member->wait_usecs += now - member->queued_time;
+				bus->in_flight++;
+				return member;
+			}
+		}
+
+		member = bus->current;
+	}
+
+	return NULL;
+}
+
+void bus_done(struct bus_scheduler *bus, struct bus_member *member,
+			  unsigned int size, int status, uint64_t now)
+{
+	member->queued = 0;
+	member->in_flight = 0;
+	bus->in_flight--;
+
+	if (status == 0)
+	{
+		member->images++;
+		member->window_images++;
+		member->window_bytes += size;
+	}
+
+	bus_update_rates(member, now);
+}
+
+void bus_update_rates(struct bus_member *member, uint64_t now)
+{
+	uint64_t elapsed = now - member->window_start;
+
+	if (elapsed < BUS_RATES_WINDOW_USECS)
+		return;
+
+	member->fps = member->window_images * 1000000.0 / elapsed;
+	member->bytes_per_second = member->window_bytes * 1000000.0 / elapsed;
+	member->window_start = now;
+	member->window_images = 0;
+	member->window_bytes = 0;
+}
@@ -0,0 +1,91 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BUS_H
+#define __BUS_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION bus_mutex;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t bus_mutex;
+#endif
+
+/*
+ * A device taking part in the scheduling of a bus; it has at most one
+ * image waiting for the bus or on the wire at a time.
+ */
+struct bus_member
+{
+	struct bus_member *next;
+	void *owner;
+
+	/* the share of the bus, target_fps wins when it is not 0 */
+	unsigned int weight;
+	double target_fps;
+	double average_size; /* of the images, to turn target_fps into bytes */
+
+	uint64_t deficit;	  /* bytes it can send, deficit round-robin */
+	unsigned int queued;  /* the size of the image waiting, 0 for none */
+	uint64_t queued_time; /* when it started waiting */
+	int in_flight;
+	double service; /* the quanta it has put on the wire, see bus_next() */
+	int failed; /* the error of an image another thread could not send */
+
+	/* statistics, since joining the bus and over the last window */
+	uint64_t images;
+	uint64_t wait_usecs;
+	uint64_t window_start;
+	uint64_t window_images;
+	uint64_t window_bytes;
+	double fps;
+	double bytes_per_second;
+};
+
+struct bus_scheduler
+{
+	struct bus_scheduler *next;
+	uint8_t bus_number;
+	bus_mutex lock;
+
+	struct bus_member *members;
+	struct bus_member *current; /* where the next round goes on from */
+	unsigned int member_count;
+	unsigned int in_flight;
+	double service; /* the one of the member which went on the wire last */
+};
+
+int bus_scheduler_init(struct bus_scheduler *bus, uint8_t bus_number);
+void bus_scheduler_destroy(struct bus_scheduler *bus);
+void bus_lock(struct bus_scheduler *bus);
+void bus_unlock(struct bus_scheduler *bus);
+
+/* the functions below are called with the bus locked */
+void bus_join(struct bus_scheduler *bus, struct bus_member *member, uint64_t now);
+void bus_leave(struct bus_scheduler *bus, struct bus_member *member);
+void bus_queue(struct bus_scheduler *bus, struct bus_member *member,
+			   unsigned int size, uint64_t now);
+struct bus_member *bus_next(struct bus_scheduler *bus, uint64_t now);
+void bus_done(struct bus_scheduler *bus, struct bus_member *member,
+			  unsigned int size, int status, uint64_t now);
+void bus_update_rates(struct bus_member *member, uint64_t now);
+
+#endif /* __BUS_H */
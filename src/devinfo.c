@@ -0,0 +1,261 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "devinfo.h"
+#include "tools.h"
+
+/*
+ * The device info cache is a plain text file with one device per line, in
+ * the format below; empty lines and lines starting with '#' are ignored:
+ *
+ *   vid:pid:fw serial bus_path native_width native_height unknown0 unknown1
+ *
+ * For example:
+ *
+ *   1de1:c101:0100 - 3-1.4 800 480 1 0
+ */
+#define DEVINFO_FILE_HEADER                                              \
+	"# libam7xxx device info cache, safe to remove\n"                    \
+	"# vid:pid:fw serial bus_path native_width native_height unknown0 unknown1\n"
+
+#define DEVINFO_LINE_MAX 256
+
+/**
+ * Get the default location of the device info cache
+ *
+ * @param[out] path The buffer where to store the path
+ * @param[in] len The size of the path buffer
+ *
+ * @return 0 on success, a negative value on error
+ */
+int devinfo_cache_default_path(char *path, size_t len)
+{
+	const char *env;
+	int ret;
+
+	env = getenv("AM7XXX_DEVINFO_CACHE");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s", env);
+		goto out;
+	}
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s/libam7xxx/devinfo", env);
+		goto out;
+	}
+
+	env = getenv("HOME");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s/.cache/libam7xxx/devinfo", env);
+		goto out;
+	}
+
+	return -ENOENT;
+
+out:
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static int parse_devinfo_line(const char *line, struct devinfo_cache_entry *entry)
+{
+	int ret;
+
+	if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+		return -EINVAL;
+
+	/* the field widths are DEVINFO_SERIAL_MAX and DEVINFO_BUS_PATH_MAX minus 1 */
+	ret = sscanf(line, "%x:%x:%x %63s %31s %u %u %u %u",
+				 &entry->vendor_id,
+				 &entry->product_id,
+				 &entry->firmware_version,
+				 entry->serial,
+				 entry->bus_path,
+				 &entry->native_width,
+				 &entry->native_height,
+				 &entry->unknown0,
+				 &entry->unknown1);
+	if (ret != 9)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int write_devinfo_line(FILE *file, const struct devinfo_cache_entry *entry)
+{
+	return fprintf(file, "%04x:%04x:%04x %s %s %u %u %u %u\n",
+				   entry->vendor_id,
+				   entry->product_id,
+				   entry->firmware_version,
+				   entry->serial,
+				   entry->bus_path,
+				   entry->native_width,
+				   entry->native_height,
+				   entry->unknown0,
+				   entry->unknown1);
+}
+
+static int same_key(const struct devinfo_cache_entry *a,
+					const struct devinfo_cache_entry *b)
+{
+	return a->vendor_id == b->vendor_id &&
+		   a->product_id == b->product_id &&
+		   a->firmware_version == b->firmware_version &&
+		   strcmp(a->serial, b->serial) == 0 &&
+		   strcmp(a->bus_path, b->bus_path) == 0;
+}
+
+/**
+ * Load the device info of a device from the cache
+ *
+ * @param[in] path The path of the cache file
+ * @param[in,out] entry The entry to load, the vendor_id, product_id,
+ *                firmware_version, serial and bus_path fields are used as
+ *                the lookup key
+ *
+ * @return 0 on success, -ENOENT if the device is not in the cache, another
+ *         negative value on error
+ */
+int devinfo_cache_load(const char *path, struct devinfo_cache_entry *entry)
+{
+	char line[DEVINFO_LINE_MAX];
+	struct devinfo_cache_entry current;
+	FILE *file;
+	int ret;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return -errno;
+
+	ret = -ENOENT;
+	while (fgets(line, sizeof(line), file))
+	{
+		if (parse_devinfo_line(line, &current) < 0)
+			continue;
+
+		if (same_key(&current, entry))
+		{
+			memcpy(entry, &current, sizeof(*entry));
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ferror(file))
+		ret = -EIO;
+
+	fclose(file);
+	return ret;
+}
+
+/**
+ * Store the device info of a device in the cache
+ *
+ * The entry replaces any previous one with the same key, other lines of the
+ * file are preserved.
+ *
+ * @param[in] path The path of the cache file
+ * @param[in] entry The entry to store
+ *
+ * @return 0 on success, a negative value on error
+ */
+int devinfo_cache_store(const char *path, const struct devinfo_cache_entry *entry)
+{
+	char tmp_path[FILENAME_MAX];
+	char line[DEVINFO_LINE_MAX];
+	struct devinfo_cache_entry current;
+	FILE *in;
+	FILE *out;
+	int found;
+	int ret;
+
+	ret = make_parent_dir(path);
+	if (ret < 0)
+		return ret;
+
+	/* programs opening devices at the same time each write their own file */
+	out = create_temp_file(path, tmp_path, sizeof(tmp_path));
+	if (out == NULL)
+		return -errno;
+
+	found = 0;
+	in = fopen(path, "r");
+	if (in == NULL && errno != ENOENT)
+	{
+		/* the other entries would be lost */
+		ret = -errno;
+		fclose(out);
+		remove(tmp_path);
+		return ret;
+	}
+	if (in == NULL)
+	{
+		fputs(DEVINFO_FILE_HEADER, out);
+	}
+	else
+	{
+		while (fgets(line, sizeof(line), in))
+		{
+			if (parse_devinfo_line(line, &current) == 0 &&
+				same_key(&current, entry))
+			{
+				if (!found)
+					write_devinfo_line(out, entry);
+				found = 1;
+				continue;
+			}
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	if (!found)
+		write_devinfo_line(out, entry);
+
+	ret = ferror(out);
+	if (fclose(out) == EOF || ret)
+	{
+		remove(tmp_path);
+		return -EIO;
+	}
+
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	remove(path);
+#endif
+	ret = rename(tmp_path, path);
+	if (ret < 0)
+	{
+		ret = -errno;
+		remove(tmp_path);
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEVINFO_H
+#define __DEVINFO_H
+
+#include <stddef.h>
+
+#define DEVINFO_SERIAL_MAX 64
+#define DEVINFO_BUS_PATH_MAX 32
+
+/*
+ * What a device answers to the DEVINFO command, along with what identifies
+ * the device it was read from.
+ */
+struct devinfo_cache_entry
+{
+	unsigned int vendor_id;
+	unsigned int product_id;
+	unsigned int firmware_version;
+	char serial[DEVINFO_SERIAL_MAX];	 /* "-" when the device has none */
+	char bus_path[DEVINFO_BUS_PATH_MAX]; /* like "3-1.4" */
+	unsigned int native_width;
+	unsigned int native_height;
+	unsigned int unknown0;
+	unsigned int unknown1;
+};
+
+int devinfo_cache_default_path(char *path, size_t len);
+int devinfo_cache_load(const char *path, struct devinfo_cache_entry *entry);
+int devinfo_cache_store(const char *path, const struct devinfo_cache_entry *entry);
+
+#endif /* __DEVINFO_H */
@@ -0,0 +1,254 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "profile.h"
+#include "tools.h"
+
+/*
+ * The profiles file is a plain text file with one profile per line, in the
+ * format below; empty lines and lines starting with '#' are ignored:
+ *
+ *   vid:pid:fw bulk_throughput frame_delay_us max_fps_jpeg max_fps_nv12 jpeg_frame_size
+ *
+ * For example:
+ *
+ *   1de1:c101:0100 21345678 1250 27.50 9.10 46210
+ */
+#define PROFILE_FILE_HEADER                                                         \
+	"# libam7xxx device profiles, measured with am7xxx-probe\n"                     \
+	"# vid:pid:fw bulk_throughput frame_delay_us max_fps_jpeg max_fps_nv12 jpeg_frame_size\n"
+
+#define PROFILE_LINE_MAX 256
+
+/**
+ * Get the default location of the profiles file
+ *
+ * @param[out] path The buffer where to store the path
+ * @param[in] len The size of the path buffer
+ *
+ * @return 0 on success, a negative value on error
+ */
+int profile_default_path(char *path, size_t len)
+{
+	const char *env;
+	int ret;
+
+	env = getenv("AM7XXX_PROFILES");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s", env);
+		goto out;
+	}
+
+	env = getenv("XDG_CONFIG_HOME");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s/libam7xxx/profiles", env);
+		goto out;
+	}
+
+	env = getenv("HOME");
+	if (env && env[0] != '\0')
+	{
+		ret = snprintf(path, len, "%s/.config/libam7xxx/profiles", env);
+		goto out;
+	}
+
+	return -ENOENT;
+
+out:
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static int parse_profile_line(const char *line, am7xxx_device_profile *profile)
+{
+	int ret;
+
+	if (line[0] == '#' || line[0] == '\n' || line[0] == '\0')
+		return -EINVAL;
+
+	ret = sscanf(line, "%x:%x:%x %u %u %f %f %u",
+				 &profile->vendor_id,
+				 &profile->product_id,
+				 &profile->firmware_version,
+				 &profile->bulk_throughput,
+				 &profile->frame_delay_us,
+				 &profile->max_fps_jpeg,
+				 &profile->max_fps_nv12,
+				 &profile->jpeg_frame_size);
+	if (ret != 8)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int write_profile_line(FILE *file, const am7xxx_device_profile *profile)
+{
+	return fprintf(file, "%04x:%04x:%04x %u %u %.2f %.2f %u\n",
+				   profile->vendor_id,
+				   profile->product_id,
+				   profile->firmware_version,
+				   profile->bulk_throughput,
+				   profile->frame_delay_us,
+				   profile->max_fps_jpeg,
+				   profile->max_fps_nv12,
+				   profile->jpeg_frame_size);
+}
+
+static int same_key(const am7xxx_device_profile *a, const am7xxx_device_profile *b)
+{
+	return a->vendor_id == b->vendor_id &&
+		   a->product_id == b->product_id &&
+		   a->firmware_version == b->firmware_version;
+}
+
+/**
+ * Load a profile from a profiles file
+ *
+ * @param[in] path The path of the profiles file
+ * @param[in,out] profile The profile to load, the vendor_id, product_id and
+ *                firmware_version fields are used as the lookup key
+ *
+ * @return 0 on success, -ENOENT if no profile was found, another negative
+ *         value on error
+ */
+int profile_load(const char *path, am7xxx_device_profile *profile)
+{
+	char line[PROFILE_LINE_MAX];
+	am7xxx_device_profile current;
+	FILE *file;
+	int ret;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return -errno;
+
+	ret = -ENOENT;
+	while (fgets(line, sizeof(line), file))
+	{
+		if (parse_profile_line(line, &current) < 0)
+			continue;
+
+		if (same_key(&current, profile))
+		{
+			memcpy(profile, &current, sizeof(*profile));
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ferror(file))
+		ret = -EIO;
+
+	fclose(file);
+	return ret;
+}
+
+/**
+ * Store a profile in a profiles file
+ *
+ * The profile replaces any previous one with the same vendor_id, product_id
+ * and firmware_version, other lines of the file are preserved.
+ *
+ * @param[in] path The path of the profiles file
+ * @param[in] profile The profile to store
+ *
+ * @return 0 on success, a negative value on error
+ */
+int profile_store(const char *path, const am7xxx_device_profile *profile)
+{
+	char tmp_path[FILENAME_MAX];
+	char line[PROFILE_LINE_MAX];
+	am7xxx_device_profile current;
+	FILE *in;
+	FILE *out;
+	int found;
+	int ret;
+
+	ret = make_parent_dir(path);
+	if (ret < 0)
+		return ret;
+
+	/* probes running at the same time each write their own file */
+	out = create_temp_file(path, tmp_path, sizeof(tmp_path));
+	if (out == NULL)
+		return -errno;
+
+	found = 0;
+	in = fopen(path, "r");
+	if (in == NULL && errno != ENOENT)
+	{
+		/* the other profiles would be lost */
+		ret = -errno;
+		fclose(out);
+		remove(tmp_path);
+		return ret;
+	}
+	if (in == NULL)
+	{
+		fputs(PROFILE_FILE_HEADER, out);
+	}
+	else
+	{
+		while (fgets(line, sizeof(line), in))
+		{
+			if (parse_profile_line(line, &current) == 0 &&
+				same_key(&current, profile))
+			{
+				if (!found)
+					write_profile_line(out, profile);
+				found = 1;
+				continue;
+			}
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	if (!found)
+		write_profile_line(out, profile);
+
+	ret = ferror(out);
+	if (fclose(out) == EOF || ret)
+	{
+		remove(tmp_path);
+		return -EIO;
+	}
+
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	remove(path);
+#endif
+	ret = rename(tmp_path, path);
+	if (ret < 0)
+	{
+		ret = -errno;
+		remove(tmp_path);
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stddef.h>
+
+#include "am7xxx.h"
+
+int profile_default_path(char *path, size_t len);
+int profile_load(const char *path, am7xxx_device_profile *profile);
+int profile_store(const char *path, const am7xxx_device_profile *profile);
+
+#endif /* __PROFILE_H */
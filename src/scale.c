@@ -0,0 +1,680 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "scale.h"
+
+/*
+ * The scaler is separable: each output row is computed by filtering
+ * 'taps' input rows vertically into an intermediate row, which is then
+ * filtered horizontally into the output.
+ *
+ * All the arithmetic is fixed-point:
+ *   - filter coefficients are in Q14 and each set sums to exactly 1 << 14
+ *   - the intermediate rows hold 16 bit samples in Q7 (max 255 << 7)
+ */
+#define COEFF_BITS 14
+#define INTER_BITS 7
+#define VSCALE_SHIFT (COEFF_BITS - INTER_BITS)
+#define HSCALE_SHIFT (COEFF_BITS + INTER_BITS)
+
+/* The values used to fill the letterbox or pillarbox bars */
+#define BLACK_Y 16
+#define BLACK_UV 128
+
+struct scale_filter
+{
+	unsigned int taps;
+	unsigned int *offsets; /* first input sample, for each output sample */
+	int16_t *coeffs;	   /* 'taps' coefficients, for each output sample */
+};
+
+struct _am7xxx_scaler
+{
+	am7xxx_pixel_format input_format;
+	unsigned int input_width;
+	unsigned int input_height;
+	unsigned int scaled_width;
+	unsigned int scaled_height;
+	unsigned int output_width;
+	unsigned int output_height;
+	unsigned int x_offset;
+	unsigned int y_offset;
+	int passthrough;
+	struct scale_filter luma_h;
+	struct scale_filter luma_v;
+	struct scale_filter chroma_h;
+	struct scale_filter chroma_v;
+	const uint8_t **rows;
+	int16_t *inter;
+};
+
+static void free_filter(struct scale_filter *filter)
+{
+	free(filter->offsets);
+	free(filter->coeffs);
+	filter->offsets = NULL;
+	filter->coeffs = NULL;
+}
+
+/*
+ * Weight of the input sample 'i' for an output sample covering the input
+ * interval [start, end), for the area method.
+ */
+static double area_weight(unsigned int i, double start, double end)
+{
+	double lo = start > i ? start : i;
+	double hi = end < i + 1 ? end : i + 1;
+
+	return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Precompute the coefficients to scale 'input_size' samples to
+ * 'output_size' samples.
+ *
+ * The weights for input samples falling out of the image are folded onto
+ * the edge samples, and the offsets are clamped so that 'taps' samples
+ * starting from each offset are always valid.
+ */
+static int init_filter(struct scale_filter *filter,
+					   unsigned int input_size,
+					   unsigned int output_size,
+					   am7xxx_scale_method method)
+{
+	double scale = (double)input_size / output_size;
+	double weights[64];
+	unsigned int taps;
+	unsigned int i;
+
+	if (method == AM7XXX_SCALE_AREA)
+		taps = (unsigned int)ceil(scale) + 1;
+	else
+		taps = 2;
+
+	if (taps > input_size)
+		taps = input_size;
+
+	if (taps > sizeof(weights) / sizeof(weights[0]))
+		return -EINVAL;
+
+	filter->taps = taps;
+	filter->offsets = malloc(output_size * sizeof(*filter->offsets));
+	filter->coeffs = malloc(output_size * taps * sizeof(*filter->coeffs));
+	if (filter->offsets == NULL || filter->coeffs == NULL)
+	{
+		free_filter(filter);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < output_size; i++)
+	{
+		int16_t *coeffs = filter->coeffs + i * taps;
+		double sum = 0;
+		int first;
+		int offset;
+		int quantized_sum;
+		unsigned int largest;
+		unsigned int t;
+
+		memset(weights, 0, sizeof(weights));
+
+		if (method == AM7XXX_SCALE_AREA)
+		{
+			double start = i * scale;
+			double end = (i + 1) * scale;
+
+			first = (int)floor(start);
+			offset = first;
+			if (offset > (int)(input_size - taps))
+				offset = input_size - taps;
+
+			for (t = 0; t < taps; t++)
+			{
+				unsigned int index = first + t;
+				if (index >= input_size)
+					break;
+				weights[index - offset] += area_weight(index, start, end);
+			}
+		}
+		else
+		{
+			double center = (i + 0.5) * scale - 0.5;
+			double frac;
+			int index;
+
+			first = (int)floor(center);
+			frac = center - first;
+
+			offset = first;
+			if (offset > (int)(input_size - taps))
+				offset = input_size - taps;
+			if (offset < 0)
+				offset = 0;
+
+			for (t = 0; t < 2; t++)
+			{
+				index = first + t;
+				if (index < 0)
+					index = 0;
+				if (index > (int)input_size - 1)
+					index = input_size - 1;
+				weights[index - offset] += t ? frac : 1.0 - frac;
+			}
+		}
+
+		for (t = 0; t < taps; t++)
+			sum += weights[t];
+
+		/* Quantize, and give the rounding error to the largest tap */
+		quantized_sum = 0;
+		largest = 0;
+		for (t = 0; t < taps; t++)
+		{
+			coeffs[t] = (int16_t)lround(weights[t] / sum * (1 << COEFF_BITS));
+			quantized_sum += coeffs[t];
+			if (coeffs[t] > coeffs[largest])
+				largest = t;
+		}
+		coeffs[largest] += (1 << COEFF_BITS) - quantized_sum;
+
+		filter->offsets[i] = offset;
+	}
+
+	return 0;
+}
+
+/* Filter 'taps' input rows into an intermediate row in Q7 */
+static void vscale_row(const struct scale_filter *filter,
+					   unsigned int output_row,
+					   const uint8_t **rows,
+					   unsigned int width,
+					   int16_t *inter)
+{
+	const int16_t *coeffs = filter->coeffs + output_row * filter->taps;
+	unsigned int taps = filter->taps;
+	unsigned int x = 0;
+	unsigned int t;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (VSCALE_SHIFT - 1));
+
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i acc_lo = round;
+		__m128i acc_hi = round;
+
+		/* Two rows at a time, so a single madd does the multiply-add */
+		for (t = 0; t + 1 < taps; t += 2)
+		{
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[t] + x)), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[t + 1] + x)), zero);
+			__m128i c = _mm_set1_epi32((int)(((uint32_t)(uint16_t)coeffs[t + 1] << 16) |
+											 (uint16_t)coeffs[t]));
+
+			acc_lo = _mm_add_epi32(acc_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), c));
+			acc_hi = _mm_add_epi32(acc_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), c));
+		}
+		if (t < taps)
+		{
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[t] + x)), zero);
+			__m128i c = _mm_set1_epi32((uint16_t)coeffs[t]);
+
+			acc_lo = _mm_add_epi32(acc_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), c));
+			acc_hi = _mm_add_epi32(acc_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), c));
+		}
+
+		acc_lo = _mm_srai_epi32(acc_lo, VSCALE_SHIFT);
+		acc_hi = _mm_srai_epi32(acc_hi, VSCALE_SHIFT);
+		_mm_storeu_si128((__m128i *)(inter + x), _mm_packs_epi32(acc_lo, acc_hi));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 8 <= width; x += 8)
+	{
+		uint32x4_t acc_lo = vdupq_n_u32(0);
+		uint32x4_t acc_hi = vdupq_n_u32(0);
+
+		for (t = 0; t < taps; t++)
+		{
+			uint16x8_t a = vmovl_u8(vld1_u8(rows[t] + x));
+
+			acc_lo = vmlal_n_u16(acc_lo, vget_low_u16(a), (uint16_t)coeffs[t]);
+			acc_hi = vmlal_n_u16(acc_hi, vget_high_u16(a), (uint16_t)coeffs[t]);
+		}
+
+		vst1q_s16(inter + x,
+				  vreinterpretq_s16_u16(vcombine_u16(vrshrn_n_u32(acc_lo, VSCALE_SHIFT),
+													 vrshrn_n_u32(acc_hi, VSCALE_SHIFT))));
+	}
+#endif
+
+	for (; x < width; x++)
+	{
+		int32_t acc = 1 << (VSCALE_SHIFT - 1);
+
+		for (t = 0; t < taps; t++)
+			acc += rows[t][x] * coeffs[t];
+
+		inter[x] = (int16_t)(acc >> VSCALE_SHIFT);
+	}
+}
+
+static inline uint8_t clip_uint8(int32_t value)
+{
+	if (value < 0)
+		return 0;
+	if (value > 255)
+		return 255;
+	return (uint8_t)value;
+}
+
+/*
+ * Filter an intermediate row horizontally into the output.
+ *
+ * The steps make it possible to read and write interleaved chroma samples
+ * directly, with no separate (de)interleaving pass.
+ */
+static void hscale_row(const struct scale_filter *filter,
+					   unsigned int output_size,
+					   const int16_t *inter,
+					   unsigned int input_step,
+					   uint8_t *output,
+					   unsigned int output_step)
+{
+	const unsigned int *offsets = filter->offsets;
+	const int16_t *coeffs = filter->coeffs;
+	unsigned int taps = filter->taps;
+	unsigned int i;
+	unsigned int t;
+
+	if (taps == 2)
+	{
+		for (i = 0; i < output_size; i++)
+		{
+			const int16_t *in = inter + offsets[i] * input_step;
+			int32_t acc = 1 << (HSCALE_SHIFT - 1);
+
+			acc += in[0] * coeffs[0] + in[input_step] * coeffs[1];
+			output[i * output_step] = clip_uint8(acc >> HSCALE_SHIFT);
+			coeffs += 2;
+		}
+		return;
+	}
+
+	for (i = 0; i < output_size; i++)
+	{
+		const int16_t *in = inter + offsets[i] * input_step;
+		int32_t acc = 1 << (HSCALE_SHIFT - 1);
+
+		for (t = 0; t < taps; t++)
+			acc += in[t * input_step] * coeffs[t];
+
+		output[i * output_step] = clip_uint8(acc >> HSCALE_SHIFT);
+		coeffs += taps;
+	}
+}
+
+/**
+ * Interleave two chroma rows into a single NV12 chroma row
+ *
+ * @param[in] u The row of U samples
+ * @param[in] v The row of V samples
+ * @param[out] uv The row of interleaved UV samples, 2 * width bytes
+ * @param[in] width The number of samples in each of the u and v rows
+ */
+void interleave_uv(const uint8_t *u, const uint8_t *v, uint8_t *uv, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(u + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(v + x));
+
+		_mm_storeu_si128((__m128i *)(uv + 2 * x), _mm_unpacklo_epi8(a, b));
+		_mm_storeu_si128((__m128i *)(uv + 2 * x + 16), _mm_unpackhi_epi8(a, b));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16x2_t pair;
+
+		pair.val[0] = vld1q_u8(u + x);
+		pair.val[1] = vld1q_u8(v + x);
+		vst2q_u8(uv + 2 * x, pair);
+	}
+#endif
+
+	for (; x < width; x++)
+	{
+		uv[2 * x] = u[x];
+		uv[2 * x + 1] = v[x];
+	}
+}
+
+static void copy_plane(const uint8_t *input, int linesize,
+					   uint8_t *output, unsigned int output_linesize,
+					   unsigned int width, unsigned int height)
+{
+	unsigned int y;
+
+	/* the common case of a plane without padding is a single copy */
+	if ((unsigned int)linesize == width && output_linesize == width)
+	{
+		memcpy(output, input, (size_t)width * height);
+		return;
+	}
+
+	for (y = 0; y < height; y++)
+		memcpy(output + (size_t)y * output_linesize,
+			   input + (size_t)y * linesize,
+			   width);
+}
+
+/**
+ * Copy an image into NV12 planes, interleaving the chroma if needed
+ *
+ * @param[in] input_format The layout of the input image
+ * @param[in] width The width of the image, must be even
+ * @param[in] height The height of the image, must be even
+ * @param[in] planes The planes of the input image: Y, U, V for
+ *            AM7XXX_PIXEL_FORMAT_YUV420P, Y, UV for AM7XXX_PIXEL_FORMAT_NV12
+ * @param[in] linesizes The size in bytes of each line, for each plane
+ * @param[out] y_out The output luma plane
+ * @param[out] uv_out The output interleaved chroma plane
+ * @param[in] output_linesize The size in bytes of each line of the output planes
+ */
+void pack_nv12(am7xxx_pixel_format input_format,
+			   unsigned int width,
+			   unsigned int height,
+			   const uint8_t *const planes[],
+			   const int linesizes[],
+			   uint8_t *y_out,
+			   uint8_t *uv_out,
+			   unsigned int output_linesize)
+{
+	unsigned int y;
+
+	copy_plane(planes[0], linesizes[0], y_out, output_linesize, width, height);
+
+	if (input_format == AM7XXX_PIXEL_FORMAT_NV12)
+	{
+		copy_plane(planes[1], linesizes[1], uv_out, output_linesize, width, height / 2);
+		return;
+	}
+
+	for (y = 0; y < height / 2; y++)
+		interleave_uv(planes[1] + (size_t)y * linesizes[1],
+					  planes[2] + (size_t)y * linesizes[2],
+					  uv_out + (size_t)y * output_linesize,
+					  width / 2);
+}
+
+/*
+ * Scale a plane; 'components' is 2 for planes of interleaved UV samples,
+ * and 'output_step' is 2 to write the samples of a chroma plane directly
+ * in the interleaved NV12 chroma plane.
+ */
+static void scale_plane(am7xxx_scaler *scaler,
+						const struct scale_filter *filter_v,
+						const struct scale_filter *filter_h,
+						const uint8_t *input,
+						int linesize,
+						unsigned int input_width,
+						unsigned int components,
+						uint8_t *output,
+						unsigned int output_linesize,
+						unsigned int output_width,
+						unsigned int output_height,
+						unsigned int output_step)
+{
+	unsigned int y;
+	unsigned int t;
+
+	for (y = 0; y < output_height; y++)
+	{
+		const uint8_t *first = input + (size_t)filter_v->offsets[y] * linesize;
+		uint8_t *out = output + (size_t)y * output_linesize;
+
+		for (t = 0; t < filter_v->taps; t++)
+			scaler->rows[t] = first + (size_t)t * linesize;
+
+		vscale_row(filter_v, y, scaler->rows, input_width * components, scaler->inter);
+		hscale_row(filter_h, output_width, scaler->inter, components, out, output_step);
+		if (components == 2)
+			hscale_row(filter_h, output_width, scaler->inter + 1, components, out + 1, output_step);
+	}
+}
+
+static void fill_bars(am7xxx_scaler *scaler, uint8_t *output)
+{
+	unsigned int width = scaler->output_width;
+	unsigned int height = scaler->output_height;
+	unsigned int right = scaler->x_offset + scaler->scaled_width;
+	unsigned int bottom = scaler->y_offset + scaler->scaled_height;
+	uint8_t *uv = output + (size_t)width * height;
+	unsigned int y;
+
+	/* top and bottom bars */
+	memset(output, BLACK_Y, (size_t)width * scaler->y_offset);
+	memset(output + (size_t)width * bottom, BLACK_Y, (size_t)width * (height - bottom));
+	memset(uv, BLACK_UV, (size_t)width * (scaler->y_offset / 2));
+	memset(uv + (size_t)width * (bottom / 2), BLACK_UV, (size_t)width * ((height - bottom) / 2));
+
+	if (scaler->scaled_width == width)
+		return;
+
+	/* left and right bars */
+	for (y = scaler->y_offset; y < bottom; y++)
+	{
+		memset(output + (size_t)y * width, BLACK_Y, scaler->x_offset);
+		memset(output + (size_t)y * width + right, BLACK_Y, width - right);
+	}
+	for (y = scaler->y_offset / 2; y < bottom / 2; y++)
+	{
+		memset(uv + (size_t)y * width, BLACK_UV, scaler->x_offset);
+		memset(uv + (size_t)y * width + right, BLACK_UV, width - right);
+	}
+}
+
+/**
+ * Create a scaler from a YUV 4:2:0 image to a letterboxed NV12 image
+ *
+ * The scaled image is centered in the output image and the remaining area
+ * is filled with black bars. The filter coefficients are computed here,
+ * once, and reused for every scaled frame.
+ *
+ * @param[out] scaler A pointer to the new scaler
+ * @param[in] input_format The pixel format of the input images
+ * @param[in] input_width The width of the input images
+ * @param[in] input_height The height of the input images
+ * @param[in] scaled_width The width of the scaled image, even
+ * @param[in] scaled_height The height of the scaled image, even
+ * @param[in] output_width The width of the output image, even
+ * @param[in] output_height The height of the output image, even
+ * @param[in] method The filter to use when scaling
+ *
+ * @return 0 on success, a negative value on error
+ */
+int scaler_new(am7xxx_scaler **scaler,
+			   am7xxx_pixel_format input_format,
+			   unsigned int input_width,
+			   unsigned int input_height,
+			   unsigned int scaled_width,
+			   unsigned int scaled_height,
+			   unsigned int output_width,
+			   unsigned int output_height,
+			   am7xxx_scale_method method)
+{
+	am7xxx_scaler *new_scaler;
+	unsigned int chroma_width = (input_width + 1) / 2;
+	unsigned int chroma_height = (input_height + 1) / 2;
+	unsigned int max_taps;
+	int ret;
+
+	if (input_width == 0 || input_height == 0 ||
+		scaled_width < 2 || scaled_height < 2 ||
+		scaled_width > output_width || scaled_height > output_height ||
+		(scaled_width | scaled_height | output_width | output_height) & 1)
+		return -EINVAL;
+
+	new_scaler = calloc(1, sizeof(*new_scaler));
+	if (new_scaler == NULL)
+		return -ENOMEM;
+
+	new_scaler->input_format = input_format;
+	new_scaler->input_width = input_width;
+	new_scaler->input_height = input_height;
+	new_scaler->scaled_width = scaled_width;
+	new_scaler->scaled_height = scaled_height;
+	new_scaler->output_width = output_width;
+	new_scaler->output_height = output_height;
+
+	/* Keep the offsets even, so the chroma planes stay aligned */
+	new_scaler->x_offset = ((output_width - scaled_width) / 2) & ~1U;
+	new_scaler->y_offset = ((output_height - scaled_height) / 2) & ~1U;
+
+	new_scaler->passthrough = (input_width == scaled_width &&
+							   input_height == scaled_height);
+	if (new_scaler->passthrough)
+		goto out;
+
+	ret = init_filter(&new_scaler->luma_h, input_width, scaled_width, method);
+	if (ret < 0)
+		goto err;
+
+	ret = init_filter(&new_scaler->luma_v, input_height, scaled_height, method);
+	if (ret < 0)
+		goto err;
+
+	ret = init_filter(&new_scaler->chroma_h, chroma_width, scaled_width / 2, method);
+	if (ret < 0)
+		goto err;
+
+	ret = init_filter(&new_scaler->chroma_v, chroma_height, scaled_height / 2, method);
+	if (ret < 0)
+		goto err;
+
+	max_taps = new_scaler->luma_v.taps;
+	if (new_scaler->chroma_v.taps > max_taps)
+		max_taps = new_scaler->chroma_v.taps;
+
+	/* 2 * chroma_width also covers the interleaved chroma rows of NV12 */
+	new_scaler->rows = malloc(max_taps * sizeof(*new_scaler->rows));
+	new_scaler->inter = malloc(2 * chroma_width * sizeof(*new_scaler->inter));
+	if (new_scaler->rows == NULL || new_scaler->inter == NULL)
+	{
+		ret = -ENOMEM;
+		goto err;
+	}
+
+out:
+	*scaler = new_scaler;
+	return 0;
+
+err:
+	scaler_free(new_scaler);
+	return ret;
+}
+
+/**
+ * Free a scaler created with scaler_new()
+ *
+ * @param[in] scaler The scaler to free
+ */
+void scaler_free(am7xxx_scaler *scaler)
+{
+	if (scaler == NULL)
+		return;
+
+	free_filter(&scaler->luma_h);
+	free_filter(&scaler->luma_v);
+	free_filter(&scaler->chroma_h);
+	free_filter(&scaler->chroma_v);
+	free(scaler->rows);
+	free(scaler->inter);
+	free(scaler);
+}
+
+/**
+ * Scale an image
+ *
+ * @param[in] scaler The scaler to use
+ * @param[in] planes The planes of the input image: Y, U, V for
+ *            AM7XXX_PIXEL_FORMAT_YUV420P, Y, UV for AM7XXX_PIXEL_FORMAT_NV12
+ * @param[in] linesizes The size in bytes of each line, for each plane
+ * @param[out] output The output NV12 image
+ */
+void scaler_scale(am7xxx_scaler *scaler,
+				  const uint8_t *const planes[],
+				  const int linesizes[],
+				  uint8_t *output)
+{
+	unsigned int output_width = scaler->output_width;
+	unsigned int chroma_width = (scaler->input_width + 1) / 2;
+	uint8_t *y_out = output + (size_t)scaler->y_offset * output_width + scaler->x_offset;
+	uint8_t *uv_out = output + (size_t)output_width * scaler->output_height +
+					  (size_t)(scaler->y_offset / 2) * output_width + scaler->x_offset;
+
+	fill_bars(scaler, output);
+
+	if (scaler->passthrough)
+	{
+		pack_nv12(scaler->input_format,
+				  scaler->scaled_width, scaler->scaled_height,
+				  planes, linesizes,
+				  y_out, uv_out, output_width);
+		return;
+	}
+
+	scale_plane(scaler, &scaler->luma_v, &scaler->luma_h,
+				planes[0], linesizes[0], scaler->input_width, 1,
+				y_out, output_width,
+				scaler->scaled_width, scaler->scaled_height, 1);
+
+	if (scaler->input_format == AM7XXX_PIXEL_FORMAT_NV12)
+	{
+		scale_plane(scaler, &scaler->chroma_v, &scaler->chroma_h,
+					planes[1], linesizes[1], chroma_width, 2,
+					uv_out, output_width,
+					scaler->scaled_width / 2, scaler->scaled_height / 2, 2);
+	}
+	else
+	{
+		scale_plane(scaler, &scaler->chroma_v, &scaler->chroma_h,
+					planes[1], linesizes[1], chroma_width, 1,
+					uv_out, output_width,
+					scaler->scaled_width / 2, scaler->scaled_height / 2, 2);
+		scale_plane(scaler, &scaler->chroma_v, &scaler->chroma_h,
+					planes[2], linesizes[2], chroma_width, 1,
+					uv_out + 1, output_width,
+					scaler->scaled_width / 2, scaler->scaled_height / 2, 2);
+	}
+}
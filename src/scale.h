@@ -0,0 +1,51 @@
+/* am7xxx - communication with AM7xxx based USB Pico Projectors and DPFs
+ *
+ * Copyright (C) 2012-2014  Antonio Ospite <ao2@ao2.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCALE_H
+#define __SCALE_H
+
+#include <stdint.h>
+
+#include "am7xxx.h"
+
+int scaler_new(am7xxx_scaler **scaler,
+			   am7xxx_pixel_format input_format,
+			   unsigned int input_width,
+			   unsigned int input_height,
+			   unsigned int scaled_width,
+			   unsigned int scaled_height,
+			   unsigned int output_width,
+			   unsigned int output_height,
+			   am7xxx_scale_method method);
+void scaler_free(am7xxx_scaler *scaler);
+void scaler_scale(am7xxx_scaler *scaler,
+				  const uint8_t *const planes[],
+				  const int linesizes[],
+				  uint8_t *output);
+
+void interleave_uv(const uint8_t *u, const uint8_t *v, uint8_t *uv, unsigned int width);
+void pack_nv12(am7xxx_pixel_format input_format,
+			   unsigned int width,
+			   unsigned int height,
+			   const uint8_t *const planes[],
+			   const int linesizes[],
+			   uint8_t *y_out,
+			   uint8_t *uv_out,
+			   unsigned int output_linesize);
+
+#endif /* __SCALE_H */
@@ -16,11 +16,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #ifdef _WIN32
 #include <windows.h>
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#define mkdir(path, mode) _mkdir(path)
 #else
-#include <errno.h>
 #include <time.h>
+#include <unistd.h>
 #endif
 
 #include "tools.h"
@@ -55,3 +66,145 @@ int msleep(unsigned long msecs)
 
 	return 0;
 }
+
+/**
+ * Sleep for a period expressed in microseconds
+ *
+ * @param[in] usecs Time to sleep in microseconds
+ *
+ * @return 0 on success, -1 on error
+ */
+int usleep_for(uint64_t usecs)
+{
+#ifdef _WIN32
+	Sleep((DWORD)((usecs + 999) / 1000));
+#else
+	struct timespec delay;
+	int ret;
+
+	delay.tv_sec = usecs / 1000000;
+	delay.tv_nsec = (usecs % 1000000) * 1000;
+	while (1)
+	{
+		ret = nanosleep(&delay, &delay);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+	if (ret == -1)
+		return ret;
+#endif
+
+	return 0;
+}
+
+/**
+ * Get the time from a clock which never goes back
+ *
+ * @return The time in microseconds, from an unspecified starting point
+ */
+uint64_t monotonic_usecs(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+		(uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * Create the directory containing a file, and the missing ones above it
+ *
+ * @param[in] path The path of the file
+ *
+ * @return 0 on success, a negative value on error
+ */
+int make_parent_dir(const char *path)
+{
+	char dir[FILENAME_MAX];
+	char *separator;
+	int ret;
+
+	ret = snprintf(dir, sizeof(dir), "%s", path);
+	if (ret < 0 || (size_t)ret >= sizeof(dir))
+		return -ENAMETOOLONG;
+
+	/* each directory is created cut at the separator after it */
+	separator = strchr(dir + 1, '/');
+	while (separator)
+	{
+		*separator = '\0';
+		ret = mkdir(dir, 0755);
+		if (ret < 0 && errno != EEXIST)
+			return -errno;
+		*separator = '/';
+
+		separator = strchr(separator + 1, '/');
+	}
+
+	return 0;
+}
+
+/**
+ * Create a new file to be renamed over path once written, its name is not
+ * used by any other writer
+ *
+ * @param[in] path The path of the file to be replaced
+ * @param[out] tmp_path The buffer where to store the path of the new file
+ * @param[in] len The size of the tmp_path buffer
+ *
+ * @return The file open for writing, or NULL with errno set on error
+ */
+FILE *create_temp_file(const char *path, char *tmp_path, size_t len)
+{
+	FILE *file;
+	int ret;
+	int fd;
+
+	ret = snprintf(tmp_path, len, "%s.XXXXXX", path);
+	if (ret < 0 || (size_t)ret >= len)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+#ifdef _WIN32
+	if (_mktemp_s(tmp_path, ret + 1) != 0)
+		return NULL;
+	fd = _open(tmp_path, _O_CREAT | _O_EXCL | _O_WRONLY | _O_TEXT, _S_IREAD | _S_IWRITE);
+	if (fd < 0)
+		return NULL;
+	file = _fdopen(fd, "w");
+	if (file == NULL)
+	{
+		_close(fd);
+		remove(tmp_path);
+	}
+#else
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return NULL;
+
+	/* mkstemp() makes it private, the file it replaces was not */
+	fchmod(fd, 0644);
+	file = fdopen(fd, "w");
+	if (file == NULL)
+	{
+		ret = errno;
+		close(fd);
+		remove(tmp_path);
+		errno = ret;
+	}
+#endif
+
+	return file;
+}
@@ -19,6 +19,13 @@
 #ifndef __TOOLS_H
 #define __TOOLS_H
 
+#include <stdint.h>
+#include <stdio.h>
+
 int msleep(unsigned long msecs);
+int usleep_for(uint64_t usecs);
+uint64_t monotonic_usecs(void);
+int make_parent_dir(const char *path);
+FILE *create_temp_file(const char *path, char *tmp_path, size_t len);
 
 #endif /* __TOOLS_H */